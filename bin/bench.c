@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "webb/webb.h"
+
+#define BENCH_PORT "8089"
+#define BODY "hello world"
+
+typedef struct BenchConfig {
+  const char *name;
+  int keep_alive;
+  // the client sends its request in the syn, once it got a cookie from the server
+  int fastopen;
+  WebbServerOptions opts;
+} BenchConfig;
+
+typedef struct ClientPayload {
+  pthread_t tid;
+  int keep_alive;
+  int fastopen;
+  size_t nrequests;
+  double *latencies_us;
+} ClientPayload;
+
+static const BenchConfig CONFIGS[] = {
+  {.name = "keep-alive, nagle", .keep_alive = 1, .opts = {.disable_nodelay = 1}},
+  {.name = "keep-alive, nodelay", .keep_alive = 1, .opts = {0}},
+  {.name = "keep-alive, nodelay, busy-poll", .keep_alive = 1, .opts = {.busy_poll_us = 50}},
+  {.name = "keep-alive, nodelay, pinned workers", .keep_alive = 1, .opts = {.pin_workers = 1}},
+  {.name = "new connections, nodelay", .keep_alive = 0, .opts = {0}},
+  {.name = "new connections, defer-accept", .keep_alive = 0, .opts = {.defer_accept = 1}},
+  {.name = "new connections, defer-accept, fastopen",
+   .keep_alive = 0,
+   .fastopen = 1,
+   .opts = {.defer_accept = 1, .fastopen_queue = 64}},
+};
+
+static int handler(const WebbRequest *req, WebbResponse *res) {
+  (void) req;
+  webb_set_body_static(res, BODY, strlen(BODY));
+  return 200;
+}
+
+static double now_us(void) {
+  struct timespec ts;
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3;
+}
+
+static int connect_server(int fastopen) {
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *info = NULL;
+  if (getaddrinfo("127.0.0.1", BENCH_PORT, &hints, &info) != 0)
+    return -1;
+  // the client always disables nagle, so only the server side setting is measured. with fastopen connect
+  // returns right away, and the first send goes out with the syn
+  int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol), yes = 1;
+  if (fd != -1 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd != -1 && fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes)) == -1) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd != -1 && connect(fd, info->ai_addr, info->ai_addrlen) == -1) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(info);
+  return fd;
+}
+
+static int roundtrip(int fd) {
+  // the request is written in two parts, like most clients writing the request line before the headers
+  static const char LINE[] = "GET / HTTP/1.1\r\n", HEADERS[] = "host: localhost\r\n\r\n";
+  if (send(fd, LINE, strlen(LINE), 0) == -1 || send(fd, HEADERS, strlen(HEADERS), 0) == -1)
+    return 1;
+  char buf[1024];
+  size_t len = 0;
+  while (len < strlen(BODY) || memcmp(buf + len - strlen(BODY), BODY, strlen(BODY)) != 0) {
+    ssize_t nread = recv(fd, buf + len, sizeof(buf) - len, 0);
+    if (nread <= 0)
+      return 1;
+    len += nread;
+  }
+  return 0;
+}
+
+static void *client_thread(void *arg) {
+  ClientPayload *payload = arg;
+  int fd = -1;
+  for (size_t i = 0; i < payload->nrequests; i++) {
+    double start = now_us();
+    if (fd == -1)
+      fd = connect_server(payload->fastopen);
+    if (fd == -1 || roundtrip(fd) != 0) {
+      (void) fprintf(stderr, "request failed: %s\n", strerror(errno));
+      exit(1);
+    }
+    if (!payload->keep_alive) {
+      close(fd);
+      fd = -1;
+    }
+    payload->latencies_us[i] = now_us() - start;
+  }
+  if (fd != -1)
+    close(fd);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static pid_t start_server(const WebbServerOptions *opts) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    (void) close(STDERR_FILENO);
+    exit(webb_server_run_opts(BENCH_PORT, handler, opts));
+  }
+  for (int i = 0; i < 100; i++) {
+    int fd = connect_server(0);
+    if (fd != -1) {
+      close(fd);
+      return pid;
+    }
+    (void) usleep(10 * 1000);
+  }
+  (void) kill(pid, SIGKILL);
+  (void) waitpid(pid, NULL, 0);
+  return -1;
+}
+
+static int run(const BenchConfig *config, size_t nclients, size_t nrequests) {
+  pid_t pid = start_server(&config->opts);
+  if (pid == -1) {
+    (void) printf("%-42s failed to start (busy-poll needs CAP_NET_ADMIN)\n", config->name);
+    return 1;
+  }
+
+  size_t total = nclients * nrequests;
+  double *latencies = malloc(total * sizeof(double));
+  ClientPayload *clients = calloc(nclients, sizeof(ClientPayload));
+  if (!latencies || !clients)
+    exit(1);
+  double start = now_us();
+  for (size_t i = 0; i < nclients; i++) {
+    clients[i] = (ClientPayload){
+      .keep_alive = config->keep_alive,
+      .fastopen = config->fastopen,
+      .nrequests = nrequests,
+      .latencies_us = latencies + i * nrequests,
+    };
+    if (pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]) != 0)
+      exit(1);
+  }
+  for (size_t i = 0; i < nclients; i++)
+    (void) pthread_join(clients[i].tid, NULL);
+  double elapsed_s = (now_us() - start) / 1e6;
+
+  qsort(latencies, total, sizeof(double), compare_doubles);
+  (void) printf(
+    "%-42s %10.0f %8.1f %8.1f %8.1f %8.1f\n",
+    config->name,
+    (double) total / elapsed_s,
+    latencies[total / 2],
+    latencies[total * 99 / 100],
+    latencies[total * 999 / 1000],
+    latencies[total - 1]);
+  free(clients);
+  free(latencies);
+  (void) kill(pid, SIGTERM);
+  (void) waitpid(pid, NULL, 0);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t nclients = 4, nrequests = 500;
+  for (int opt; (opt = getopt(argc, argv, "c:n:")) != -1;) {
+    if (opt == 'c')
+      nclients = strtoul(optarg, NULL, 10);
+    else if (opt == 'n')
+      nrequests = strtoul(optarg, NULL, 10);
+    else {
+      (void) fprintf(stderr, "usage: %s [-c clients] [-n requests per client]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!nclients || !nrequests)
+    return 1;
+
+  (void) printf("%zu clients, %zu requests each, latencies in us\n", nclients, nrequests);
+  (void) printf("%-42s %10s %8s %8s %8s %8s\n", "", "req/s", "p50", "p99", "p99.9", "max");
+  (void) fflush(stdout);
+  for (size_t i = 0; i < sizeof(CONFIGS) / sizeof(CONFIGS[0]); i++)
+    (void) run(&CONFIGS[i], nclients, nrequests);
+  return 0;
+}
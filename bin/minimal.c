@@ -1,4 +1,3 @@
-#include <string.h>
 #include "webb/webb.h"
 
 int http_handler(const WebbRequest *req, WebbResponse *res) {
@@ -6,7 +5,7 @@ int http_handler(const WebbRequest *req, WebbResponse *res) {
   if (req->method != WEBB_GET)
     return 404;
   webb_set_body_static(res, "hello world", 11);
-  webb_set_header(res, "content-type", strdup("text/raw"));
+  res->content_type = "text/raw";
   return 200;
 }
 
@@ -1,21 +1,53 @@
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "webb/webb.h"
 
-#define PATH_MAX     4096
-#define DEFAULT_PORT "8080"
+#define PATH_MAX           4096
+#define DEFAULT_PORT       "8080"
+#define HTTP_DATE_FMT      "%a, %d %b %Y %H:%M:%S GMT"
+#define MAX_RANGES         16
+#define MAX_MULTIPART_SIZE (1024 * 1024)  // 1mb
+#define DIR_CACHE_SIZE     64
+
+typedef struct ByteRange {
+  size_t start;
+  size_t len;
+} ByteRange;
+
+typedef struct DirCacheEntry {
+  char *path;
+  struct timespec mtime;
+  WebbShared *html;
+} DirCacheEntry;
+
+typedef struct ContentEncoding {
+  const char *name;
+  const char *ext;
+} ContentEncoding;
+
+// precompressed sidecar files, in order of preference
+static const ContentEncoding ENCODINGS[] = {
+  {"br", ".br"},
+  {"gzip", ".gz"},
+};
 
 const char *mime_type(const char *path) {
   static const char *const MIME_TYPES[][2] = {
+    {".br", "application/x-brotli"},
     {".css", "text/css"},
     {".gif", "image/gif"},
+    {".gz", "application/gzip"},
     {".htm", "text/html"},
     {".html", "text/html"},
     {".jpeg", "image/jpg"},
@@ -37,35 +69,369 @@ const char *mime_type(const char *path) {
 }
 
 char WORK_DIR[PATH_MAX];
+int SORT_LISTINGS = 0;
+DirCacheEntry DIR_CACHE[DIR_CACHE_SIZE];
+pthread_mutex_t DIR_CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
 
-int handle_dir(WebbResponse *res, const char *path, const char *uri) {
-  DIR *dp = opendir(path);
-  if (!dp) {
-    perror("could not open dir");
-    return -1;
+int resolve_path(const char *path, char *resolved) {
+  if (realpath(path, resolved) == NULL)
+    return 1;
+  // check path traversal attack
+  return strstr(resolved, WORK_DIR) != resolved;
+}
+
+void format_etag(char *buf, size_t len, const struct stat *sb, const ContentEncoding *encoding) {
+  // each encoding is a different representation, so needs its own etag
+  (void) snprintf(
+    buf,
+    len,
+    "\"%llx-%llx-%llx%s%s\"",
+    (unsigned long long) sb->st_mtim.tv_sec,
+    (unsigned long long) sb->st_mtim.tv_nsec,
+    (unsigned long long) sb->st_size,
+    encoding ? "-" : "",
+    encoding ? encoding->name : "");
+}
+
+int accepts_encoding(const char *header, const char *name) {
+  // header is a comma separated list of encodings with optional weights, e.g "gzip;q=0.5, br"
+  int wildcard = 0;
+  size_t name_len = strlen(name);
+  for (const char *s = header; *s;) {
+    while (*s == ' ' || *s == ',')
+      s++;
+    size_t len = strcspn(s, ",; "), params_len = strcspn(s, ",");
+    double q = 1;
+    const char *params = memchr(s + len, ';', params_len - len);
+    if (params) {
+      params += strspn(params + 1, " ") + 1;
+      if (strncasecmp(params, "q=", 2) == 0)
+        q = strtod(params + 2, NULL);
+    }
+    if (len == name_len && strncasecmp(s, name, len) == 0)
+      return q > 0;
+    if (len == 1 && *s == '*')
+      wildcard = q > 0;
+    s += params_len;
   }
+  return wildcard;
+}
 
-  char *html = malloc(65536), *s = html;
-  s += sprintf(s, "<!DOCTYPE html>\n<html>\n<body>\n<ul>\n");
+int etag_matches(const char *header, const char *etag) {
+  // header is a comma separated list of (possibly weak) etags, or a single "*"
+  size_t etag_len = strlen(etag);
+  for (const char *s = header; *s;) {
+    while (*s == ' ' || *s == ',')
+      s++;
+    if (strncmp(s, "W/", 2) == 0)
+      s += 2;
+    size_t len = strcspn(s, ", ");
+    if ((len == 1 && *s == '*') || (len == etag_len && memcmp(s, etag, len) == 0))
+      return 1;
+    s += len;
+  }
+  return 0;
+}
 
-  for (struct dirent *entry; (entry = readdir(dp));) {
-    if (strcmp(entry->d_name, ".") == 0)
-      continue;
-    if (strcmp(entry->d_name, "..") == 0)
+int is_not_modified(const WebbRequest *req, const struct stat *sb, const char *etag) {
+  // if-none-match takes precedence over if-modified-since, rfc9110 13.2.2
+  const char *if_none_match = webb_get_header(req, "if-none-match");
+  if (if_none_match)
+    return etag_matches(if_none_match, etag);
+  const char *if_modified_since = webb_get_header(req, "if-modified-since");
+  if (!if_modified_since)
+    return 0;
+  struct tm tm = {0};
+  const char *end = strptime(if_modified_since, HTTP_DATE_FMT, &tm);
+  if (!end || *end)
+    return 0;
+  return sb->st_mtime <= timegm(&tm);
+}
+
+int parse_size(const char **s, size_t *n) {
+  if (**s < '0' || **s > '9')
+    return 1;
+  char *end;
+  unsigned long long v = strtoull(*s, &end, 10);
+  *n = (size_t) v;
+  *s = end;
+  return 0;
+}
+
+// returns the number of satisfiable ranges, 0 if the header should be ignored, or -1 if none are satisfiable
+int parse_ranges(const char *header, size_t size, ByteRange *ranges) {
+  if (strncasecmp(header, "bytes=", 6) != 0)
+    return 0;
+  int n = 0, specs = 0;
+  for (const char *s = header + 6; *s;) {
+    while (*s == ' ' || *s == ',')
+      s++;
+    if (!*s)
+      break;
+    if (specs++ == MAX_RANGES)
+      return 0;
+    size_t first = 0, last = size - 1;
+    if (*s == '-') {
+      // suffix range, the last N bytes of the file
+      s++;
+      size_t suffix;
+      if (parse_size(&s, &suffix) != 0)
+        return 0;
+      if (suffix == 0)
+        continue;
+      first = suffix < size ? size - suffix : 0;
+    } else {
+      if (parse_size(&s, &first) != 0 || *s++ != '-')
+        return 0;
+      if (*s >= '0' && *s <= '9') {
+        if (parse_size(&s, &last) != 0 || last < first)
+          return 0;
+        if (last >= size)
+          last = size - 1;
+      }
+    }
+    if (*s && *s != ',' && *s != ' ')
+      return 0;
+    if (first >= size)
       continue;
-    s += sprintf(
-      s,
-      "<li><a href=\"%s%s%s\">%s</a></li>\n",
-      uri,
-      uri[strlen(uri) - 1] == '/' ? "" : "/",
-      entry->d_name,
-      entry->d_name);
-  }
-  closedir(dp);
-
-  s += sprintf(s, "</ul>\n</body>\n</html>\n");
-  webb_set_body(res, html, s - html);
-  webb_set_header(res, "content-type", strdup("text/html"));
+    ranges[n++] = (ByteRange){.start = first, .len = last - first + 1};
+  }
+  return n ? n : -1;
+}
+
+int range_applies(const WebbRequest *req, const char *etag, const char *last_modified) {
+  // an if-range that does not match means the client's copy is stale, so the full file is sent
+  const char *if_range = webb_get_header(req, "if-range");
+  if (!if_range)
+    return 1;
+  if (*if_range == '"')
+    return strcmp(if_range, etag) == 0;
+  return strcmp(if_range, last_modified) == 0;
+}
+
+int handle_multipart(WebbResponse *res, int fd, const ByteRange *ranges, int n, size_t size, const char *type) {
+  static const char *const PART_FMT = "\r\n--%s\r\ncontent-type: %s\r\ncontent-range: bytes %zu-%zu/%zu\r\n\r\n";
+  static const char *const END_FMT = "\r\n--%s--\r\n";
+  // random, so that it cannot be guessed and is next to certain not to occur in the ranges sent
+  unsigned char nonce[12];
+  char boundary[32] = "webb-";
+  if (getrandom(nonce, sizeof(nonce), 0) != (ssize_t) sizeof(nonce)) {
+    perror("getrandom");
+    return 500;
+  }
+  for (size_t i = 0; i < sizeof(nonce); i++)
+    (void) sprintf(boundary + 5 + 2 * i, "%02x", nonce[i]);
+
+  size_t total = 0;
+  for (int i = 0; i < n; i++) {
+    size_t end = ranges[i].start + ranges[i].len - 1;
+    total += snprintf(NULL, 0, PART_FMT, boundary, type, ranges[i].start, end, size) + ranges[i].len;
+  }
+  total += snprintf(NULL, 0, END_FMT, boundary);
+  if (total > MAX_MULTIPART_SIZE)
+    return 0;
+
+  char *body = malloc(total + 1), *s = body;
+  if (!body)
+    return 500;
+  for (int i = 0; i < n; i++) {
+    size_t end = ranges[i].start + ranges[i].len - 1;
+    s += sprintf(s, PART_FMT, boundary, type, ranges[i].start, end, size);
+    if (pread(fd, s, ranges[i].len, (off_t) ranges[i].start) != (ssize_t) ranges[i].len) {
+      perror("pread");
+      free(body);
+      return 500;
+    }
+    s += ranges[i].len;
+  }
+  s += sprintf(s, END_FMT, boundary);
+
+  webb_set_body(res, body, s - body);
+  (void) webb_set_headerf(res, "content-type", "multipart/byteranges; boundary=%s", boundary);
+  return 206;
+}
+
+int handle_file(
+  const WebbRequest *req,
+  WebbResponse *res,
+  const char *file,
+  const char *type,
+  const struct stat *sb,
+  const ContentEncoding *encoding) {
+  char etag[64], last_modified[64];
+  struct tm tm;
+  format_etag(etag, sizeof(etag), sb, encoding);
+  (void) strftime(last_modified, sizeof(last_modified), HTTP_DATE_FMT, gmtime_r(&sb->st_mtime, &tm));
+  (void) webb_set_headerf(res, "etag", "%s", etag);
+  (void) webb_set_headerf(res, "last-modified", "%s", last_modified);
+  webb_set_header_static(res, "accept-ranges", "bytes");
+  webb_set_header_static(res, "vary", "accept-encoding");
+  if (encoding)
+    (void) webb_set_headerf(res, "content-encoding", "%s", encoding->name);
+  if (is_not_modified(req, sb, etag))
+    return 304;
+
+  size_t size = (size_t) sb->st_size;
+  ByteRange ranges[MAX_RANGES];
+  const char *range = webb_get_header(req, "range");
+  int nranges = range && size && range_applies(req, etag, last_modified) ? parse_ranges(range, size, ranges) : 0;
+  if (nranges == -1) {
+    (void) webb_set_headerf(res, "content-range", "bytes */%zu", size);
+    return 416;
+  }
+
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    return 500;
+  }
+  if (nranges > 1) {
+    int status = handle_multipart(res, fd, ranges, nranges, size, type);
+    if (status != 0) {
+      (void) close(fd);
+      return status;
+    }
+    // too large to assemble in memory, only the first range is sent. clients ask for the rest again
+    nranges = 1;
+  }
+  res->content_type = type;
+  if (nranges == 0) {
+    webb_set_body_fd(res, fd, size);
+    return 200;
+  }
+  size_t end = ranges[0].start + ranges[0].len - 1;
+  (void) webb_set_headerf(res, "content-range", "bytes %zu-%zu/%zu", ranges[0].start, end, size);
+  webb_set_body_fd_range(res, fd, ranges[0].start, ranges[0].len);
+  return 206;
+}
+
+int skip_dots(const struct dirent *entry) {
+  return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+void write_escaped(FILE *out, const char *s) {
+  for (; *s; s++) {
+    switch (*s) {
+    case '&':
+      (void) fputs("&amp;", out);
+      break;
+    case '<':
+      (void) fputs("&lt;", out);
+      break;
+    case '>':
+      (void) fputs("&gt;", out);
+      break;
+    case '"':
+      (void) fputs("&quot;", out);
+      break;
+    default:
+      (void) fputc(*s, out);
+    }
+  }
+}
+
+void write_percent_encoded(FILE *out, const char *s) {
+  // everything but unreserved characters and the path separators, which leaves nothing to escape for html
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~/", c))
+      (void) fputc(c, out);
+    else
+      (void) fprintf(out, "%%%02X", c);
+  }
+}
+
+char *render_dir(const char *path, size_t *len) {
+  struct dirent **entries;
+  int n = scandir(path, &entries, skip_dots, SORT_LISTINGS ? alphasort : NULL);
+  if (n == -1) {
+    perror("could not open dir");
+    return NULL;
+  }
+
+  // the listing is built whole in a growing buffer so it can be cached, there is no limit on the number of entries
+  char *html = NULL;
+  FILE *out = open_memstream(&html, len);
+  const char *uri = path + strlen(WORK_DIR);
+  if (out)
+    (void) fputs("<!DOCTYPE html>\n<html>\n<body>\n<ul>\n", out);
+  for (int i = 0; i < n; i++) {
+    if (out) {
+      (void) fputs("<li><a href=\"", out);
+      write_percent_encoded(out, uri);
+      (void) fputc('/', out);
+      write_percent_encoded(out, entries[i]->d_name);
+      (void) fputs("\">", out);
+      write_escaped(out, entries[i]->d_name);
+      (void) fputs("</a></li>\n", out);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  if (!out) {
+    perror("open_memstream");
+    return NULL;
+  }
+  (void) fputs("</ul>\n</body>\n</html>\n", out);
+  if (fclose(out) != 0) {
+    perror("fclose");
+    free(html);
+    return NULL;
+  }
+  return html;
+}
+
+size_t hash_path(const char *path) {
+  size_t h = 14695981039346656037ULL;
+  for (; *path; path++)
+    h = (h ^ (unsigned char) *path) * 1099511628211ULL;
+  return h;
+}
+
+int dir_cache_get(const char *path, const struct timespec *mtime, WebbResponse *res) {
+  // the cached listing is shared by every response sending it, only a reference is taken
+  DirCacheEntry *entry = &DIR_CACHE[hash_path(path) % DIR_CACHE_SIZE];
+  int hit = 0;
+  (void) pthread_mutex_lock(&DIR_CACHE_LOCK);
+  if (entry->path && strcmp(entry->path, path) == 0 && entry->mtime.tv_sec == mtime->tv_sec
+      && entry->mtime.tv_nsec == mtime->tv_nsec) {
+    webb_set_body_shared(res, entry->html);
+    hit = 1;
+  }
+  (void) pthread_mutex_unlock(&DIR_CACHE_LOCK);
+  return hit;
+}
+
+void dir_cache_put(const char *path, const struct timespec *mtime, WebbShared *html) {
+  // responses still sending the replaced listing keep it alive until they are done
+  DirCacheEntry *entry = &DIR_CACHE[hash_path(path) % DIR_CACHE_SIZE];
+  char *path_copy = strdup(path);
+  if (!path_copy)
+    return;
+  (void) pthread_mutex_lock(&DIR_CACHE_LOCK);
+  free(entry->path);
+  webb_shared_release(entry->html);
+  *entry = (DirCacheEntry){.path = path_copy, .mtime = *mtime, .html = webb_shared_ref(html)};
+  (void) pthread_mutex_unlock(&DIR_CACHE_LOCK);
+}
+
+int handle_dir(WebbResponse *res, const char *path, const struct stat *sb) {
+  // a directory's mtime changes whenever an entry is added, removed or renamed
+  if (!dir_cache_get(path, &sb->st_mtim, res)) {
+    size_t len;
+    char *html = render_dir(path, &len);
+    if (!html)
+      return -1;
+    WebbShared *shared = webb_shared_new(html, len);
+    if (!shared) {
+      free(html);
+      return -1;
+    }
+    webb_set_body_shared(res, shared);
+    dir_cache_put(path, &sb->st_mtim, shared);
+    webb_shared_release(shared);
+  }
+  res->content_type = "text/html";
   return 200;
 }
 
@@ -76,50 +442,42 @@ int handle_request(const WebbRequest *req, WebbResponse *res) {
   char input_path[PATH_MAX], file[PATH_MAX];
   if (snprintf(input_path, PATH_MAX, "%s%s", WORK_DIR, req->uri) < 0)
     return 404;
-  if (realpath(input_path, file) == NULL)
-    return 404;
-  // check path traversal attack
-  if (strstr(file, WORK_DIR) != file)
+  if (resolve_path(input_path, file) != 0)
     return 404;
 
   struct stat sb;
   if (stat(file, &sb) == -1)
     return 404;
   if (S_ISDIR(sb.st_mode))
-    return handle_dir(res, file, req->uri);
+    return handle_dir(res, file, &sb);
   if (!S_ISREG(sb.st_mode))
     return 404;
 
-  int fd = open(file, O_RDONLY);
-  if (fd == -1) {
-    perror("open");
-    return 500;
+  // serve a precompressed sidecar (e.g foo.js.br) if the client accepts it, typed after the original file
+  const char *accept_encoding = webb_get_header(req, "accept-encoding");
+  for (size_t i = 0; accept_encoding && i < sizeof(ENCODINGS) / sizeof(ENCODINGS[0]); i++) {
+    if (!accepts_encoding(accept_encoding, ENCODINGS[i].name))
+      continue;
+    char sidecar[PATH_MAX];
+    struct stat sidecar_sb;
+    if (snprintf(input_path, PATH_MAX, "%s%s", file, ENCODINGS[i].ext) >= PATH_MAX)
+      continue;
+    if (resolve_path(input_path, sidecar) != 0 || stat(sidecar, &sidecar_sb) == -1 || !S_ISREG(sidecar_sb.st_mode))
+      continue;
+    return handle_file(req, res, sidecar, mime_type(file), &sidecar_sb, &ENCODINGS[i]);
   }
-  webb_set_body_fd(res, fd, sb.st_size);
-  webb_set_header(res, "content-type", strdup(mime_type(file)));
-  return 200;
-}
-
-int http_handler(const WebbRequest *req, WebbResponse *res) {
-  int status = handle_request(req, res);
-  printf(
-    "%s %s%s%s %d\n",
-    webb_method_str(req->method),
-    req->uri,
-    req->query ? "?" : "",
-    req->query ? req->query : "",
-    status);
-  return status;
+  return handle_file(req, res, file, mime_type(file), &sb, NULL);
 }
 
 int print_usage(const char *program, int error) {
-  printf("usage: %s [-h] [-p PORT] [DIR]\n", program);
+  printf("usage: %s [-h] [-s] [-p PORT] [DIR]\n", program);
   if (!error) {
     printf("webb - A small http server written in C using libwebb\n");
     printf("\n");
     printf("args:\n");
     printf("  DIR      Directory to run web server from, defaults to cwd\n");
     printf("  -p PORT  Port to listen on, default " DEFAULT_PORT "\n");
+    printf("  -s       Sort directory listings by name\n");
     printf("  -h       Show this help text\n");
   }
   return error;
@@ -128,11 +486,14 @@ int print_usage(const char *program, int error) {
 int main(int argc, char *argv[]) {
   int opt;
   char *port = DEFAULT_PORT;
-  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+  while ((opt = getopt(argc, argv, "p:sh")) != -1) {
     switch (opt) {
     case 'p':
       port = optarg;
       break;
+    case 's':
+      SORT_LISTINGS = 1;
+      break;
     case 'h':
       return print_usage(argv[0], 0);
     default:
@@ -158,5 +519,7 @@ int main(int argc, char *argv[]) {
     WORK_DIR[dirlen - 1] = '\0';
 
   printf("Server listening on port %s...\n", port);
-  return webb_server_run(port, http_handler);
+  (void) fflush(stdout);
+  WebbServerOptions opts = {.access_log_fd = STDOUT_FILENO};
+  return webb_server_run_opts(port, handle_request, &opts);
 }
@@ -2,6 +2,8 @@
 #define WEBB_H
 
 #include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,8 +37,13 @@ typedef struct WebbHeaders {
 typedef struct WebbRequest {
   /** @brief The HTTP verb of the request. */
   WebbMethod method;
-  /** @brief The uri component of the request. */
+  /** @brief The uri component of the request, percent-decoded. */
   char *uri;
+  /**
+   * @brief The uri component as received, still percent-encoded (may be NULL). Shares the allocation of uri, so
+   *        it is not freed on its own.
+   */
+  const char *target;
   /** @brief The query string of the request (may be NULL). */
   char *query;
   /** @brief The HTTP request headers. */
@@ -45,6 +52,17 @@ typedef struct WebbRequest {
   char *body;
   /** @brief The length of the request body. */
   size_t body_len;
+  /**
+   * @brief The index of the worker handling the request, less than the number of workers. Embedded servers
+   *        (see webb_server_new) always report 0, whichever thread processes them.
+   */
+  size_t worker;
+  /** @brief The worker's own data, as returned by WebbServerOptions.worker_init (NULL without it). */
+  void *worker_data;
+  /** @brief The address of the client (e.g a sockaddr_in6), owned by the connection. */
+  const struct sockaddr *peer;
+  /** @brief The length of peer. */
+  socklen_t peer_len;
 } WebbRequest;
 
 /** @brief The type of the response body. */
@@ -53,22 +71,63 @@ typedef enum WebbBodyType {
   WEBB_BODY_ALLOCATED,
   WEBB_BODY_STATIC,
   WEBB_BODY_FD,
+  WEBB_BODY_SHARED,
+  WEBB_BODY_MMAP,
+  WEBB_BODY_SPLICE,
 } WebbBodyType;
 
+/**
+ * @brief A reference counted, immutable buffer. It can be the body of any number of responses at once, on any
+ *        number of workers, without being copied. Freed once the last reference is released.
+ */
+typedef struct WebbShared WebbShared;
+
+/** @brief A connection taken over by the WebSocket protocol, see webb_websocket_upgrade. */
+typedef struct WebbWebSocket WebbWebSocket;
+
+/** @brief A connection receiving server-sent events, see webb_sse_subscribe. */
+typedef struct WebbSseSubscriber WebbSseSubscriber;
+
+/**
+ * @brief Called once a WEBB_BODY_SPLICE body was sent, or dropped along with its connection, on the worker
+ *        that was sending it.
+ *
+ * @param fd       The body's source, owned by the function from here.
+ * @param complete Non-zero if all of the body was read from fd.
+ * @param arg      As passed to webb_set_body_splice.
+ */
+typedef void(WebbSpliceDone)(int fd, int complete, void *arg);
+
 /** @brief A Webb response body. */
 typedef struct WebbBody {
   /** @brief The length of the HTTP response body. */
   size_t len;
+  /**
+   * @brief The offset in the file to start sending from, only used for WEBB_BODY_FD. For WEBB_BODY_SPLICE, the
+   *        number of bytes read from the source so far.
+   */
+  size_t offset;
   /** @brief The body type. */
   WebbBodyType type;
   union {
-    /** @brief The HTTP body buffer. */
+    /** @brief The HTTP body buffer, also the mapping for WEBB_BODY_MMAP. */
     char *buf;
     /** @brief The HTTP body file descriptor. */
     int fd;
+    /** @brief The HTTP body shared buffer, a reference is held until the response is sent. */
+    WebbShared *shared;
+    /** @brief The socket or pipe streamed as the HTTP body, and what to call once it is done with. */
+    struct {
+      int fd;
+      WebbSpliceDone *done;
+      void *arg;
+    } splice;
   } body;
 } WebbBody;
 
+/** @brief The space in each response for headers set without allocating. */
+#define WEBB_HEADER_ARENA_SIZE 512
+
 /** @brief A Webb HTTP response. */
 typedef struct WebbResponse {
   /** @brief HTTP status response code (e.g 200 for OK). */
@@ -77,11 +136,33 @@ typedef struct WebbResponse {
   WebbHeaders *headers;
   /** @brief HTTP body to send */
   WebbBody body;
+  /** @brief The content-type header, NULL to leave it out. Not freed, e.g a string literal. */
+  const char *content_type;
+  /** @brief The cache-control header, NULL to leave it out. Not freed, e.g a string literal. */
+  const char *cache_control;
+  /**
+   * @brief Header lines written as is after all other headers (each "key: value\r\n"), NULL for none. Not freed,
+   *        has to stay valid until the response is sent, e.g part of the buffer of a shared body.
+   */
+  const char *raw_headers;
+  /** @brief Set by webb_websocket_upgrade, the connection is handed over to it once the response is sent. */
+  WebbWebSocket *websocket;
+  /** @brief Set by webb_sse_subscribe, the connection receives its channel's events once the head is sent. */
+  WebbSseSubscriber *sse;
+  /** @brief The bytes of arena used by webb_set_header_static and webb_set_headerf. */
+  size_t arena_used;
+  /** @brief Headers set without allocating, and their formatted values. Freed with the response. */
+  union {
+    char buf[WEBB_HEADER_ARENA_SIZE];
+    void *align;
+  } arena;
 } WebbResponse;
 
 /**
  * @brief A Webb HTTP handler function. Accepts an incoming request and returns a response.
- *        Note that this function has to be thread-safe.
+ *        Note that this function has to be thread-safe. State kept in req->worker_data is only ever used
+ *        by a single worker thread, so it needs no locking. The requests of HTTP/2 streams (h2c) come through
+ *        it as well, their handler never running on a coroutine as the streams share a socket.
  *
  * @param req The HTTP request object.
  * @param res The HTTP response object, mutated by the function.
@@ -90,6 +171,227 @@ typedef struct WebbResponse {
  */
 typedef int(WebbHandler)(const WebbRequest *req, WebbResponse *res);
 
+/** @brief Options for the Webb http server. Zero-initialize to get the defaults. */
+typedef struct WebbServerOptions {
+  /**
+   * @brief File descriptor to write an access log to (e.g STDOUT_FILENO), 0 disables access logging.
+   *        Each worker appends records to its own ring buffer, written out in batches by a background thread.
+   *        Records are dropped (and the number dropped reported) if the writer cannot keep up.
+   */
+  int access_log_fd;
+  /** @brief Maximum number of library log messages per second, 0 for no limit. */
+  unsigned log_rate_limit;
+  /**
+   * @brief Maximum size in bytes of the request line and headers, 0 for the default (8kb), at most 1mb.
+   *        Requests exceeding it are answered with 431. Header buffers start at 1kb and grow as needed.
+   */
+  size_t max_header_size;
+  /** @brief Maximum number of open connections, 0 for no limit. Connections beyond it are answered with 503. */
+  size_t max_connections;
+  /** @brief Maximum number of open connections per worker thread, 0 for no limit. */
+  size_t max_connections_per_worker;
+  /** @brief Seconds to advertise in the retry-after header of 503 responses, 0 for the default (1). */
+  unsigned retry_after;
+  /** @brief Set to disable TCP_NODELAY, leaving Nagle's algorithm on for small responses. */
+  int disable_nodelay;
+  /** @brief Seconds to wait for request data before accepting a new connection (TCP_DEFER_ACCEPT), 0 disables. */
+  int defer_accept;
+  /** @brief Length of the TCP fast open queue, allowing data in the SYN (TCP_FASTOPEN), 0 disables. */
+  int fastopen_queue;
+  /** @brief Microseconds to busy poll the device queue on blocking reads (SO_BUSY_POLL), 0 disables. */
+  int busy_poll_us;
+  /** @brief Socket send buffer size in bytes (SO_SNDBUF), 0 for the system default. */
+  int send_buffer_size;
+  /** @brief Socket receive buffer size in bytes (SO_RCVBUF), 0 for the system default. */
+  int recv_buffer_size;
+  /**
+   * @brief Set to pin each worker thread to its own CPU and steer connections to the worker on the CPU that
+   *        received them, so packet processing and the handler share caches. Each worker then accepts from its
+   *        own SO_REUSEPORT listener, picked by a classic BPF program. Uses at most one worker per allowed CPU.
+   */
+  int pin_workers;
+  /**
+   * @brief Called once per worker, on the worker's own thread before it handles any request (for embedded
+   *        servers, by webb_server_new). The returned pointer is passed to handlers as req->worker_data.
+   *        Returning NULL is not an error. May be NULL.
+   */
+  void *(*worker_init)(size_t worker, void *arg);
+  /**
+   * @brief Called with the data returned by worker_init when a worker stops, on the worker's thread.
+   *        Threaded workers only stop on fatal errors, embedded servers stop in webb_server_free. May be NULL.
+   */
+  void (*worker_fini)(size_t worker, void *data, void *arg);
+  /** @brief Passed as is to worker_init and worker_fini. */
+  void *worker_arg;
+  /**
+   * @brief Set to run each request's handler on a coroutine with a stack of this many bytes (e.g 64kb), 0 calls
+   *        handlers directly. Handlers can then wait with webb_wait_fd, webb_read, webb_write and webb_sleep
+   *        without blocking their worker, which handles other connections meanwhile. Stacks are pooled per
+   *        worker and start with a guard page, so overflowing one crashes instead of corrupting memory.
+   */
+  size_t coroutine_stack_size;
+  /**
+   * @brief Set to send in-memory bodies of at least this many bytes with MSG_ZEROCOPY, 0 disables it. The kernel
+   *        then sends straight from the body instead of copying it, and the body is only freed once the kernel
+   *        reports (through the socket error queue) that it is done with it. Pays off from a few hundred kb, on
+   *        connections where the kernel copies anyway (e.g loopback) regular sends are used again. A connection
+   *        closed while such sends are in flight is half closed, and kept until they complete (at most 5s).
+   */
+  size_t zerocopy_threshold;
+  /**
+   * @brief Requests per second allowed per client, 0 disables rate limiting. Requests beyond it are answered
+   *        with 429 as soon as their head is parsed, before check_request and the handler run. One with a body
+   *        is answered before the body is read (and without an interim 100 response), the connection being
+   *        closed after it. Clients are tracked in a fixed size table shared by all workers, and checked with a
+   *        few atomic operations, without locking.
+   */
+  unsigned rate_limit;
+  /** @brief Requests a client can make at once after being idle, 0 for rate_limit (one second's worth). */
+  unsigned rate_limit_burst;
+  /** @brief Leading bits of ipv4 addresses identifying a client (e.g 24), 0 for the whole address. */
+  unsigned rate_limit_ipv4_prefix;
+  /** @brief Leading bits of ipv6 addresses identifying a client, 0 for the default (64, a typical subnet). */
+  unsigned rate_limit_ipv6_prefix;
+  /**
+   * @brief Number of clients tracked at once, 0 for the default (65536). Beyond it, the clients idle for the
+   *        longest are forgotten, starting over with a full burst.
+   */
+  size_t rate_limit_clients;
+  /**
+   * @brief Called once the head of an HTTP/1.1 request with a body is parsed, before any of the body is read
+   *        (e.g to check credentials, the route or the content-length). Returns 0 to go on, any other value
+   *        being the status of a final response sent right away with res, the handler never running and the
+   *        connection being closed after it. Clients sending "expect: 100-continue" get the interim 100
+   *        response once it returns 0. Bodies over 2mb are refused with 413 before it runs. Runs without a
+   *        coroutine. May be NULL.
+   */
+  WebbHandler *check_request;
+} WebbServerOptions;
+
+/** @brief A non-owning slice of a string, not null terminated. */
+typedef struct WebbSlice {
+  /** @brief The first character of the slice. */
+  const char *ptr;
+  /** @brief The length of the slice. */
+  size_t len;
+} WebbSlice;
+
+/** @brief A query string parameter, as slices into the request's query string. Not decoded. */
+typedef struct WebbQueryParam {
+  /** @brief The parameter name. */
+  WebbSlice key;
+  /** @brief The parameter value, empty if the parameter has no '='. */
+  WebbSlice value;
+} WebbQueryParam;
+
+/** @brief The maximum number of path parameters in a single route. */
+#define WEBB_MAX_ROUTE_PARAMS 16
+
+/** @brief Path parameters captured when matching a route, e.g `id` in "/users/:id". */
+typedef struct WebbRouteParams {
+  /** @brief The number of captured parameters. */
+  size_t len;
+  /** @brief The parameter names, in the order they appear in the route. Owned by the router. */
+  const char *const *names;
+  /** @brief The parameter values, slices into the request uri. */
+  WebbSlice values[WEBB_MAX_ROUTE_PARAMS];
+} WebbRouteParams;
+
+/**
+ * @brief A Webb route handler function, like WebbHandler but also given the matched path parameters.
+ *        Note that this function has to be thread-safe.
+ *
+ * @param req The HTTP request object.
+ * @param params The path parameters of the matched route.
+ * @param res The HTTP response object, mutated by the function.
+ *
+ * @returns The HTTP status code (e.g 200 for OK), -1 on unexpected errors.
+ */
+typedef int(WebbRouteHandler)(const WebbRequest *req, const WebbRouteParams *params, WebbResponse *res);
+
+/** @brief A Webb http server driven by the caller's own event loop, see webb_server_new. */
+typedef struct WebbServer WebbServer;
+
+/** @brief A router, dispatching requests to route handlers based on method and path. */
+typedef struct WebbRouter WebbRouter;
+
+/** @brief A response cache in front of a handler, see webb_cache_new. */
+typedef struct WebbCache WebbCache;
+
+/** @brief Options for a response cache. Zero-initialize to get the defaults. */
+typedef struct WebbCacheOptions {
+  /** @brief Memory budget in bytes, split evenly between shards, 0 for the default (64mb). */
+  size_t max_bytes;
+  /**
+   * @brief Number of shards, each with its own lock and least recently used list, 0 for the default (16).
+   *        Rounded up to a power of two.
+   */
+  size_t shards;
+  /**
+   * @brief Request headers whose values are part of the cache key (e.g "accept-encoding"), NULL terminated.
+   *        Copied. May be NULL.
+   */
+  const char *const *vary;
+} WebbCacheOptions;
+
+/** @brief Named channels of server-sent events, see webb_sse_new. */
+typedef struct WebbSse WebbSse;
+
+/** @brief Options for server-sent events. Zero-initialize to get the defaults. */
+typedef struct WebbSseOptions {
+  /** @brief Maximum bytes waiting to be sent to a slow subscriber, 0 for the default (1mb). It is dropped past it. */
+  size_t max_queued;
+} WebbSseOptions;
+
+/** @brief A reverse proxy forwarding requests to upstream servers, see webb_proxy_new. */
+typedef struct WebbProxy WebbProxy;
+
+/** @brief How a proxy picks the upstream of each request. */
+typedef enum WebbProxyBalance {
+  /** @brief Each worker takes the upstreams in turn. */
+  WEBB_PROXY_ROUND_ROBIN = 0,
+  /** @brief The upstream with the fewest requests in flight, from all workers. */
+  WEBB_PROXY_LEAST_CONNECTIONS,
+} WebbProxyBalance;
+
+/** @brief Options for a reverse proxy. Zero-initialize to get the defaults. */
+typedef struct WebbProxyOptions {
+  /** @brief The upstream servers, as "host:port" or "[ipv6]:port", NULL terminated. Resolved once. */
+  const char *const *upstreams;
+  /** @brief How requests are balanced between upstreams. */
+  WebbProxyBalance balance;
+  /** @brief Idle keep-alive connections kept per worker and upstream, 0 for the default (16). */
+  size_t max_idle;
+  /**
+   * @brief Milliseconds to wait for each read of an upstream's response head or copied body, 0 for the default
+   *        (60000). Requests timing out are answered with 504. Spliced bodies are not covered.
+   */
+  unsigned timeout;
+} WebbProxyOptions;
+
+/**
+ * @brief What a WebSocket does with its messages. The functions are called on the worker's event loop, so they
+ *        must not block (webb_wait_fd and the like block the worker). Zero-initialize to get the defaults.
+ */
+typedef struct WebbWebSocketHandlers {
+  /** @brief Called once the upgrade response was sent, before any message. May be NULL. */
+  void (*open)(WebbWebSocket *ws);
+  /**
+   * @brief Called with each complete message, fragmented ones being reassembled. data is only valid during the
+   *        call. Text messages are not checked to be valid UTF-8. May be NULL.
+   */
+  void (*message)(WebbWebSocket *ws, const char *data, size_t len, int binary);
+  /**
+   * @brief Called once the connection is closed, with the code of the close frame received (1005 if it had none,
+   *        1006 if no close frame was received). ws is freed right after. May be NULL.
+   */
+  void (*close)(WebbWebSocket *ws, int code);
+  /** @brief Maximum size in bytes of a message, 0 for the default (1mb). Larger ones close with 1009. */
+  size_t max_message;
+  /** @brief Maximum bytes waiting to be sent to a slow client, 0 for the default (4mb). It is dropped past it. */
+  size_t max_queued;
+} WebbWebSocketHandlers;
+
 /**
  * @brief Starts the Webb http server.
  *
@@ -100,6 +402,106 @@ typedef int(WebbHandler)(const WebbRequest *req, WebbResponse *res);
  */
 int webb_server_run(const char *port, WebbHandler *handler);
 
+/**
+ * @brief Starts the Webb http server, with options. SIGPIPE is ignored process wide.
+ *
+ * @param port    The port to listen to (e.g "8080").
+ * @param handler The http request/response handler function.
+ * @param opts    The server options, NULL for the defaults.
+ *
+ * @returns A non-zero error. Note that this function never returns unless an error occurred.
+ */
+int webb_server_run_opts(const char *port, WebbHandler *handler, const WebbServerOptions *opts);
+
+/**
+ * @brief Creates a Webb http server embedded in the caller's own event loop, without starting any threads.
+ *        It listens on port right away, connections are then accepted and handled by webb_server_process,
+ *        with handlers called on the calling thread. pin_workers is ignored, and no access log thread is
+ *        started, records are written out by webb_server_process. Signal dispositions are left alone:
+ *        sendfile and splice cannot be told not to raise SIGPIPE, so callers serving file or splice bodies
+ *        should ignore SIGPIPE themselves, or a peer closing mid-response kills the process.
+ *
+ * @param port    The port to listen to (e.g "8080").
+ * @param handler The http request/response handler function.
+ * @param opts    The server options, NULL for the defaults. Copied.
+ *
+ * @returns The server, NULL on error.
+ */
+WebbServer *webb_server_new(const char *port, WebbHandler *handler, const WebbServerOptions *opts);
+
+/**
+ * @brief Get the file descriptor to watch for a server, readable (e.g EPOLLIN) when it has events to process.
+ *
+ * @param server The server.
+ *
+ * @returns The file descriptor, owned by the server.
+ */
+int webb_server_fd(const WebbServer *server);
+
+/**
+ * @brief Processes the events ready on a server, never blocking.
+ *
+ * @param server The server.
+ * @param budget The maximum number of events to process.
+ *
+ * @returns The number of events processed, -1 on errors. When it is budget there may be more ready events that
+ *          the file descriptor does not signal again, call it again before waiting.
+ */
+int webb_server_process(WebbServer *server, int budget);
+
+/**
+ * @brief Closes all connections and the listening socket of a server, and frees it.
+ *
+ * @param server The server, may be NULL.
+ */
+void webb_server_free(WebbServer *server);
+
+/**
+ * @brief Waits until a file descriptor is readable or writable. Called from a handler running on a coroutine
+ *        (see coroutine_stack_size), only the handler is suspended and its worker handles other connections
+ *        meanwhile. Otherwise the calling thread blocks. A file descriptor can only be waited on by one
+ *        handler at a time.
+ *
+ * @param fd       The file descriptor, has to support epoll (e.g a socket, pipe or timerfd).
+ * @param writable Non-zero to wait until fd is writable, 0 until it is readable.
+ *
+ * @returns 0 once fd is ready (or has an error or hang up to report), non-zero on errors (with errno set).
+ */
+int webb_wait_fd(int fd, int writable);
+
+/**
+ * @brief Like read, but waits with webb_wait_fd while fd would block. Only yields to the worker if fd is
+ *        non-blocking (e.g SOCK_NONBLOCK or O_NONBLOCK), otherwise read blocks the calling thread.
+ *
+ * @param fd  The file descriptor.
+ * @param buf The buffer to read into.
+ * @param len The maximum number of bytes to read.
+ *
+ * @returns The number of bytes read, 0 at end of file, -1 on errors (with errno set).
+ */
+ssize_t webb_read(int fd, void *buf, size_t len);
+
+/**
+ * @brief Writes all of buf, waiting with webb_wait_fd while fd would block. Only yields to the worker if fd is
+ *        non-blocking (e.g SOCK_NONBLOCK or O_NONBLOCK), otherwise write blocks the calling thread.
+ *
+ * @param fd  The file descriptor.
+ * @param buf The bytes to write.
+ * @param len The number of bytes to write.
+ *
+ * @returns len, -1 on errors (with errno set, part of buf may have been written).
+ */
+ssize_t webb_write(int fd, const void *buf, size_t len);
+
+/**
+ * @brief Sleeps for a number of milliseconds, only suspending the handler when it runs on a coroutine.
+ *
+ * @param ms The number of milliseconds to sleep.
+ *
+ * @returns 0 on success, non-zero on errors.
+ */
+int webb_sleep(unsigned ms);
+
 /**
  * @brief Get the value of a given header from the request.
  *
@@ -110,15 +512,74 @@ int webb_server_run(const char *port, WebbHandler *handler);
  */
 const char *webb_get_header(const WebbRequest *req, const char *key);
 
+/**
+ * @brief Iterate the parameters of the request's query string, in order, without allocating or decoding.
+ *        E.g `for (size_t pos = 0; webb_query_next(req, &pos, &param) == 0;)`.
+ *
+ * @param req The HTTP request.
+ * @param pos The position in the query string, 0 to start from the first parameter. Updated.
+ * @param param Set to the next parameter, its slices are owned by req.
+ *
+ * @returns 0 when a parameter was found, non-zero once there are no more.
+ */
+int webb_query_next(const WebbRequest *req, size_t *pos, WebbQueryParam *param);
+
+/**
+ * @brief Look up the first query string parameter with a given name, without allocating. Names are compared
+ *        after decoding, so "a%20b" matches "a b".
+ *
+ * @param req The HTTP request.
+ * @param name The decoded parameter name.
+ * @param value Set to the parameter value, not decoded and owned by req.
+ *
+ * @returns 0 when the parameter was found, non-zero otherwise.
+ */
+int webb_query_get(const WebbRequest *req, const char *name, WebbSlice *value);
+
+/**
+ * @brief Decode a query string slice (percent escapes, and '+' as space) into a caller buffer, null terminated.
+ *        Decoding never makes a slice longer, so a buffer of slice->len + 1 bytes is always enough.
+ *
+ * @param slice The slice to decode, e.g a WebbQueryParam value.
+ * @param buf The buffer to decode into.
+ * @param len The size of buf.
+ *
+ * @returns The decoded length, -1 if the slice has an invalid escape or does not fit in buf.
+ */
+ssize_t webb_query_decode(const WebbSlice *slice, char *buf, size_t len);
+
 /**
  * @brief Set a given response header.
  *
  * @param res The HTTP response.
  * @param key The header name. Has to be a non-allocated string.
- * @param val The header value. Has to be an allocated string (will be freed).
+ * @param val The header value. Has to be an allocated string (will be freed). If NULL (e.g a failed strdup) or
+ *            out of memory, the header is left out.
  */
 void webb_set_header(WebbResponse *res, char *key, char *val);
 
+/**
+ * @brief Set a given response header without allocating, the header is kept in the response's arena.
+ *        Allocates like webb_set_header only once the arena is full, leaving the header out if out of memory.
+ *
+ * @param res The HTTP response.
+ * @param key The header name. Has to be a non-allocated string.
+ * @param val The header value. Has to be a non-allocated string that outlives the response (e.g a literal).
+ */
+void webb_set_header_static(WebbResponse *res, char *key, char *val);
+
+/**
+ * @brief Set a given response header, formatting its value like printf straight into the response's arena.
+ *        Allocates like webb_set_header only once the arena is full.
+ *
+ * @param res The HTTP response.
+ * @param key The header name. Has to be a non-allocated string.
+ * @param fmt The printf format of the header value.
+ *
+ * @returns 0 on success, non-zero if out of memory or fmt is invalid.
+ */
+int webb_set_headerf(WebbResponse *res, char *key, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
 /**
  * @brief Set the body of the response. Body will be freed.
  *
@@ -145,6 +606,332 @@ void webb_set_body_static(WebbResponse *res, char *body, size_t len);
  */
 void webb_set_body_fd(WebbResponse *res, int fd, size_t len);
 
+/**
+ * @brief Set the body of the response as a range of a file descriptor to send, e.g part of an opened file.
+ *        The file descriptor is closed once the response is sent.
+ *
+ * @param res The HTTP response.
+ * @param fd The file descriptor to read from. Has to be seekable.
+ * @param offset The offset in the file to start sending from.
+ * @param len The number of bytes to send.
+ */
+void webb_set_body_fd_range(WebbResponse *res, int fd, size_t offset, size_t len);
+
+/**
+ * @brief Set the body of the response as a memory mapping, e.g of a file. Unmapped once the response is sent.
+ *
+ * @param res The HTTP response.
+ * @param addr The mapping, as returned by mmap.
+ * @param len The length of the mapping, all of it is sent.
+ */
+void webb_set_body_mmap(WebbResponse *res, char *addr, size_t len);
+
+/**
+ * @brief Set the body of the response as a socket or pipe to stream, moved to the client with splice without
+ *        being copied through user space. Unlike other bodies, it may still be waited on once the handler
+ *        returned. Non-blocking sockets are waited on by the worker, blocking ones block it.
+ *
+ * @param res The HTTP response.
+ * @param fd The socket or pipe to read from.
+ * @param len The number of bytes to send.
+ * @param done Called with fd once the response is sent or dropped, closes fd if NULL.
+ * @param arg Passed on to done.
+ */
+void webb_set_body_splice(WebbResponse *res, int fd, size_t len, WebbSpliceDone *done, void *arg);
+
+/**
+ * @brief Set the body of the response as a shared buffer. A reference is taken until the response is sent, the
+ *        caller keeps its own.
+ *
+ * @param res The HTTP response.
+ * @param shared The shared buffer.
+ */
+void webb_set_body_shared(WebbResponse *res, WebbShared *shared);
+
+/**
+ * @brief Create a shared buffer from an allocated buffer, holding a single reference.
+ *
+ * @param buf The contents. Has to be allocated, freed with the shared buffer (not freed on errors).
+ * @param len The length of buf.
+ *
+ * @returns The shared buffer, NULL if out of memory. Release with webb_shared_release.
+ */
+WebbShared *webb_shared_new(char *buf, size_t len);
+
+/**
+ * @brief Create a shared buffer mapping all of a file, holding a single reference. The pages are read in
+ *        right away, so serving the buffer never waits on the disk.
+ *
+ * @param fd The file to map, e.g an opened file. Can be closed afterwards.
+ *
+ * @returns The shared buffer, NULL on errors. Release with webb_shared_release.
+ */
+WebbShared *webb_shared_mmap(int fd);
+
+/**
+ * @brief Get the contents of a shared buffer.
+ *
+ * @param shared The shared buffer.
+ * @param len Set to the length of the contents.
+ *
+ * @returns The contents, not null terminated.
+ */
+const char *webb_shared_data(const WebbShared *shared, size_t *len);
+
+/**
+ * @brief Take another reference to a shared buffer, e.g to keep it in a cache. Can be called from any thread.
+ *
+ * @param shared The shared buffer.
+ *
+ * @returns shared.
+ */
+WebbShared *webb_shared_ref(WebbShared *shared);
+
+/**
+ * @brief Release a reference to a shared buffer, freeing it if it was the last one. Can be called from any
+ *        thread.
+ *
+ * @param shared The shared buffer, may be NULL.
+ */
+void webb_shared_release(WebbShared *shared);
+
+/**
+ * @brief Create a new, empty router.
+ *
+ * @returns The router, or NULL if out of memory. Free with webb_router_free.
+ */
+WebbRouter *webb_router_new(void);
+
+/**
+ * @brief Add a route to the router. Routes should be added at startup, before the router is used.
+ *        A pattern consists of static segments, `:name` parameters matching a single path segment,
+ *        and optionally a final `*name` parameter matching the rest of the path, e.g "/users/:id/posts".
+ *        Static segments take precedence over parameters, and parameters over wildcards, at the first segment
+ *        where matching patterns differ. Adding a route after the router has been used is not thread-safe.
+ *
+ * @param router The router.
+ * @param method The HTTP method to match.
+ * @param pattern The path pattern to match, has to start with '/'. Is copied by the router.
+ * @param handler The handler to call for matching requests.
+ *
+ * @returns 0 on success, non-zero if the pattern is invalid or the route already exists.
+ */
+int webb_router_add(WebbRouter *router, WebbMethod method, const char *pattern, WebbRouteHandler *handler);
+
+/**
+ * @brief Dispatch a request to the matching route handler. Can be called from a WebbHandler.
+ *        The routes are compiled into a state machine on the first dispatch, after which matching takes one
+ *        lookup per path segment, linear in the length of the path regardless of the number of routes.
+ *
+ * @param router The router.
+ * @param req The HTTP request.
+ * @param res The HTTP response, mutated by the route handler.
+ *
+ * @returns The status returned by the route handler, 404 if no route matched the path,
+ *          or 405 if routes matched the path but none of them the method (with the allow header set, listing
+ *          the methods of every route matching the path). -1 if out of memory compiling the routes.
+ */
+int webb_router_dispatch(const WebbRouter *router, const WebbRequest *req, WebbResponse *res);
+
+/**
+ * @brief Get a path parameter by name.
+ *
+ * @param params The path parameters of the matched route.
+ * @param name The parameter name, without the leading ':' or '*'.
+ *
+ * @returns The parameter value, or NULL if the route has no such parameter. Owned by params.
+ */
+const WebbSlice *webb_route_param(const WebbRouteParams *params, const char *name);
+
+/**
+ * @brief Free a router and all of its routes.
+ *
+ * @param router The router.
+ */
+void webb_router_free(WebbRouter *router);
+
+/**
+ * @brief Create a response cache in front of a handler. GET responses are cached by uri, query string and the
+ *        values of the vary request headers, for their cache-control max-age (or s-maxage) in seconds. Responses
+ *        without one, with no-store, no-cache, private or a set-cookie header, with a file descriptor body, or
+ *        with a status other than 200, 203, 301, 404 and 410 are not cached. Each cached response is kept with
+ *        its header lines already serialized, and served without copying (see webb_set_body_shared).
+ *
+ * @param handler The handler computing responses on cache misses, called concurrently from any worker.
+ * @param opts    The cache options, NULL for the defaults.
+ *
+ * @returns The cache, or NULL if out of memory. Free with webb_cache_free.
+ */
+WebbCache *webb_cache_new(WebbHandler *handler, const WebbCacheOptions *opts);
+
+/**
+ * @brief Answer a request from the cache, calling the cache's handler on misses. Concurrent misses for the same
+ *        key are collapsed into a single handler call, the other requests wait for its response. Requests
+ *        running on coroutines (see coroutine_stack_size) yield to their worker while waiting, others block
+ *        their whole worker until the response is ready, so they only wait for handler calls on other
+ *        workers and call the handler themselves otherwise. A request waits at most a second, then calls
+ *        the handler itself. HTTP/2 streams never run on coroutines.
+ *        Can be called from a WebbHandler, on any worker.
+ *
+ * @param cache The cache.
+ * @param req   The HTTP request.
+ * @param res   The HTTP response, mutated by the cache or its handler.
+ *
+ * @returns The status of the cached response, or the status returned by the handler.
+ */
+int webb_cache_handle(WebbCache *cache, const WebbRequest *req, WebbResponse *res);
+
+/**
+ * @brief Free a cache and all of its responses. Responses still being sent keep their own reference.
+ *
+ * @param cache The cache, may be NULL.
+ */
+void webb_cache_free(WebbCache *cache);
+
+/**
+ * @brief Create a reverse proxy to one or more upstream HTTP/1.1 servers. Each worker keeps its own pool of
+ *        keep-alive connections to every upstream. Response heads are parsed like requests, small bodies are
+ *        copied and larger ones moved between the sockets with splice (see webb_set_body_splice). Upstream
+ *        responses have to have a content-length, others are answered with 502. Pools are picked by req->worker
+ *        and not locked, so a proxy is used by the handlers of a single server. Embedded servers all report
+ *        worker 0: two of them, even on different threads, need a proxy each.
+ *
+ * @param opts The proxy options, upstreams is required.
+ *
+ * @returns The proxy, or NULL if an upstream cannot be resolved or out of memory. Free with webb_proxy_free.
+ */
+WebbProxy *webb_proxy_new(const WebbProxyOptions *opts);
+
+/**
+ * @brief Forward a request to an upstream and fill res with its response, to be called from a handler. Upstream
+ *        sockets are waited on with webb_wait_fd, so this only blocks the handler when it runs on a coroutine.
+ *        The target is sent as received (the uri percent-encoded again without it), hop-by-hop headers are
+ *        dropped and x-forwarded-for is added.
+ *        A request that failed on a reused connection the upstream had closed meanwhile is retried once.
+ *
+ * @param proxy The proxy.
+ * @param req   The request, forwarded as is. req->worker picks the connection pool.
+ * @param res   The response.
+ *
+ * @returns The upstream's status, or 502 if it could not be reached or its response could not be parsed.
+ */
+int webb_proxy_handle(WebbProxy *proxy, const WebbRequest *req, WebbResponse *res);
+
+/**
+ * @brief Free a proxy and close its idle connections. Has to outlive the servers using it, as responses still
+ *        being sent return their connection to its pools.
+ *
+ * @param proxy The proxy, may be NULL.
+ */
+void webb_proxy_free(WebbProxy *proxy);
+
+/**
+ * @brief Accept a WebSocket handshake (rfc6455), to be returned from a handler. Once the 101 response is sent the
+ *        connection is no longer HTTP, its frames are handled on the same worker's event loop.
+ *
+ * @param req      The request, a GET with upgrade: websocket.
+ * @param res      The response, gets the handshake headers.
+ * @param handlers The functions called with the WebSocket's events. Copied.
+ * @param data     Anything, returned by webb_websocket_data.
+ *
+ * @returns 101, 400 if req is not a valid handshake, 426 for another version of the protocol, -1 if out of memory.
+ */
+int webb_websocket_upgrade(
+  const WebbRequest *req,
+  WebbResponse *res,
+  const WebbWebSocketHandlers *handlers,
+  void *data);
+
+/**
+ * @brief Get the data passed to webb_websocket_upgrade.
+ *
+ * @param ws The WebSocket.
+ *
+ * @returns The data.
+ */
+void *webb_websocket_data(const WebbWebSocket *ws);
+
+/**
+ * @brief Send a message, from the WebSocket's worker (e.g in its handlers). Sent right away when the socket has
+ *        room, otherwise queued until it does.
+ *
+ * @param ws     The WebSocket.
+ * @param data   The message.
+ * @param len    The length of the message.
+ * @param binary Non-zero for a binary message, 0 for text.
+ *
+ * @returns 0 on success, non-zero if the WebSocket failed (e.g over max_queued), it is then closed by its worker.
+ */
+int webb_websocket_send(WebbWebSocket *ws, const char *data, size_t len, int binary);
+
+/**
+ * @brief Send the same message to many WebSockets of the calling worker. The frame is built once, in a shared
+ *        buffer queued without copying to the sockets that cannot take it right away.
+ *
+ * @param sockets The WebSockets.
+ * @param n       The number of WebSockets.
+ * @param data    The message.
+ * @param len     The length of the message.
+ * @param binary  Non-zero for a binary message, 0 for text.
+ *
+ * @returns The number of WebSockets that failed, they are closed by their worker. n if out of memory.
+ */
+size_t webb_websocket_broadcast(WebbWebSocket *const *sockets, size_t n, const char *data, size_t len, int binary);
+
+/**
+ * @brief Start the closing handshake. The connection is closed once the client answers, further messages from it
+ *        are dropped.
+ *
+ * @param ws   The WebSocket.
+ * @param code The status code of the close frame (e.g 1000 for a normal closure).
+ */
+void webb_websocket_close(WebbWebSocket *ws, int code);
+
+/**
+ * @brief Create a set of server-sent event channels (text/event-stream), created by name as they are subscribed.
+ *
+ * @param opts The options, NULL for the defaults.
+ *
+ * @returns The channels, or NULL if out of memory. Free with webb_sse_free.
+ */
+WebbSse *webb_sse_new(const WebbSseOptions *opts);
+
+/**
+ * @brief Subscribe a request's connection to a channel, to be returned from a handler. The response is sent
+ *        without a content-length and the connection stays open, receiving the events published from the time
+ *        its head is sent until either side closes it. Not available to HTTP/2 streams, which get a 500.
+ *
+ * @param sse     The channels.
+ * @param channel The name of the channel. Copied.
+ * @param res     The response, gets the event stream's headers.
+ *
+ * @returns 200, -1 if out of memory.
+ */
+int webb_sse_subscribe(WebbSse *sse, const char *channel, WebbResponse *res);
+
+/**
+ * @brief Publish an event to every subscriber of a channel, from any thread. It is formatted once in a shared
+ *        buffer, written right away to the subscribers with room in their socket and queued by reference to
+ *        the others, until their worker sees them writable. Subscribers over max_queued are dropped.
+ *
+ * @param sse     The channels.
+ * @param channel The name of the channel.
+ * @param event   The event's type, NULL for a plain message. Must not contain "\r" or "\n".
+ * @param data    The event's data, each line (ended by "\r\n", "\r" or "\n") sent as a data field.
+ * @param len     The length of data.
+ *
+ * @returns The number of subscribers the event was sent or queued to, -1 if out of memory or the event's type
+ *          contains a line break.
+ */
+int webb_sse_publish(WebbSse *sse, const char *channel, const char *event, const char *data, size_t len);
+
+/**
+ * @brief Free the channels. Has to outlive the servers using it, as their subscribers are in its channels.
+ *
+ * @param sse The channels, may be NULL.
+ */
+void webb_sse_free(WebbSse *sse);
+
 /**
  * @brief Convert an HTTP method to it's string representation (e.g HTTP_GET -> "GET").
  *
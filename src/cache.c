@@ -0,0 +1,434 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+typedef struct CacheEntry {
+  uint64_t hash;
+  char *key;
+  size_t key_len;
+  // the body followed by the serialized header lines, NULL while the response is being computed
+  WebbShared *data;
+  size_t body_len;
+  const char *head;
+  int status;
+  time_t stored;
+  time_t expires;
+  size_t size;
+  // signaled once a pending entry is filled (or dropped), created by the first request waiting on it
+  int fill_fd;
+  // the thread computing a pending entry's response
+  pthread_t filler;
+  struct CacheEntry *chain;
+  // least recently used list, filled entries only
+  struct CacheEntry *prev, *next;
+} CacheEntry;
+
+typedef struct CacheShard {
+  pthread_mutex_t lock;
+  CacheEntry **buckets;
+  size_t nbuckets;
+  size_t count;
+  // lru.next is the most recently used entry, lru.prev the next to be evicted
+  CacheEntry lru;
+  size_t bytes;
+  size_t max_bytes;
+} CacheShard;
+
+struct WebbCache {
+  WebbHandler *handler;
+  char **vary;
+  size_t nshards;
+  CacheShard *shards;
+};
+
+static uint64_t hash_key(const char *key, size_t len) {
+  // fnv-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) key[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static time_t now_s(void) {
+  struct timespec ts;
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static size_t append_key(char *key, size_t len, const char *s) {
+  // parts are separated by null characters, which none of them can contain
+  if (!s)
+    s = "";
+  size_t n = strlen(s);
+  if (len + n + 1 > CACHE_MAX_KEY)
+    return CACHE_MAX_KEY + 1;
+  memcpy(key + len, s, n);
+  key[len + n] = '\0';
+  return len + n + 1;
+}
+
+static size_t build_key(const WebbCache *cache, const WebbRequest *req, char *key) {
+  size_t len = append_key(key, 0, req->uri);
+  len = append_key(key, len, req->query);
+  for (char **name = cache->vary; *name && len <= CACHE_MAX_KEY; name++)
+    len = append_key(key, len, webb_get_header(req, *name));
+  return len;
+}
+
+static CacheEntry **find_entry(CacheShard *shard, uint64_t hash, const char *key, size_t len) {
+  CacheEntry **entry = &shard->buckets[(hash >> 32) & (shard->nbuckets - 1)];
+  for (; *entry; entry = &(*entry)->chain) {
+    if ((*entry)->hash == hash && (*entry)->key_len == len && memcmp((*entry)->key, key, len) == 0)
+      break;
+  }
+  return entry;
+}
+
+static void grow_buckets(CacheShard *shard) {
+  // a failed grow only makes the chains longer
+  size_t nbuckets = shard->nbuckets * 2;
+  CacheEntry **buckets = calloc(nbuckets, sizeof(CacheEntry *));
+  if (!buckets)
+    return;
+  for (size_t i = 0; i < shard->nbuckets; i++) {
+    for (CacheEntry *entry = shard->buckets[i], *chain; entry; entry = chain) {
+      chain = entry->chain;
+      CacheEntry **bucket = &buckets[(entry->hash >> 32) & (nbuckets - 1)];
+      entry->chain = *bucket;
+      *bucket = entry;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+static void lru_unlink(CacheEntry *entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+}
+
+static void lru_push(CacheShard *shard, CacheEntry *entry) {
+  entry->prev = &shard->lru;
+  entry->next = shard->lru.next;
+  shard->lru.next->prev = entry;
+  shard->lru.next = entry;
+}
+
+static void signal_filled(CacheEntry *entry) {
+  if (entry->fill_fd == -1)
+    return;
+  uint64_t one = 1;
+  if (write(entry->fill_fd, &one, sizeof(one)) == -1)
+    LOG_ERRNO("write");
+  (void) close(entry->fill_fd);
+  entry->fill_fd = -1;
+}
+
+static void remove_entry(CacheShard *shard, CacheEntry **link) {
+  // responses still being sent hold their own reference to the data
+  CacheEntry *entry = *link;
+  *link = entry->chain;
+  shard->count--;
+  if (entry->data) {
+    lru_unlink(entry);
+    shard->bytes -= entry->size;
+    webb_shared_release(entry->data);
+  }
+  signal_filled(entry);
+  free(entry->key);
+  free(entry);
+}
+
+static void evict(CacheShard *shard) {
+  while (shard->bytes > shard->max_bytes && shard->lru.prev != &shard->lru) {
+    CacheEntry *entry = shard->lru.prev;
+    remove_entry(shard, find_entry(shard, entry->hash, entry->key, entry->key_len));
+  }
+}
+
+static long max_age(const char *cache_control) {
+  // s-maxage takes precedence, responses that may not be shared or stored are not cached
+  long age = 0, shared_age = -1;
+  for (const char *s = cache_control; *s;) {
+    s += strspn(s, " \t,");
+    size_t len = strcspn(s, ",");
+    if (strncasecmp(s, "no-store", 8) == 0 || strncasecmp(s, "no-cache", 8) == 0)
+      return 0;
+    if (strncasecmp(s, "private", 7) == 0)
+      return 0;
+    if (strncasecmp(s, "max-age=", 8) == 0)
+      age = strtol(s + 8, NULL, 10);
+    else if (strncasecmp(s, "s-maxage=", 9) == 0)
+      shared_age = strtol(s + 9, NULL, 10);
+    s += len;
+  }
+  return shared_age >= 0 ? shared_age : age;
+}
+
+static const char *response_header(const WebbResponse *res, const char *key) {
+  for (WebbHeaders *h = res->headers; h; h = h->next) {
+    if (strcasecmp(key, h->key) == 0)
+      return h->val;
+  }
+  return NULL;
+}
+
+static size_t put_header(char *buf, size_t len, size_t n, const char *key, const char *val) {
+  // only measures once buf is full, e.g with a NULL buf
+  return n + (size_t) snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, "%s: %s\r\n", key, val);
+}
+
+static size_t serialize_headers(const WebbResponse *res, char *buf, size_t len) {
+  // the same lines send_response writes, later written as is after the headers of a cached response
+  size_t n = 0;
+  if (res->content_type)
+    n = put_header(buf, len, n, "content-type", res->content_type);
+  if (res->cache_control)
+    n = put_header(buf, len, n, "cache-control", res->cache_control);
+  for (WebbHeaders *h = res->headers; h; h = h->next)
+    n = put_header(buf, len, n, h->key, h->val);
+  return n;
+}
+
+static int cacheable_status(int status) {
+  // statuses that answer any request for the key, unlike e.g a 206 or 304 answering a conditional or range request
+  return status == 200 || status == 203 || status == 301 || status == 404 || status == 410;
+}
+
+static WebbShared *build_data(const WebbResponse *res, time_t *ttl) {
+  // only in-memory bodies of responses explicitly allowed to be stored are cached
+  const char *cache_control = res->cache_control ? res->cache_control : response_header(res, "cache-control");
+  if (!cacheable_status(res->status) || !cache_control || response_header(res, "set-cookie"))
+    return NULL;
+  if (res->body.type == WEBB_BODY_FD || res->body.type == WEBB_BODY_SPLICE)
+    return NULL;
+  *ttl = (time_t) max_age(cache_control);
+  if (*ttl <= 0)
+    return NULL;
+  size_t head_len = serialize_headers(res, NULL, 0);
+  if (head_len > CACHE_MAX_HEAD)
+    return NULL;
+  size_t body_len = res->body.len;
+  char *buf = malloc(body_len + head_len + 1);
+  if (!buf)
+    return NULL;
+  if (res->body.type == WEBB_BODY_SHARED) {
+    size_t len;
+    memcpy(buf, webb_shared_data(res->body.body.shared, &len), body_len);
+  } else if (body_len) {
+    memcpy(buf, res->body.body.buf, body_len);
+  }
+  (void) serialize_headers(res, buf + body_len, head_len + 1);
+  WebbShared *data = webb_shared_new(buf, body_len);
+  if (!data)
+    free(buf);
+  return data;
+}
+
+static void set_cached(WebbResponse *res, const CacheEntry *entry, time_t now) {
+  // the caller holds a reference to entry->data, owned by the response from here
+  res->status = entry->status;
+  res->body = (WebbBody){.type = WEBB_BODY_SHARED, .len = entry->body_len, .body = {.shared = entry->data}};
+  res->raw_headers = entry->head;
+  (void) webb_set_headerf(res, "age", "%ld", (long) (now - entry->stored));
+}
+
+static int lookup(CacheShard *shard, uint64_t hash, const char *key, size_t len, time_t now, WebbResponse *res) {
+  // 0 on hits, called with the shard locked
+  CacheEntry **link = find_entry(shard, hash, key, len);
+  CacheEntry *entry = *link;
+  if (!entry || !entry->data)
+    return 1;
+  if (entry->expires <= now) {
+    remove_entry(shard, link);
+    return 1;
+  }
+  lru_unlink(entry);
+  lru_push(shard, entry);
+  webb_shared_ref(entry->data);
+  set_cached(res, entry, now);
+  return 0;
+}
+
+static int can_wait(const CacheEntry *entry) {
+  // requests off a coroutine block their whole worker while waiting. should the filler be a suspended
+  // coroutine of that same worker it could never resume, so those requests call the handler themselves
+  return coro_running() || !pthread_equal(entry->filler, pthread_self());
+}
+
+static int wait_filled(CacheShard *shard, CacheEntry *entry) {
+  // every waiter needs its own file descriptor, a wait only allows one waiter per descriptor. the wait is
+  // bounded, as the filler could be waiting on the waiter's worker itself (e.g a request to this server)
+  if (entry->fill_fd == -1)
+    entry->fill_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int fd = entry->fill_fd == -1 ? -1 : fcntl(entry->fill_fd, F_DUPFD_CLOEXEC, 0);
+  (void) pthread_mutex_unlock(&shard->lock);
+  if (fd == -1) {
+    LOG_ERRNO("eventfd");
+    return 1;
+  }
+  int res = coro_wait_fd_timeout(fd, 0, CACHE_FILL_WAIT_MS);
+  (void) close(fd);
+  return res;
+}
+
+static int fill(const WebbCache *cache, CacheShard *shard, CacheEntry *entry, const WebbRequest *req,
+  WebbResponse *res) {
+  // the handler runs unlocked, requests for the same key meanwhile wait for its response
+  int status = cache->handler(req, res);
+  res->status = status;
+  time_t ttl = 0;
+  WebbShared *data = status >= 0 ? build_data(res, &ttl) : NULL;
+  size_t body_len = 0, size = 0;
+  const char *buf = NULL;
+  if (data) {
+    // the response is sent from the cached copy too, the handler's body is not needed anymore
+    buf = webb_shared_data(data, &body_len);
+    size = sizeof(CacheEntry) + entry->key_len + body_len + strlen(buf + body_len) + 1;
+    http_body_free(&res->body);
+    res->body = (WebbBody){.type = WEBB_BODY_SHARED, .len = body_len, .body = {.shared = webb_shared_ref(data)}};
+  }
+  (void) pthread_mutex_lock(&shard->lock);
+  CacheEntry **link = find_entry(shard, entry->hash, entry->key, entry->key_len);
+  if (!data || size > shard->max_bytes) {
+    remove_entry(shard, link);
+    webb_shared_release(data);
+  } else {
+    entry->data = data;
+    entry->body_len = body_len;
+    entry->head = buf + body_len;
+    entry->status = status;
+    entry->stored = now_s();
+    entry->expires = entry->stored + ttl;
+    entry->size = size;
+    lru_push(shard, entry);
+    shard->bytes += entry->size;
+    signal_filled(entry);
+    evict(shard);
+  }
+  (void) pthread_mutex_unlock(&shard->lock);
+  return status;
+}
+
+WebbCache *webb_cache_new(WebbHandler *handler, const WebbCacheOptions *opts) {
+  WebbCacheOptions defaults = {0};
+  if (!opts)
+    opts = &defaults;
+  WebbCache *cache = calloc(1, sizeof(WebbCache));
+  if (!cache)
+    return NULL;
+  cache->handler = handler;
+  size_t nvary = 0;
+  while (opts->vary && opts->vary[nvary])
+    nvary++;
+  cache->vary = calloc(nvary + 1, sizeof(char *));
+  if (!cache->vary)
+    goto err;
+  for (size_t i = 0; i < nvary; i++) {
+    cache->vary[i] = strdup(opts->vary[i]);
+    if (!cache->vary[i])
+      goto err;
+  }
+  // a power of two, so the shard is picked from the hash with a mask
+  size_t nshards = 1;
+  while (nshards < (opts->shards ? opts->shards : CACHE_DEFAULT_SHARDS))
+    nshards *= 2;
+  size_t max_bytes = opts->max_bytes ? opts->max_bytes : CACHE_DEFAULT_MAX_BYTES;
+  cache->shards = calloc(nshards, sizeof(CacheShard));
+  if (!cache->shards)
+    goto err;
+  for (; cache->nshards < nshards; cache->nshards++) {
+    CacheShard *shard = &cache->shards[cache->nshards];
+    shard->nbuckets = CACHE_MIN_BUCKETS;
+    shard->buckets = calloc(shard->nbuckets, sizeof(CacheEntry *));
+    if (!shard->buckets)
+      goto err;
+    (void) pthread_mutex_init(&shard->lock, NULL);
+    shard->lru.prev = shard->lru.next = &shard->lru;
+    shard->max_bytes = max_bytes / nshards;
+  }
+  return cache;
+
+err:
+  webb_cache_free(cache);
+  return NULL;
+}
+
+int webb_cache_handle(WebbCache *cache, const WebbRequest *req, WebbResponse *res) {
+  char key[CACHE_MAX_KEY + 1];
+  size_t len = req->method == WEBB_GET ? build_key(cache, req, key) : CACHE_MAX_KEY + 1;
+  if (len > CACHE_MAX_KEY)
+    return cache->handler(req, res);
+  uint64_t hash = hash_key(key, len);
+  CacheShard *shard = &cache->shards[hash & (cache->nshards - 1)];
+  time_t now = now_s();
+
+  (void) pthread_mutex_lock(&shard->lock);
+  if (lookup(shard, hash, key, len, now, res) == 0) {
+    (void) pthread_mutex_unlock(&shard->lock);
+    return res->status;
+  }
+  CacheEntry **link = find_entry(shard, hash, key, len);
+  if (*link && !can_wait(*link)) {
+    (void) pthread_mutex_unlock(&shard->lock);
+    return cache->handler(req, res);
+  }
+  if (*link) {
+    // another request is computing this response, it is waited for once instead of calling the handler again
+    if (wait_filled(shard, *link) == 0) {
+      (void) pthread_mutex_lock(&shard->lock);
+      int hit = lookup(shard, hash, key, len, now_s(), res) == 0;
+      (void) pthread_mutex_unlock(&shard->lock);
+      if (hit)
+        return res->status;
+    }
+    return cache->handler(req, res);
+  }
+  CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+  if (entry)
+    entry->key = malloc(len);
+  if (!entry || !entry->key) {
+    (void) pthread_mutex_unlock(&shard->lock);
+    free(entry);
+    return cache->handler(req, res);
+  }
+  memcpy(entry->key, key, len);
+  entry->key_len = len;
+  entry->hash = hash;
+  entry->fill_fd = -1;
+  entry->filler = pthread_self();
+  *link = entry;
+  if (++shard->count > shard->nbuckets)
+    grow_buckets(shard);
+  (void) pthread_mutex_unlock(&shard->lock);
+  return fill(cache, shard, entry, req, res);
+}
+
+void webb_cache_free(WebbCache *cache) {
+  if (!cache)
+    return;
+  for (size_t i = 0; i < cache->nshards; i++) {
+    CacheShard *shard = &cache->shards[i];
+    for (size_t j = 0; j < shard->nbuckets; j++) {
+      while (shard->buckets[j])
+        remove_entry(shard, &shard->buckets[j]);
+    }
+    free(shard->buckets);
+    (void) pthread_mutex_destroy(&shard->lock);
+  }
+  free(cache->shards);
+  for (char **name = cache->vary; name && *name; name++)
+    free(*name);
+  free(cache->vary);
+  free(cache);
+}
@@ -0,0 +1,228 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+
+// the coroutine running on this thread, NULL when handlers run directly
+static __thread Coroutine *current;
+
+static void coro_main(void) {
+  Coroutine *coro = current;
+  coro->fn(coro->arg);
+  coro->finished = 1;
+  // returns to the last coro_resume through uc_link
+}
+
+static void coro_yield(void) {
+  Coroutine *coro = current;
+  (void) swapcontext(&coro->ctx, &coro->caller);
+}
+
+int coro_running(void) {
+  return current != NULL;
+}
+
+static void coro_unmap(Coroutine *coro) {
+  (void) munmap(coro->stack, coro->size);
+  free(coro);
+}
+
+static Coroutine *coro_alloc(size_t stack_size) {
+  Coroutine *coro = calloc(1, sizeof(Coroutine));
+  if (!coro)
+    return NULL;
+  // the lowest page is left inaccessible, so overflowing the stack faults instead of corrupting memory
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  coro->size = (stack_size + page - 1) / page * page + page;
+  coro->stack = mmap(NULL, coro->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (coro->stack == MAP_FAILED) {
+    LOG_ERRNO("mmap");
+    free(coro);
+    return NULL;
+  }
+  if (mprotect(coro->stack, page, PROT_NONE) == -1) {
+    LOG_ERRNO("mprotect");
+    coro_unmap(coro);
+    return NULL;
+  }
+  return coro;
+}
+
+static int coro_prepare(Coroutine *coro) {
+  if (getcontext(&coro->ctx) == -1) {
+    LOG_ERRNO("getcontext");
+    return 1;
+  }
+  coro->ctx.uc_stack.ss_sp = coro->stack;
+  coro->ctx.uc_stack.ss_size = coro->size;
+  coro->ctx.uc_link = &coro->caller;
+  makecontext(&coro->ctx, coro_main, 0);
+  return 0;
+}
+
+Coroutine *coro_new(CoroutinePool *pool, void (*fn)(void *arg), void *arg) {
+  // stacks are reused while still mapped (and warm in cache), only the context is set up again
+  Coroutine *coro = pool->free;
+  if (coro) {
+    pool->free = coro->next;
+    pool->nfree--;
+  } else {
+    coro = coro_alloc(pool->stack_size);
+    if (!coro)
+      return NULL;
+  }
+  if (coro_prepare(coro) != 0) {
+    coro_unmap(coro);
+    return NULL;
+  }
+  coro->fn = fn;
+  coro->arg = arg;
+  coro->finished = 0;
+  coro->wait_fd = -1;
+  coro->next = NULL;
+  return coro;
+}
+
+int coro_resume(Coroutine *coro) {
+  Coroutine *prev = current;
+  current = coro;
+  (void) swapcontext(&coro->caller, &coro->ctx);
+  current = prev;
+  return coro->finished;
+}
+
+void coro_put(CoroutinePool *pool, Coroutine *coro) {
+  if (pool->nfree == CORO_POOL_MAX_FREE) {
+    coro_unmap(coro);
+    return;
+  }
+  coro->next = pool->free;
+  pool->free = coro;
+  pool->nfree++;
+}
+
+void coro_pool_free(CoroutinePool *pool) {
+  while (pool->free) {
+    Coroutine *next = pool->free->next;
+    coro_unmap(pool->free);
+    pool->free = next;
+  }
+  pool->nfree = 0;
+}
+
+int webb_wait_fd(int fd, int writable) {
+  Coroutine *coro = current;
+  if (!coro) {
+    // not on a coroutine, the calling thread blocks instead
+    struct pollfd pfd = {.fd = fd, .events = writable ? POLLOUT : POLLIN};
+    while (poll(&pfd, 1, -1) == -1) {
+      if (errno != EINTR)
+        return 1;
+    }
+    return 0;
+  }
+  // the worker registers the fd once the coroutine is suspended, and resumes it when the fd is ready
+  coro->wait_fd = fd;
+  coro->wait_writable = writable;
+  coro->wait_errno = 0;
+  coro_yield();
+  coro->wait_fd = -1;
+  if (coro->wait_errno) {
+    errno = coro->wait_errno;
+    return 1;
+  }
+  return 0;
+}
+
+ssize_t webb_read(int fd, void *buf, size_t len) {
+  for (;;) {
+    ssize_t nread = read(fd, buf, len);
+    if (nread >= 0)
+      return nread;
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || webb_wait_fd(fd, 0) != 0)
+      return -1;
+  }
+}
+
+ssize_t webb_write(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  for (size_t written = 0; written < len;) {
+    ssize_t n = write(fd, p + written, len - written);
+    if (n >= 0) {
+      written += (size_t) n;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || webb_wait_fd(fd, 1) != 0)
+      return -1;
+  }
+  return (ssize_t) len;
+}
+
+int webb_sleep(unsigned ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000};
+  if (!current) {
+    while (nanosleep(&ts, &ts) == -1) {
+      if (errno != EINTR)
+        return 1;
+    }
+    return 0;
+  }
+  // a timer fd is waited on like any other, a zero timeout would disarm it so it fires after 1ns instead
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1)
+    return 1;
+  if (!ms)
+    ts.tv_nsec = 1;
+  struct itimerspec spec = {.it_value = ts};
+  int res = timerfd_settime(fd, 0, &spec, NULL) == -1 || webb_wait_fd(fd, 0) != 0;
+  (void) close(fd);
+  return res;
+}
+
+int coro_wait_fd_timeout(int fd, int writable, unsigned ms) {
+  // like webb_wait_fd, failing with ETIMEDOUT once ms passed. a coroutine waits on an epoll fd holding both fd
+  // and a timer fd, which is readable as soon as either of them is
+  if (!current) {
+    struct pollfd pfd = {.fd = fd, .events = writable ? POLLOUT : POLLIN};
+    int n;
+    while ((n = poll(&pfd, 1, (int) ms)) == -1) {
+      if (errno != EINTR)
+        return 1;
+    }
+    if (n == 0)
+      errno = ETIMEDOUT;
+    return n == 0;
+  }
+  int epfd = epoll_create1(EPOLL_CLOEXEC), timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec spec = {.it_value = {.tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000 + !ms}};
+  struct epoll_event timer_event = {.events = EPOLLIN, .data = {.fd = timer}};
+  struct epoll_event fd_event = {.events = writable ? EPOLLOUT : EPOLLIN, .data = {.fd = fd}};
+  int res = epfd == -1 || timer == -1 || timerfd_settime(timer, 0, &spec, NULL) == -1
+            || epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &timer_event) == -1
+            || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &fd_event) == -1 || webb_wait_fd(epfd, 0) != 0;
+  if (!res) {
+    // errors and hang ups of fd are always reported, so it is only missing once the timer fired
+    struct epoll_event events[2];
+    int n = epoll_wait(epfd, events, 2, 0);
+    res = 1;
+    for (int i = 0; i < n; i++)
+      res &= events[i].data.fd != fd;
+    if (res)
+      errno = ETIMEDOUT;
+  }
+  int err = errno;
+  if (epfd != -1)
+    (void) close(epfd);
+  if (timer != -1)
+    (void) close(timer);
+  errno = err;
+  return res;
+}
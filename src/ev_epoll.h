@@ -5,14 +5,17 @@
 
 #define EV_MAX_EVENTS 16
 
+// flags, a single event can report several of them
 typedef enum EventKind {
-  EVENT_READ,
-  EVENT_WRITE,
-  EVENT_CLOSE,
+  EVENT_READ = 1,
+  EVENT_WRITE = 2,
+  EVENT_CLOSE = 4,
+  // the socket has an error, or something in its error queue
+  EVENT_ERROR = 8,
 } EventKind;
 
 typedef struct Event {
-  EventKind kind;
+  unsigned kinds;
   void *data;
 } Event;
 
@@ -33,12 +36,14 @@ int ev_create(EPollEventLoop *ev) {
 }
 
 int ev_add(EPollEventLoop *ev, int fd, void *data) {
-  if (fcntl(fd, F_SETFD, O_NONBLOCK) == -1) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
     LOG_ERRNO("fcntl(O_NONBLOCK)");
     return 1;
   }
+  // edge triggered, so registering for writes up front costs nothing until a write actually blocks
   struct epoll_event e = {
-    .events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP,
+    .events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLHUP,
     .data = {.ptr = data},
   };
   if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) == -1) {
@@ -48,25 +53,57 @@ int ev_add(EPollEventLoop *ev, int fd, void *data) {
   return 0;
 }
 
-static EventKind epoll_events_to_enum(uint32_t events) {
+int ev_watch(EPollEventLoop *ev, int fd, unsigned kinds, void *data) {
+  // level triggered and left as is (e.g blocking), for one off waits removed with ev_unwatch once ready.
+  // errors are left to the caller, they are usually caused by the fd (e.g a regular file)
+  struct epoll_event e = {
+    .events = (kinds & EVENT_READ ? EPOLLIN : 0) | (kinds & EVENT_WRITE ? EPOLLOUT : 0),
+    .data = {.ptr = data},
+  };
+  return epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) == -1;
+}
+
+int ev_unwatch(EPollEventLoop *ev, int fd) {
+  return epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL) == -1;
+}
+
+static unsigned epoll_events_to_kinds(uint32_t events) {
+  unsigned kinds = 0;
   if (events & (EPOLLRDHUP | EPOLLHUP))
-    return EVENT_CLOSE;
+    kinds |= EVENT_CLOSE;
+  if (events & EPOLLERR)
+    kinds |= EVENT_ERROR;
   if (events & EPOLLOUT)
-    return EVENT_WRITE;
-  return EVENT_READ;
+    kinds |= EVENT_WRITE;
+  if (events & EPOLLIN)
+    kinds |= EVENT_READ;
+  return kinds;
+}
+
+int ev_pending(const EPollEventLoop *h) {
+  return h->index >= 0;
 }
 
-int ev_next(EPollEventLoop *h, Event *e) {
+int ev_next(EPollEventLoop *h, Event *e, int timeout) {
+  // returns 1 when no event is ready within timeout (in ms, -1 waits forever)
   if (h->index < 0) {
-    int n = epoll_wait(h->epfd, h->events, EV_MAX_EVENTS, -1);
+    int n = epoll_wait(h->epfd, h->events, EV_MAX_EVENTS, timeout);
     if (n == -1) {
+      if (errno == EINTR)
+        return 1;
       LOG_ERRNO("epoll_wait");
       return -1;
     }
+    if (n == 0)
+      return 1;
     h->index = n - 1;
   }
   e->data = h->events[h->index].data.ptr;
-  e->kind = epoll_events_to_enum(h->events[h->index].events);
+  e->kinds = epoll_events_to_kinds(h->events[h->index].events);
   h->index -= 1;
   return 0;
 }
+
+void ev_free(EPollEventLoop *ev) {
+  (void) close(ev->epfd);
+}
@@ -0,0 +1,952 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+#define PREFACE        "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN    24
+#define FRAME_HEAD     9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW     0x7fffffff
+
+typedef enum H2FrameType {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9,
+} H2FrameType;
+
+typedef enum H2Flag {
+  FLAG_END_STREAM = 0x1,
+  FLAG_ACK = 0x1,
+  FLAG_END_HEADERS = 0x4,
+  FLAG_PADDED = 0x8,
+  FLAG_PRIORITY = 0x20,
+} H2Flag;
+
+typedef enum H2Error {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+} H2Error;
+
+typedef enum H2Setting {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5,
+} H2Setting;
+
+typedef struct H2Stream {
+  uint32_t id;
+  WebbRequest req;
+  size_t body_cap;
+  // set once the client sent all of the request, and once its response is ready (usually from the handler)
+  int remote_closed;
+  int dispatched;
+  WebbResponse res;
+  int headers_sent;
+  size_t sent;
+  // flow control, the send window going negative when the client shrinks its initial window
+  int64_t send_window;
+  int64_t recv_window;
+  struct H2Stream *next;
+} H2Stream;
+
+struct H2Session {
+  int fd;
+  size_t max_header_size;
+  H2Dispatch *dispatch;
+  void *arg;
+  // bytes of the client's preface still expected, then frames not handled yet
+  size_t preface;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_cap;
+  // a header block continued in CONTINUATION frames, block_stream being 0 between blocks
+  unsigned char *block;
+  size_t block_len;
+  size_t block_cap;
+  uint32_t block_stream;
+  int block_end_stream;
+  HpackTable decoder;
+  // frames to send, the first out_sent bytes being sent already
+  unsigned char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+  // open streams, newest first. turn is the stream that last had its turn to send a frame
+  H2Stream *streams;
+  size_t nstreams;
+  uint32_t last_stream;
+  uint32_t turn;
+  int64_t send_window;
+  int64_t recv_window;
+  uint32_t peer_window;
+  uint32_t peer_max_frame;
+  // set once either side sent GOAWAY, no more streams are opened
+  int goaway;
+};
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+static void frame_head(unsigned char *p, size_t len, H2FrameType type, unsigned flags, uint32_t stream) {
+  p[0] = (unsigned char) (len >> 16);
+  p[1] = (unsigned char) (len >> 8);
+  p[2] = (unsigned char) len;
+  p[3] = (unsigned char) type;
+  p[4] = (unsigned char) flags;
+  put32(p + 5, stream);
+}
+
+static unsigned char *reserve(H2Session *h2, size_t len) {
+  // room for len more bytes to send. a client that does not read its frames is dropped past H2_MAX_OUT
+  if (h2->out_sent) {
+    memmove(h2->out, h2->out + h2->out_sent, h2->out_len - h2->out_sent);
+    h2->out_len -= h2->out_sent;
+    h2->out_sent = 0;
+  }
+  if (h2->out_len + len <= h2->out_cap)
+    return h2->out + h2->out_len;
+  if (h2->out_len + len > H2_MAX_OUT)
+    return NULL;
+  size_t cap = h2->out_cap ? h2->out_cap : H2_OUT_BUFFER;
+  while (cap < h2->out_len + len)
+    cap *= 2;
+  unsigned char *out = realloc(h2->out, cap);
+  if (!out)
+    return NULL;
+  h2->out = out;
+  h2->out_cap = cap;
+  return out + h2->out_len;
+}
+
+static unsigned char *frame(H2Session *h2, H2FrameType type, unsigned flags, uint32_t stream, size_t len) {
+  // queues a frame, its payload to be written to the returned pointer
+  unsigned char *p = reserve(h2, FRAME_HEAD + len);
+  if (!p)
+    return NULL;
+  frame_head(p, len, type, flags, stream);
+  h2->out_len += FRAME_HEAD + len;
+  return p + FRAME_HEAD;
+}
+
+static int send_rst(H2Session *h2, uint32_t stream, H2Error code) {
+  unsigned char *p = frame(h2, FRAME_RST_STREAM, 0, stream, 4);
+  if (!p)
+    return 1;
+  put32(p, code);
+  return 0;
+}
+
+static int send_window_update(H2Session *h2, uint32_t stream, uint32_t increment) {
+  unsigned char *p = frame(h2, FRAME_WINDOW_UPDATE, 0, stream, 4);
+  if (!p)
+    return 1;
+  put32(p, increment);
+  return 0;
+}
+
+static int connection_error(H2Session *h2, H2Error code) {
+  // always 1, the connection is closed once the goaway is sent (best effort)
+  unsigned char *p = frame(h2, FRAME_GOAWAY, 0, 0, 8);
+  if (p) {
+    put32(p, h2->last_stream);
+    put32(p + 4, code);
+  }
+  h2->goaway = 1;
+  return 1;
+}
+
+static H2Stream *find_stream(H2Session *h2, uint32_t id) {
+  for (H2Stream *stream = h2->streams; stream; stream = stream->next) {
+    if (stream->id == id)
+      return stream;
+  }
+  return NULL;
+}
+
+static H2Stream *new_stream(H2Session *h2, uint32_t id) {
+  H2Stream *stream = calloc(1, sizeof(H2Stream));
+  if (!stream)
+    return NULL;
+  stream->id = id;
+  stream->send_window = h2->peer_window;
+  stream->recv_window = H2_WINDOW;
+  stream->next = h2->streams;
+  h2->streams = stream;
+  h2->nstreams++;
+  h2->last_stream = id;
+  return stream;
+}
+
+static void close_stream(H2Session *h2, H2Stream *stream) {
+  H2Stream **link = &h2->streams;
+  while (*link != stream)
+    link = &(*link)->next;
+  *link = stream->next;
+  h2->nstreams--;
+  http_req_free(&stream->req);
+  http_res_free(&stream->res);
+  free(stream);
+}
+
+static int reset_stream(H2Session *h2, H2Stream *stream, H2Error code) {
+  // returns 1 if the rst_stream could not be queued
+  int res = send_rst(h2, stream->id, code);
+  close_stream(h2, stream);
+  return res;
+}
+
+static int finish_stream(H2Session *h2, H2Stream *stream) {
+  // the rest of a request answered early is not needed anymore, rfc9113 8.1
+  int res = stream->remote_closed ? 0 : send_rst(h2, stream->id, H2_NO_ERROR);
+  close_stream(h2, stream);
+  return res;
+}
+
+static void end_request(H2Session *h2, H2Stream *stream) {
+  stream->remote_closed = 1;
+  if (stream->dispatched)
+    return;
+  h2->dispatch(h2->arg, &stream->req, &stream->res);
+  // 1xx responses (e.g a websocket upgrade) and event streams, which take over a connection, have no place here
+  if (stream->res.status < 200 || !webb_status_str(stream->res.status) || stream->res.sse)
+    stream->res.status = 500;
+  stream->dispatched = 1;
+}
+
+static int is_connection_header(const char *name, size_t len) {
+  // connection specific headers are not allowed in http/2, rfc9113 8.2.2
+  static const char *const NAMES[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+  for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++) {
+    if (strlen(NAMES[i]) == len && strncasecmp(NAMES[i], name, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+typedef struct HeaderSink {
+  // NULL to discard the headers (e.g trailers)
+  WebbRequest *req;
+  char *authority;
+  int method;
+  int scheme;
+  int regular;
+  int invalid;
+  size_t headers;
+} HeaderSink;
+
+static int add_pseudo_header(HeaderSink *sink, const char *name, char *value) {
+  // returns 1 for a malformed request. each pseudo header comes once, before the regular ones
+  WebbRequest *req = sink->req;
+  if (strcmp(name, ":method") == 0 && !sink->method) {
+    sink->method = 1;
+    req->method = http_parse_method(value, strlen(value));
+    free(value);
+    return req->method == WEBB_INVALID;
+  }
+  if (strcmp(name, ":path") == 0 && !req->uri) {
+    char *query = strchr(value, '?');
+    size_t len = query ? (size_t) (query - value) : strlen(value);
+    // the raw target follows the decoded one, like for http/1.1
+    req->uri = malloc(2 * len + 2);
+    ssize_t n = req->uri && len ? uri_decode_to(value, len, req->uri, len + 1) : -1;
+    int invalid = n == -1;
+    if (!invalid) {
+      char *target = req->uri + n + 1;
+      memcpy(target, value, len);
+      target[len] = '\0';
+      req->target = target;
+    }
+    if (!invalid && query)
+      invalid = !(req->query = strdup(query + 1));
+    free(value);
+    return invalid;
+  }
+  if (strcmp(name, ":authority") == 0 && !sink->authority) {
+    sink->authority = value;
+    return 0;
+  }
+  if (strcmp(name, ":scheme") == 0 && !sink->scheme) {
+    sink->scheme = 1;
+    free(value);
+    return 0;
+  }
+  free(value);
+  return 1;
+}
+
+static int add_header(void *arg, char *name, char *value) {
+  HeaderSink *sink = arg;
+  if (!sink->req || sink->invalid) {
+    free(name);
+    free(value);
+    return 0;
+  }
+  if (name[0] == ':') {
+    sink->invalid = sink->regular || add_pseudo_header(sink, name, value);
+    free(name);
+    return 0;
+  }
+  // names are lowercase in http/2, and only MAX_HEADERS of them are kept like for http/1.1 requests
+  sink->regular = 1;
+  size_t len = strlen(name);
+  for (size_t i = 0; i < len; i++)
+    sink->invalid |= name[i] >= 'A' && name[i] <= 'Z';
+  sink->invalid |= is_connection_header(name, len);
+  WebbHeaders *header = sink->invalid || sink->headers++ >= MAX_HEADERS ? NULL : malloc(sizeof(WebbHeaders));
+  if (!header) {
+    free(name);
+    free(value);
+    return 0;
+  }
+  header->key = name;
+  header->val = value;
+  header->next = sink->req->headers;
+  sink->req->headers = header;
+  return 0;
+}
+
+static int handle_block(H2Session *h2, uint32_t id, const unsigned char *block, size_t len, int end_stream) {
+  // returns 1 on connection errors. the block is decoded in any case, as it updates the decoder's table
+  H2Stream *stream = find_stream(h2, id);
+  if (!stream && id <= h2->last_stream)
+    return connection_error(h2, H2_STREAM_CLOSED);
+  int trailers = stream != NULL;
+  if (!trailers && !(stream = new_stream(h2, id)))
+    return connection_error(h2, H2_INTERNAL_ERROR);
+  HeaderSink sink = {.req = trailers ? NULL : &stream->req};
+  if (hpack_decode(&h2->decoder, block, len, add_header, &sink) != 0) {
+    free(sink.authority);
+    return connection_error(h2, H2_COMPRESSION_ERROR);
+  }
+  if (trailers) {
+    // ignored, they end the request
+    if (!end_stream || stream->remote_closed)
+      return reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+    end_request(h2, stream);
+    return 0;
+  }
+  if (h2->nstreams > H2_MAX_STREAMS || h2->goaway) {
+    free(sink.authority);
+    return reset_stream(h2, stream, H2_REFUSED_STREAM);
+  }
+  if (sink.invalid || !sink.method || !stream->req.uri) {
+    free(sink.authority);
+    return reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+  }
+  // handlers look for the host header, carried by :authority instead
+  WebbHeaders *host = sink.authority && !webb_get_header(&stream->req, "host") ? malloc(sizeof(WebbHeaders)) : NULL;
+  if (host && (host->key = strdup("host"))) {
+    host->val = sink.authority;
+    host->next = stream->req.headers;
+    stream->req.headers = host;
+  } else {
+    free(host);
+    free(sink.authority);
+  }
+  if (sink.headers > MAX_HEADERS) {
+    stream->res.status = 431;
+    stream->dispatched = 1;
+  }
+  if (end_stream)
+    end_request(h2, stream);
+  return 0;
+}
+
+static int strip_padding(unsigned flags, unsigned char **payload, size_t *len) {
+  if (!(flags & FLAG_PADDED))
+    return 0;
+  if (*len == 0 || (*payload)[0] >= *len)
+    return 1;
+  *len -= 1 + (size_t) (*payload)[0];
+  (*payload)++;
+  return 0;
+}
+
+static int append_block(H2Session *h2, unsigned flags, const unsigned char *fragment, size_t len) {
+  if (h2->block_len + len > h2->max_header_size)
+    return connection_error(h2, H2_ENHANCE_YOUR_CALM);
+  if (h2->block_len + len > h2->block_cap) {
+    size_t cap = h2->block_cap ? h2->block_cap : BUF_POOL_MIN_SIZE;
+    while (cap < h2->block_len + len)
+      cap *= 2;
+    unsigned char *block = realloc(h2->block, cap);
+    if (!block)
+      return connection_error(h2, H2_INTERNAL_ERROR);
+    h2->block = block;
+    h2->block_cap = cap;
+  }
+  memcpy(h2->block + h2->block_len, fragment, len);
+  h2->block_len += len;
+  if (!(flags & FLAG_END_HEADERS))
+    return 0;
+  uint32_t id = h2->block_stream;
+  h2->block_stream = 0;
+  return handle_block(h2, id, h2->block, h2->block_len, h2->block_end_stream);
+}
+
+static int handle_headers(H2Session *h2, unsigned flags, uint32_t id, unsigned char *payload, size_t len) {
+  // client streams are odd
+  if (!(id & 1) || strip_padding(flags, &payload, &len) != 0)
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  if (flags & FLAG_PRIORITY) {
+    if (len < 5)
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    payload += 5;
+    len -= 5;
+  }
+  // most blocks fit in one frame, and are decoded in place
+  if (flags & FLAG_END_HEADERS)
+    return handle_block(h2, id, payload, len, flags & FLAG_END_STREAM);
+  h2->block_stream = id;
+  h2->block_len = 0;
+  h2->block_end_stream = flags & FLAG_END_STREAM;
+  return append_block(h2, flags, payload, len);
+}
+
+static int append_body(H2Stream *stream, const unsigned char *data, size_t len) {
+  // null terminated like http/1.1 bodies
+  WebbRequest *req = &stream->req;
+  if (req->body_len + len + 1 > stream->body_cap) {
+    size_t cap = stream->body_cap ? stream->body_cap : BUF_POOL_MIN_SIZE;
+    while (cap < req->body_len + len + 1)
+      cap *= 2;
+    char *body = realloc(req->body, cap);
+    if (!body)
+      return 1;
+    req->body = body;
+    stream->body_cap = cap;
+  }
+  memcpy(req->body + req->body_len, data, len);
+  req->body_len += len;
+  req->body[req->body_len] = '\0';
+  return 0;
+}
+
+static int handle_data(H2Session *h2, unsigned flags, uint32_t id, unsigned char *payload, size_t len) {
+  // padding counts against the windows too, they are refilled once half used
+  size_t flow = len;
+  if (!id || strip_padding(flags, &payload, &len) != 0)
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  if ((int64_t) flow > h2->recv_window)
+    return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+  h2->recv_window -= (int64_t) flow;
+  if (h2->recv_window < H2_WINDOW / 2) {
+    if (send_window_update(h2, 0, (uint32_t) (H2_WINDOW - h2->recv_window)) != 0)
+      return 1;
+    h2->recv_window = H2_WINDOW;
+  }
+  H2Stream *stream = find_stream(h2, id);
+  if (!stream || stream->remote_closed) {
+    if (id > h2->last_stream)
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    return stream ? reset_stream(h2, stream, H2_STREAM_CLOSED) : send_rst(h2, id, H2_STREAM_CLOSED);
+  }
+  if ((int64_t) flow > stream->recv_window)
+    return reset_stream(h2, stream, H2_FLOW_CONTROL_ERROR);
+  stream->recv_window -= (int64_t) flow;
+  // a body over the limit is answered without the handler, the rest of it is dropped
+  if (!stream->dispatched && stream->req.body_len + len > MAX_BODY_LEN) {
+    stream->res.status = 413;
+    stream->dispatched = 1;
+  }
+  if (!stream->dispatched && append_body(stream, payload, len) != 0)
+    return connection_error(h2, H2_INTERNAL_ERROR);
+  if (flags & FLAG_END_STREAM) {
+    end_request(h2, stream);
+  } else if (stream->recv_window < H2_WINDOW / 2) {
+    if (send_window_update(h2, id, (uint32_t) (H2_WINDOW - stream->recv_window)) != 0)
+      return 1;
+    stream->recv_window = H2_WINDOW;
+  }
+  return 0;
+}
+
+static int apply_settings(H2Session *h2, const unsigned char *p, size_t len) {
+  // returns 1 on connection errors. the header table size does not matter, the encoder never indexes
+  if (len % 6)
+    return connection_error(h2, H2_FRAME_SIZE_ERROR);
+  for (; len; p += 6, len -= 6) {
+    uint32_t value = get32(p + 2);
+    switch (p[0] << 8 | p[1]) {
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+      // applies to the open streams as well, rfc9113 6.9.2
+      if (value > MAX_WINDOW)
+        return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+      for (H2Stream *stream = h2->streams; stream; stream = stream->next) {
+        stream->send_window += (int64_t) value - h2->peer_window;
+        if (stream->send_window > MAX_WINDOW)
+          return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+      }
+      h2->peer_window = value;
+      break;
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < H2_MAX_FRAME || value > 0xffffff)
+        return connection_error(h2, H2_PROTOCOL_ERROR);
+      h2->peer_max_frame = value;
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+static int handle_window_update(H2Session *h2, uint32_t id, const unsigned char *payload, size_t len) {
+  if (len != 4)
+    return connection_error(h2, H2_FRAME_SIZE_ERROR);
+  uint32_t increment = get32(payload) & MAX_WINDOW;
+  if (!id) {
+    h2->send_window += increment;
+    if (!increment || h2->send_window > MAX_WINDOW)
+      return connection_error(h2, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    return 0;
+  }
+  H2Stream *stream = find_stream(h2, id);
+  if (!stream)
+    return id > h2->last_stream ? connection_error(h2, H2_PROTOCOL_ERROR) : 0;
+  stream->send_window += increment;
+  if (!increment || stream->send_window > MAX_WINDOW)
+    return reset_stream(h2, stream, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+  return 0;
+}
+
+static int handle_frame(H2Session *h2, const unsigned char *head, unsigned char *payload) {
+  // returns 1 once the connection should be closed
+  size_t len = (size_t) head[0] << 16 | (size_t) head[1] << 8 | head[2];
+  unsigned type = head[3], flags = head[4];
+  uint32_t id = get32(head + 5) & MAX_WINDOW;
+  // nothing comes between the frames of a header block
+  if (h2->block_stream && (type != FRAME_CONTINUATION || id != h2->block_stream))
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  switch (type) {
+  case FRAME_DATA:
+    return handle_data(h2, flags, id, payload, len);
+  case FRAME_HEADERS:
+    return handle_headers(h2, flags, id, payload, len);
+  case FRAME_CONTINUATION:
+    if (!h2->block_stream)
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    return append_block(h2, flags, payload, len);
+  case FRAME_PRIORITY:
+    // ignored, streams take turns
+    if (!id || len != 5)
+      return connection_error(h2, !id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+    return 0;
+  case FRAME_RST_STREAM: {
+    if (!id || id > h2->last_stream || len != 4)
+      return connection_error(h2, len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+    H2Stream *stream = find_stream(h2, id);
+    if (stream)
+      close_stream(h2, stream);
+    return 0;
+  }
+  case FRAME_SETTINGS:
+    if (id)
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    if (flags & FLAG_ACK)
+      return len ? connection_error(h2, H2_FRAME_SIZE_ERROR) : 0;
+    if (apply_settings(h2, payload, len) != 0)
+      return 1;
+    return !frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, 0);
+  case FRAME_PING: {
+    if (id || len != 8)
+      return connection_error(h2, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+    if (flags & FLAG_ACK)
+      return 0;
+    unsigned char *p = frame(h2, FRAME_PING, FLAG_ACK, 0, 8);
+    if (!p)
+      return 1;
+    memcpy(p, payload, 8);
+    return 0;
+  }
+  case FRAME_GOAWAY:
+    // the streams already open are still answered
+    h2->goaway = 1;
+    return 0;
+  case FRAME_WINDOW_UPDATE:
+    return handle_window_update(h2, id, payload, len);
+  case FRAME_PUSH_PROMISE:
+    return connection_error(h2, H2_PROTOCOL_ERROR);
+  default:
+    // unknown frame types are ignored, rfc9113 4.1
+    return 0;
+  }
+}
+
+static int handle_input(H2Session *h2) {
+  // returns 1 once the connection should be closed. an incomplete frame is left at the start of the buffer
+  size_t pos = 0;
+  int res = 0;
+  if (h2->preface) {
+    size_t n = h2->in_len < h2->preface ? h2->in_len : h2->preface;
+    if (memcmp(h2->in, PREFACE + PREFACE_LEN - h2->preface, n) != 0)
+      return 1;
+    h2->preface -= n;
+    pos = n;
+  }
+  while (!res && !h2->preface && h2->in_len - pos >= FRAME_HEAD) {
+    unsigned char *head = h2->in + pos;
+    size_t len = (size_t) head[0] << 16 | (size_t) head[1] << 8 | head[2];
+    if (len > H2_MAX_FRAME) {
+      res = connection_error(h2, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (h2->in_len - pos < FRAME_HEAD + len)
+      break;
+    pos += FRAME_HEAD + len;
+    res = handle_frame(h2, head, head + FRAME_HEAD);
+  }
+  memmove(h2->in, h2->in + pos, h2->in_len - pos);
+  h2->in_len -= pos;
+  return res;
+}
+
+static int read_input(H2Session *h2) {
+  // edge triggered, so everything readable is read now. the buffer always has room for a whole frame
+  for (;;) {
+    if (handle_input(h2) != 0)
+      return 1;
+    ssize_t n = read(h2->fd, h2->in + h2->in_len, h2->in_cap - h2->in_len);
+    if (n > 0) {
+      h2->in_len += (size_t) n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+}
+
+static int send_headers(H2Session *h2, H2Stream *stream, int end_stream) {
+  // the block is split in CONTINUATION frames past the client's maximum frame size
+  const WebbResponse *res = &stream->res;
+  char date[64], length[32];
+  time_t now = time(NULL);
+  struct tm tm;
+  size_t date_len = strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &tm));
+  size_t cap = 128 + date_len, len;
+  if (res->content_type)
+    cap += strlen(res->content_type) + 12;
+  if (res->cache_control)
+    cap += strlen(res->cache_control) + 12;
+  for (const WebbHeaders *h = res->headers; h; h = h->next)
+    cap += strlen(h->key) + strlen(h->val) + 12;
+  // a raw header line is at least 4 bytes long, and takes at most 9 more encoded
+  if (res->raw_headers)
+    cap += 4 * strlen(res->raw_headers);
+  unsigned char *block = malloc(cap);
+  if (!block)
+    return 1;
+  len = hpack_encode_status(block, res->status);
+  len += hpack_encode_header(block + len, "date", 4, date, date_len);
+  len += hpack_encode_header(block + len, "server", 6, "libwebb 0.1", 11);
+  if (res->status != 204 && res->status != 304) {
+    int n = sprintf(length, "%zu", res->body.len);
+    len += hpack_encode_header(block + len, "content-length", 14, length, (size_t) n);
+  }
+  if (res->content_type)
+    len += hpack_encode_header(block + len, "content-type", 12, res->content_type, strlen(res->content_type));
+  if (res->cache_control)
+    len += hpack_encode_header(block + len, "cache-control", 13, res->cache_control, strlen(res->cache_control));
+  for (const WebbHeaders *h = res->headers; h; h = h->next) {
+    size_t key_len = strlen(h->key);
+    if (!is_connection_header(h->key, key_len))
+      len += hpack_encode_header(block + len, h->key, key_len, h->val, strlen(h->val));
+  }
+  for (const char *line = res->raw_headers; line && *line;) {
+    const char *end = strstr(line, "\r\n"), *colon = strchr(line, ':');
+    if (!end)
+      end = line + strlen(line);
+    if (colon && colon < end && !is_connection_header(line, (size_t) (colon - line))) {
+      const char *value = colon + 1 + strspn(colon + 1, " \t");
+      len += hpack_encode_header(block + len, line, (size_t) (colon - line), value, (size_t) (end - value));
+    }
+    line = *end ? end + 2 : end;
+  }
+
+  H2FrameType type = FRAME_HEADERS;
+  size_t off = 0;
+  do {
+    size_t n = len - off < h2->peer_max_frame ? len - off : h2->peer_max_frame;
+    unsigned flags = type == FRAME_HEADERS && end_stream ? FLAG_END_STREAM : 0;
+    if (off + n == len)
+      flags |= FLAG_END_HEADERS;
+    unsigned char *p = frame(h2, type, flags, stream->id, n);
+    if (!p) {
+      free(block);
+      return 1;
+    }
+    memcpy(p, block + off, n);
+    off += n;
+    type = FRAME_CONTINUATION;
+  } while (off < len);
+  free(block);
+  return 0;
+}
+
+static ssize_t read_body(WebbBody *body, size_t sent, unsigned char *dst, size_t len) {
+  // in-memory bodies are copied into the frames, the others read into them
+  switch (body->type) {
+  case WEBB_BODY_FD:
+    return pread(body->body.fd, dst, len, (off_t) (body->offset + sent));
+  case WEBB_BODY_SPLICE: {
+    ssize_t n = read(body->body.splice.fd, dst, len);
+    if (n > 0)
+      body->offset += (size_t) n;
+    return n;
+  }
+  case WEBB_BODY_SHARED: {
+    size_t shared_len;
+    memcpy(dst, webb_shared_data(body->body.shared, &shared_len) + sent, len);
+    return (ssize_t) len;
+  }
+  default:
+    memcpy(dst, body->body.buf + sent, len);
+    return (ssize_t) len;
+  }
+}
+
+static int send_stream(H2Session *h2, H2Stream *stream, int *wait_fd) {
+  // returns -1 on failure, 1 once a frame was queued and 0 while the stream waits for a window or its body
+  WebbResponse *res = &stream->res;
+  int no_body = stream->req.method == WEBB_HEAD || res->status == 204 || res->status == 304;
+  size_t len = no_body ? 0 : res->body.len;
+  if (!stream->headers_sent) {
+    if (send_headers(h2, stream, len == 0) != 0)
+      return -1;
+    stream->headers_sent = 1;
+    return len == 0 && finish_stream(h2, stream) != 0 ? -1 : 1;
+  }
+  int64_t window = stream->send_window < h2->send_window ? stream->send_window : h2->send_window;
+  if (window <= 0)
+    return 0;
+  // frames stay at the default size whatever larger one the client allows (never below it), and within the
+  // batch, so that large windows cannot push the buffer past H2_MAX_OUT
+  size_t room = h2->out_len < H2_OUT_BUFFER ? H2_OUT_BUFFER - h2->out_len : 0;
+  if (room <= FRAME_HEAD)
+    return 0;
+  size_t chunk = len - stream->sent;
+  if (chunk > (size_t) window)
+    chunk = (size_t) window;
+  if (chunk > H2_MAX_FRAME)
+    chunk = H2_MAX_FRAME;
+  if (chunk > room - FRAME_HEAD)
+    chunk = room - FRAME_HEAD;
+  unsigned char *p = reserve(h2, FRAME_HEAD + chunk);
+  if (!p)
+    return -1;
+  ssize_t n = read_body(&res->body, stream->sent, p + FRAME_HEAD, chunk);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (*wait_fd == -1)
+      *wait_fd = res->body.body.splice.fd;
+    return 0;
+  }
+  if (n <= 0) {
+    // the body's source failed or ended early
+    LOG("failed to read a response body");
+    return reset_stream(h2, stream, H2_INTERNAL_ERROR) != 0 ? -1 : 1;
+  }
+  stream->sent += (size_t) n;
+  stream->send_window -= n;
+  h2->send_window -= n;
+  frame_head(p, (size_t) n, FRAME_DATA, stream->sent == len ? FLAG_END_STREAM : 0, stream->id);
+  h2->out_len += FRAME_HEAD + (size_t) n;
+  return stream->sent == len && finish_stream(h2, stream) != 0 ? -1 : 1;
+}
+
+static int fill(H2Session *h2, int *wait_fd) {
+  // streams take turns by id, a frame each, starting after the last one served. returns 1 on failure
+  for (int progress = 1; progress && h2->out_len < H2_OUT_BUFFER;) {
+    progress = 0;
+    for (int wrap = 0; wrap < 2; wrap++) {
+      for (H2Stream *stream = h2->streams, *next; stream && h2->out_len < H2_OUT_BUFFER; stream = next) {
+        next = stream->next;
+        if (!stream->dispatched || (stream->id < h2->turn) == wrap)
+          continue;
+        uint32_t id = stream->id;
+        int res = send_stream(h2, stream, wait_fd);
+        if (res < 0)
+          return 1;
+        if (res > 0) {
+          progress = 1;
+          h2->turn = id;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static int flush(H2Session *h2) {
+  // returns 1 on failure, out_len is left non-zero when the socket is full
+  while (h2->out_sent < h2->out_len) {
+    ssize_t n = send(h2->fd, h2->out + h2->out_sent, h2->out_len - h2->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0) {
+      h2->out_sent += (size_t) n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    return n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+  h2->out_len = h2->out_sent = 0;
+  return 0;
+}
+
+int h2_is_upgrade(const WebbRequest *req) {
+  // rfc7540 3.2, an http/1.1 request carrying the client's settings
+  return http_has_token(webb_get_header(req, "upgrade"), "h2c")
+         && http_has_token(webb_get_header(req, "connection"), "upgrade") && webb_get_header(req, "http2-settings");
+}
+
+static int upgrade_settings(H2Session *h2, const char *encoded) {
+  // the payload of a SETTINGS frame, base64url encoded without padding
+  unsigned char settings[256];
+  size_t len = 0;
+  uint32_t bits = 0;
+  int nbits = 0;
+  for (const char *c = encoded; *c && *c != '='; c++) {
+    const char *ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const char *pos = strchr(ALPHABET, *c);
+    if (!pos || len == sizeof(settings))
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    bits = bits << 6 | (uint32_t) (pos - ALPHABET);
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      settings[len++] = (unsigned char) (bits >> nbits);
+    }
+  }
+  return apply_settings(h2, settings, len);
+}
+
+H2Session *h2_session_new(int fd, size_t max_header_size, H2Dispatch *dispatch, void *arg) {
+  H2Session *h2 = calloc(1, sizeof(H2Session));
+  if (!h2)
+    return NULL;
+  h2->fd = fd;
+  h2->max_header_size = max_header_size;
+  h2->dispatch = dispatch;
+  h2->arg = arg;
+  h2->decoder.max_size = HPACK_TABLE_SIZE;
+  h2->send_window = DEFAULT_WINDOW;
+  h2->recv_window = H2_WINDOW;
+  h2->peer_window = DEFAULT_WINDOW;
+  h2->peer_max_frame = H2_MAX_FRAME;
+  return h2;
+}
+
+int h2_session_start(H2Session *h2, const char *buffered, size_t len, WebbRequest *upgrade) {
+  // bytes read past the request line or upgrade request are the rest of the preface and the first frames
+  h2->in_cap = len > FRAME_HEAD + H2_MAX_FRAME ? len : FRAME_HEAD + H2_MAX_FRAME;
+  h2->in = malloc(h2->in_cap);
+  if (!h2->in)
+    return 1;
+  memcpy(h2->in, buffered, len);
+  h2->in_len = len;
+  // "PRI * HTTP/2.0\r\n" was read as a request line
+  h2->preface = PREFACE_LEN - 16;
+  if (upgrade) {
+    static const char SWITCHING[] = "HTTP/1.1 101 Switching Protocols\r\nconnection: upgrade\r\nupgrade: h2c\r\n\r\n";
+    unsigned char *p = reserve(h2, sizeof(SWITCHING) - 1);
+    if (!p)
+      return 1;
+    memcpy(p, SWITCHING, sizeof(SWITCHING) - 1);
+    h2->out_len += sizeof(SWITCHING) - 1;
+    h2->preface = PREFACE_LEN;
+    if (upgrade_settings(h2, webb_get_header(upgrade, "http2-settings")) != 0)
+      return 1;
+  }
+
+  // the windows the client starts with are raised right away, bodies are buffered whole anyway
+  unsigned char *p = frame(h2, FRAME_SETTINGS, 0, 0, 12);
+  if (!p)
+    return 1;
+  p[0] = 0;
+  p[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+  put32(p + 2, H2_MAX_STREAMS);
+  p[6] = 0;
+  p[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+  put32(p + 8, H2_WINDOW);
+  if (send_window_update(h2, 0, H2_WINDOW - DEFAULT_WINDOW) != 0)
+    return 1;
+  if (upgrade) {
+    // the upgrade request is stream 1, already complete
+    H2Stream *stream = new_stream(h2, 1);
+    if (!stream)
+      return 1;
+    stream->req = *upgrade;
+    memset(upgrade, 0, sizeof(*upgrade));
+    end_request(h2, stream);
+  }
+  return 0;
+}
+
+int h2_session_handle(H2Session *h2, int *wait_fd) {
+  // returns 1 once the connection should be closed. wait_fd is set to a body's source that has nothing to read,
+  // the session is to be handled again once it is readable
+  *wait_fd = -1;
+  if (read_input(h2) != 0) {
+    (void) flush(h2);
+    return 1;
+  }
+  for (;;) {
+    if (flush(h2) != 0)
+      return 1;
+    // the rest is sent once the socket is writable again
+    if (h2->out_len)
+      return 0;
+    if (fill(h2, wait_fd) != 0)
+      return 1;
+    if (!h2->out_len)
+      break;
+  }
+  // a client that sent GOAWAY is closed once its last stream is answered
+  return h2->goaway && !h2->streams;
+}
+
+void h2_session_free(H2Session *h2) {
+  while (h2->streams)
+    close_stream(h2, h2->streams);
+  hpack_table_free(&h2->decoder);
+  free(h2->in);
+  free(h2->block);
+  free(h2->out);
+  free(h2);
+}
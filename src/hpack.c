@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "internal.h"
+
+typedef struct HpackStatic {
+  const char *name;
+  const char *value;
+} HpackStatic;
+
+// rfc7541 appendix a, index 1 being the first entry
+static const HpackStatic STATIC_TABLE[] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""},
+};
+
+#define STATIC_ENTRIES (sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]))
+
+// the huffman code of rfc7541 appendix b is canonical, so it is fully described by the number of codes of each
+// length and the symbols ordered by code. the last code, 30 bits long, is eos
+static const uint16_t HUFFMAN_COUNTS[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+
+static const unsigned char HUFFMAN_SYMBOLS[256] = {
+  48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,  51,  52,  53,  54,  55,  56,  57,
+  61,  65,  95,  98,  100, 102, 103, 104, 108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,
+  73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,  106, 107, 113, 118, 119, 120,
+  121, 122, 38,  42,  44,  59,  88,  90,  33,  34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,
+  93,  126, 94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172,
+  176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+  173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139, 140, 141, 143, 147,
+  149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142,
+  144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213,
+  218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250,
+  251, 252, 253, 254, 2,   3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,  21,  23,
+  24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,  22};
+
+static int huffman_decode(const unsigned char *in, size_t len, char *out) {
+  // bit by bit, codes of each length being consecutive numbers starting at first. the padding has to be a
+  // prefix of eos, shorter than a byte
+  uint32_t code = 0, first = 0;
+  size_t index = 0, length = 0;
+  for (size_t i = 0; i < len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = code << 1 | ((in[i] >> bit) & 1);
+      length++;
+      if (code - first < HUFFMAN_COUNTS[length]) {
+        index += code - first;
+        if (index == sizeof(HUFFMAN_SYMBOLS))
+          return 1;
+        *out++ = (char) HUFFMAN_SYMBOLS[index];
+        code = first = 0;
+        index = length = 0;
+        continue;
+      }
+      if (length == 30)
+        return 1;
+      index += HUFFMAN_COUNTS[length];
+      first = (first + HUFFMAN_COUNTS[length]) << 1;
+    }
+  }
+  *out = '\0';
+  return length > 7 || code != (1u << length) - 1;
+}
+
+static int decode_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value) {
+  // rfc7541 5.1, values past 2^28 are refused
+  size_t mask = ((size_t) 1 << prefix) - 1;
+  *value = **p & mask;
+  (*p)++;
+  if (*value < mask)
+    return 0;
+  for (int shift = 0; shift <= 21; shift += 7) {
+    if (*p == end)
+      return 1;
+    unsigned char b = *(*p)++;
+    *value += (size_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return 1;
+}
+
+static char *decode_string(const unsigned char **p, const unsigned char *end) {
+  // a new null terminated string, huffman coded strings being at most 8/5 as long decoded
+  if (*p == end)
+    return NULL;
+  int huffman = **p & 0x80;
+  size_t len;
+  if (decode_int(p, end, 7, &len) != 0 || len > (size_t) (end - *p))
+    return NULL;
+  char *str = malloc(huffman ? len * 8 / 5 + 1 : len + 1);
+  if (!str)
+    return NULL;
+  if (huffman) {
+    if (huffman_decode(*p, len, str) != 0) {
+      free(str);
+      return NULL;
+    }
+  } else {
+    memcpy(str, *p, len);
+    str[len] = '\0';
+  }
+  *p += len;
+  return str;
+}
+
+static HpackEntry *dynamic_entry(HpackTable *table, size_t i) {
+  // 0 being the newest
+  return &table->entries[(table->first + i) % HPACK_MAX_ENTRIES];
+}
+
+static void evict(HpackTable *table, size_t max_size) {
+  while (table->size > max_size) {
+    HpackEntry *oldest = dynamic_entry(table, --table->len);
+    table->size -= strlen(oldest->name) + strlen(oldest->value) + 32;
+    free(oldest->name);
+    free(oldest->value);
+  }
+}
+
+static int insert(HpackTable *table, const char *name, const char *value) {
+  // entries larger than the whole table only empty it, rfc7541 4.4
+  size_t size = strlen(name) + strlen(value) + 32;
+  evict(table, size > table->max_size ? 0 : table->max_size - size);
+  if (size > table->max_size)
+    return 0;
+  char *name_copy = strdup(name), *value_copy = strdup(value);
+  if (!name_copy || !value_copy) {
+    free(name_copy);
+    free(value_copy);
+    return 1;
+  }
+  table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+  table->entries[table->first] = (HpackEntry){.name = name_copy, .value = value_copy};
+  table->len++;
+  table->size += size;
+  return 0;
+}
+
+static int lookup(HpackTable *table, size_t index, const char **name, const char **value) {
+  if (index == 0)
+    return 1;
+  if (index <= STATIC_ENTRIES) {
+    *name = STATIC_TABLE[index - 1].name;
+    *value = STATIC_TABLE[index - 1].value;
+    return 0;
+  }
+  if (index - STATIC_ENTRIES > table->len)
+    return 1;
+  HpackEntry *entry = dynamic_entry(table, index - STATIC_ENTRIES - 1);
+  *name = entry->name;
+  *value = entry->value;
+  return 0;
+}
+
+int hpack_decode(HpackTable *table, const unsigned char *block, size_t len, HpackHeaderFn *fn, void *arg) {
+  const unsigned char *p = block, *end = block + len;
+  while (p < end) {
+    size_t index;
+    const char *name, *value;
+    unsigned char b = *p;
+    if (b & 0x80) {
+      // indexed header field
+      if (decode_int(&p, end, 7, &index) != 0 || lookup(table, index, &name, &value) != 0)
+        return 1;
+      char *name_copy = strdup(name), *value_copy = strdup(value);
+      if (!name_copy || !value_copy) {
+        free(name_copy);
+        free(value_copy);
+        return 1;
+      }
+      if (fn(arg, name_copy, value_copy) != 0)
+        return 1;
+      continue;
+    }
+    if ((b & 0xe0) == 0x20) {
+      // dynamic table size update, at most the size allowed in our settings
+      if (decode_int(&p, end, 5, &index) != 0 || index > HPACK_TABLE_SIZE)
+        return 1;
+      table->max_size = index;
+      evict(table, index);
+      continue;
+    }
+    // literal header field, with incremental indexing or not indexed, the name indexed or literal
+    int indexing = (b & 0x40) != 0;
+    if (decode_int(&p, end, indexing ? 6 : 4, &index) != 0)
+      return 1;
+    char *literal_name = NULL;
+    if (index) {
+      if (lookup(table, index, &name, &value) != 0)
+        return 1;
+      literal_name = strdup(name);
+    } else {
+      literal_name = decode_string(&p, end);
+    }
+    char *literal_value = literal_name ? decode_string(&p, end) : NULL;
+    if (!literal_value || (indexing && insert(table, literal_name, literal_value) != 0)) {
+      free(literal_name);
+      free(literal_value);
+      return 1;
+    }
+    if (fn(arg, literal_name, literal_value) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+void hpack_table_free(HpackTable *table) {
+  evict(table, 0);
+}
+
+static size_t encode_int(unsigned char *out, unsigned char flags, int prefix, size_t value) {
+  size_t mask = ((size_t) 1 << prefix) - 1, n = 1;
+  if (value < mask) {
+    out[0] = (unsigned char) (flags | value);
+    return 1;
+  }
+  out[0] = (unsigned char) (flags | mask);
+  for (value -= mask; value >= 0x80; value >>= 7)
+    out[n++] = (unsigned char) (0x80 | (value & 0x7f));
+  out[n++] = (unsigned char) value;
+  return n;
+}
+
+static size_t encode_string(unsigned char *out, const char *str, size_t len, int lowercase) {
+  // never huffman coded, headers are sent once and the encoding costs more than the bytes saved on a lan
+  size_t n = encode_int(out, 0, 7, len);
+  for (size_t i = 0; i < len; i++)
+    out[n + i] = (unsigned char) (lowercase && str[i] >= 'A' && str[i] <= 'Z' ? str[i] + 'a' - 'A' : str[i]);
+  return n + len;
+}
+
+size_t hpack_encode_status(unsigned char *out, int status) {
+  // the statuses of the static table are a single byte
+  for (size_t i = 7; i < 14; i++) {
+    if (atoi(STATIC_TABLE[i].value) == status)
+      return encode_int(out, 0x80, 7, i + 1);
+  }
+  char value[8];
+  (void) snprintf(value, sizeof(value), "%03d", status % 1000);
+  size_t n = encode_int(out, 0x00, 4, 8);
+  return n + encode_string(out + n, value, 3, 0);
+}
+
+size_t hpack_encode_header(unsigned char *out, const char *name, size_t name_len, const char *value, size_t value_len) {
+  // without indexing, as the dynamic table is not used. names are lowercased, and taken from the static table
+  // when there (e.g content-type)
+  for (size_t i = 14; i < STATIC_ENTRIES; i++) {
+    const char *static_name = STATIC_TABLE[i].name;
+    if (strlen(static_name) == name_len && strncasecmp(static_name, name, name_len) == 0) {
+      size_t n = encode_int(out, 0x00, 4, i + 1);
+      return n + encode_string(out + n, value, value_len, 0);
+    }
+  }
+  out[0] = 0x00;
+  size_t n = 1 + encode_string(out + 1, name, name_len, 1);
+  return n + encode_string(out + n, value, value_len, 0);
+}
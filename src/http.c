@@ -1,56 +1,27 @@
 #include <ctype.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "internal.h"
 #include "webb/webb.h"
 
-static char *uri_decode(const char *s, size_t len) {
-  // clang-format off
-  static const char HEX_LOOKUP[256] = {
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
-    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-  };
-  // clang-format on
-  char *res = malloc(len + 1), *dst = res;
-  for (size_t i = 0; i < len; i++) {
-    char c = s[i];
-    if (c == '+') {
-      c = ' ';
-    } else if (c == '%') {
-      if (i + 2 >= len)
-        goto err;
-      char a = HEX_LOOKUP[(unsigned char) s[++i]];
-      char b = HEX_LOOKUP[(unsigned char) s[++i]];
-      if (a < 0 || b < 0)
-        goto err;
-      c = (char) ((a << 4) | b);
-    }
-    *dst++ = c;
+static char *uri_decode(const char *s, size_t len, const char **raw) {
+  // the raw target follows the decoded one in the same allocation, freed with it
+  char *res = malloc(2 * len + 2);
+  ssize_t n = res ? uri_decode_to(s, len, res, len + 1) : -1;
+  if (n == -1) {
+    free(res);
+    return NULL;
   }
-  *dst = '\0';
+  char *copy = res + n + 1;
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  *raw = copy;
   return res;
-
-err:
-  free(res);
-  return NULL;
 }
 
-static WebbMethod parse_http_method(const char *method, size_t len) {
+WebbMethod http_parse_method(const char *method, size_t len) {
   if (len == 7 && memcmp(method, "CONNECT", 7) == 0)
     return WEBB_CONNECT;
   if (len == 6 && memcmp(method, "DELETE", 6) == 0)
@@ -72,10 +43,24 @@ static WebbMethod parse_http_method(const char *method, size_t len) {
   return WEBB_INVALID;
 }
 
+static int parse_status_line(const char *line, int *status) {
+  // e.g "HTTP/1.1 200 OK", the reason phrase is optional and ignored
+  if (strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char) line[7]) || line[8] != ' ')
+    return 1;
+  const char *code = line + 9;
+  if (!isdigit((unsigned char) code[0]) || !isdigit((unsigned char) code[1]) || !isdigit((unsigned char) code[2]))
+    return 1;
+  if (code[3] != ' ' && code[3] != '\0')
+    return 1;
+  *status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+  return *status < 100 || *status > 599;
+}
+
 const char *http_next_line(HttpParseState *s) {
   for (size_t i = s->i; i + 1 < s->read; i++) {
     if (s->buf[i] == '\r' && s->buf[i + 1] == '\n') {
       char *line = s->buf + s->i;
+      s->header_bytes += i + 2 - s->i;
       s->i = i + 2;
       s->buf[i] = '\0';
       return line;
@@ -90,17 +75,23 @@ WebbResult http_parse_step(HttpParseState *state, WebbRequest *req) {
     case PARSE_STEP_INIT: {
       memset(req, 0, sizeof(*req));
       const char *line = http_next_line(state);
-      if (!line) {
-        if (state->read == sizeof(state->buf))
-          return RESULT_INVALID_HTTP;
+      if (!line)
         return RESULT_NEED_DATA;
+      // the start of the http/2 connection preface, rfc9113 3.4
+      if (!state->response && strcmp(line, "PRI * HTTP/2.0") == 0)
+        return RESULT_HTTP2;
+      if (state->response) {
+        if (parse_status_line(line, &state->status) != 0)
+          return RESULT_INVALID_HTTP;
+        state->step = PARSE_STEP_HEADERS;
+        break;
       }
 
       // parse http verb, ends with a space
       char *verb_end = strchr(line, ' ');
       if (!verb_end)
         return RESULT_INVALID_HTTP;
-      req->method = parse_http_method(line, verb_end - line);
+      req->method = http_parse_method(line, verb_end - line);
       if (req->method == WEBB_INVALID)
         return RESULT_INVALID_HTTP;
 
@@ -114,7 +105,7 @@ WebbResult http_parse_step(HttpParseState *state, WebbRequest *req) {
         req->query = strndup(query_start + 1, qs_end - query_start - 1);
         uri_end = query_start;
       }
-      req->uri = uri_decode(line, uri_end - line);
+      req->uri = uri_decode(line, uri_end - line, &req->target);
       if (!req->uri)
         return RESULT_INVALID_HTTP;
 
@@ -126,11 +117,10 @@ WebbResult http_parse_step(HttpParseState *state, WebbRequest *req) {
     }
     case PARSE_STEP_HEADERS: {
       const char *line = http_next_line(state);
-      if (!line) {
-        if (state->read == sizeof(state->buf))
-          return RESULT_INVALID_HTTP;
+      if (!line)
         return RESULT_NEED_DATA;
-      }
+      if (state->header_bytes > http_max_header_size(state))
+        return RESULT_HEADERS_TOO_LARGE;
       // empty line means end of headers
       if (strcmp(line, "") == 0) {
         state->step = PARSE_STEP_BODY;
@@ -170,7 +160,69 @@ WebbResult http_parse_step(HttpParseState *state, WebbRequest *req) {
 void http_state_reset(HttpParseState *state) {
   state->step = PARSE_STEP_INIT;
   state->headers = 0;
+  state->header_bytes = 0;
   state->body_read = 0;
+
+  // give idle connections' buffers back to the pool, and shrink buffers grown by large requests
+  size_t left = state->read - state->i;
+  if (left == 0) {
+    http_state_free(state);
+  } else if (state->cap > BUF_POOL_MIN_SIZE && left <= BUF_POOL_MIN_SIZE) {
+    char *buf = buf_pool_get(state->pool, BUF_POOL_MIN_SIZE);
+    if (!buf)
+      return;
+    memcpy(buf, state->buf + state->i, left);
+    buf_pool_put(state->pool, state->buf, state->cap);
+    state->buf = buf;
+    state->cap = BUF_POOL_MIN_SIZE;
+    state->read = left;
+    state->i = 0;
+  }
+}
+
+void http_state_free(HttpParseState *state) {
+  buf_pool_put(state->pool, state->buf, state->cap);
+  state->buf = NULL;
+  state->cap = 0;
+  state->read = 0;
+  state->i = 0;
+}
+
+size_t http_max_header_size(const HttpParseState *state) {
+  static const size_t LIMIT = (size_t) BUF_POOL_MIN_SIZE << (BUF_POOL_CLASSES - 1);
+  if (!state->max_header_size)
+    return DEFAULT_MAX_HEADER_SIZE;
+  return state->max_header_size < LIMIT ? state->max_header_size : LIMIT;
+}
+
+int http_state_grow(HttpParseState *state) {
+  size_t cap = buf_pool_size(state->cap ? state->cap * 2 : BUF_POOL_MIN_SIZE);
+  if (cap <= state->cap)
+    return 1;
+  char *buf = buf_pool_get(state->pool, cap);
+  if (!buf)
+    return 1;
+  if (state->buf)
+    memcpy(buf, state->buf + state->i, state->read - state->i);
+  buf_pool_put(state->pool, state->buf, state->cap);
+  state->buf = buf;
+  state->cap = cap;
+  state->read -= state->i;
+  state->i = 0;
+  return 0;
+}
+
+int http_has_token(const char *list, const char *token) {
+  // e.g "keep-alive, Upgrade", case insensitive
+  size_t len = strlen(token);
+  for (const char *p = list; p && *p;) {
+    p += strspn(p, " \t,");
+    size_t n = strcspn(p, " \t,");
+    if (n == len && strncasecmp(p, token, len) == 0)
+      return 1;
+    p += n;
+  }
+  return 0;
 }
 
 const char *webb_get_header(const WebbRequest *req, const char *key) {
@@ -182,13 +234,67 @@ const char *webb_get_header(const WebbRequest *req, const char *key) {
 }
 
 void webb_set_header(WebbResponse *res, char *key, char *val) {
-  WebbHeaders *header = malloc(sizeof(WebbHeaders));
+  // out of memory, the header is left out
+  WebbHeaders *header = val ? malloc(sizeof(WebbHeaders)) : NULL;
+  if (!header) {
+    free(val);
+    return;
+  }
   header->key = key;
   header->val = val;
   header->next = res->headers;
   res->headers = header;
 }
 
+static WebbHeaders *arena_header(WebbResponse *res) {
+  // nodes are aligned like pointers, the values formatted after them need no alignment
+  size_t start = (res->arena_used + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+  if (start + sizeof(WebbHeaders) > sizeof(res->arena.buf))
+    return NULL;
+  res->arena_used = start + sizeof(WebbHeaders);
+  return (WebbHeaders *) (res->arena.buf + start);
+}
+
+void webb_set_header_static(WebbResponse *res, char *key, char *val) {
+  WebbHeaders *header = arena_header(res);
+  if (!header) {
+    // left out when the copy cannot be allocated either
+    char *copy = strdup(val);
+    if (copy)
+      webb_set_header(res, key, copy);
+    return;
+  }
+  *header = (WebbHeaders){.key = key, .val = val, .next = res->headers};
+  res->headers = header;
+}
+
+int webb_set_headerf(WebbResponse *res, char *key, const char *fmt, ...) {
+  size_t used = res->arena_used;
+  WebbHeaders *header = arena_header(res);
+  size_t avail = header ? sizeof(res->arena.buf) - res->arena_used : 0;
+  char *val = res->arena.buf + res->arena_used;
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(avail ? val : NULL, avail, fmt, args);
+  va_end(args);
+  if (len >= 0 && (size_t) len < avail) {
+    res->arena_used += (size_t) len + 1;
+    *header = (WebbHeaders){.key = key, .val = val, .next = res->headers};
+    res->headers = header;
+    return 0;
+  }
+  // does not fit, the value is allocated instead
+  res->arena_used = used;
+  val = len >= 0 ? malloc((size_t) len + 1) : NULL;
+  if (!val)
+    return 1;
+  va_start(args, fmt);
+  (void) vsnprintf(val, (size_t) len + 1, fmt, args);
+  va_end(args);
+  webb_set_header(res, key, val);
+  return 0;
+}
+
 const char *webb_method_str(WebbMethod m) {
   // clang-format off
   switch (m) {
@@ -2,16 +2,65 @@
 #define WEBB_INTERNAL_H
 
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <ucontext.h>
 #include "webb/webb.h"
 
-#define LOG(msg, ...)  (void) fprintf(stderr, "libwebb - " msg "\n" __VA_OPT__(, ) __VA_ARGS__)
+#define LOG(msg, ...) \
+  (log_allowed() ? (void) fprintf(stderr, "libwebb - " msg "\n" __VA_OPT__(, ) __VA_ARGS__) : (void) 0)
 #define LOG_ERRNO(msg) LOG(msg ": %s", strerror(errno))
 
-#define MAX_HEADERS  64
-#define MAX_BODY_LEN (2 * 1024 * 1024)  // 2mb
+#define WORKERS                 8
+#define MAX_HEADERS             64
+#define MAX_BODY_LEN            (2 * 1024 * 1024)  // 2mb
+#define DEFAULT_MAX_HEADER_SIZE (8 * 1024)         // 8kb
+
+#define BUF_POOL_MIN_SIZE 1024
+#define BUF_POOL_CLASSES  11  // 1kb to 1mb
+#define BUF_POOL_MAX_FREE 64  // buffers kept per size class
+
+#define CORO_POOL_MAX_FREE 64  // stacks kept per worker
+
+#define CACHE_DEFAULT_SHARDS    16
+#define CACHE_DEFAULT_MAX_BYTES (64 * 1024 * 1024)  // 64mb
+#define CACHE_MIN_BUCKETS       64                  // per shard, doubled as entries are added
+#define CACHE_MAX_KEY           4096                // requests with longer keys bypass the cache
+#define CACHE_MAX_HEAD          8192                // responses with more header bytes are not cached
+#define CACHE_FILL_WAIT_MS      1000                // misses wait this long for another request's response
+
+#define RATE_LIMIT_WAYS                8      // slots per set, one cache line
+#define RATE_LIMIT_DEFAULT_CLIENTS     65536
+#define RATE_LIMIT_DEFAULT_IPV6_PREFIX 64
+
+#define PROXY_DEFAULT_MAX_IDLE 16
+#define PROXY_MAX_COPY         (16 * 1024)  // larger upstream bodies are spliced instead of copied
+#define PROXY_DEFAULT_TIMEOUT  60000        // ms
+
+#define WEBSOCKET_DEFAULT_MAX_MESSAGE (1024 * 1024)      // 1mb
+#define WEBSOCKET_DEFAULT_MAX_QUEUED  (4 * 1024 * 1024)  // 4mb
+#define WEBSOCKET_MIN_BUFFER          4096
+
+#define OUT_QUEUE_IOVECS 64  // chunks sent per sendmsg
+
+#define SSE_DEFAULT_MAX_QUEUED (1024 * 1024)  // 1mb
+#define SSE_BUCKETS            256           // channels are hashed by name
+
+#define HPACK_TABLE_SIZE  4096  // the protocol's default, never changed in our settings
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+#define H2_MAX_STREAMS 256                // concurrent streams per connection
+#define H2_WINDOW      (1024 * 1024)      // receive window of each connection and stream
+#define H2_MAX_FRAME   16384              // the protocol's default, the largest frame received
+#define H2_OUT_BUFFER  (64 * 1024)        // frames batched per send
+#define H2_MAX_OUT     (1024 * 1024)      // frames waiting for a slow client before it is dropped
+
+#define ACCESS_LOG_RING_SIZE  1024  // records per worker
+#define ACCESS_LOG_TARGET_LEN 224
 
 typedef enum WebbResult {
   RESULT_OK = 0,
@@ -20,6 +69,9 @@ typedef enum WebbResult {
   RESULT_UNEXPECTED,
   RESULT_DISCONNECTED,
   RESULT_NEED_DATA,
+  RESULT_HEADERS_TOO_LARGE,
+  RESULT_HTTP2,
+  RESULT_TIMEOUT,
 } WebbResult;
 
 typedef enum HttpParseStep {
@@ -29,23 +81,235 @@ typedef enum HttpParseStep {
   PARSE_STEP_COMPLETE,
 } HttpParseStep;
 
+typedef struct BufPool {
+  char *free[BUF_POOL_CLASSES];
+  size_t nfree[BUF_POOL_CLASSES];
+} BufPool;
+
 typedef struct HttpParseState {
   HttpParseStep step;
   size_t headers;
+  size_t header_bytes;
   size_t body_read;
   size_t read;
   size_t i;
-  char buf[4096];
+  // grown on demand up to max_header_size (0 for the default), buffers are taken from pool if set
+  char *buf;
+  size_t cap;
+  size_t max_header_size;
+  BufPool *pool;
+  // set to parse a response's status line instead of a request line, status being the parsed status code
+  int response;
+  int status;
 } HttpParseState;
 
+size_t buf_pool_size(size_t size);
+
+char *buf_pool_get(BufPool *pool, size_t size);
+
+void buf_pool_put(BufPool *pool, char *buf, size_t size);
+
+void buf_pool_free(BufPool *pool);
+
 WebbResult http_parse_step(HttpParseState *state, WebbRequest *req);
 
 WebbResult parse_request(int fd, HttpParseState *state, WebbRequest *req);
 
+WebbResult parse_request_head(int fd, HttpParseState *state, WebbRequest *req);
+
+WebbResult parse_request_body(int fd, HttpParseState *state, WebbRequest *req);
+
 void http_state_reset(HttpParseState *state);
 
+void http_state_free(HttpParseState *state);
+
+size_t http_max_header_size(const HttpParseState *state);
+
+int http_state_grow(HttpParseState *state);
+
 void http_req_free(WebbRequest *req);
 
+int http_has_token(const char *list, const char *token);
+
+WebbMethod http_parse_method(const char *method, size_t len);
+
+size_t uri_plain_len(const char *s, size_t len);
+
+ssize_t uri_decode_to(const char *s, size_t len, char *dst, size_t cap);
+
+void http_body_free(WebbBody *body);
+
 void http_res_free(WebbResponse *res);
 
+typedef struct Coroutine {
+  ucontext_t ctx;
+  // where the coroutine returns to when it yields or finishes
+  ucontext_t caller;
+  // the stack mapping, its lowest page being the guard page
+  char *stack;
+  size_t size;
+  void (*fn)(void *arg);
+  void *arg;
+  int finished;
+  // the fd a suspended coroutine waits on, and the error to return if the worker failed to wait on it
+  int wait_fd;
+  int wait_writable;
+  int wait_errno;
+  struct Coroutine *next;
+} Coroutine;
+
+typedef struct CoroutinePool {
+  size_t stack_size;
+  Coroutine *free;
+  size_t nfree;
+} CoroutinePool;
+
+Coroutine *coro_new(CoroutinePool *pool, void (*fn)(void *arg), void *arg);
+
+int coro_resume(Coroutine *coro);
+
+void coro_put(CoroutinePool *pool, Coroutine *coro);
+
+void coro_pool_free(CoroutinePool *pool);
+
+int coro_running(void);
+
+int coro_wait_fd_timeout(int fd, int writable, unsigned ms);
+
+typedef struct RateLimitSet {
+  // each slot is a client's 16 bit tag and the time in microseconds its bucket is full again (48 bits)
+  __attribute__((aligned(64))) uint64_t slots[RATE_LIMIT_WAYS];
+} RateLimitSet;
+
+typedef struct RateLimiter {
+  RateLimitSet *sets;
+  size_t nsets;
+  uint64_t interval_us;
+  uint64_t tolerance_us;
+  unsigned ipv4_prefix;
+  unsigned ipv6_prefix;
+} RateLimiter;
+
+int rate_limiter_init(RateLimiter *limiter, const WebbServerOptions *opts);
+
+int rate_limiter_allow(RateLimiter *limiter, const struct sockaddr *addr, uint64_t now_us);
+
+void rate_limiter_free(RateLimiter *limiter);
+
+// bytes waiting to be sent on a socket, each chunk a part of a shared buffer
+typedef struct OutChunk {
+  WebbShared *shared;
+  size_t offset;
+  size_t len;
+  struct OutChunk *next;
+} OutChunk;
+
+typedef struct OutQueue {
+  OutChunk *head;
+  OutChunk *tail;
+  size_t bytes;
+} OutQueue;
+
+int out_queue_push(OutQueue *queue, WebbShared *shared, size_t offset, size_t len);
+
+int out_queue_flush(OutQueue *queue, int fd);
+
+void out_queue_free(OutQueue *queue);
+
+void websocket_unmask(char *data, size_t len, const unsigned char mask[4]);
+
+void websocket_attach(WebbWebSocket *ws, int fd, const char *buffered, size_t len);
+
+int websocket_handle(WebbWebSocket *ws);
+
+void websocket_free(WebbWebSocket *ws);
+
+void sse_attach(WebbSseSubscriber *sub, int fd);
+
+int sse_handle(WebbSseSubscriber *sub);
+
+void sse_free(WebbSseSubscriber *sub);
+
+typedef struct HpackEntry {
+  char *name;
+  char *value;
+} HpackEntry;
+
+typedef struct HpackTable {
+  // a ring of entries, first being the newest. max_size starts at HPACK_TABLE_SIZE, the encoder can lower it
+  HpackEntry entries[HPACK_MAX_ENTRIES];
+  size_t first;
+  size_t len;
+  size_t size;
+  size_t max_size;
+} HpackTable;
+
+// takes ownership of name and value, returns non-zero to stop decoding
+typedef int(HpackHeaderFn)(void *arg, char *name, char *value);
+
+int hpack_decode(HpackTable *table, const unsigned char *block, size_t len, HpackHeaderFn *fn, void *arg);
+
+void hpack_table_free(HpackTable *table);
+
+// out needs room for 8 bytes, and 12 bytes more than the name and value for a header
+size_t hpack_encode_status(unsigned char *out, int status);
+
+size_t hpack_encode_header(unsigned char *out, const char *name, size_t name_len, const char *value, size_t value_len);
+
+typedef struct H2Session H2Session;
+
+// runs the handler of a stream's complete request
+typedef void(H2Dispatch)(void *arg, WebbRequest *req, WebbResponse *res);
+
+int h2_is_upgrade(const WebbRequest *req);
+
+H2Session *h2_session_new(int fd, size_t max_header_size, H2Dispatch *dispatch, void *arg);
+
+int h2_session_start(H2Session *h2, const char *buffered, size_t len, WebbRequest *upgrade);
+
+int h2_session_handle(H2Session *h2, int *wait_fd);
+
+void h2_session_free(H2Session *h2);
+
+typedef struct AccessLogRecord {
+  time_t time;
+  WebbMethod method;
+  int status;
+  size_t body_len;
+  unsigned duration_us;
+  char target[ACCESS_LOG_TARGET_LEN];
+} AccessLogRecord;
+
+typedef struct AccessLogRing {
+  // written by the worker, read by the writer thread
+  __attribute__((aligned(64))) size_t head;
+  // written by the writer thread, read by the worker
+  __attribute__((aligned(64))) size_t tail;
+  size_t dropped;
+  AccessLogRecord records[ACCESS_LOG_RING_SIZE];
+} AccessLogRing;
+
+typedef struct AccessLog {
+  int fd;
+  int stop;
+  int running;
+  pthread_t writer;
+  size_t nrings;
+  AccessLogRing *rings;
+} AccessLog;
+
+int log_allowed(void);
+
+void log_set_rate_limit(unsigned per_second);
+
+int access_log_init(AccessLog *log, int fd, size_t nrings);
+
+int access_log_start(AccessLog *log);
+
+int access_log_push(AccessLogRing *ring, const AccessLogRecord *record);
+
+size_t access_log_flush(AccessLog *log);
+
+void access_log_free(AccessLog *log);
+
 #endif
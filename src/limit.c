@@ -0,0 +1,130 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+#define SLOT_TIME_BITS 48
+#define SLOT_TIME_MASK ((UINT64_C(1) << SLOT_TIME_BITS) - 1)
+
+static uint64_t prefix_mask(unsigned prefix, unsigned bits) {
+  // the top prefix bits of a bits wide word
+  if (prefix == 0)
+    return 0;
+  uint64_t mask = prefix >= 64 ? UINT64_MAX : ~(UINT64_MAX >> prefix);
+  return bits == 64 ? mask : (mask >> (64 - bits)) & ((UINT64_C(1) << bits) - 1);
+}
+
+static uint64_t load_be64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static int client_key(const RateLimiter *limiter, const struct sockaddr *addr, uint64_t key[2]) {
+  // clients are identified by a prefix of their address, ipv4 mapped ipv6 addresses counting as ipv4
+  uint32_t ipv4;
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) (const void *) addr;
+    ipv4 = ntohl(in->sin_addr.s_addr);
+  } else if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) (const void *) addr;
+    const unsigned char *bytes = in6->sin6_addr.s6_addr;
+    if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+      unsigned prefix = limiter->ipv6_prefix;
+      key[0] = load_be64(bytes) & prefix_mask(prefix, 64);
+      key[1] = load_be64(bytes + 8) & prefix_mask(prefix > 64 ? prefix - 64 : 0, 64);
+      return 0;
+    }
+    ipv4 = (uint32_t) bytes[12] << 24 | (uint32_t) bytes[13] << 16 | (uint32_t) bytes[14] << 8 | bytes[15];
+  } else {
+    return 1;
+  }
+  // kept apart from ipv6 keys, whose first word is only this small for the reserved ::/32
+  key[0] = ipv4 & prefix_mask(limiter->ipv4_prefix, 32);
+  key[1] = UINT64_MAX;
+  return 0;
+}
+
+static uint64_t hash_key(const uint64_t key[2]) {
+  // splitmix64 finalizer over both words
+  uint64_t h = key[0] * 0x9e3779b97f4a7c15ULL ^ key[1];
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+int rate_limiter_init(RateLimiter *limiter, const WebbServerOptions *opts) {
+  memset(limiter, 0, sizeof(*limiter));
+  if (!opts->rate_limit)
+    return 0;
+  limiter->interval_us = 1000000 / opts->rate_limit;
+  if (!limiter->interval_us)
+    limiter->interval_us = 1;
+  unsigned burst = opts->rate_limit_burst ? opts->rate_limit_burst : opts->rate_limit;
+  limiter->tolerance_us = limiter->interval_us * (burst - 1);
+  limiter->ipv4_prefix = opts->rate_limit_ipv4_prefix ? opts->rate_limit_ipv4_prefix : 32;
+  if (limiter->ipv4_prefix > 32)
+    limiter->ipv4_prefix = 32;
+  limiter->ipv6_prefix = opts->rate_limit_ipv6_prefix ? opts->rate_limit_ipv6_prefix : RATE_LIMIT_DEFAULT_IPV6_PREFIX;
+  if (limiter->ipv6_prefix > 128)
+    limiter->ipv6_prefix = 128;
+  // a power of two number of sets, so the set is picked from the hash with a mask
+  size_t clients = opts->rate_limit_clients ? opts->rate_limit_clients : RATE_LIMIT_DEFAULT_CLIENTS;
+  limiter->nsets = 1;
+  while (limiter->nsets * RATE_LIMIT_WAYS < clients)
+    limiter->nsets *= 2;
+  void *sets;
+  if (posix_memalign(&sets, sizeof(RateLimitSet), limiter->nsets * sizeof(RateLimitSet)) != 0) {
+    LOG("failed to allocate rate limiter");
+    return 1;
+  }
+  memset(sets, 0, limiter->nsets * sizeof(RateLimitSet));
+  limiter->sets = sets;
+  return 0;
+}
+
+int rate_limiter_allow(RateLimiter *limiter, const struct sockaddr *addr, uint64_t now_us) {
+  uint64_t key[2];
+  if (!limiter->sets || !addr || client_key(limiter, addr, key) != 0)
+    return 1;
+  uint64_t hash = hash_key(key), tag = hash >> SLOT_TIME_BITS;
+  uint64_t *slots = limiter->sets[hash & (limiter->nsets - 1)].slots;
+  now_us &= SLOT_TIME_MASK;
+  for (;;) {
+    // the client's slot, or the one whose bucket has been full the longest to take over. an empty slot
+    // reads as a bucket that was full at time 0
+    size_t slot = 0;
+    uint64_t old = __atomic_load_n(&slots[0], __ATOMIC_RELAXED), full_at = 0;
+    int found = 0;
+    for (size_t i = 0; i < RATE_LIMIT_WAYS && !found; i++) {
+      uint64_t v = i ? __atomic_load_n(&slots[i], __ATOMIC_RELAXED) : old;
+      found = v >> SLOT_TIME_BITS == tag;
+      if (found || (v & SLOT_TIME_MASK) < (old & SLOT_TIME_MASK)) {
+        slot = i;
+        old = v;
+      }
+    }
+    if (found)
+      full_at = old & SLOT_TIME_MASK;
+    // every request takes a token, moving the time the bucket is full again an interval ahead. it is empty
+    // once that is more than the burst (less the request's own token) ahead
+    if (full_at < now_us)
+      full_at = now_us;
+    if (full_at - now_us > limiter->tolerance_us)
+      return 0;
+    uint64_t next = tag << SLOT_TIME_BITS | ((full_at + limiter->interval_us) & SLOT_TIME_MASK);
+    if (__atomic_compare_exchange_n(&slots[slot], &old, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+}
+
+void rate_limiter_free(RateLimiter *limiter) {
+  free(limiter->sets);
+  limiter->sets = NULL;
+}
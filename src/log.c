@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+#define ACCESS_LOG_IDLE_NS (10 * 1000 * 1000)  // 10ms
+#define ACCESS_LOG_BUF_LEN 65536
+
+static unsigned log_rate_limit;
+static time_t log_window;
+static unsigned log_count;
+static unsigned log_suppressed;
+
+void log_set_rate_limit(unsigned per_second) {
+  __atomic_store_n(&log_rate_limit, per_second, __ATOMIC_RELAXED);
+}
+
+int log_allowed(void) {
+  unsigned limit = __atomic_load_n(&log_rate_limit, __ATOMIC_RELAXED);
+  if (!limit)
+    return 1;
+  // fixed one second windows, whoever starts a new window reports what was suppressed in the last one
+  time_t now = time(NULL), window = __atomic_load_n(&log_window, __ATOMIC_RELAXED);
+  if (now != window && __atomic_compare_exchange_n(&log_window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&log_count, 0, __ATOMIC_RELAXED);
+    unsigned suppressed = __atomic_exchange_n(&log_suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed)
+      (void) fprintf(stderr, "libwebb - suppressed %u log messages\n", suppressed);
+  }
+  if (__atomic_add_fetch(&log_count, 1, __ATOMIC_RELAXED) <= limit)
+    return 1;
+  __atomic_add_fetch(&log_suppressed, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int access_log_push(AccessLogRing *ring, const AccessLogRecord *record) {
+  // single producer, the worker owning the ring. when full the record is dropped rather than blocking
+  size_t head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == ACCESS_LOG_RING_SIZE) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  ring->records[head % ACCESS_LOG_RING_SIZE] = *record;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      LOG_ERRNO("write(access log)");
+      return 1;
+    }
+    buf += written;
+    len -= written;
+  }
+  return 0;
+}
+
+static size_t format_record(char *buf, size_t len, const AccessLogRecord *r) {
+  struct tm tm;
+  size_t n = strftime(buf, len, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&r->time, &tm));
+  n += snprintf(
+    buf + n,
+    len - n,
+    " %s %s %d %zu %uus\n",
+    webb_method_str(r->method),
+    r->target,
+    r->status,
+    r->body_len,
+    r->duration_us);
+  return n < len ? n : len - 1;
+}
+
+size_t access_log_flush(AccessLog *log) {
+  // single consumer, records from all rings are batched into as few writes as possible
+  char buf[ACCESS_LOG_BUF_LEN];
+  size_t len = 0, flushed = 0;
+  for (size_t i = 0; i < log->nrings; i++) {
+    AccessLogRing *ring = &log->rings[i];
+    size_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++, flushed++) {
+      if (ACCESS_LOG_BUF_LEN - len < sizeof(AccessLogRecord) + 128) {
+        (void) write_all(log->fd, buf, len);
+        len = 0;
+      }
+      len += format_record(buf + len, sizeof(buf) - len, &ring->records[tail % ACCESS_LOG_RING_SIZE]);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+      LOG("access log full, dropped %zu records", dropped);
+  }
+  if (len)
+    (void) write_all(log->fd, buf, len);
+  return flushed;
+}
+
+#ifndef WEBB_NO_THREADS
+static void *access_log_writer(void *arg) {
+  AccessLog *log = arg;
+  while (!__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+    if (access_log_flush(log) == 0) {
+      struct timespec idle = {.tv_nsec = ACCESS_LOG_IDLE_NS};
+      (void) nanosleep(&idle, NULL);
+    }
+  }
+  (void) access_log_flush(log);
+  return NULL;
+}
+
+#endif
+
+int access_log_init(AccessLog *log, int fd, size_t nrings) {
+  memset(log, 0, sizeof(*log));
+  log->fd = fd;
+  log->nrings = nrings;
+  log->rings = calloc(nrings, sizeof(AccessLogRing));
+  if (!log->rings) {
+    LOG("failed to allocate access log");
+    return 1;
+  }
+  return 0;
+}
+
+#ifndef WEBB_NO_THREADS
+int access_log_start(AccessLog *log) {
+  if (pthread_create(&log->writer, NULL, access_log_writer, log) != 0) {
+    LOG_ERRNO("pthread_create");
+    return 1;
+  }
+  log->running = 1;
+  return 0;
+}
+
+#endif
+
+void access_log_free(AccessLog *log) {
+#ifndef WEBB_NO_THREADS
+  if (log->running) {
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+    (void) pthread_join(log->writer, NULL);
+  }
+#endif
+  free(log->rings);
+  log->rings = NULL;
+}
@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+static size_t size_class(size_t size) {
+  size_t class = 0;
+  while (class + 1 < BUF_POOL_CLASSES && (size_t) BUF_POOL_MIN_SIZE << class < size)
+    class++;
+  return class;
+}
+
+size_t buf_pool_size(size_t size) {
+  return (size_t) BUF_POOL_MIN_SIZE << size_class(size);
+}
+
+char *buf_pool_get(BufPool *pool, size_t size) {
+  // freed buffers form an intrusive linked list, the first bytes of each holding the next pointer
+  size_t class = size_class(size);
+  if (pool && pool->free[class]) {
+    char *buf = pool->free[class];
+    memcpy(&pool->free[class], buf, sizeof(char *));
+    pool->nfree[class]--;
+    return buf;
+  }
+  return malloc((size_t) BUF_POOL_MIN_SIZE << class);
+}
+
+void buf_pool_put(BufPool *pool, char *buf, size_t size) {
+  if (!buf)
+    return;
+  size_t class = size_class(size);
+  if (!pool || pool->nfree[class] == BUF_POOL_MAX_FREE) {
+    free(buf);
+    return;
+  }
+  memcpy(buf, &pool->free[class], sizeof(char *));
+  pool->free[class] = buf;
+  pool->nfree[class]++;
+}
+
+void buf_pool_free(BufPool *pool) {
+  for (size_t class = 0; class < BUF_POOL_CLASSES; class++) {
+    while (pool->free[class]) {
+      char *next;
+      memcpy(&next, pool->free[class], sizeof(char *));
+      free(pool->free[class]);
+      pool->free[class] = next;
+    }
+    pool->nfree[class] = 0;
+  }
+}
@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+typedef struct Upstream {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  // requests in flight from all workers, for least connections
+  size_t active;
+} Upstream;
+
+// the idle keep-alive connections of a worker to an upstream, the most recently used last
+typedef struct ProxyPool {
+  int *fds;
+  size_t nfds;
+} ProxyPool;
+
+// only ever used by its worker's thread, so it needs no locking
+typedef struct ProxyWorker {
+  size_t next;
+  BufPool bufs;
+  ProxyPool *pools;
+} ProxyWorker;
+
+struct WebbProxy {
+  Upstream *upstreams;
+  size_t nupstreams;
+  WebbProxyBalance balance;
+  size_t max_idle;
+  unsigned timeout;
+  ProxyWorker workers[WORKERS];
+};
+
+// an upstream connection whose response body is spliced to the client, followed by the response's header lines
+typedef struct ProxyStream {
+  WebbProxy *proxy;
+  ProxyWorker *worker;
+  size_t upstream;
+  int keep_alive;
+  char head[];
+} ProxyStream;
+
+// hop-by-hop headers (rfc9110 7.6.1), the ones only meant for the client's connection, and those set by the proxy
+static const char *const REQUEST_SKIPPED[] = {
+  "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", "expect",
+  "content-length", "x-forwarded-for", NULL,
+};
+static const char *const RESPONSE_SKIPPED[] = {
+  "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade",
+  "content-length", "date", "server", NULL,
+};
+
+static int resolve_upstream(const char *spec, Upstream *upstream) {
+  // "host:port" or "[ipv6]:port", the port being after the last colon
+  char host[256];
+  const char *port = strrchr(spec, ':'), *start = spec;
+  size_t len = port ? (size_t) (port - spec) : 0;
+  if (len && spec[0] == '[') {
+    if (len < 2 || port[-1] != ']') {
+      LOG("invalid upstream %s", spec);
+      return 1;
+    }
+    start++;
+    len -= 2;
+  }
+  if (!port || !len || len >= sizeof(host)) {
+    LOG("invalid upstream %s", spec);
+    return 1;
+  }
+  memcpy(host, start, len);
+  host[len] = '\0';
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *info;
+  if (getaddrinfo(host, port + 1, &hints, &info) != 0) {
+    LOG("failed to resolve upstream %s", spec);
+    return 1;
+  }
+  memcpy(&upstream->addr, info->ai_addr, info->ai_addrlen);
+  upstream->addr_len = info->ai_addrlen;
+  freeaddrinfo(info);
+  return 0;
+}
+
+static size_t pick_upstream(WebbProxy *proxy, ProxyWorker *worker) {
+  size_t start = worker->next++ % proxy->nupstreams;
+  if (proxy->balance != WEBB_PROXY_LEAST_CONNECTIONS)
+    return start;
+  // ties are broken round robin, so idle upstreams share the load
+  size_t best = start, best_active = SIZE_MAX;
+  for (size_t i = 0; i < proxy->nupstreams; i++) {
+    size_t upstream = (start + i) % proxy->nupstreams;
+    size_t active = __atomic_load_n(&proxy->upstreams[upstream].active, __ATOMIC_RELAXED);
+    if (active < best_active) {
+      best = upstream;
+      best_active = active;
+    }
+  }
+  return best;
+}
+
+static int connect_upstream(const Upstream *upstream, unsigned timeout) {
+  int fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    LOG_ERRNO("socket");
+    return -1;
+  }
+  int one = 1, err = 0;
+  socklen_t err_len = sizeof(err);
+  (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, (const struct sockaddr *) &upstream->addr, upstream->addr_len) == -1) {
+    if (errno != EINPROGRESS || coro_wait_fd_timeout(fd, 1, timeout) != 0
+        || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0) {
+      // errno is kept for the caller, which answers a timeout with 504
+      err = err ? err : errno;
+      errno = err;
+      LOG_ERRNO("failed to connect to upstream");
+      (void) close(fd);
+      errno = err;
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static int take_connection(WebbProxy *proxy, ProxyWorker *worker, size_t upstream, int *reused) {
+  // an idle connection the upstream closed meanwhile reads as end of file, one with anything to read is unusable
+  ProxyPool *pool = &worker->pools[upstream];
+  while (pool->nfds) {
+    int fd = pool->fds[--pool->nfds];
+    char c;
+    if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      *reused = 1;
+      return fd;
+    }
+    (void) close(fd);
+  }
+  *reused = 0;
+  return connect_upstream(&proxy->upstreams[upstream], proxy->timeout);
+}
+
+static void release_connection(WebbProxy *proxy, ProxyWorker *worker, size_t upstream, int fd, int keep_alive) {
+  // the most recently used connections are reused first, the others time out on the upstream's side
+  ProxyPool *pool = &worker->pools[upstream];
+  __atomic_sub_fetch(&proxy->upstreams[upstream].active, 1, __ATOMIC_RELAXED);
+  if (keep_alive && pool->nfds < proxy->max_idle)
+    pool->fds[pool->nfds++] = fd;
+  else
+    (void) close(fd);
+}
+
+static void stream_done(int fd, int complete, void *arg) {
+  // the connection can only be reused once all of the body was read from it
+  ProxyStream *stream = arg;
+  release_connection(stream->proxy, stream->worker, stream->upstream, fd, complete && stream->keep_alive);
+  free(stream);
+}
+
+static int send_all(int fd, const char *buf, size_t len, int flags, unsigned timeout) {
+  // like webb_write, without raising SIGPIPE when the upstream closed the connection
+  for (size_t sent = 0; sent < len;) {
+    ssize_t n = send(fd, buf + sent, len - sent, flags | MSG_NOSIGNAL);
+    if (n >= 0) {
+      sent += (size_t) n;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || coro_wait_fd_timeout(fd, 1, timeout) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int skipped(const char *const *names, const char *key) {
+  for (const char *const *name = names; *name; name++) {
+    if (strcasecmp(*name, key) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int peer_ip(const WebbRequest *req, char *ip) {
+  const struct sockaddr *peer = req->peer;
+  if (peer && peer->sa_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) (const void *) peer;
+    return inet_ntop(AF_INET, &in->sin_addr, ip, INET6_ADDRSTRLEN) == NULL;
+  }
+  if (peer && peer->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) (const void *) peer;
+    return inet_ntop(AF_INET6, &in6->sin6_addr, ip, INET6_ADDRSTRLEN) == NULL;
+  }
+  return 1;
+}
+
+static size_t encode_uri(const char *uri, char *dst, int raw) {
+  // a raw target is forwarded as received, only escaping what cannot be on a request line. a decoded uri (e.g one
+  // a handler set) has everything but unreserved characters and path delimiters escaped again, '+' included, as
+  // some upstreams decode it to a space
+  static const char HEX[] = "0123456789ABCDEF";
+  size_t n = 0;
+  for (const unsigned char *p = (const unsigned char *) uri; *p; p++) {
+    if (raw ? *p > ' ' && *p < 0x7f : isalnum(*p) || strchr("-._~/!$&'()*,;=:@", *p)) {
+      dst[n++] = (char) *p;
+    } else {
+      dst[n++] = '%';
+      dst[n++] = HEX[*p >> 4];
+      dst[n++] = HEX[*p & 15];
+    }
+  }
+  return n;
+}
+
+static char *format_request(ProxyWorker *worker, const WebbRequest *req, size_t *len, size_t *cap) {
+  // sized for the worst case first, so the head is formatted in a single buffer from the worker's pool
+  const char *connection = webb_get_header(req, "connection"), *forwarded = webb_get_header(req, "x-forwarded-for");
+  char ip[INET6_ADDRSTRLEN];
+  int has_ip = peer_ip(req, ip) == 0;
+  const char *target = req->target ? req->target : req->uri;
+  size_t size = strlen(webb_method_str(req->method)) + 3 * strlen(target) + 64;
+  if (req->query)
+    size += 3 * strlen(req->query) + 1;
+  for (const WebbHeaders *h = req->headers; h; h = h->next)
+    size += strlen(h->key) + strlen(h->val) + 4;
+  if (forwarded)
+    size += strlen(forwarded) + 2;
+  size += sizeof("x-forwarded-for: \r\n") + INET6_ADDRSTRLEN + sizeof("content-length: \r\n") + 20;
+  if (size > buf_pool_size(size))
+    return NULL;
+  *cap = size;
+  char *buf = buf_pool_get(&worker->bufs, size), *p = buf;
+  if (!buf)
+    return NULL;
+
+  p += sprintf(p, "%s ", webb_method_str(req->method));
+  p += encode_uri(target, p, target == req->target);
+  if (req->query) {
+    *p++ = '?';
+    p += encode_uri(req->query, p, 1);
+  }
+  p += sprintf(p, " HTTP/1.1\r\n");
+  for (const WebbHeaders *h = req->headers; h; h = h->next) {
+    if (!skipped(REQUEST_SKIPPED, h->key) && !http_has_token(connection, h->key))
+      p += sprintf(p, "%s: %s\r\n", h->key, h->val);
+  }
+  if (forwarded && has_ip)
+    p += sprintf(p, "x-forwarded-for: %s, %s\r\n", forwarded, ip);
+  else if (forwarded || has_ip)
+    p += sprintf(p, "x-forwarded-for: %s\r\n", forwarded ? forwarded : ip);
+  if (req->body_len || req->method == WEBB_POST || req->method == WEBB_PUT || req->method == WEBB_PATCH)
+    p += sprintf(p, "content-length: %zu\r\n", req->body_len);
+  p += sprintf(p, "\r\n");
+  *len = (size_t) (p - buf);
+  return buf;
+}
+
+static WebbResult wait_upstream(int fd, unsigned timeout) {
+  if (coro_wait_fd_timeout(fd, 0, timeout) == 0)
+    return RESULT_OK;
+  if (errno != ETIMEDOUT)
+    return RESULT_UNEXPECTED;
+  LOG("upstream timed out");
+  return RESULT_TIMEOUT;
+}
+
+static WebbResult read_head(int fd, HttpParseState *s, WebbRequest *head, unsigned timeout) {
+  // the head is peeked until it parses, then exactly its bytes are read, leaving the body in the socket to be
+  // spliced. a partial head is parsed again from the start once more arrived, which is rare past the first peek
+  for (size_t peeked = 0, waited = 0;;) {
+    if (!s->cap && http_state_grow(s) != 0)
+      return RESULT_OOM;
+    ssize_t n = recv(fd, s->buf, s->cap, MSG_PEEK);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      WebbResult res = wait_upstream(fd, timeout);
+      if (res != RESULT_OK)
+        return res;
+      continue;
+    }
+    // once waited for more than was peeked, the same bytes again mean the upstream closed the connection
+    if (n < 1 || (waited && (size_t) n <= peeked))
+      return peeked ? RESULT_INVALID_HTTP : RESULT_DISCONNECTED;
+    peeked = (size_t) n;
+    waited = 0;
+    http_req_free(head);
+    s->step = PARSE_STEP_INIT;
+    s->headers = s->header_bytes = 0;
+    s->i = 0;
+    s->read = peeked;
+    WebbResult res = http_parse_step(s, head);
+    if (res == RESULT_OK)
+      return recv(fd, s->buf, s->i, 0) == (ssize_t) s->i ? RESULT_OK : RESULT_UNEXPECTED;
+    if (res != RESULT_NEED_DATA)
+      return res;
+    if (peeked == s->cap) {
+      if (s->cap >= http_max_header_size(s))
+        return RESULT_HEADERS_TOO_LARGE;
+      s->read = 0;
+      if (http_state_grow(s) != 0)
+        return RESULT_OOM;
+      continue;
+    }
+    // only readable again once there is more than what was already peeked
+    int lowat = (int) peeked + 1, one = 1;
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    res = wait_upstream(fd, timeout);
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+    if (res != RESULT_OK)
+      return res;
+    waited = 1;
+  }
+}
+
+static size_t format_headers(const WebbRequest *head, char *buf) {
+  // the parser prepends headers, they are written back in the order the upstream sent them
+  const WebbHeaders *headers[MAX_HEADERS];
+  size_t n = 0, len = 0;
+  for (const WebbHeaders *h = head->headers; h && n < MAX_HEADERS; h = h->next) {
+    if (!skipped(RESPONSE_SKIPPED, h->key))
+      headers[n++] = h;
+  }
+  while (n--) {
+    size_t key_len = strlen(headers[n]->key), val_len = strlen(headers[n]->val);
+    if (buf) {
+      memcpy(buf + len, headers[n]->key, key_len);
+      memcpy(buf + len + key_len, ": ", 2);
+      memcpy(buf + len + key_len + 2, headers[n]->val, val_len);
+      memcpy(buf + len + key_len + 2 + val_len, "\r\n", 2);
+    }
+    len += key_len + val_len + 4;
+  }
+  if (buf)
+    buf[len] = '\0';
+  return len;
+}
+
+static WebbResult read_body(int fd, char *buf, size_t len, unsigned timeout) {
+  for (size_t nread = 0; nread < len;) {
+    ssize_t n = recv(fd, buf + nread, len - nread, 0);
+    if (n > 0) {
+      nread += (size_t) n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return RESULT_INVALID_HTTP;
+    WebbResult res = wait_upstream(fd, timeout);
+    if (res != RESULT_OK)
+      return res;
+  }
+  return RESULT_OK;
+}
+
+static WebbResult forward_response(
+  WebbProxy *proxy, ProxyWorker *worker, size_t upstream, int fd, const WebbRequest *req, WebbResponse *res) {
+  // on success the connection is owned by the response, released once the body was read from it
+  HttpParseState s = {.response = 1, .pool = &worker->bufs};
+  WebbRequest head = {0};
+  WebbResult result;
+  // interim responses (e.g 103 early hints) are dropped, only the final one is forwarded
+  do {
+    result = read_head(fd, &s, &head, proxy->timeout);
+  } while (result == RESULT_OK && s.status < 200 && s.status != 101);
+  http_state_free(&s);
+  const char *connection = webb_get_header(&head, "connection");
+  int keep_alive = !http_has_token(connection, "close");
+  int has_body = req->method != WEBB_HEAD && s.status != 204 && s.status != 304;
+  if (result == RESULT_OK && (s.status == 101 || !webb_status_str(s.status)))
+    result = RESULT_INVALID_HTTP;
+  // the body has to be delimited by its length, chunked bodies are not decoded
+  if (result == RESULT_OK && has_body
+      && (webb_get_header(&head, "transfer-encoding") || !webb_get_header(&head, "content-length")))
+    result = RESULT_INVALID_HTTP;
+  if (result != RESULT_OK) {
+    http_req_free(&head);
+    return result;
+  }
+
+  size_t body_len = has_body ? head.body_len : 0, head_len = format_headers(&head, NULL);
+  if (body_len > PROXY_MAX_COPY) {
+    ProxyStream *stream = malloc(sizeof(ProxyStream) + head_len + 1);
+    if (!stream) {
+      http_req_free(&head);
+      return RESULT_OOM;
+    }
+    *stream = (ProxyStream){.proxy = proxy, .worker = worker, .upstream = upstream, .keep_alive = keep_alive};
+    (void) format_headers(&head, stream->head);
+    res->raw_headers = stream->head;
+    webb_set_body_splice(res, fd, body_len, stream_done, stream);
+  } else {
+    // small enough to copy, the connection is free for the next request right away
+    char *buf = malloc(body_len + head_len + 1);
+    WebbShared *shared = buf ? webb_shared_new(buf, body_len) : NULL;
+    result = shared ? read_body(fd, buf, body_len, proxy->timeout) : RESULT_OOM;
+    if (result != RESULT_OK) {
+      if (shared)
+        webb_shared_release(shared);
+      else
+        free(buf);
+      http_req_free(&head);
+      return result;
+    }
+    (void) format_headers(&head, buf + body_len);
+    res->raw_headers = buf + body_len;
+    webb_set_body_shared(res, shared);
+    webb_shared_release(shared);
+    release_connection(proxy, worker, upstream, fd, keep_alive);
+  }
+  res->status = s.status;
+  http_req_free(&head);
+  return RESULT_OK;
+}
+
+WebbProxy *webb_proxy_new(const WebbProxyOptions *opts) {
+  size_t nupstreams = 0;
+  while (opts->upstreams && opts->upstreams[nupstreams])
+    nupstreams++;
+  if (!nupstreams) {
+    LOG("proxy has no upstreams");
+    return NULL;
+  }
+  WebbProxy *proxy = calloc(1, sizeof(WebbProxy));
+  if (!proxy)
+    return NULL;
+  proxy->balance = opts->balance;
+  proxy->max_idle = opts->max_idle ? opts->max_idle : PROXY_DEFAULT_MAX_IDLE;
+  proxy->timeout = opts->timeout ? opts->timeout : PROXY_DEFAULT_TIMEOUT;
+  proxy->upstreams = calloc(nupstreams, sizeof(Upstream));
+  if (!proxy->upstreams)
+    goto err;
+  proxy->nupstreams = nupstreams;
+  for (size_t i = 0; i < nupstreams; i++) {
+    if (resolve_upstream(opts->upstreams[i], &proxy->upstreams[i]) != 0)
+      goto err;
+  }
+  for (size_t w = 0; w < WORKERS; w++) {
+    ProxyWorker *worker = &proxy->workers[w];
+    worker->pools = calloc(nupstreams, sizeof(ProxyPool));
+    if (!worker->pools)
+      goto err;
+    for (size_t i = 0; i < nupstreams; i++) {
+      worker->pools[i].fds = malloc(proxy->max_idle * sizeof(int));
+      if (!worker->pools[i].fds)
+        goto err;
+    }
+  }
+  return proxy;
+
+err:
+  webb_proxy_free(proxy);
+  return NULL;
+}
+
+int webb_proxy_handle(WebbProxy *proxy, const WebbRequest *req, WebbResponse *res) {
+  ProxyWorker *worker = &proxy->workers[req->worker % WORKERS];
+  size_t upstream = pick_upstream(proxy, worker), head_len = 0, head_cap = 0;
+  __atomic_add_fetch(&proxy->upstreams[upstream].active, 1, __ATOMIC_RELAXED);
+  char *head = format_request(worker, req, &head_len, &head_cap);
+  WebbResult result = head ? RESULT_DISCONNECTED : RESULT_OOM;
+  for (int attempt = 0; head && attempt < 2; attempt++) {
+    int reused, fd = take_connection(proxy, worker, upstream, &reused);
+    if (fd == -1) {
+      result = errno == ETIMEDOUT ? RESULT_TIMEOUT : RESULT_DISCONNECTED;
+      break;
+    }
+    int more = req->body_len ? MSG_MORE : 0;
+    int sent = send_all(fd, head, head_len, more, proxy->timeout) == 0
+               && send_all(fd, req->body, req->body_len, 0, proxy->timeout) == 0;
+    result = sent ? forward_response(proxy, worker, upstream, fd, req, res)
+                  : errno == ETIMEDOUT ? RESULT_TIMEOUT : RESULT_DISCONNECTED;
+    if (result == RESULT_OK)
+      break;
+    (void) close(fd);
+    // a reused connection may have been closed by the upstream just as the request was sent. the request is
+    // sent again if it never reached the upstream, or if it can be repeated safely
+    int idempotent = req->method != WEBB_POST && req->method != WEBB_PATCH && req->method != WEBB_CONNECT;
+    if (!reused || result != RESULT_DISCONNECTED || (sent && !idempotent))
+      break;
+  }
+  buf_pool_put(&worker->bufs, head, head_cap);
+  if (result == RESULT_OK)
+    return res->status;
+  __atomic_sub_fetch(&proxy->upstreams[upstream].active, 1, __ATOMIC_RELAXED);
+  return result == RESULT_TIMEOUT ? 504 : 502;
+}
+
+void webb_proxy_free(WebbProxy *proxy) {
+  if (!proxy)
+    return;
+  for (size_t w = 0; w < WORKERS; w++) {
+    ProxyWorker *worker = &proxy->workers[w];
+    for (size_t i = 0; worker->pools && i < proxy->nupstreams; i++) {
+      for (size_t j = 0; j < worker->pools[i].nfds; j++)
+        (void) close(worker->pools[i].fds[j]);
+      free(worker->pools[i].fds);
+    }
+    free(worker->pools);
+    buf_pool_free(&worker->bufs);
+  }
+  free(proxy->upstreams);
+  free(proxy);
+}
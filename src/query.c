@@ -0,0 +1,132 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include "internal.h"
+#include "webb/webb.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// clang-format off
+static const signed char HEX_LOOKUP[256] = {
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+   0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+  -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+// clang-format on
+
+size_t uri_plain_len(const char *s, size_t len) {
+  // the length of the prefix that decodes to itself, 16 bytes are checked at a time where sse2 is available
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i percent = _mm_set1_epi8('%'), plus = _mm_set1_epi8('+');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, plus)));
+    if (mask)
+      return i + (size_t) __builtin_ctz((unsigned) mask);
+  }
+#endif
+  while (i < len && s[i] != '%' && s[i] != '+')
+    i++;
+  return i;
+}
+
+static int decode_char(const char *s, size_t len, size_t *i) {
+  // decodes the character at *i and moves past it, -1 for invalid escapes
+  char c = s[(*i)++];
+  if (c == '+')
+    return ' ';
+  if (c != '%')
+    return (unsigned char) c;
+  if (*i + 2 > len)
+    return -1;
+  int a = HEX_LOOKUP[(unsigned char) s[*i]], b = HEX_LOOKUP[(unsigned char) s[*i + 1]];
+  *i += 2;
+  return a < 0 || b < 0 ? -1 : (a << 4) | b;
+}
+
+ssize_t uri_decode_to(const char *s, size_t len, char *dst, size_t cap) {
+  // plain runs are copied as is, so only the escapes are decoded a character at a time
+  size_t n = 0;
+  for (size_t i = 0; i < len;) {
+    size_t plain = uri_plain_len(s + i, len - i);
+    if (n + plain >= cap)
+      return -1;
+    memcpy(dst + n, s + i, plain);
+    n += plain;
+    i += plain;
+    if (i == len)
+      break;
+    int c = decode_char(s, len, &i);
+    if (c < 0 || n + 1 >= cap)
+      return -1;
+    dst[n++] = (char) c;
+  }
+  if (n >= cap)
+    return -1;
+  dst[n] = '\0';
+  return (ssize_t) n;
+}
+
+static int slice_equals(const WebbSlice *slice, const char *s) {
+  // compares the decoded slice to s, without decoding it anywhere
+  size_t plain = uri_plain_len(slice->ptr, slice->len);
+  if (strncmp(slice->ptr, s, plain) != 0)
+    return 0;
+  s += plain;
+  for (size_t i = plain; i < slice->len; s++) {
+    int c = decode_char(slice->ptr, slice->len, &i);
+    if (c <= 0 || c != (unsigned char) *s)
+      return 0;
+  }
+  return *s == '\0';
+}
+
+int webb_query_next(const WebbRequest *req, size_t *pos, WebbQueryParam *param) {
+  const char *query = req->query;
+  if (!query)
+    return 1;
+  size_t len = strlen(query);
+  // empty parameters (e.g "a=1&&b=2") are skipped
+  while (*pos < len && query[*pos] == '&')
+    (*pos)++;
+  if (*pos >= len)
+    return 1;
+  const char *start = query + *pos, *end = memchr(start, '&', len - *pos);
+  if (!end)
+    end = query + len;
+  const char *eq = memchr(start, '=', (size_t) (end - start));
+  param->key = (WebbSlice){.ptr = start, .len = (size_t) ((eq ? eq : end) - start)};
+  param->value = eq ? (WebbSlice){.ptr = eq + 1, .len = (size_t) (end - eq - 1)} : (WebbSlice){.ptr = end, .len = 0};
+  *pos = (size_t) (end - query);
+  return 0;
+}
+
+int webb_query_get(const WebbRequest *req, const char *name, WebbSlice *value) {
+  WebbQueryParam param;
+  for (size_t pos = 0; webb_query_next(req, &pos, &param) == 0;) {
+    if (slice_equals(&param.key, name)) {
+      *value = param.value;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+ssize_t webb_query_decode(const WebbSlice *slice, char *buf, size_t len) {
+  return uri_decode_to(slice->ptr, slice->len, buf, len);
+}
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+int out_queue_push(OutQueue *queue, WebbShared *shared, size_t offset, size_t len) {
+  // a new reference to shared is queued, so the same buffer can wait on any number of sockets
+  if (!len)
+    return 0;
+  OutChunk *chunk = malloc(sizeof(OutChunk));
+  if (!chunk)
+    return 1;
+  *chunk = (OutChunk){.shared = webb_shared_ref(shared), .offset = offset, .len = len};
+  if (queue->tail)
+    queue->tail->next = chunk;
+  else
+    queue->head = chunk;
+  queue->tail = chunk;
+  queue->bytes += len;
+  return 0;
+}
+
+static void consume(OutQueue *queue, size_t sent) {
+  queue->bytes -= sent;
+  while (sent) {
+    OutChunk *chunk = queue->head;
+    if (sent < chunk->len) {
+      chunk->offset += sent;
+      chunk->len -= sent;
+      return;
+    }
+    sent -= chunk->len;
+    queue->head = chunk->next;
+    webb_shared_release(chunk->shared);
+    free(chunk);
+  }
+  if (!queue->head)
+    queue->tail = NULL;
+}
+
+int out_queue_flush(OutQueue *queue, int fd) {
+  // as much as the socket takes, many chunks per call. returns non-zero on errors, what is left stays queued
+  while (queue->head) {
+    struct iovec iov[OUT_QUEUE_IOVECS];
+    size_t n = 0, len;
+    for (OutChunk *chunk = queue->head; chunk && n < OUT_QUEUE_IOVECS; chunk = chunk->next, n++) {
+      const char *data = webb_shared_data(chunk->shared, &len);
+      iov[n].iov_base = (void *) (uintptr_t) (data + chunk->offset);
+      iov[n].iov_len = chunk->len;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno != EAGAIN && errno != EWOULDBLOCK;
+    }
+    consume(queue, (size_t) sent);
+  }
+  return 0;
+}
+
+void out_queue_free(OutQueue *queue) {
+  consume(queue, queue->bytes);
+}
@@ -0,0 +1,471 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+#define ROUTER_METHODS (WEBB_TRACE + 1)
+
+typedef struct Route {
+  WebbRouteHandler *handler;
+  char **names;
+  // the path segment each parameter matches, a wildcard matching its segment and the rest of the path
+  size_t segments[WEBB_MAX_ROUTE_PARAMS];
+  size_t nparams;
+  int wildcard;
+} Route;
+
+typedef struct RouteNode {
+  // the static path segment leading to this node, NULL for param nodes
+  char *segment;
+  size_t len;
+  struct RouteNode *children;
+  struct RouteNode *next;
+  // the child matching any non-empty segment
+  struct RouteNode *param;
+  // routes ending at this node, and routes with a final wildcard after it
+  Route routes[ROUTER_METHODS];
+  Route wildcard[ROUTER_METHODS];
+  int has_wildcard;
+} RouteNode;
+
+// a route pattern still matching the path so far: a node, or the wildcard after it
+typedef struct Candidate {
+  const RouteNode *node;
+  int wildcard;
+} Candidate;
+
+typedef struct Transition {
+  const char *segment;
+  size_t len;
+  struct MatchState *state;
+} Transition;
+
+// the candidates after some path segments, ordered by precedence. states are built once for every distinct list
+// of candidates, so a path is matched with a single transition per segment
+typedef struct MatchState {
+  Candidate *candidates;
+  size_t ncandidates;
+  uint64_t hash;
+  // transitions on the static segments of the candidates, open addressing
+  Transition *table;
+  size_t table_size;
+  struct MatchState *empty;
+  struct MatchState *other;
+  // the route of the first candidate allowing each method when the path ends here, and all methods allowed
+  const Route *routes[ROUTER_METHODS];
+  unsigned allowed;
+  struct MatchState *chain;
+  struct MatchState *pending;
+  struct MatchState *next;
+} MatchState;
+
+typedef struct Matcher {
+  pthread_mutex_t lock;
+  MatchState *start;
+  MatchState *states;
+} Matcher;
+
+struct WebbRouter {
+  RouteNode root;
+  // compiled on the first dispatch, dropped when routes are added
+  Matcher *matcher;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+  // fnv-1a
+  for (size_t i = 0; i < len; i++) {
+    hash ^= ((const unsigned char *) data)[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void route_free(Route *route) {
+  for (char **name = route->names; name && *name; name++)
+    free(*name);
+  free(route->names);
+}
+
+static void node_free(RouteNode *node) {
+  while (node->children) {
+    RouteNode *child = node->children;
+    node->children = child->next;
+    node_free(child);
+    free(child);
+  }
+  if (node->param) {
+    node_free(node->param);
+    free(node->param);
+  }
+  for (size_t i = 0; i < ROUTER_METHODS; i++) {
+    route_free(&node->routes[i]);
+    route_free(&node->wildcard[i]);
+  }
+  free(node->segment);
+}
+
+static void matcher_reset(Matcher *matcher) {
+  while (matcher->states) {
+    MatchState *state = matcher->states;
+    matcher->states = state->next;
+    free(state->candidates);
+    free(state->table);
+    free(state);
+  }
+  matcher->start = NULL;
+}
+
+static RouteNode *static_child(const RouteNode *node, const char *segment, size_t len) {
+  for (RouteNode *child = node->children; child; child = child->next) {
+    if (child->len == len && memcmp(child->segment, segment, len) == 0)
+      return child;
+  }
+  return NULL;
+}
+
+static RouteNode *insert_child(RouteNode *node, const char *segment, size_t len) {
+  RouteNode **slot = &node->param;
+  if (*segment != ':') {
+    RouteNode *child = static_child(node, segment, len);
+    if (child)
+      return child;
+    for (slot = &node->children; *slot; slot = &(*slot)->next)
+      ;
+  }
+  if (!*slot) {
+    *slot = calloc(1, sizeof(RouteNode));
+    if (*slot && *segment != ':' && !((*slot)->segment = strndup(segment, len))) {
+      free(*slot);
+      *slot = NULL;
+    }
+    if (*slot)
+      (*slot)->len = len;
+  }
+  return *slot;
+}
+
+WebbRouter *webb_router_new(void) {
+  WebbRouter *router = calloc(1, sizeof(WebbRouter));
+  if (!router)
+    return NULL;
+  router->matcher = calloc(1, sizeof(Matcher));
+  if (!router->matcher) {
+    free(router);
+    return NULL;
+  }
+  (void) pthread_mutex_init(&router->matcher->lock, NULL);
+  return router;
+}
+
+int webb_router_add(WebbRouter *router, WebbMethod method, const char *pattern, WebbRouteHandler *handler) {
+  if ((size_t) method >= ROUTER_METHODS || !handler || pattern[0] != '/') {
+    LOG("invalid route: %s", pattern);
+    return 1;
+  }
+  // one segment at a time, parameters and wildcards taking whole segments
+  Route route = {.handler = handler};
+  const char *names[WEBB_MAX_ROUTE_PARAMS];
+  RouteNode *node = &router->root;
+  int wildcard = 0;
+  size_t index = 0;
+  for (const char *s = pattern + 1; node; s += strcspn(s, "/") + 1, index++) {
+    size_t len = strcspn(s, "/");
+    int dynamic = *s == ':' || *s == '*';
+    if (memchr(s + 1, ':', len ? len - 1 : 0) || memchr(s + 1, '*', len ? len - 1 : 0) || (dynamic && len < 2)
+        || (dynamic && route.nparams == WEBB_MAX_ROUTE_PARAMS) || (*s == '*' && s[len])) {
+      LOG("invalid route: %s", pattern);
+      return 1;
+    }
+    if (dynamic) {
+      names[route.nparams] = s + 1;
+      route.segments[route.nparams++] = index;
+    }
+    if (*s == '*') {
+      wildcard = 1;
+      break;
+    }
+    node = insert_child(node, s, len);
+    if (!s[len])
+      break;
+  }
+  if (!node)
+    return 1;
+  Route *slot = wildcard ? &node->wildcard[method] : &node->routes[method];
+  if (slot->handler) {
+    LOG("duplicate route: %s %s", webb_method_str(method), pattern);
+    return 1;
+  }
+
+  route.names = calloc(route.nparams + 1, sizeof(char *));
+  if (!route.names)
+    return 1;
+  for (size_t i = 0; i < route.nparams; i++) {
+    route.names[i] = strndup(names[i], strcspn(names[i], "/"));
+    if (!route.names[i]) {
+      route_free(&route);
+      return 1;
+    }
+  }
+  route.wildcard = wildcard;
+  *slot = route;
+  node->has_wildcard |= wildcard;
+  matcher_reset(router->matcher);
+  return 0;
+}
+
+typedef struct Compiler {
+  Matcher *matcher;
+  // every state built, by their candidates
+  MatchState **buckets;
+  size_t nbuckets;
+  size_t nstates;
+  // states whose transitions are still to be built
+  MatchState *pending;
+  Candidate *scratch;
+  size_t scratch_cap;
+} Compiler;
+
+static int candidates_equal(const Candidate *a, const Candidate *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (a[i].node != b[i].node || a[i].wildcard != b[i].wildcard)
+      return 0;
+  }
+  return 1;
+}
+
+static MatchState *intern(Compiler *c, const Candidate *candidates, size_t n, int *err) {
+  // the state for a list of candidates, built once. NULL for an empty list, matching nothing
+  if (!n)
+    return NULL;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; i++) {
+    hash = hash_bytes(hash, &candidates[i].node, sizeof(candidates[i].node));
+    hash = hash_bytes(hash, &candidates[i].wildcard, sizeof(candidates[i].wildcard));
+  }
+  MatchState **bucket = &c->buckets[hash & (c->nbuckets - 1)];
+  for (MatchState *state = *bucket; state; state = state->chain) {
+    if (state->hash == hash && state->ncandidates == n && candidates_equal(state->candidates, candidates, n))
+      return state;
+  }
+  MatchState *state = calloc(1, sizeof(MatchState));
+  if (state)
+    state->candidates = malloc(n * sizeof(Candidate));
+  if (!state || !state->candidates) {
+    free(state);
+    *err = 1;
+    return NULL;
+  }
+  memcpy(state->candidates, candidates, n * sizeof(Candidate));
+  state->ncandidates = n;
+  state->hash = hash;
+  state->chain = *bucket;
+  *bucket = state;
+  state->next = c->matcher->states;
+  c->matcher->states = state;
+  c->nstates++;
+  state->pending = c->pending;
+  c->pending = state;
+  return state;
+}
+
+static int grow_buckets(Compiler *c) {
+  size_t nbuckets = c->nbuckets * 2;
+  MatchState **buckets = calloc(nbuckets, sizeof(MatchState *));
+  if (!buckets)
+    return 1;
+  for (size_t i = 0; i < c->nbuckets; i++) {
+    for (MatchState *state = c->buckets[i], *chain; state; state = chain) {
+      chain = state->chain;
+      state->chain = buckets[state->hash & (nbuckets - 1)];
+      buckets[state->hash & (nbuckets - 1)] = state;
+    }
+  }
+  free(c->buckets);
+  c->buckets = buckets;
+  c->nbuckets = nbuckets;
+  return 0;
+}
+
+static MatchState *step(Compiler *c, const MatchState *state, const char *segment, size_t len, int *err) {
+  // the candidates after one more segment, NULL for a segment that is none of the candidates' static ones. each
+  // candidate is followed by its static child, its parameter and its wildcard, which keeps them in precedence
+  size_t n = 0, cap = state->ncandidates * 3;
+  if (cap > c->scratch_cap) {
+    Candidate *scratch = realloc(c->scratch, cap * sizeof(Candidate));
+    if (!scratch) {
+      *err = 1;
+      return NULL;
+    }
+    c->scratch = scratch;
+    c->scratch_cap = cap;
+  }
+  for (size_t i = 0; i < state->ncandidates; i++) {
+    const Candidate *candidate = &state->candidates[i];
+    const RouteNode *node = candidate->node, *child = segment ? static_child(node, segment, len) : NULL;
+    if (candidate->wildcard) {
+      c->scratch[n++] = *candidate;
+      continue;
+    }
+    if (child)
+      c->scratch[n++] = (Candidate){.node = child};
+    if (node->param && (!segment || len))
+      c->scratch[n++] = (Candidate){.node = node->param};
+    if (node->has_wildcard)
+      c->scratch[n++] = (Candidate){.node = node, .wildcard = 1};
+  }
+  return intern(c, c->scratch, n, err);
+}
+
+static Transition *add_transition(MatchState *state, const char *segment, size_t len) {
+  // NULL if the segment already has one
+  size_t i = hash_bytes(14695981039346656037ULL, segment, len) & (state->table_size - 1);
+  for (; state->table[i].segment; i = (i + 1) & (state->table_size - 1)) {
+    if (state->table[i].len == len && memcmp(state->table[i].segment, segment, len) == 0)
+      return NULL;
+  }
+  state->table[i] = (Transition){.segment = segment, .len = len};
+  return &state->table[i];
+}
+
+static int build_state(Compiler *c, MatchState *state) {
+  size_t nkeys = 0;
+  for (size_t i = 0; i < state->ncandidates; i++) {
+    const Candidate *candidate = &state->candidates[i];
+    const Route *routes = candidate->wildcard ? candidate->node->wildcard : candidate->node->routes;
+    for (size_t m = 0; m < ROUTER_METHODS; m++) {
+      if (routes[m].handler && !state->routes[m])
+        state->routes[m] = &routes[m];
+      state->allowed |= routes[m].handler ? 1u << m : 0;
+    }
+    for (const RouteNode *child = candidate->wildcard ? NULL : candidate->node->children; child; child = child->next)
+      nkeys++;
+  }
+  int err = 0;
+  if (nkeys) {
+    for (state->table_size = 1; state->table_size < nkeys * 2;)
+      state->table_size *= 2;
+    state->table = calloc(state->table_size, sizeof(Transition));
+    if (!state->table)
+      return 1;
+  }
+  for (size_t i = 0; i < state->ncandidates && !err; i++) {
+    const Candidate *candidate = &state->candidates[i];
+    for (const RouteNode *child = candidate->wildcard ? NULL : candidate->node->children; child && !err;
+         child = child->next) {
+      // the empty segment has its own transition
+      Transition *transition = child->len ? add_transition(state, child->segment, child->len) : NULL;
+      if (transition)
+        transition->state = step(c, state, child->segment, child->len, &err);
+    }
+  }
+  if (!err)
+    state->empty = step(c, state, "", 0, &err);
+  if (!err)
+    state->other = step(c, state, NULL, 0, &err);
+  return err;
+}
+
+static MatchState *compile(Matcher *matcher, const RouteNode *root) {
+  Compiler c = {.matcher = matcher, .nbuckets = 64};
+  c.buckets = calloc(c.nbuckets, sizeof(MatchState *));
+  Candidate start = {.node = root};
+  int err = !c.buckets;
+  MatchState *state = err ? NULL : intern(&c, &start, 1, &err);
+  while (!err && c.pending) {
+    MatchState *pending = c.pending;
+    c.pending = pending->pending;
+    err = build_state(&c, pending) != 0 || (c.nstates > c.nbuckets && grow_buckets(&c) != 0);
+  }
+  free(c.buckets);
+  free(c.scratch);
+  if (err) {
+    LOG("failed to compile routes");
+    matcher_reset(matcher);
+    return NULL;
+  }
+  return state;
+}
+
+static const MatchState *next_state(const MatchState *state, const char *segment, size_t len) {
+  if (!len)
+    return state->empty;
+  if (state->table_size) {
+    size_t i = hash_bytes(14695981039346656037ULL, segment, len) & (state->table_size - 1);
+    for (; state->table[i].segment; i = (i + 1) & (state->table_size - 1)) {
+      if (state->table[i].len == len && memcmp(state->table[i].segment, segment, len) == 0)
+        return state->table[i].state;
+    }
+  }
+  return state->other;
+}
+
+static int method_not_allowed(unsigned allowed, WebbResponse *res) {
+  char allow[128] = "", *s = allow;
+  for (int m = 0; m < ROUTER_METHODS; m++) {
+    if (allowed & 1u << m)
+      s += sprintf(s, "%s%s", s == allow ? "" : ", ", webb_method_str((WebbMethod) m));
+  }
+  char *val = strdup(allow);
+  if (val)
+    webb_set_header(res, "allow", val);
+  return 405;
+}
+
+int webb_router_dispatch(const WebbRouter *router, const WebbRequest *req, WebbResponse *res) {
+  Matcher *matcher = router->matcher;
+  const MatchState *state = __atomic_load_n(&matcher->start, __ATOMIC_ACQUIRE);
+  if (!state) {
+    (void) pthread_mutex_lock(&matcher->lock);
+    if (!matcher->start)
+      __atomic_store_n(&matcher->start, compile(matcher, &router->root), __ATOMIC_RELEASE);
+    state = matcher->start;
+    (void) pthread_mutex_unlock(&matcher->lock);
+    if (!state)
+      return -1;
+  }
+  if (req->uri[0] != '/')
+    return 404;
+  for (const char *s = req->uri + 1; state; s += strcspn(s, "/") + 1) {
+    size_t len = strcspn(s, "/");
+    state = next_state(state, s, len);
+    if (!s[len])
+      break;
+  }
+  if (!state)
+    return 404;
+  const Route *route = (size_t) req->method < ROUTER_METHODS ? state->routes[req->method] : NULL;
+  if (!route)
+    return state->allowed ? method_not_allowed(state->allowed, res) : 404;
+
+  // the parameters are picked from the path by segment, the last one of a wildcard taking the rest
+  WebbRouteParams params = {.len = route->nparams, .names = (const char *const *) route->names};
+  const char *s = req->uri + 1;
+  for (size_t i = 0, index = 0; i < route->nparams; s += strcspn(s, "/") + 1, index++) {
+    if (route->segments[i] != index)
+      continue;
+    size_t len = route->wildcard && i == route->nparams - 1 ? strlen(s) : strcspn(s, "/");
+    params.values[i++] = (WebbSlice){.ptr = s, .len = len};
+  }
+  return route->handler(req, &params, res);
+}
+
+const WebbSlice *webb_route_param(const WebbRouteParams *params, const char *name) {
+  for (size_t i = 0; i < params->len; i++) {
+    if (strcmp(params->names[i], name) == 0)
+      return &params->values[i];
+  }
+  return NULL;
+}
+
+void webb_router_free(WebbRouter *router) {
+  if (!router)
+    return;
+  node_free(&router->root);
+  matcher_reset(router->matcher);
+  (void) pthread_mutex_destroy(&router->matcher->lock);
+  free(router->matcher);
+  free(router);
+}
@@ -1,11 +1,23 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -13,19 +25,189 @@
 #include "internal.h"
 #include "webb/webb.h"
 
+#define ACCEPT_BACKOFF_MS 1
+#define LOAD_WINDOW_NS    (10 * 1000 * 1000)  // 10ms
+#define LOAD_BUSY_LEVELS  16
+#define SHED_LINGER_NS    (200 * 1000 * 1000)  // 200ms
+#define SHED_LINGER_MAX   64
+#define ZEROCOPY_DRAIN_NS (5ULL * 1000 * 1000 * 1000)  // 5s
+
+struct WebbShared {
+  size_t refs;
+  char *buf;
+  size_t len;
+  // unmapped instead of freed
+  int mapped;
+};
+
+// connections shed with a 503, their write side shut down. they are kept open for a while so the request the
+// client is still sending does not make close reset the connection before the client read the response
+typedef struct ShedQueue {
+  int fds[SHED_LINGER_MAX];
+  uint64_t deadlines[SHED_LINGER_MAX];
+  size_t head;
+  size_t len;
+} ShedQueue;
+
+typedef struct Server {
+  const WebbServerOptions *opts;
+  size_t nworkers;
+  size_t active;
+  uint64_t load_updated_ns;
+  // sent as is to connections shed under load, without allocating
+  char overload_res[128];
+  size_t overload_res_len;
+  // shared by all workers, and the response sent as is to requests over the limit
+  RateLimiter limiter;
+  char limited_res[128];
+  size_t limited_res_len;
+} Server;
+
 typedef struct ThreadPayload {
   pthread_t tid;
   EPollEventLoop ev;
   WebbHandler *handler_fn;
+  AccessLogRing *access_log;
+  BufPool pool;
+  Server *server;
+  size_t active;
+  // the worker's index and the data returned by worker_init, owned by the worker thread
+  size_t index;
+  void *data;
+  // time spent handling events in the LOAD_WINDOW_NS window the last batch ended in (busy_window being its
+  // number) and in the window before it, and when the batch currently being handled started (0 when idle)
+  uint64_t busy_window;
+  uint64_t busy_ns;
+  uint64_t busy_prev_ns;
+  uint64_t busy_since;
+  // sampled by the acceptor only, the busy fraction over the last windows
+  unsigned busy;
+  // the worker's own listener when workers are pinned or the server is embedded, otherwise -1, and the
+  // connections it shed
+  int listener;
+  ShedQueue shed;
+  // only tracked for embedded servers, threaded workers run until the process exits
+  int track_connections;
+  struct Connection *connections;
+  // closed during the batch of events being handled, which may still hold events for them, and closed with
+  // zero copy sends in flight, waiting for them to complete
+  struct Connection *closed;
+  struct Connection *draining;
+  // handler coroutines, and the fds they wait on. waits is registered in ev, data being the waiting connection
+  CoroutinePool coroutines;
+  EPollEventLoop waits;
 } ThreadPayload;
 
+struct WebbServer {
+  WebbServerOptions opts;
+  Server server;
+  ThreadPayload worker;
+  AccessLog access_log;
+};
+
+// a body sent with MSG_ZEROCOPY, kept until the kernel reports the last send using it as completed
+typedef struct ZeroCopyBody {
+  WebbBody body;
+  int used;
+  uint32_t last;
+  struct ZeroCopyBody *next;
+} ZeroCopyBody;
+
 typedef struct Connection {
   int fd;
+  ThreadPayload *payload;
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
   WebbRequest req;
   HttpParseState state;
+  // the response being sent and when its request was parsed. a response that cannot be sent without
+  // blocking is kept, with the request, until the socket is writable again
+  WebbResponse res;
+  struct timespec start;
+  int writing;
+  // the coroutine of a handler waiting on an fd, and set when the connection closed meanwhile
+  Coroutine *coro;
+  int closing;
+  // bytes to send before the rest of the body (e.g the unsent part of the head), and the part of the
+  // body already sent or moved to out
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t body_sent;
+  // set when the connection is closed once the response is sent, which says so in its connection header
+  int close_after;
+  // zero copy sends, 1 once enabled on the socket and -1 when unsupported or the kernel copies anyway (e.g
+  // loopback). sends are numbered by the kernel, next being the next one's id and done the number completed.
+  // zc_body is set once the current body was sent with zero copy, completed bodies wait in zc_bodies
+  int zerocopy;
+  uint32_t zc_next;
+  uint32_t zc_done;
+  ZeroCopyBody *zc_body;
+  ZeroCopyBody *zc_bodies;
+  ZeroCopyBody *zc_tail;
+  // splice bodies move through a pipe opened on first use, piped being the bytes in it. while the body's
+  // source has nothing to read it is watched in waits, splice_wait being that fd (otherwise -1)
+  int pipe[2];
+  size_t piped;
+  int splice_wait;
+  // set once the connection was upgraded, its socket then only carries websocket frames
+  WebbWebSocket *ws;
+  // set once the connection was subscribed to server-sent events, it then only carries them
+  WebbSseSubscriber *sse;
+  // set once the connection switched to http/2, by prior knowledge or an h2c upgrade
+  H2Session *h2;
+  // linked into the connections of an embedded server, to be closed when it is freed, or once closed into
+  // the worker's draining connections
+  struct Connection *prev;
+  struct Connection *next;
+  // set once closed while the kernel still sends from zero copy bodies, until when it may take
+  uint64_t drain_until;
+  // set once closed, the connection is then only kept until the end of the batch
+  int closed;
+  struct Connection *next_closed;
 } Connection;
 
-static int open_server_socket(const char *port) {
+typedef enum SendResult {
+  SEND_DONE,
+  SEND_BLOCKED,
+  SEND_FAILED,
+  // nothing sent yet, the handler is waiting on an fd
+  SEND_WAITING,
+} SendResult;
+
+#define SET_SOCKOPT(fd, level, name, val) set_int_option(fd, level, name, #name, val)
+
+static int set_int_option(int fd, int level, int name, const char *name_str, int val) {
+  if (setsockopt(fd, level, name, &val, sizeof(val)) == -1) {
+    LOG("setsockopt(%s): %s", name_str, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static int set_listener_options(int fd, const WebbServerOptions *opts, int reuseport) {
+  // buffer sizes, nodelay and busy polling are inherited by accepted sockets. buffer sizes have to be
+  // set before listening to be taken into account for the tcp window scale
+  if (SET_SOCKOPT(fd, SOL_SOCKET, SO_REUSEADDR, 1) != 0)
+    return 1;
+  if (reuseport && SET_SOCKOPT(fd, SOL_SOCKET, SO_REUSEPORT, 1) != 0)
+    return 1;
+  if (!opts->disable_nodelay && SET_SOCKOPT(fd, IPPROTO_TCP, TCP_NODELAY, 1) != 0)
+    return 1;
+  if (opts->defer_accept && SET_SOCKOPT(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts->defer_accept) != 0)
+    return 1;
+  if (opts->fastopen_queue && SET_SOCKOPT(fd, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen_queue) != 0)
+    return 1;
+  if (opts->busy_poll_us && SET_SOCKOPT(fd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll_us) != 0)
+    return 1;
+  if (opts->send_buffer_size && SET_SOCKOPT(fd, SOL_SOCKET, SO_SNDBUF, opts->send_buffer_size) != 0)
+    return 1;
+  if (opts->recv_buffer_size && SET_SOCKOPT(fd, SOL_SOCKET, SO_RCVBUF, opts->recv_buffer_size) != 0)
+    return 1;
+  return 0;
+}
+
+static int open_server_socket(const char *port, const WebbServerOptions *opts, int reuseport) {
   struct addrinfo *servinfo = NULL;
   struct addrinfo hints = {
     .ai_family = AF_UNSPEC,
@@ -43,9 +225,9 @@ static int open_server_socket(const char *port) {
     int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
     if (fd == -1)
       continue;
-    int yes = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-      LOG_ERRNO("setsockopt");
+    if (set_listener_options(fd, opts, reuseport) != 0) {
+      close(fd);
+      freeaddrinfo(servinfo);
       return -1;
     }
     if (bind(fd, info->ai_addr, info->ai_addrlen) == -1) {
@@ -68,65 +250,238 @@ static int open_server_socket(const char *port) {
   return sockfd;
 }
 
-static int send_all(int fd, const char *buf, size_t len) {
-  for (ssize_t sent = -1; len; buf += sent, len -= sent) {
-    sent = send(fd, buf, len, 0);
+static SendResult send_buf(int fd, const char *buf, size_t len, size_t *sent) {
+  while (*sent < len) {
+    ssize_t n = send(fd, buf + *sent, len - *sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SEND_BLOCKED;
+      LOG_ERRNO("send");
+      return SEND_FAILED;
+    }
+    *sent += n;
+  }
+  return SEND_DONE;
+}
+
+static SendResult stash_output(Connection *conn, const char *buf, size_t len) {
+  conn->out = malloc(len);
+  if (!conn->out) {
+    LOG("failed to allocate output buffer");
+    return SEND_FAILED;
+  }
+  memcpy(conn->out, buf, len);
+  conn->out_len = len;
+  conn->out_sent = 0;
+  return SEND_BLOCKED;
+}
+
+static SendResult send_fd_copy(Connection *conn, int src, size_t offset, size_t len) {
+  // fallback for fds sendfile cannot handle, e.g pipes. those are not seekable so lseek failing is fine.
+  // what was read but could not be sent is stashed, as the source cannot be read again
+  char buf[65536];
+  if (offset != 0)
+    (void) lseek(src, (off_t) offset, SEEK_SET);
+  while (conn->body_sent < len) {
+    size_t left = len - conn->body_sent;
+    ssize_t nread = read(src, buf, sizeof(buf) < left ? sizeof(buf) : left);
+    if (nread < 1)
+      return SEND_FAILED;
+    conn->body_sent += nread;
+    size_t sent = 0;
+    SendResult res = send_buf(conn->fd, buf, (size_t) nread, &sent);
+    if (res == SEND_BLOCKED)
+      return stash_output(conn, buf + sent, (size_t) nread - sent);
+    if (res != SEND_DONE)
+      return res;
+  }
+  return SEND_DONE;
+}
+
+static SendResult send_fd(Connection *conn, int src, size_t offset, size_t len) {
+  // sendfile copies directly from the page cache, never touching user space
+  while (conn->body_sent < len) {
+    off_t pos = (off_t) (offset + conn->body_sent);
+    ssize_t sent = sendfile(conn->fd, src, &pos, len - conn->body_sent);
     if (sent == -1) {
-      if (errno == EWOULDBLOCK) {
-        LOG("writing would block!");
+      if (errno == EINVAL || errno == ESPIPE || errno == ENOSYS)
+        return send_fd_copy(conn, src, offset + conn->body_sent, len);
+      if (errno == EINTR)
         continue;
-      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SEND_BLOCKED;
+      LOG_ERRNO("sendfile");
+      return SEND_FAILED;
+    }
+    if (sent == 0)
+      return SEND_FAILED;
+    conn->body_sent += sent;
+  }
+  return SEND_DONE;
+}
+
+static int use_zerocopy(Connection *conn, size_t len) {
+  size_t threshold = conn->payload->server->opts->zerocopy_threshold;
+  if (!threshold || len < threshold || conn->zerocopy == -1)
+    return 0;
+  if (!conn->zerocopy) {
+    int one = 1;
+    conn->zerocopy = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+  }
+  // the body is only freed once completed, which needs somewhere to keep it
+  if (conn->zerocopy == 1 && !conn->zc_body)
+    conn->zc_body = calloc(1, sizeof(ZeroCopyBody));
+  return conn->zerocopy == 1 && conn->zc_body;
+}
+
+static SendResult send_buf_zerocopy(Connection *conn, const char *buf, size_t len) {
+  // the kernel pins the pages of buf instead of copying them, each send that sent anything gets an id
+  while (conn->body_sent < len) {
+    ssize_t n = send(conn->fd, buf + conn->body_sent, len - conn->body_sent, MSG_NOSIGNAL | MSG_ZEROCOPY);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SEND_BLOCKED;
+      // too many sends awaiting completion, copy this time
+      if (errno == ENOBUFS)
+        return send_buf(conn->fd, buf, len, &conn->body_sent);
       LOG_ERRNO("send");
-      return 1;
+      return SEND_FAILED;
     }
+    conn->zc_body->used = 1;
+    conn->zc_body->last = conn->zc_next++;
+    conn->body_sent += n;
   }
-  return 0;
+  return SEND_DONE;
+}
+
+static SendResult send_mem(Connection *conn, const char *buf, size_t len) {
+  if (use_zerocopy(conn, len))
+    return send_buf_zerocopy(conn, buf, len);
+  return send_buf(conn->fd, buf, len, &conn->body_sent);
+}
+
+static SendResult send_splice(Connection *conn, WebbBody *body) {
+  // moved from the source to the pipe and from the pipe to the socket, never touching user space. the pipe
+  // is only refilled once drained, so a full pipe never blocks the source
+  ThreadPayload *payload = conn->payload;
+  int src = body->body.splice.fd;
+  if (conn->splice_wait != -1) {
+    (void) ev_unwatch(&payload->waits, conn->splice_wait);
+    conn->splice_wait = -1;
+  }
+  if (conn->pipe[0] == -1 && pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    LOG_ERRNO("pipe2");
+    return SEND_FAILED;
+  }
+  while (conn->body_sent < body->len) {
+    int from = conn->piped ? conn->pipe[0] : src, to = conn->piped ? conn->fd : conn->pipe[1];
+    size_t len = conn->piped ? conn->piped : body->len - body->offset;
+    ssize_t n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_ERRNO("splice");
+        return SEND_FAILED;
+      }
+      if (conn->piped)
+        return SEND_BLOCKED;
+      if (ev_watch(&payload->waits, src, EVENT_READ, conn) != 0) {
+        LOG_ERRNO("epoll_ctl");
+        return SEND_FAILED;
+      }
+      conn->splice_wait = src;
+      return SEND_BLOCKED;
+    }
+    // the source ended before the whole body
+    if (n == 0)
+      return SEND_FAILED;
+    if (conn->piped) {
+      conn->piped -= (size_t) n;
+      conn->body_sent += (size_t) n;
+    } else {
+      conn->piped = (size_t) n;
+      body->offset += (size_t) n;
+    }
+  }
+  return SEND_DONE;
 }
 
-static int send_body(int fd, const WebbBody *body) {
+static SendResult send_body(Connection *conn, WebbBody *body) {
   switch (body->type) {
   case WEBB_BODY_NULL:
-    return 0;
+    return SEND_DONE;
   case WEBB_BODY_ALLOCATED:  // fallthrough
   case WEBB_BODY_STATIC:
-    return send_all(fd, body->body.buf, body->len);
-  case WEBB_BODY_FD: {
-    char buf[65536];
-    for (size_t left = body->len; left;) {
-      ssize_t nread = read(body->body.fd, buf, sizeof(buf) < left ? sizeof(buf) : left);
-      if (nread < 1)
-        return 1;
-      if (send_all(fd, buf, (size_t) nread) != 0)
-        return 1;
-      left -= nread;
-    }
-    return 0;
-  }
+  case WEBB_BODY_MMAP:
+    return send_mem(conn, body->body.buf, body->len);
+  case WEBB_BODY_SHARED:
+    return send_mem(conn, body->body.shared->buf, body->len);
+  case WEBB_BODY_FD:
+    return send_fd(conn, body->body.fd, body->offset, body->len);
+  case WEBB_BODY_SPLICE:
+    return send_splice(conn, body);
   default:
-    return 1;
+    return SEND_FAILED;
   }
 }
 
-static int send_response(int fd, const WebbResponse *res) {
+static SendResult send_pending(Connection *conn) {
+  if (conn->out) {
+    SendResult res = send_buf(conn->fd, conn->out, conn->out_len, &conn->out_sent);
+    if (res != SEND_DONE)
+      return res;
+    free(conn->out);
+    conn->out = NULL;
+  }
+  return send_body(conn, &conn->res.body);
+}
+
+static SendResult send_response(Connection *conn) {
+  // the head is written straight from the stack, only what does not fit in the socket buffer is copied
   char buf[65536], *bufptr = buf;
+  WebbResponse *res = &conn->res;
   const char *status_str = webb_status_str(res->status);
   if (!status_str)
-    return 1;
+    return SEND_FAILED;
   bufptr += sprintf(bufptr, "HTTP/1.1 %d %s\r\n", res->status, status_str);
   time_t now = time(0);
   struct tm *tm = gmtime(&now);
   bufptr += strftime(bufptr, buf + sizeof(buf) - bufptr, "date: %a, %d %b %Y %H:%M:%S %Z\r\n", tm);
   bufptr += sprintf(bufptr, "server: libwebb 0.1\r\n");
-  bufptr += sprintf(bufptr, "connection: keep-alive\r\n");
-  bufptr += sprintf(bufptr, "content-length: %zu\r\n", res->body.len);
+  // an event stream's body goes on until the connection is closed
+  int streaming = res->sse && res->status == 200;
+  if (res->websocket && res->status == 101)
+    bufptr += sprintf(bufptr, "connection: upgrade\r\n");
+  else if (streaming || conn->close_after)
+    bufptr += sprintf(bufptr, "connection: close\r\n");
+  else
+    bufptr += sprintf(bufptr, "connection: keep-alive\r\n");
+  // 1xx, 204 and 304 responses never have a body, rfc9110 8.6
+  if (res->status >= 200 && res->status != 204 && res->status != 304 && !streaming)
+    bufptr += sprintf(bufptr, "content-length: %zu\r\n", res->body.len);
+  if (res->content_type)
+    bufptr += sprintf(bufptr, "content-type: %s\r\n", res->content_type);
+  if (res->cache_control)
+    bufptr += sprintf(bufptr, "cache-control: %s\r\n", res->cache_control);
   for (WebbHeaders *h = res->headers; h; h = h->next)
     bufptr += sprintf(bufptr, "%s: %s\r\n", h->key, h->val);
+  if (res->raw_headers)
+    bufptr += sprintf(bufptr, "%s", res->raw_headers);
   bufptr += sprintf(bufptr, "\r\n");
-  if (send_all(fd, buf, bufptr - buf))
-    return 1;
-  if (send_body(fd, &res->body) != 0)
-    return 1;
-  return 0;
+
+  size_t sent = 0;
+  conn->body_sent = 0;
+  SendResult result = send_buf(conn->fd, buf, bufptr - buf, &sent);
+  if (result == SEND_BLOCKED)
+    return stash_output(conn, buf + sent, (size_t) (bufptr - buf) - sent);
+  if (result != SEND_DONE)
+    return result;
+  return send_body(conn, &res->body);
 }
 
 void webb_set_body(WebbResponse *res, char *body, size_t len) {
@@ -141,11 +496,89 @@ void webb_set_body_fd(WebbResponse *res, int fd, size_t len) {
   res->body = (WebbBody){.type = WEBB_BODY_FD, .len = len, .body = {.fd = fd}};
 }
 
-static void free_headers(WebbHeaders *header, int allocated_keys) {
+void webb_set_body_fd_range(WebbResponse *res, int fd, size_t offset, size_t len) {
+  res->body = (WebbBody){.type = WEBB_BODY_FD, .len = len, .offset = offset, .body = {.fd = fd}};
+}
+
+void webb_set_body_mmap(WebbResponse *res, char *addr, size_t len) {
+  res->body = (WebbBody){.type = WEBB_BODY_MMAP, .len = len, .body = {.buf = addr}};
+}
+
+void webb_set_body_splice(WebbResponse *res, int fd, size_t len, WebbSpliceDone *done, void *arg) {
+  res->body = (WebbBody){
+    .type = WEBB_BODY_SPLICE,
+    .len = len,
+    .body = {.splice = {.fd = fd, .done = done, .arg = arg}},
+  };
+}
+
+void webb_set_body_shared(WebbResponse *res, WebbShared *shared) {
+  res->body = (WebbBody){
+    .type = WEBB_BODY_SHARED,
+    .len = shared->len,
+    .body = {.shared = webb_shared_ref(shared)},
+  };
+}
+
+WebbShared *webb_shared_new(char *buf, size_t len) {
+  WebbShared *shared = malloc(sizeof(WebbShared));
+  if (!shared)
+    return NULL;
+  *shared = (WebbShared){.refs = 1, .buf = buf, .len = len};
+  return shared;
+}
+
+WebbShared *webb_shared_mmap(int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    LOG_ERRNO("fstat");
+    return NULL;
+  }
+  // an empty file cannot be mapped, and needs no mapping
+  char *buf = NULL;
+  if (sb.st_size > 0) {
+    buf = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (buf == MAP_FAILED) {
+      LOG_ERRNO("mmap");
+      return NULL;
+    }
+  }
+  WebbShared *shared = webb_shared_new(buf, (size_t) sb.st_size);
+  if (!shared) {
+    if (buf)
+      (void) munmap(buf, (size_t) sb.st_size);
+    return NULL;
+  }
+  shared->mapped = 1;
+  return shared;
+}
+
+const char *webb_shared_data(const WebbShared *shared, size_t *len) {
+  *len = shared->len;
+  return shared->buf;
+}
+
+WebbShared *webb_shared_ref(WebbShared *shared) {
+  // a new reference is always taken through an existing one, so there is nothing to synchronize with
+  __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+  return shared;
+}
+
+void webb_shared_release(WebbShared *shared) {
+  // the releasing thread has to see every write made through other references before freeing
+  if (!shared || __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  if (!shared->mapped)
+    free(shared->buf);
+  else if (shared->buf)
+    (void) munmap(shared->buf, shared->len);
+  free(shared);
+}
+
+static void free_headers(WebbHeaders *header) {
   while (header) {
     WebbHeaders *next = header->next;
-    if (allocated_keys)
-      free(header->key);
+    free(header->key);
     free(header->val);
     free(header);
     header = next;
@@ -153,27 +586,57 @@ static void free_headers(WebbHeaders *header, int allocated_keys) {
 }
 
 void http_req_free(WebbRequest *req) {
-  free_headers(req->headers, 1);
+  free_headers(req->headers);
   free(req->uri);
   free(req->query);
   free(req->body);
 }
 
-void http_res_free(WebbResponse *res) {
-  free_headers(res->headers, 0);
-  switch (res->body.type) {
+void http_body_free(WebbBody *body) {
+  switch (body->type) {
   case WEBB_BODY_NULL:
     break;
   case WEBB_BODY_ALLOCATED:
-    free(res->body.body.buf);
+    free(body->body.buf);
   case WEBB_BODY_STATIC:
     break;
   case WEBB_BODY_FD:
-    (void) close(res->body.body.fd);
+    (void) close(body->body.fd);
+    break;
+  case WEBB_BODY_SHARED:
+    webb_shared_release(body->body.shared);
+    break;
+  case WEBB_BODY_MMAP:
+    if (body->len)
+      (void) munmap(body->body.buf, body->len);
+    break;
+  case WEBB_BODY_SPLICE:
+    if (body->body.splice.done)
+      body->body.splice.done(body->body.splice.fd, body->offset == body->len, body->body.splice.arg);
+    else
+      (void) close(body->body.splice.fd);
   }
 }
 
-WebbResult parse_request(int fd, HttpParseState *s, WebbRequest *req) {
+void http_res_free(WebbResponse *res) {
+  // headers in the arena are part of the response, and their values either in the arena or not allocated
+  uintptr_t arena = (uintptr_t) res->arena.buf;
+  for (WebbHeaders *header = res->headers, *next; header; header = next) {
+    next = header->next;
+    if ((uintptr_t) header - arena < sizeof(res->arena.buf))
+      continue;
+    free(header->val);
+    free(header);
+  }
+  http_body_free(&res->body);
+  // only set when the upgrade was not taken, its socket never opened
+  if (res->websocket)
+    websocket_free(res->websocket);
+  if (res->sse)
+    sse_free(res->sse);
+}
+
+WebbResult parse_request_head(int fd, HttpParseState *s, WebbRequest *req) {
   // this function has to be reentrant at every EWOULDBLOCK point
   while (s->step != PARSE_STEP_COMPLETE) {
     WebbResult res = http_parse_step(s, req);
@@ -181,10 +644,16 @@ WebbResult parse_request(int fd, HttpParseState *s, WebbRequest *req) {
     case RESULT_OK:
       break;
     case RESULT_NEED_DATA:
-      memmove(s->buf, s->buf + s->i, s->read - s->i);
-      s->read -= s->i;
-      s->i = 0;
-      ssize_t nread = read(fd, s->buf + s->read, sizeof(s->buf) - s->read);
+      if (s->header_bytes + s->read - s->i >= http_max_header_size(s))
+        return RESULT_HEADERS_TOO_LARGE;
+      if (s->read == s->cap && s->i) {
+        memmove(s->buf, s->buf + s->i, s->read - s->i);
+        s->read -= s->i;
+        s->i = 0;
+      }
+      if (s->read == s->cap && http_state_grow(s) != 0)
+        return RESULT_OOM;
+      ssize_t nread = read(fd, s->buf + s->read, s->cap - s->read);
       if (nread == -1) {
         if (errno == EWOULDBLOCK)
           return RESULT_NEED_DATA;
@@ -199,7 +668,11 @@ WebbResult parse_request(int fd, HttpParseState *s, WebbRequest *req) {
       return res;
     }
   }
+  return RESULT_OK;
+}
 
+WebbResult parse_request_body(int fd, HttpParseState *s, WebbRequest *req) {
+  // reentrant like parse_request_head, req->body is allocated on the first call
   if (req->body_len == 0)
     return RESULT_OK;
 
@@ -209,9 +682,13 @@ WebbResult parse_request(int fd, HttpParseState *s, WebbRequest *req) {
     req->body = malloc(req->body_len + 1);
     if (!req->body)
       return RESULT_OOM;
+    req->body[req->body_len] = '\0';
+    // anything past the body in the buffer belongs to the next pipelined request
     size_t i = s->read - s->i;
-    memcpy(req->body, s->buf + s->i, i > req->body_len ? req->body_len : i);
-    s->i = s->read;
+    if (i > req->body_len)
+      i = req->body_len;
+    memcpy(req->body, s->buf + s->i, i);
+    s->i += i;
     s->body_read = i;
   }
   for (ssize_t nread = -1; s->body_read < req->body_len; s->body_read += nread) {
@@ -228,90 +705,1048 @@ WebbResult parse_request(int fd, HttpParseState *s, WebbRequest *req) {
   return RESULT_OK;
 }
 
-static void *worker_thread(void *arg) {
-  ThreadPayload *payload = arg;
-  Event event;
-  while (ev_next(&payload->ev, &event) == 0) {
-    Connection *conn = event.data;
-    switch (event.kind) {
-    case EVENT_READ:
-      switch (parse_request(conn->fd, &conn->state, &conn->req)) {
-      case RESULT_OK: {
-        WebbResponse res = {0};
-        res.status = payload->handler_fn(&conn->req, &res);
-        if (res.status < 0) {
-          LOG("handler function failed");
-          res.status = 500;
-        }
-        if (send_response(conn->fd, &res) != 0)
-          LOG("failed to send data");
-        http_res_free(&res);
-        http_req_free(&conn->req);
-        http_state_reset(&conn->state);
+WebbResult parse_request(int fd, HttpParseState *s, WebbRequest *req) {
+  WebbResult res = parse_request_head(fd, s, req);
+  return res == RESULT_OK ? parse_request_body(fd, s, req) : res;
+}
+
+static void log_access(
+  AccessLogRing *ring,
+  const WebbRequest *req,
+  const WebbResponse *res,
+  const struct timespec *start) {
+  struct timespec end;
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  AccessLogRecord record = {
+    .time = time(NULL),
+    .method = req->method,
+    .status = res->status,
+    .body_len = res->body.len,
+    .duration_us = (unsigned) ((end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000),
+  };
+  (void) snprintf(
+    record.target,
+    sizeof(record.target),
+    "%s%s%s",
+    req->uri,
+    req->query ? "?" : "",
+    req->query ? req->query : "");
+  (void) access_log_push(ring, &record);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static int server_init(Server *server, const WebbServerOptions *opts) {
+  log_set_rate_limit(opts->log_rate_limit);
+  server->opts = opts;
+  server->overload_res_len = (size_t) snprintf(
+    server->overload_res,
+    sizeof(server->overload_res),
+    "HTTP/1.1 503 Service Unavailable\r\nretry-after: %u\r\nconnection: close\r\ncontent-length: 0\r\n\r\n",
+    opts->retry_after ? opts->retry_after : 1);
+  // a token is back within a second for any limit of at least one request per second
+  server->limited_res_len = (size_t) snprintf(
+    server->limited_res,
+    sizeof(server->limited_res),
+    "HTTP/1.1 429 Too Many Requests\r\nretry-after: 1\r\nconnection: keep-alive\r\ncontent-length: 0\r\n\r\n");
+  return rate_limiter_init(&server->limiter, opts);
+}
+
+static int drain_input(int fd) {
+  // returns 1 once the client closed its side too, or the connection failed
+  char buf[4096];
+  for (int i = 0; i < 16; i++) {
+    ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0 || (n == -1 && errno != EINTR))
+      return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+  return 0;
+}
+
+static void close_drained(int fd) {
+  // unread bytes would make close send a reset rather than a fin
+  (void) drain_input(fd);
+  (void) close(fd);
+}
+
+static void reap_shed(ShedQueue *queue, uint64_t now) {
+  // closes the connections whose linger ended, oldest first
+  while (queue->len && queue->deadlines[queue->head] <= now) {
+    close_drained(queue->fds[queue->head]);
+    queue->head = (queue->head + 1) % SHED_LINGER_MAX;
+    queue->len--;
+  }
+}
+
+static void shed_connection(const Server *server, ShedQueue *queue, int fd) {
+  // best effort. without a queue (e.g when out of fds) the connection is closed right away
+  (void) send(fd, server->overload_res, server->overload_res_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (!queue || shutdown(fd, SHUT_WR) == -1 || drain_input(fd)) {
+    close_drained(fd);
+    return;
+  }
+  uint64_t now = now_ns();
+  reap_shed(queue, queue->len == SHED_LINGER_MAX ? queue->deadlines[queue->head] : now);
+  size_t i = (queue->head + queue->len++) % SHED_LINGER_MAX;
+  queue->fds[i] = fd;
+  queue->deadlines[i] = now + SHED_LINGER_NS;
+}
+
+static int has_room(const Server *server, const ThreadPayload *payload) {
+  size_t max_total = server->opts->max_connections, max_worker = server->opts->max_connections_per_worker;
+  if (max_total && __atomic_load_n(&server->active, __ATOMIC_RELAXED) >= max_total)
+    return 0;
+  return !max_worker || __atomic_load_n(&payload->active, __ATOMIC_RELAXED) < max_worker;
+}
+
+static void add_connection(
+  Server *server,
+  ShedQueue *shed,
+  ThreadPayload *payload,
+  int fd,
+  const struct sockaddr_storage *peer,
+  socklen_t peer_len) {
+  // over the connection limits or out of memory, answer 503 right away rather than queueing more work
+  Connection *conn = payload ? calloc(1, sizeof(Connection)) : NULL;
+  if (!conn) {
+    shed_connection(server, shed, fd);
+    return;
+  }
+  conn->fd = fd;
+  conn->payload = payload;
+  conn->peer = *peer;
+  conn->peer_len = peer_len;
+  conn->pipe[0] = conn->pipe[1] = conn->splice_wait = -1;
+  conn->state.pool = &payload->pool;
+  conn->state.max_header_size = server->opts->max_header_size;
+  __atomic_add_fetch(&payload->active, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&server->active, 1, __ATOMIC_RELAXED);
+  if (ev_add(&payload->ev, conn->fd, conn) != 0) {
+    __atomic_sub_fetch(&payload->active, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&server->active, 1, __ATOMIC_RELAXED);
+    shed_connection(server, shed, fd);
+    free(conn);
+    return;
+  }
+  if (payload->track_connections) {
+    conn->next = payload->connections;
+    if (conn->next)
+      conn->next->prev = conn;
+    payload->connections = conn;
+  }
+}
+
+static void accept_connections(ThreadPayload *payload) {
+  // the listener is edge triggered, so everything pending is accepted. when out of fds the remaining
+  // connections wait in the backlog until the next one arrives, there is no reserve fd per worker
+  struct sockaddr_storage peer;
+  for (;;) {
+    socklen_t peer_len = sizeof(peer);
+    int fd = accept(payload->listener, (struct sockaddr *) &peer, &peer_len);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        LOG_ERRNO("accept");
+      return;
+    }
+    ThreadPayload *room = has_room(payload->server, payload) ? payload : NULL;
+    add_connection(payload->server, &payload->shed, room, fd, &peer, peer_len);
+  }
+}
+
+static void free_completed_bodies(Connection *conn) {
+  while (conn->zc_bodies && (int32_t) (conn->zc_bodies->last - conn->zc_done) < 0) {
+    ZeroCopyBody *next = conn->zc_bodies->next;
+    http_body_free(&conn->zc_bodies->body);
+    free(conn->zc_bodies);
+    conn->zc_bodies = next;
+  }
+  if (!conn->zc_bodies)
+    conn->zc_tail = NULL;
+}
+
+static size_t reap_zerocopy(Connection *conn) {
+  // returns the number of notifications read from the error queue, where the kernel reports completed sends
+  char control[128];
+  size_t reaped = 0;
+  for (;;) {
+    struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+    if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+          && (cmsg->cmsg_level != SOL_IPV6 || cmsg->cmsg_type != IPV6_RECVERR))
         continue;
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      // tcp completes sends in order, ee_info to ee_data being the ids completed
+      conn->zc_done = err.ee_data + 1;
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        conn->zerocopy = -1;
+      reaped++;
+    }
+  }
+  free_completed_bodies(conn);
+  return reaped;
+}
+
+static void retire_body(Connection *conn) {
+  // the kernel may still be sending from the body, it is freed once its last send completed
+  ZeroCopyBody *zc = conn->zc_body;
+  zc->body = conn->res.body;
+  zc->next = NULL;
+  memset(&conn->res.body, 0, sizeof(conn->res.body));
+  conn->zc_body = NULL;
+  if (conn->zc_tail)
+    conn->zc_tail->next = zc;
+  else
+    conn->zc_bodies = zc;
+  conn->zc_tail = zc;
+}
+
+static void finish_response(ThreadPayload *payload, Connection *conn) {
+  if (payload->access_log)
+    log_access(payload->access_log, &conn->req, &conn->res, &conn->start);
+  if (conn->zc_body && conn->zc_body->used)
+    retire_body(conn);
+  if (conn->res.websocket && conn->res.status == 101) {
+    // the bytes read past the upgrade request are already frames, the parse buffer is not needed anymore
+    conn->ws = conn->res.websocket;
+    conn->res.websocket = NULL;
+    websocket_attach(conn->ws, conn->fd, conn->state.buf + conn->state.i, conn->state.read - conn->state.i);
+    http_state_free(&conn->state);
+  }
+  if (conn->res.sse && conn->res.status == 200) {
+    // events are published to the socket from now on, anything the client sends is discarded
+    conn->sse = conn->res.sse;
+    conn->res.sse = NULL;
+    sse_attach(conn->sse, conn->fd);
+    http_state_free(&conn->state);
+  }
+  http_res_free(&conn->res);
+  memset(&conn->res, 0, sizeof(conn->res));
+  http_req_free(&conn->req);
+  memset(&conn->req, 0, sizeof(conn->req));
+  http_state_reset(&conn->state);
+  conn->writing = 0;
+}
+
+static void release_connection(ThreadPayload *payload, Connection *conn, int reset) {
+  // the socket is closed once the kernel is done with the zero copy bodies, or reset when they took too long.
+  // either way none of the bodies is sent from anymore
+  if (reset) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    (void) setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+  if (conn->drain_until)
+    close_drained(conn->fd);
+  else if (close(conn->fd) == -1)
+    LOG_ERRNO("close");
+  conn->zc_done = conn->zc_next;
+  free_completed_bodies(conn);
+  conn->closed = 1;
+  conn->next_closed = payload->closed;
+  payload->closed = conn;
+  __atomic_sub_fetch(&payload->active, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&payload->server->active, 1, __ATOMIC_RELAXED);
+}
+
+static void finish_draining(ThreadPayload *payload, Connection *conn, int reset) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    payload->draining = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  release_connection(payload, conn, reset);
+}
+
+static void expire_draining(ThreadPayload *payload, uint64_t now) {
+  for (Connection *conn = payload->draining, *next; conn; conn = next) {
+    next = conn->next;
+    if (now >= conn->drain_until)
+      finish_draining(payload, conn, 1);
+  }
+}
+
+static void close_connection(ThreadPayload *payload, Connection *conn) {
+  if (payload->track_connections) {
+    if (conn->prev)
+      conn->prev->next = conn->next;
+    else
+      payload->connections = conn->next;
+    if (conn->next)
+      conn->next->prev = conn->prev;
+  }
+  if (conn->zc_body && conn->zc_body->used)
+    retire_body(conn);
+  free(conn->zc_body);
+  conn->zc_body = NULL;
+  if (conn->zc_bodies)
+    (void) reap_zerocopy(conn);
+  if (conn->ws)
+    websocket_free(conn->ws);
+  if (conn->sse)
+    sse_free(conn->sse);
+  if (conn->h2)
+    h2_session_free(conn->h2);
+  // only when the server is freed, the handler is never resumed
+  if (conn->coro)
+    coro_put(&payload->coroutines, conn->coro);
+  if (conn->splice_wait != -1)
+    (void) ev_unwatch(&payload->waits, conn->splice_wait);
+  if (conn->pipe[0] != -1) {
+    (void) close(conn->pipe[0]);
+    (void) close(conn->pipe[1]);
+  }
+  http_req_free(&conn->req);
+  http_res_free(&conn->res);
+  free(conn->out);
+  http_state_free(&conn->state);
+  // bodies still being sent from cannot be freed after a regular close, as the kernel keeps sending in the
+  // background. the write side is shut down instead, the socket is closed once the error queue reports the
+  // last send as completed
+  if (conn->zc_bodies && shutdown(conn->fd, SHUT_WR) == 0) {
+    conn->drain_until = now_ns() + ZEROCOPY_DRAIN_NS;
+    conn->prev = NULL;
+    conn->next = payload->draining;
+    if (conn->next)
+      conn->next->prev = conn;
+    payload->draining = conn;
+    return;
+  }
+  release_connection(payload, conn, conn->zc_bodies != NULL);
+}
+
+static void free_closed(ThreadPayload *payload) {
+  // once no more events are buffered, as they could be for the connections closed meanwhile
+  while (payload->closed) {
+    Connection *conn = payload->closed;
+    payload->closed = conn->next_closed;
+    free(conn);
+  }
+}
+
+static void run_handler(void *arg) {
+  Connection *conn = arg;
+  conn->res.status = conn->payload->handler_fn(&conn->req, &conn->res);
+}
+
+static SendResult sent(ThreadPayload *payload, Connection *conn, SendResult res) {
+  if (res == SEND_FAILED)
+    LOG("failed to send data");
+  else if (res == SEND_BLOCKED)
+    conn->writing = 1;
+  else
+    finish_response(payload, conn);
+  return res;
+}
+
+static SendResult send_handled(ThreadPayload *payload, Connection *conn) {
+  if (conn->res.status < 0) {
+    LOG("handler function failed");
+    conn->res.status = 500;
+  }
+  return sent(payload, conn, send_response(conn));
+}
+
+static SendResult send_limited(ThreadPayload *payload, Connection *conn) {
+  // the handler never runs, the response was formatted once by server_init
+  const Server *server = payload->server;
+  size_t len = server->limited_res_len, nsent = 0;
+  conn->res.status = 429;
+  SendResult res = send_buf(conn->fd, server->limited_res, len, &nsent);
+  if (res == SEND_BLOCKED)
+    res = stash_output(conn, server->limited_res + nsent, len - nsent);
+  return sent(payload, conn, res);
+}
+
+static SendResult resume_handler(ThreadPayload *payload, Connection *conn) {
+  // runs the handler until it finishes, or waits on an fd that could be registered in waits
+  while (!coro_resume(conn->coro)) {
+    Coroutine *coro = conn->coro;
+    if (ev_watch(&payload->waits, coro->wait_fd, coro->wait_writable ? EVENT_WRITE : EVENT_READ, conn) == 0)
+      return SEND_WAITING;
+    coro->wait_errno = errno;
+  }
+  coro_put(&payload->coroutines, conn->coro);
+  conn->coro = NULL;
+  if (conn->closing)
+    return SEND_FAILED;
+  return send_handled(payload, conn);
+}
+
+static void prepare_request(ThreadPayload *payload, Connection *conn) {
+  if (payload->access_log)
+    (void) clock_gettime(CLOCK_MONOTONIC, &conn->start);
+  conn->req.worker = payload->index;
+  conn->req.worker_data = payload->data;
+  conn->req.peer = (const struct sockaddr *) &conn->peer;
+  conn->req.peer_len = conn->peer_len;
+}
+
+static int refuse_request(ThreadPayload *payload, Connection *conn, int status) {
+  // the final response to a request whose body is left unread, the connection is closed after it. what did not
+  // fit in the socket is flushed by handle_connection first
+  conn->res.status = status;
+  conn->close_after = 1;
+  conn->writing = send_response(conn) == SEND_BLOCKED;
+  if (payload->access_log)
+    log_access(payload->access_log, &conn->req, &conn->res, &conn->start);
+  return 1;
+}
+
+static int check_request(ThreadPayload *payload, Connection *conn) {
+  // runs once the head of a request is parsed, before any of its body is read. returns 1 once the connection
+  // should be closed, as a request refused here leaves its body unread, and -1 for a request without a body
+  // over the rate limit, which is answered without closing the connection
+  prepare_request(payload, conn);
+  if (!rate_limiter_allow(&payload->server->limiter, conn->req.peer, now_ns() / 1000)) {
+    if (!conn->req.body_len)
+      return -1;
+    webb_set_header_static(&conn->res, "retry-after", "1");
+    return refuse_request(payload, conn, 429);
+  }
+  if (!conn->req.body_len)
+    return 0;
+  if (conn->req.body_len > (size_t) MAX_BODY_LEN)
+    return refuse_request(payload, conn, 413);
+  WebbHandler *check = payload->server->opts->check_request;
+  if (check) {
+    int status = check(&conn->req, &conn->res);
+    if (status != 0) {
+      if (status < 0) {
+        LOG("request check failed");
+        status = 500;
       }
-      case RESULT_NEED_DATA:
+      return refuse_request(payload, conn, status);
+    }
+    http_res_free(&conn->res);
+    memset(&conn->res, 0, sizeof(conn->res));
+  }
+  // clients waiting for the go ahead would otherwise only send the body after a timeout, rfc9110 10.1.1.
+  // a client that sent some of it already does not wait
+  const HttpParseState *s = &conn->state;
+  if (s->read == s->i && http_has_token(webb_get_header(&conn->req, "expect"), "100-continue")) {
+    static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    size_t sent = 0;
+    if (send_buf(conn->fd, CONTINUE, sizeof(CONTINUE) - 1, &sent) == SEND_FAILED)
+      return 1;
+  }
+  return 0;
+}
+
+static SendResult respond(ThreadPayload *payload, Connection *conn) {
+  // the request was prepared and checked against the rate limit by check_request
+  if (payload->coroutines.stack_size) {
+    conn->coro = coro_new(&payload->coroutines, run_handler, conn);
+    if (conn->coro)
+      return resume_handler(payload, conn);
+    // webb_wait_fd and the like block the worker instead
+    LOG("failed to allocate a coroutine");
+  }
+  run_handler(conn);
+  return send_handled(payload, conn);
+}
+
+static void dispatch_stream(void *arg, WebbRequest *req, WebbResponse *res) {
+  // the handler runs right away for each http/2 stream, without a coroutine, as the streams of a connection
+  // share its socket. webb_wait_fd and the like block the worker instead
+  Connection *conn = arg;
+  ThreadPayload *payload = conn->payload;
+  struct timespec start;
+  if (payload->access_log)
+    (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  req->worker = payload->index;
+  req->worker_data = payload->data;
+  req->peer = (const struct sockaddr *) &conn->peer;
+  req->peer_len = conn->peer_len;
+  if (!rate_limiter_allow(&payload->server->limiter, req->peer, now_ns() / 1000)) {
+    res->status = 429;
+    webb_set_header_static(res, "retry-after", "1");
+  } else {
+    res->status = payload->handler_fn(req, res);
+  }
+  if (res->status < 0) {
+    LOG("handler function failed");
+    res->status = 500;
+  }
+  if (payload->access_log)
+    log_access(payload->access_log, req, res, &start);
+}
+
+static int handle_h2(ThreadPayload *payload, Connection *conn) {
+  // a body's source with nothing to read is watched in waits like for splice bodies
+  if (conn->splice_wait != -1) {
+    (void) ev_unwatch(&payload->waits, conn->splice_wait);
+    conn->splice_wait = -1;
+  }
+  int wait_fd;
+  if (h2_session_handle(conn->h2, &wait_fd) != 0)
+    return 1;
+  if (wait_fd != -1) {
+    if (ev_watch(&payload->waits, wait_fd, EVENT_READ, conn) != 0)
+      return 1;
+    conn->splice_wait = wait_fd;
+  }
+  return 0;
+}
+
+static int start_h2(Connection *conn, WebbRequest *upgrade) {
+  // the bytes read past the preface's request line or the upgrade request are already http/2
+  HttpParseState *state = &conn->state;
+  conn->h2 = h2_session_new(conn->fd, http_max_header_size(state), dispatch_stream, conn);
+  if (!conn->h2 || h2_session_start(conn->h2, state->buf + state->i, state->read - state->i, upgrade) != 0)
+    return 1;
+  http_state_free(state);
+  return 0;
+}
+
+static int handle_requests(ThreadPayload *payload, Connection *conn) {
+  // returns 1 once the connection should be closed.
+  // edge triggered, so everything readable has to be handled now
+  for (;;) {
+    if (conn->ws)
+      return websocket_handle(conn->ws);
+    if (conn->sse)
+      return sse_handle(conn->sse);
+    if (conn->h2)
+      return handle_h2(payload, conn);
+    WebbResult result = parse_request_head(conn->fd, &conn->state, &conn->req);
+    // the body is allocated once checked, a request waiting for more of it is not checked again
+    int checked = result == RESULT_OK && !conn->req.body ? check_request(payload, conn) : 0;
+    if (checked > 0)
+      return !conn->writing;
+    if (checked < 0) {
+      SendResult res = send_limited(payload, conn);
+      if (res != SEND_DONE)
+        return res == SEND_FAILED;
+      continue;
+    }
+    if (result == RESULT_OK)
+      result = parse_request_body(conn->fd, &conn->state, &conn->req);
+    switch (result) {
+    case RESULT_OK: {
+      if (h2_is_upgrade(&conn->req)) {
+        if (start_h2(conn, &conn->req) != 0)
+          return 1;
         continue;
-      case RESULT_INVALID_HTTP:
-      case RESULT_DISCONNECTED:
-        goto close;
-      default:
-        LOG("unexpected error");
-        goto close;
       }
-    case EVENT_CLOSE:
-      goto close;
-    case EVENT_WRITE:
-      LOG("TODO: should not receive EVENT_WRITE");
-      exit(1);
+      SendResult res = respond(payload, conn);
+      if (res != SEND_DONE)
+        return res == SEND_FAILED;
+      continue;
     }
-  close:
-    if (close(conn->fd) == -1)
-      LOG_ERRNO("close");
-    free(conn);
+    case RESULT_HTTP2:
+      if (start_h2(conn, NULL) != 0)
+        return 1;
+      continue;
+    case RESULT_NEED_DATA:
+      return 0;
+    case RESULT_HEADERS_TOO_LARGE:
+      conn->res.status = 431;
+      conn->close_after = 1;
+      conn->writing = send_response(conn) == SEND_BLOCKED;
+      return !conn->writing;
+    case RESULT_INVALID_HTTP:
+    case RESULT_DISCONNECTED:
+      return 1;
+    default:
+      LOG("unexpected error");
+      return 1;
+    }
+  }
+}
+
+static int handle_connection(ThreadPayload *payload, Connection *conn, unsigned kinds) {
+  // returns 1 once the connection should be closed. only zero copy completions are expected in the error queue
+  if ((kinds & EVENT_ERROR) && reap_zerocopy(conn) == 0)
+    kinds |= EVENT_CLOSE;
+  if (conn->coro) {
+    // pipelined requests wait in the buffer until the handler is done, it is closed after that
+    conn->closing |= (kinds & EVENT_CLOSE) != 0;
+    return 0;
+  }
+  // frames may still be buffered after a hang up, the close frame among them
+  if (conn->ws)
+    return websocket_handle(conn->ws) || (kinds & EVENT_CLOSE);
+  if (conn->sse)
+    return sse_handle(conn->sse) || (kinds & EVENT_CLOSE);
+  if (conn->h2)
+    return handle_h2(payload, conn) || (kinds & EVENT_CLOSE);
+  if (kinds & EVENT_CLOSE)
+    return 1;
+  if (conn->writing) {
+    // pipelined requests wait in the buffer until the previous response is out
+    if (!(kinds & EVENT_WRITE))
+      return 0;
+    SendResult res = send_pending(conn);
+    if (res != SEND_DONE)
+      return res == SEND_FAILED;
+    // a refused request's body was left unread, nothing more can be parsed
+    if (conn->close_after)
+      return 1;
+    finish_response(payload, conn);
+  }
+  return handle_requests(payload, conn);
+}
+
+static void resume_waiting(ThreadPayload *payload) {
+  // waits is edge triggered in the worker's loop, so every handler whose fd is ready is resumed now. without
+  // a handler, it is the source of a splice body that became readable
+  for (Event event; ev_next(&payload->waits, &event, 0) == 0;) {
+    Connection *conn = event.data;
+    if (conn->closed)
+      continue;
+    if (!conn->coro) {
+      if (handle_connection(payload, conn, EVENT_WRITE) != 0)
+        close_connection(payload, conn);
+      continue;
+    }
+    (void) ev_unwatch(&payload->waits, conn->coro->wait_fd);
+    SendResult res = resume_handler(payload, conn);
+    if (res == SEND_FAILED || (res == SEND_DONE && handle_requests(payload, conn) != 0))
+      close_connection(payload, conn);
+  }
+}
+
+static void handle_event(ThreadPayload *payload, const Event *event) {
+  if (payload->shed.len || payload->draining) {
+    uint64_t now = now_ns();
+    reap_shed(&payload->shed, now);
+    expire_draining(payload, now);
+  }
+  if (event->data == &payload->listener) {
+    accept_connections(payload);
+    return;
+  }
+  if (event->data == &payload->waits) {
+    resume_waiting(payload);
+    return;
+  }
+  Connection *conn = event->data;
+  if (conn->drain_until) {
+    // only completions are waited for, or the peer closing (once all was acked, or reset)
+    if (conn->closed || !(event->kinds & (EVENT_ERROR | EVENT_CLOSE)))
+      return;
+    (void) reap_zerocopy(conn);
+    if (!conn->zc_bodies)
+      finish_draining(payload, conn, 0);
+    return;
+  }
+  if (!conn->closed && handle_connection(payload, conn, event->kinds) != 0)
+    close_connection(payload, conn);
+}
+
+static int open_worker_listener(
+  ThreadPayload *payload,
+  const char *port,
+  const WebbServerOptions *opts,
+  int reuseport) {
+  // reuseport listeners join their group in worker order, which is the index the steering program returns
+  payload->listener = open_server_socket(port, opts, reuseport);
+  if (payload->listener == -1)
+    return 1;
+  return ev_add(&payload->ev, payload->listener, &payload->listener);
+}
+
+static int open_waits(ThreadPayload *payload, size_t stack_size) {
+  // also where the sources of splice bodies are waited on, so it is needed without coroutines too
+  payload->coroutines.stack_size = stack_size;
+  if (ev_create(&payload->waits) != 0)
+    return 1;
+  return ev_add(&payload->ev, payload->waits.epfd, &payload->waits);
+}
+
+static void start_worker_data(ThreadPayload *payload) {
+  const WebbServerOptions *opts = payload->server->opts;
+  if (opts->worker_init)
+    payload->data = opts->worker_init(payload->index, opts->worker_arg);
+}
+
+static void stop_worker_data(ThreadPayload *payload) {
+  const WebbServerOptions *opts = payload->server->opts;
+  if (opts->worker_fini)
+    opts->worker_fini(payload->index, payload->data, opts->worker_arg);
+  payload->data = NULL;
+}
+
+WebbServer *webb_server_new(const char *port, WebbHandler *handler_fn, const WebbServerOptions *opts) {
+  WebbServer *server = calloc(1, sizeof(WebbServer));
+  if (!server) {
+    LOG("failed to allocate server");
+    return NULL;
+  }
+  if (opts)
+    server->opts = *opts;
+  server->server.nworkers = 1;
+  ThreadPayload *worker = &server->worker;
+  worker->handler_fn = handler_fn;
+  worker->server = &server->server;
+  worker->listener = -1;
+  worker->track_connections = 1;
+  worker->ev.epfd = -1;
+  worker->waits.epfd = -1;
+  if (server_init(&server->server, &server->opts) != 0)
+    goto err;
+  if (ev_create(&worker->ev) != 0 || open_worker_listener(worker, port, &server->opts, 0) != 0)
+    goto err;
+  if (open_waits(worker, server->opts.coroutine_stack_size) != 0)
+    goto err;
+  if (server->opts.access_log_fd) {
+    if (access_log_init(&server->access_log, server->opts.access_log_fd, 1) != 0)
+      goto err;
+    worker->access_log = &server->access_log.rings[0];
+  }
+  start_worker_data(worker);
+  return server;
+
+err:
+  // worker_init was never called
+  server->opts.worker_fini = NULL;
+  webb_server_free(server);
+  return NULL;
+}
+
+int webb_server_fd(const WebbServer *server) {
+  return server->worker.ev.epfd;
+}
+
+int webb_server_process(WebbServer *server, int budget) {
+  int handled = 0;
+  for (Event event; handled < budget; handled++) {
+    int res = ev_next(&server->worker.ev, &event, 0);
+    if (res == -1)
+      return -1;
+    if (res == 1)
+      break;
+    handle_event(&server->worker, &event);
+  }
+  if (!ev_pending(&server->worker.ev))
+    free_closed(&server->worker);
+  // there is no writer thread, records are written out as part of processing
+  if (server->access_log.rings)
+    (void) access_log_flush(&server->access_log);
+  return handled;
+}
+
+void webb_server_free(WebbServer *server) {
+  if (!server)
+    return;
+  ThreadPayload *worker = &server->worker;
+  while (worker->connections)
+    close_connection(worker, worker->connections);
+  while (worker->draining)
+    finish_draining(worker, worker->draining, 1);
+  free_closed(worker);
+  reap_shed(&worker->shed, UINT64_MAX);
+  stop_worker_data(worker);
+  if (worker->listener != -1)
+    (void) close(worker->listener);
+  if (worker->ev.epfd != -1)
+    ev_free(&worker->ev);
+  if (worker->waits.epfd != -1)
+    ev_free(&worker->waits);
+  coro_pool_free(&worker->coroutines);
+  access_log_free(&server->access_log);
+  buf_pool_free(&worker->pool);
+  rate_limiter_free(&server->server.limiter);
+  free(server);
+}
+
+#ifndef WEBB_NO_THREADS
+
+static void add_busy(ThreadPayload *payload, uint64_t since, uint64_t now) {
+  // a batch is counted in the window it ended in, only the worker writes these
+  uint64_t window = now / LOAD_WINDOW_NS, last = payload->busy_window;
+  if (window != last) {
+    __atomic_store_n(&payload->busy_prev_ns, window == last + 1 ? payload->busy_ns : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&payload->busy_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&payload->busy_window, window, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&payload->busy_ns, now - since, __ATOMIC_RELAXED);
+}
+
+static void *worker_thread(void *arg) {
+  ThreadPayload *payload = arg;
+  start_worker_data(payload);
+  Event event;
+  for (uint64_t busy_since = 0;;) {
+    // about to block for new events, the time since the batch started was spent handling it
+    if (busy_since && !ev_pending(&payload->ev)) {
+      __atomic_store_n(&payload->busy_since, 0, __ATOMIC_RELAXED);
+      add_busy(payload, busy_since, now_ns());
+      busy_since = 0;
+    }
+    if (payload->closed && !ev_pending(&payload->ev))
+      free_closed(payload);
+    int res = ev_next(&payload->ev, &event, -1);
+    if (res == -1)
+      break;
+    if (res == 1)
+      continue;
+    if (!busy_since) {
+      busy_since = now_ns();
+      __atomic_store_n(&payload->busy_since, busy_since, __ATOMIC_RELAXED);
+    }
+    handle_event(payload, &event);
   }
   LOG("fatal error in worker thread!");
+  stop_worker_data(payload);
   exit(1);
 }
 
-int webb_server_run(const char *port, WebbHandler *handler_fn) {
-  int sockfd = open_server_socket(port);
-  if (sockfd == -1)
+static int accept_reserved(
+  const Server *server, int sockfd, int *reserve_fd, struct sockaddr_storage *peer, socklen_t *peer_len) {
+  // out of fds. wait for a pending connection and accept it in place of a reserved fd. if the reserve
+  // cannot be reopened there is still no room, so the connection is shed instead of spinning on accept
+  if (*reserve_fd == -1) {
+    (void) poll(NULL, 0, ACCEPT_BACKOFF_MS);
+    *reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return -1;
+  }
+  struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+  if (poll(&pfd, 1, -1) != 1)
+    return -1;
+  (void) close(*reserve_fd);
+  int fd = accept(sockfd, (struct sockaddr *) peer, peer_len);
+  *reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || *reserve_fd != -1)
+    return fd;
+  shed_connection(server, NULL, fd);
+  *reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return -1;
+}
+
+static void sample_load(Server *server, ThreadPayload *payloads) {
+  // busy fractions over the current and the previous window, so however long ago the last sample was, only
+  // recent load counts. the batch a worker is in the middle of counts too, so a worker stuck in a slow
+  // handler is seen as busy right away, and fully busy once stuck since before the previous window
+  uint64_t now = now_ns();
+  if (now - server->load_updated_ns < LOAD_WINDOW_NS)
+    return;
+  uint64_t window = now / LOAD_WINDOW_NS, start = (window - 1) * LOAD_WINDOW_NS, span = now - start;
+  for (size_t i = 0; i < server->nworkers; i++) {
+    ThreadPayload *payload = &payloads[i];
+    uint64_t last = __atomic_load_n(&payload->busy_window, __ATOMIC_RELAXED), busy = 0;
+    if (last == window || last + 1 == window)
+      busy = __atomic_load_n(&payload->busy_ns, __ATOMIC_RELAXED);
+    if (last == window)
+      busy += __atomic_load_n(&payload->busy_prev_ns, __ATOMIC_RELAXED);
+    uint64_t since = __atomic_load_n(&payload->busy_since, __ATOMIC_RELAXED);
+    if (since && since < now)
+      busy += now - (since > start ? since : start);
+    payload->busy = (unsigned) (busy >= span ? LOAD_BUSY_LEVELS : busy * LOAD_BUSY_LEVELS / span);
+  }
+  server->load_updated_ns = now;
+}
+
+static ThreadPayload *pick_worker(Server *server, ThreadPayload *payloads, size_t *next) {
+  // the least busy worker, then the one with the fewest connections. starting the scan after the last
+  // pick spreads connections between workers that are equally loaded
+  sample_load(server, payloads);
+  ThreadPayload *best = NULL;
+  size_t best_active = 0;
+  for (size_t i = 0; i < server->nworkers; i++) {
+    ThreadPayload *payload = &payloads[(*next + i) % server->nworkers];
+    size_t active = __atomic_load_n(&payload->active, __ATOMIC_RELAXED);
+    if (!has_room(server, payload))
+      continue;
+    if (!best || payload->busy < best->busy || (payload->busy == best->busy && active < best_active)) {
+      best = payload;
+      best_active = active;
+    }
+  }
+  if (best)
+    *next = (size_t) (best - payloads + 1) % server->nworkers;
+  return best;
+}
+
+static size_t allowed_cpus(int *cpus, size_t max) {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+    LOG_ERRNO("sched_getaffinity");
+    return 0;
+  }
+  size_t n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+    if (CPU_ISSET(cpu, &set))
+      cpus[n++] = cpu;
+  }
+  return n;
+}
+
+static int attach_steering_program(int fd, const int *cpus, size_t n) {
+  // selects the listener, and so the worker, pinned to the cpu that received the connection. returning
+  // an index out of range makes the kernel fall back to the default reuseport hash
+  struct sock_filter code[2 * WORKERS + 2];
+  unsigned short len = 0;
+  code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (unsigned) (SKF_AD_OFF + SKF_AD_CPU));
+  for (size_t i = 0; i < n; i++) {
+    code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) cpus[i], 0, 1);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (unsigned) i);
+  }
+  code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (unsigned) -1);
+  struct sock_fprog prog = {.len = len, .filter = code};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+    LOG_ERRNO("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
     return 1;
+  }
+  return 0;
+}
 
-  ThreadPayload payloads[8];
-  for (int i = 0; i < 8; i++) {
-    payloads[i].handler_fn = handler_fn;
-    if (ev_create(&payloads[i].ev) != 0)
+static int start_worker(ThreadPayload *payload, const int *cpu) {
+  pthread_attr_t attr;
+  if (pthread_attr_init(&attr) != 0)
+    return 1;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpu)
+    CPU_SET(*cpu, &set);
+  int err = cpu ? pthread_attr_setaffinity_np(&attr, sizeof(set), &set) : 0;
+  if (err == 0)
+    err = pthread_create(&payload->tid, &attr, worker_thread, payload);
+  (void) pthread_attr_destroy(&attr);
+  if (err != 0) {
+    LOG("pthread_create: %s", strerror(err));
+    return 1;
+  }
+  return 0;
+}
+
+int webb_server_run_opts(const char *port, WebbHandler *handler_fn, const WebbServerOptions *opts) {
+  static const WebbServerOptions DEFAULT_OPTS = {0};
+  if (!opts)
+    opts = &DEFAULT_OPTS;
+  Server server = {0};
+  // writing to a connection closed by the peer should fail with EPIPE, not kill the process. the process is
+  // ours here, embedders decide for themselves
+  (void) signal(SIGPIPE, SIG_IGN);
+  if (server_init(&server, opts) != 0)
+    return 1;
+  int reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  int cpus[WORKERS];
+  server.nworkers = opts->pin_workers ? allowed_cpus(cpus, WORKERS) : WORKERS;
+  if (server.nworkers == 0)
+    return 1;
+  int sockfd = -1;
+  if (!opts->pin_workers) {
+    sockfd = open_server_socket(port, opts, 0);
+    if (sockfd == -1)
+      return 1;
+  }
+
+  AccessLog access_log = {0};
+  ThreadPayload payloads[WORKERS];
+  memset(payloads, 0, sizeof(payloads));
+  for (size_t i = 0; i < WORKERS; i++) {
+    payloads[i].listener = -1;
+    payloads[i].waits.epfd = -1;
+  }
+  if (opts->access_log_fd) {
+    if (access_log_init(&access_log, opts->access_log_fd, server.nworkers) != 0)
       goto err;
-    if (pthread_create(&payloads[i].tid, NULL, worker_thread, &payloads[i]) != 0) {
-      LOG_ERRNO("pthread_create");
+    if (access_log_start(&access_log) != 0)
       goto err;
-    }
   }
 
-  struct sockaddr_storage addr;
-  socklen_t addrsize = sizeof(addr);
-  for (size_t tid = 0; 1; tid = (tid + 1) % 8) {
-    Connection *conn = calloc(1, sizeof(Connection));
-    if (!conn) {
-      LOG("failed to allocate new connection");
+  for (size_t i = 0; i < server.nworkers; i++) {
+    payloads[i].handler_fn = handler_fn;
+    payloads[i].server = &server;
+    payloads[i].index = i;
+    payloads[i].access_log = access_log.rings ? &access_log.rings[i] : NULL;
+    if (ev_create(&payloads[i].ev) != 0 || open_waits(&payloads[i], opts->coroutine_stack_size) != 0)
       goto err;
-    }
-    conn->fd = accept(sockfd, (struct sockaddr *) &addr, &addrsize);
-    if (conn->fd == -1) {
-      LOG_ERRNO("accept");
-      free(conn);
+    if (opts->pin_workers && open_worker_listener(&payloads[i], port, opts, 1) != 0)
       goto err;
-    }
-    if (ev_add(&payloads[tid].ev, conn->fd, conn) != 0) {
-      close(conn->fd);
-      free(conn);
+  }
+  if (opts->pin_workers && attach_steering_program(payloads[0].listener, cpus, server.nworkers) != 0)
+    goto err;
+  for (size_t i = 0; i < server.nworkers; i++) {
+    if (start_worker(&payloads[i], opts->pin_workers ? &cpus[i] : NULL) != 0)
       goto err;
+  }
+
+  // pinned workers accept their own connections, the workers never return
+  if (opts->pin_workers) {
+    (void) pthread_join(payloads[0].tid, NULL);
+    goto err;
+  }
+
+  struct sockaddr_storage addr;
+  ShedQueue shed = {0};
+  for (size_t next = 0, exhausted = 0; 1;) {
+    // connections shed by the acceptor are closed once their linger ended, without waiting for the next one
+    if (shed.len) {
+      uint64_t now = now_ns(), deadline = shed.deadlines[shed.head];
+      struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+      int ready = deadline > now ? poll(&pfd, 1, (int) ((deadline - now) / 1000000) + 1) : 0;
+      reap_shed(&shed, now_ns());
+      if (ready != 1)
+        continue;
+    }
+    socklen_t addrsize = sizeof(addr);
+    int fd = accept(sockfd, (struct sockaddr *) &addr, &addrsize);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM) {
+        LOG_ERRNO("accept");
+        goto err;
+      }
+      if (!exhausted)
+        LOG_ERRNO("accept");
+      exhausted = 1;
+      fd = accept_reserved(&server, sockfd, &reserve_fd, &addr, &addrsize);
+      if (fd == -1)
+        continue;
+    } else {
+      exhausted = 0;
     }
+    add_connection(&server, &shed, pick_worker(&server, payloads, &next), fd, &addr, addrsize);
   }
 
 err:
-  (void) close(sockfd);
+  if (sockfd != -1)
+    (void) close(sockfd);
+  for (size_t i = 0; i < WORKERS; i++) {
+    if (payloads[i].listener != -1)
+      (void) close(payloads[i].listener);
+  }
   return 1;
 }
+
+#else
+int webb_server_run_opts(const char *port, WebbHandler *handler_fn, const WebbServerOptions *opts) {
+  // without threads the server runs embedded, in a loop of its own
+  (void) signal(SIGPIPE, SIG_IGN);
+  WebbServer *server = webb_server_new(port, handler_fn, opts);
+  if (!server)
+    return 1;
+  for (int handled = 0; handled != -1; handled = webb_server_process(server, EV_MAX_EVENTS)) {
+    struct pollfd pfd = {.fd = webb_server_fd(server), .events = POLLIN};
+    if (handled < EV_MAX_EVENTS && poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+      LOG_ERRNO("poll");
+      break;
+    }
+  }
+  webb_server_free(server);
+  return 1;
+}
+#endif
+
+int webb_server_run(const char *port, WebbHandler *handler_fn) {
+  return webb_server_run_opts(port, handler_fn, NULL);
+}
+
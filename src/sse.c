@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "internal.h"
+#include "webb/webb.h"
+
+typedef struct SseChannel {
+  char *name;
+  // guards the subscribers list, taken before a subscriber's own lock
+  pthread_mutex_t lock;
+  WebbSseSubscriber *subscribers;
+  struct SseChannel *next;
+} SseChannel;
+
+struct WebbSse {
+  // guards the buckets, channels are only freed with the whole set
+  pthread_mutex_t lock;
+  SseChannel *buckets[SSE_BUCKETS];
+  size_t max_queued;
+};
+
+struct WebbSseSubscriber {
+  SseChannel *channel;
+  size_t max_queued;
+  // -1 until the response head is sent, the subscriber is in its channel's list from then on
+  int fd;
+  // guards out and failed, as events are published from any thread while the worker flushes
+  pthread_mutex_t lock;
+  OutQueue out;
+  int failed;
+  WebbSseSubscriber *prev;
+  WebbSseSubscriber *next;
+};
+
+static uint64_t hash_name(const char *name) {
+  // fnv-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name; name++) {
+    hash ^= (unsigned char) *name;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static SseChannel *find_channel(WebbSse *sse, const char *name, int create) {
+  SseChannel **bucket = &sse->buckets[hash_name(name) % SSE_BUCKETS], *channel;
+  (void) pthread_mutex_lock(&sse->lock);
+  for (channel = *bucket; channel && strcmp(channel->name, name) != 0; channel = channel->next)
+    ;
+  if (!channel && create && (channel = calloc(1, sizeof(SseChannel)))) {
+    if ((channel->name = strdup(name))) {
+      (void) pthread_mutex_init(&channel->lock, NULL);
+      channel->next = *bucket;
+      *bucket = channel;
+    } else {
+      free(channel);
+      channel = NULL;
+    }
+  }
+  (void) pthread_mutex_unlock(&sse->lock);
+  return channel;
+}
+
+static int fail_subscriber(WebbSseSubscriber *sub) {
+  // the worker sees the hang up and closes the connection
+  if (!sub->failed)
+    (void) shutdown(sub->fd, SHUT_RDWR);
+  sub->failed = 1;
+  return 1;
+}
+
+static int send_event(WebbSseSubscriber *sub, WebbShared *event) {
+  // written right away when nothing is queued, only the rest is queued by reference. called with sub->lock held
+  size_t len, sent = 0;
+  const char *data = webb_shared_data(event, &len);
+  if (sub->failed)
+    return 1;
+  if (!sub->out.head) {
+    ssize_t n;
+    do {
+      n = send(sub->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return fail_subscriber(sub);
+    sent = n > 0 ? (size_t) n : 0;
+  }
+  // slow consumers are dropped rather than buffering for them without bound
+  if (sub->out.bytes + len - sent > sub->max_queued)
+    return fail_subscriber(sub);
+  return out_queue_push(&sub->out, event, sent, len - sent) != 0 ? fail_subscriber(sub) : 0;
+}
+
+static WebbShared *format_event(const char *event, const char *data, size_t len) {
+  // each line of data goes in its own data field, the blank line ending the event. "\r\n", "\r" and "\n" all end
+  // a line for the client, so each of them is sent as a single "\n"
+  size_t size = (event ? 8 + strlen(event) : 0) + 8 + len;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == '\r' && i + 1 < len && data[i + 1] == '\n')
+      size--;
+    else if (data[i] == '\r' || data[i] == '\n')
+      size += 6;
+  }
+  char *buf = malloc(size), *p = buf;
+  WebbShared *shared = buf ? webb_shared_new(buf, size) : NULL;
+  if (!shared) {
+    free(buf);
+    return NULL;
+  }
+  if (event)
+    p += sprintf(p, "event: %s\n", event);
+  memcpy(p, "data: ", 6);
+  p += 6;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] != '\r' && data[i] != '\n') {
+      *p++ = data[i];
+      continue;
+    }
+    if (data[i] == '\r' && i + 1 < len && data[i + 1] == '\n')
+      i++;
+    memcpy(p, "\ndata: ", 7);
+    p += 7;
+  }
+  *p++ = '\n';
+  *p = '\n';
+  return shared;
+}
+
+WebbSse *webb_sse_new(const WebbSseOptions *opts) {
+  WebbSse *sse = calloc(1, sizeof(WebbSse));
+  if (!sse)
+    return NULL;
+  (void) pthread_mutex_init(&sse->lock, NULL);
+  sse->max_queued = opts && opts->max_queued ? opts->max_queued : SSE_DEFAULT_MAX_QUEUED;
+  return sse;
+}
+
+int webb_sse_subscribe(WebbSse *sse, const char *channel, WebbResponse *res) {
+  WebbSseSubscriber *sub = calloc(1, sizeof(WebbSseSubscriber));
+  if (!sub)
+    return -1;
+  sub->channel = find_channel(sse, channel, 1);
+  if (!sub->channel) {
+    free(sub);
+    return -1;
+  }
+  sub->max_queued = sse->max_queued;
+  sub->fd = -1;
+  (void) pthread_mutex_init(&sub->lock, NULL);
+  res->sse = sub;
+  res->content_type = "text/event-stream";
+  res->cache_control = "no-cache";
+  return 200;
+}
+
+int webb_sse_publish(WebbSse *sse, const char *channel, const char *event, const char *data, size_t len) {
+  // the event is formatted once and shared by every subscriber's queue. a line break in its type would start
+  // another field
+  if (event && event[strcspn(event, "\r\n")]) {
+    LOG("invalid event type");
+    return -1;
+  }
+  SseChannel *ch = find_channel(sse, channel, 0);
+  if (!ch)
+    return 0;
+  WebbShared *shared = format_event(event, data, len);
+  if (!shared)
+    return -1;
+  int n = 0;
+  (void) pthread_mutex_lock(&ch->lock);
+  for (WebbSseSubscriber *sub = ch->subscribers; sub; sub = sub->next) {
+    (void) pthread_mutex_lock(&sub->lock);
+    n += send_event(sub, shared) == 0;
+    (void) pthread_mutex_unlock(&sub->lock);
+  }
+  (void) pthread_mutex_unlock(&ch->lock);
+  webb_shared_release(shared);
+  return n;
+}
+
+void webb_sse_free(WebbSse *sse) {
+  if (!sse)
+    return;
+  for (size_t i = 0; i < SSE_BUCKETS; i++) {
+    while (sse->buckets[i]) {
+      SseChannel *channel = sse->buckets[i];
+      sse->buckets[i] = channel->next;
+      (void) pthread_mutex_destroy(&channel->lock);
+      free(channel->name);
+      free(channel);
+    }
+  }
+  (void) pthread_mutex_destroy(&sse->lock);
+  free(sse);
+}
+
+void sse_attach(WebbSseSubscriber *sub, int fd) {
+  SseChannel *channel = sub->channel;
+  sub->fd = fd;
+  (void) pthread_mutex_lock(&channel->lock);
+  sub->next = channel->subscribers;
+  if (sub->next)
+    sub->next->prev = sub;
+  channel->subscribers = sub;
+  (void) pthread_mutex_unlock(&channel->lock);
+}
+
+int sse_handle(WebbSseSubscriber *sub) {
+  // returns 1 once the connection should be closed. clients have nothing to send, whatever they do is discarded
+  char buf[512];
+  ssize_t n;
+  do {
+    n = read(sub->fd, buf, sizeof(buf));
+  } while (n > 0 || (n == -1 && errno == EINTR));
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    return 1;
+  (void) pthread_mutex_lock(&sub->lock);
+  int res = sub->failed || out_queue_flush(&sub->out, sub->fd) != 0;
+  (void) pthread_mutex_unlock(&sub->lock);
+  return res;
+}
+
+void sse_free(WebbSseSubscriber *sub) {
+  // once out of its channel's list no publisher can reach it, so it can go before its socket is closed
+  if (sub->fd != -1) {
+    SseChannel *channel = sub->channel;
+    (void) pthread_mutex_lock(&channel->lock);
+    if (sub->prev)
+      sub->prev->next = sub->next;
+    else
+      channel->subscribers = sub->next;
+    if (sub->next)
+      sub->next->prev = sub->prev;
+    (void) pthread_mutex_unlock(&channel->lock);
+  }
+  out_queue_free(&sub->out);
+  (void) pthread_mutex_destroy(&sub->lock);
+  free(sub);
+}
@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "internal.h"
+#include "webb/webb.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+typedef enum WebSocketOpcode {
+  OPCODE_CONTINUATION = 0x0,
+  OPCODE_TEXT = 0x1,
+  OPCODE_BINARY = 0x2,
+  OPCODE_CLOSE = 0x8,
+  OPCODE_PING = 0x9,
+  OPCODE_PONG = 0xa,
+} WebSocketOpcode;
+
+struct WebbWebSocket {
+  int fd;
+  WebbWebSocketHandlers handlers;
+  void *data;
+  // set once the connection was handed over, and once the socket was shut down after a failed send. the worker
+  // then sees the hang up and closes it, as the socket may be failed from another socket's handler
+  int open;
+  int failed;
+  int close_sent;
+  int close_code;
+  // received bytes, complete frames are handled and removed from the start
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+  // the fragments of the message being received, opcode being 0 between messages
+  char *msg;
+  size_t msg_len;
+  size_t msg_cap;
+  WebSocketOpcode msg_opcode;
+  OutQueue out;
+};
+
+static uint32_t rotl(uint32_t x, int n) {
+  return x << n | x >> (32 - n);
+}
+
+static void sha1(const char *data, size_t len, unsigned char digest[20]) {
+  // only ever hashes a handshake key and the guid, the padded message fits in two blocks
+  unsigned char msg[128] = {0};
+  size_t nblocks = len + 9 > 64 ? 2 : 1;
+  uint64_t bits = (uint64_t) len * 8;
+  memcpy(msg, data, len);
+  msg[len] = 0x80;
+  for (int i = 0; i < 8; i++)
+    msg[nblocks * 64 - 1 - i] = (unsigned char) (bits >> (8 * i));
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  for (size_t block = 0; block < nblocks; block++) {
+    const unsigned char *p = msg + block * 64;
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t t = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  for (int i = 0; i < 20; i++)
+    digest[i] = (unsigned char) (h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+static void base64(const unsigned char *in, size_t len, char *out) {
+  static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t) in[i] << 16 | (i + 1 < len ? (uint32_t) in[i + 1] << 8 : 0) | (i + 2 < len ? in[i + 2] : 0);
+    *out++ = ALPHABET[v >> 18 & 63];
+    *out++ = ALPHABET[v >> 12 & 63];
+    *out++ = i + 1 < len ? ALPHABET[v >> 6 & 63] : '=';
+    *out++ = i + 2 < len ? ALPHABET[v & 63] : '=';
+  }
+  *out = '\0';
+}
+
+void websocket_unmask(char *data, size_t len, const unsigned char mask[4]) {
+  // xor with the 4 byte key repeated, 16 bytes at a time where sse2 is available, then 8. every block is a
+  // multiple of 4 bytes, so the key lines up with each of them as is
+  uint32_t key;
+  memcpy(&key, mask, sizeof(key));
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i key128 = _mm_set1_epi32((int) key);
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+    _mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(chunk, key128));
+  }
+#endif
+  uint64_t key64 = (uint64_t) key << 32 | key;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t chunk;
+    memcpy(&chunk, data + i, sizeof(chunk));
+    chunk ^= key64;
+    memcpy(data + i, &chunk, sizeof(chunk));
+  }
+  for (; i < len; i++)
+    data[i] = (char) (data[i] ^ mask[i % 4]);
+}
+
+static size_t frame_head(unsigned char *head, WebSocketOpcode opcode, size_t len) {
+  // server frames are never masked nor fragmented
+  head[0] = (unsigned char) (0x80 | opcode);
+  if (len < 126) {
+    head[1] = (unsigned char) len;
+    return 2;
+  }
+  if (len <= 0xffff) {
+    head[1] = 126;
+    head[2] = (unsigned char) (len >> 8);
+    head[3] = (unsigned char) len;
+    return 4;
+  }
+  head[1] = 127;
+  for (int i = 0; i < 8; i++)
+    head[2 + i] = (unsigned char) ((uint64_t) len >> (56 - 8 * i));
+  return 10;
+}
+
+static int fail_socket(WebbWebSocket *ws) {
+  // the worker sees the hang up and closes the connection, whichever socket's event is being handled now
+  if (!ws->failed)
+    (void) shutdown(ws->fd, SHUT_RDWR);
+  ws->failed = 1;
+  return 1;
+}
+
+static int queue_copy(WebbWebSocket *ws, const struct iovec *iov, size_t n, size_t skip) {
+  // the bytes past skip are copied to the queue, the caller's buffers being gone once it returns
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++)
+    len += iov[i].iov_len;
+  len -= skip;
+  if (ws->out.bytes + len > ws->handlers.max_queued)
+    return fail_socket(ws);
+  char *buf = malloc(len), *p = buf;
+  WebbShared *shared = buf ? webb_shared_new(buf, len) : NULL;
+  if (!shared) {
+    free(buf);
+    return fail_socket(ws);
+  }
+  for (size_t i = 0; i < n; i++) {
+    size_t from = skip < iov[i].iov_len ? skip : iov[i].iov_len;
+    memcpy(p, (const char *) iov[i].iov_base + from, iov[i].iov_len - from);
+    p += iov[i].iov_len - from;
+    skip -= from;
+  }
+  int res = out_queue_push(&ws->out, shared, 0, len);
+  webb_shared_release(shared);
+  return res ? fail_socket(ws) : 0;
+}
+
+static int send_frame(WebbWebSocket *ws, WebSocketOpcode opcode, const char *data, size_t len) {
+  // written right away when nothing is queued, what the socket does not take is queued
+  unsigned char head[10];
+  struct iovec iov[2] = {
+    {.iov_base = head, .iov_len = frame_head(head, opcode, len)},
+    {.iov_base = (void *) (uintptr_t) data, .iov_len = len},
+  };
+  if (ws->failed)
+    return 1;
+  ssize_t sent = 0;
+  if (!ws->out.head) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    do {
+      sent = sendmsg(ws->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return fail_socket(ws);
+    if (sent == (ssize_t) (iov[0].iov_len + len))
+      return 0;
+  }
+  return queue_copy(ws, iov, 2, sent > 0 ? (size_t) sent : 0);
+}
+
+static int send_shared(WebbWebSocket *ws, WebbShared *frame) {
+  // the same frame for every socket, only what a socket does not take right away is queued by reference
+  size_t len, sent = 0;
+  const char *data = webb_shared_data(frame, &len);
+  if (ws->failed)
+    return 1;
+  if (!ws->out.head) {
+    ssize_t n;
+    do {
+      n = send(ws->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return fail_socket(ws);
+    sent = n > 0 ? (size_t) n : 0;
+  }
+  if (sent == len)
+    return 0;
+  if (ws->out.bytes + len - sent > ws->handlers.max_queued || out_queue_push(&ws->out, frame, sent, len - sent) != 0)
+    return fail_socket(ws);
+  return 0;
+}
+
+static int send_close(WebbWebSocket *ws, int code) {
+  // 1005 and 1006 are only reported locally, never sent
+  char payload[2] = {(char) (code >> 8), (char) code};
+  ws->close_sent = 1;
+  return send_frame(ws, OPCODE_CLOSE, payload, code == 1005 || code == 1006 ? 0 : 2);
+}
+
+static int protocol_error(WebbWebSocket *ws, int code) {
+  (void) send_close(ws, code);
+  ws->close_code = code;
+  return 1;
+}
+
+static int append_fragment(WebbWebSocket *ws, const char *data, size_t len) {
+  if (ws->msg_len + len > ws->handlers.max_message)
+    return protocol_error(ws, 1009);
+  if (ws->msg_len + len > ws->msg_cap) {
+    size_t cap = ws->msg_cap ? ws->msg_cap : WEBSOCKET_MIN_BUFFER;
+    while (cap < ws->msg_len + len)
+      cap *= 2;
+    char *msg = realloc(ws->msg, cap);
+    if (!msg)
+      return protocol_error(ws, 1011);
+    ws->msg = msg;
+    ws->msg_cap = cap;
+  }
+  memcpy(ws->msg + ws->msg_len, data, len);
+  ws->msg_len += len;
+  return 0;
+}
+
+static void deliver(WebbWebSocket *ws, WebSocketOpcode opcode, const char *data, size_t len) {
+  // messages that arrive once the closing handshake started are dropped
+  if (ws->handlers.message && !ws->close_sent)
+    ws->handlers.message(ws, data, len, opcode == OPCODE_BINARY);
+}
+
+static int handle_frame(WebbWebSocket *ws, int fin, WebSocketOpcode opcode, const char *data, size_t len) {
+  // returns 1 once the connection should be closed. control frames may come between the fragments of a message
+  if ((opcode & 0x8) && (!fin || len > 125))
+    return protocol_error(ws, 1002);
+  switch (opcode) {
+  case OPCODE_TEXT:
+  case OPCODE_BINARY:
+    if (ws->msg_opcode)
+      return protocol_error(ws, 1002);
+    if (fin) {
+      // unfragmented messages are delivered straight from the receive buffer
+      deliver(ws, opcode, data, len);
+      return 0;
+    }
+    ws->msg_opcode = opcode;
+    ws->msg_len = 0;
+    return append_fragment(ws, data, len);
+  case OPCODE_CONTINUATION:
+    if (!ws->msg_opcode)
+      return protocol_error(ws, 1002);
+    if (append_fragment(ws, data, len) != 0)
+      return 1;
+    if (fin) {
+      deliver(ws, ws->msg_opcode, ws->msg, ws->msg_len);
+      ws->msg_opcode = 0;
+      ws->msg_len = 0;
+    }
+    return 0;
+  case OPCODE_PING:
+    return send_frame(ws, OPCODE_PONG, data, len) != 0;
+  case OPCODE_PONG:
+    return 0;
+  case OPCODE_CLOSE:
+    // answered with the same code, unless the close was ours
+    ws->close_code = len >= 2 ? (unsigned char) data[0] << 8 | (unsigned char) data[1] : 1005;
+    if (!ws->close_sent)
+      (void) send_close(ws, ws->close_code);
+    return 1;
+  default:
+    return protocol_error(ws, 1002);
+  }
+}
+
+static int handle_frames(WebbWebSocket *ws) {
+  // returns 1 once the connection should be closed. an incomplete frame is left at the start of the buffer
+  size_t pos = 0;
+  int res = 0;
+  while (!res && !ws->failed) {
+    unsigned char *p = (unsigned char *) ws->in + pos;
+    size_t avail = ws->in_len - pos, head = 2;
+    if (avail < 2)
+      break;
+    size_t len = p[1] & 0x7f;
+    // no extension was negotiated, and client frames are always masked
+    if ((p[0] & 0x70) || !(p[1] & 0x80)) {
+      res = protocol_error(ws, 1002);
+      break;
+    }
+    if (len == 126) {
+      if (avail < 4)
+        break;
+      len = (size_t) p[2] << 8 | p[3];
+      head = 4;
+    } else if (len == 127) {
+      if (avail < 10)
+        break;
+      uint64_t len64 = 0;
+      for (int i = 0; i < 8; i++)
+        len64 = len64 << 8 | p[2 + i];
+      len = len64 > ws->handlers.max_message ? SIZE_MAX : (size_t) len64;
+      head = 10;
+    }
+    if (len > ws->handlers.max_message) {
+      res = protocol_error(ws, 1009);
+      break;
+    }
+    if (avail < head + 4 + len)
+      break;
+    char *payload = (char *) p + head + 4;
+    websocket_unmask(payload, len, p + head);
+    pos += head + 4 + len;
+    res = handle_frame(ws, p[0] & 0x80, p[0] & 0x0f, payload, len);
+  }
+  memmove(ws->in, ws->in + pos, ws->in_len - pos);
+  ws->in_len -= pos;
+  return res || ws->failed;
+}
+
+void websocket_attach(WebbWebSocket *ws, int fd, const char *buffered, size_t len) {
+  // bytes already read past the upgrade request are the first frames
+  ws->fd = fd;
+  ws->open = 1;
+  ws->close_code = 1006;
+  ws->in_cap = WEBSOCKET_MIN_BUFFER;
+  while (ws->in_cap < len)
+    ws->in_cap *= 2;
+  ws->in = malloc(ws->in_cap);
+  if (!ws->in) {
+    ws->in_cap = 0;
+    (void) fail_socket(ws);
+    return;
+  }
+  memcpy(ws->in, buffered, len);
+  ws->in_len = len;
+  if (ws->handlers.open)
+    ws->handlers.open(ws);
+}
+
+int websocket_handle(WebbWebSocket *ws) {
+  // returns 1 once the connection should be closed. edge triggered, so everything readable is read now
+  if (ws->failed || out_queue_flush(&ws->out, ws->fd) != 0)
+    return 1;
+  for (;;) {
+    if (handle_frames(ws) != 0)
+      return 1;
+    // grown until the frame at the start fits, frames are at most max_message long
+    if (ws->in_len == ws->in_cap) {
+      char *in = realloc(ws->in, ws->in_cap * 2);
+      if (!in)
+        return 1;
+      ws->in = in;
+      ws->in_cap *= 2;
+    }
+    ssize_t n = read(ws->fd, ws->in + ws->in_len, ws->in_cap - ws->in_len);
+    if (n > 0) {
+      ws->in_len += (size_t) n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+}
+
+void websocket_free(WebbWebSocket *ws) {
+  if (ws->open && ws->handlers.close)
+    ws->handlers.close(ws, ws->close_code);
+  out_queue_free(&ws->out);
+  free(ws->in);
+  free(ws->msg);
+  free(ws);
+}
+
+int webb_websocket_upgrade(
+  const WebbRequest *req,
+  WebbResponse *res,
+  const WebbWebSocketHandlers *handlers,
+  void *data) {
+  const char *key = webb_get_header(req, "sec-websocket-key"), *version = webb_get_header(req, "sec-websocket-version");
+  if (req->method != WEBB_GET || !http_has_token(webb_get_header(req, "upgrade"), "websocket")
+      || !http_has_token(webb_get_header(req, "connection"), "upgrade") || !key || strlen(key) != 24)
+    return 400;
+  if (!version || strcmp(version, "13") != 0) {
+    webb_set_header_static(res, "sec-websocket-version", "13");
+    return 426;
+  }
+  WebbWebSocket *ws = calloc(1, sizeof(WebbWebSocket));
+  if (!ws)
+    return -1;
+  ws->data = data;
+  ws->fd = -1;
+  if (handlers)
+    ws->handlers = *handlers;
+  if (!ws->handlers.max_message)
+    ws->handlers.max_message = WEBSOCKET_DEFAULT_MAX_MESSAGE;
+  if (!ws->handlers.max_queued)
+    ws->handlers.max_queued = WEBSOCKET_DEFAULT_MAX_QUEUED;
+
+  // the accept key proves the handshake was understood, rfc6455 4.2.2
+  char input[24 + sizeof(WEBSOCKET_GUID)], accept[29];
+  unsigned char digest[20];
+  memcpy(input, key, 24);
+  memcpy(input + 24, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID));
+  sha1(input, sizeof(input) - 1, digest);
+  base64(digest, sizeof(digest), accept);
+  webb_set_header_static(res, "upgrade", "websocket");
+  if (webb_set_headerf(res, "sec-websocket-accept", "%s", accept) != 0) {
+    free(ws);
+    return -1;
+  }
+  res->websocket = ws;
+  return 101;
+}
+
+void *webb_websocket_data(const WebbWebSocket *ws) {
+  return ws->data;
+}
+
+int webb_websocket_send(WebbWebSocket *ws, const char *data, size_t len, int binary) {
+  if (ws->close_sent)
+    return 1;
+  return send_frame(ws, binary ? OPCODE_BINARY : OPCODE_TEXT, data, len);
+}
+
+size_t webb_websocket_broadcast(WebbWebSocket *const *sockets, size_t n, const char *data, size_t len, int binary) {
+  // server frames are not masked, so every socket sends the very same bytes
+  unsigned char head[10];
+  size_t head_len = frame_head(head, binary ? OPCODE_BINARY : OPCODE_TEXT, len), failed = 0;
+  char *buf = malloc(head_len + len);
+  WebbShared *frame = buf ? webb_shared_new(buf, head_len + len) : NULL;
+  if (!frame) {
+    free(buf);
+    return n;
+  }
+  memcpy(buf, head, head_len);
+  memcpy(buf + head_len, data, len);
+  for (size_t i = 0; i < n; i++)
+    failed += sockets[i]->close_sent || send_shared(sockets[i], frame) != 0;
+  webb_shared_release(frame);
+  return failed;
+}
+
+void webb_websocket_close(WebbWebSocket *ws, int code) {
+  if (!ws->close_sent)
+    (void) send_close(ws, code);
+}
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+static int CALLS;
+static WebbCache *CACHE;
+
+static int cached_handler(const WebbRequest *req, WebbResponse *res) {
+  __atomic_add_fetch(&CALLS, 1, __ATOMIC_RELAXED);
+  const char *cache_control = webb_get_header(req, "x-cache-control");
+  const char *status = webb_get_header(req, "x-status");
+  if (strcmp(req->uri, "/slow") == 0)
+    usleep(100 * 1000);
+  if (strcmp(req->uri, "/stuck") == 0)
+    usleep(1500 * 1000);
+  if (strcmp(req->uri, "/yield") == 0)
+    (void) webb_sleep(1);
+  res->content_type = "text/plain";
+  res->cache_control = cache_control ? cache_control : "public, max-age=60";
+  webb_set_header_static(res, "x-uri", req->uri);
+  if (webb_get_header(req, "x-cookie"))
+    webb_set_header_static(res, "set-cookie", "a=b");
+  char *body = strdup(req->uri);
+  webb_set_body(res, body, strlen(body));
+  return status ? atoi(status) : 200;
+}
+
+static int get(WebbCache *cache, const char *uri, const char *query, WebbHeaders *headers, WebbResponse *res) {
+  char uri_buf[64], query_buf[64];
+  (void) snprintf(uri_buf, sizeof(uri_buf), "%s", uri);
+  (void) snprintf(query_buf, sizeof(query_buf), "%s", query ? query : "");
+  WebbRequest req = {.method = WEBB_GET, .uri = uri_buf, .query = query ? query_buf : NULL, .headers = headers};
+  http_res_free(res);
+  memset(res, 0, sizeof(*res));
+  return webb_cache_handle(cache, &req, res);
+}
+
+static int body_is(const WebbResponse *res, const char *body) {
+  size_t len;
+  if (res->body.type != WEBB_BODY_SHARED)
+    return 0;
+  const char *data = webb_shared_data(res->body.body.shared, &len);
+  return res->body.len == strlen(body) && memcmp(data, body, res->body.len) == 0;
+}
+
+TEST(test_cache_hits) {
+  const char *vary[] = {"accept-encoding", NULL};
+  WebbCacheOptions opts = {.vary = vary};
+  WebbCache *cache = webb_cache_new(cached_handler, &opts);
+  ASSERT(cache);
+  WebbResponse res = {0};
+  CALLS = 0;
+
+  EXPECT(get(cache, "/a", NULL, NULL, &res) == 200);
+  EXPECT(body_is(&res, "/a"));
+  EXPECT(res.raw_headers == NULL);
+  EXPECT(get(cache, "/a", NULL, NULL, &res) == 200);
+  EXPECT(CALLS == 1);
+  EXPECT(body_is(&res, "/a"));
+  ASSERT(res.raw_headers);
+  EXPECT(strcmp(res.raw_headers,
+           "content-type: text/plain\r\ncache-control: public, max-age=60\r\nx-uri: /a\r\n") == 0);
+  EXPECT(res.headers && strcmp(res.headers->key, "age") == 0);
+
+  // the query string and vary headers are part of the key, other headers are not
+  EXPECT(get(cache, "/a", "b=1", NULL, &res) == 200);
+  EXPECT(CALLS == 2);
+  WebbHeaders gzip = {.key = "accept-encoding", .val = "gzip"};
+  WebbHeaders other = {.key = "user-agent", .val = "test"};
+  EXPECT(get(cache, "/a", NULL, &gzip, &res) == 200);
+  EXPECT(get(cache, "/a", NULL, &gzip, &res) == 200);
+  EXPECT(get(cache, "/a", NULL, &other, &res) == 200);
+  EXPECT(CALLS == 3);
+
+  // other methods are passed through
+  WebbRequest post = {.method = WEBB_POST, .uri = "/a"};
+  http_res_free(&res);
+  memset(&res, 0, sizeof(res));
+  EXPECT(webb_cache_handle(cache, &post, &res) == 200);
+  EXPECT(CALLS == 4);
+  EXPECT(res.body.type == WEBB_BODY_ALLOCATED);
+
+  http_res_free(&res);
+  webb_cache_free(cache);
+}
+
+TEST(test_cache_uncacheable) {
+  WebbCache *cache = webb_cache_new(cached_handler, NULL);
+  ASSERT(cache);
+  WebbResponse res = {0};
+  CALLS = 0;
+  char *values[] = {"no-store, max-age=60", "max-age=60, private", "no-cache", "public", "max-age=0"};
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    WebbHeaders header = {.key = "x-cache-control", .val = values[i]};
+    EXPECT(get(cache, "/a", NULL, &header, &res) == 200);
+    EXPECT(get(cache, "/a", NULL, &header, &res) == 200);
+    EXPECT(res.body.type == WEBB_BODY_ALLOCATED);
+  }
+  EXPECT(CALLS == 10);
+
+  WebbHeaders cookie = {.key = "x-cookie", .val = "1"};
+  EXPECT(get(cache, "/b", NULL, &cookie, &res) == 200);
+  EXPECT(get(cache, "/b", NULL, &cookie, &res) == 200);
+  EXPECT(CALLS == 12);
+
+  // only statuses answering any request for the key are stored, not e.g partial content
+  char *statuses[] = {"206", "304", "302", "500"};
+  for (size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+    WebbHeaders header = {.key = "x-status", .val = statuses[i]};
+    EXPECT(get(cache, "/d", NULL, &header, &res) == atoi(statuses[i]));
+    EXPECT(get(cache, "/d", NULL, &header, &res) == atoi(statuses[i]));
+  }
+  EXPECT(CALLS == 20);
+  WebbHeaders not_found = {.key = "x-status", .val = "404"};
+  EXPECT(get(cache, "/e", NULL, &not_found, &res) == 404);
+  EXPECT(get(cache, "/e", NULL, &not_found, &res) == 404);
+  EXPECT(CALLS == 21);
+
+  // s-maxage takes precedence over max-age
+  WebbHeaders shared = {.key = "x-cache-control", .val = "max-age=0, s-maxage=60"};
+  EXPECT(get(cache, "/c", NULL, &shared, &res) == 200);
+  EXPECT(get(cache, "/c", NULL, &shared, &res) == 200);
+  EXPECT(CALLS == 22);
+
+  http_res_free(&res);
+  webb_cache_free(cache);
+}
+
+TEST(test_cache_expiry) {
+  WebbCache *cache = webb_cache_new(cached_handler, NULL);
+  ASSERT(cache);
+  WebbResponse res = {0};
+  CALLS = 0;
+  WebbHeaders header = {.key = "x-cache-control", .val = "max-age=1"};
+  EXPECT(get(cache, "/a", NULL, &header, &res) == 200);
+  EXPECT(get(cache, "/a", NULL, &header, &res) == 200);
+  EXPECT(CALLS == 1);
+  usleep(2100 * 1000);
+  EXPECT(get(cache, "/a", NULL, &header, &res) == 200);
+  EXPECT(CALLS == 2);
+  http_res_free(&res);
+  webb_cache_free(cache);
+}
+
+TEST(test_cache_budget) {
+  // a single shard with room for a few entries, the least recently used is evicted first
+  WebbCacheOptions opts = {.shards = 1, .max_bytes = 4 * (sizeof(void *) * 16 + 128)};
+  WebbCache *cache = webb_cache_new(cached_handler, &opts);
+  ASSERT(cache);
+  WebbResponse res = {0};
+  CALLS = 0;
+  char uri[16];
+  for (int i = 0; i < 64; i++) {
+    (void) snprintf(uri, sizeof(uri), "/%d", i);
+    EXPECT(get(cache, uri, NULL, NULL, &res) == 200);
+    EXPECT(get(cache, "/0", NULL, NULL, &res) == 200);
+  }
+  EXPECT(CALLS == 64);
+  EXPECT(get(cache, "/1", NULL, NULL, &res) == 200);
+  EXPECT(CALLS == 65);
+
+  // a response evicted while still being sent keeps its body
+  for (int i = 64; i < 128; i++) {
+    WebbResponse other = {0};
+    (void) snprintf(uri, sizeof(uri), "/%d", i);
+    EXPECT(get(cache, uri, NULL, NULL, &other) == 200);
+    http_res_free(&other);
+  }
+  EXPECT(body_is(&res, "/1"));
+
+  http_res_free(&res);
+  webb_cache_free(cache);
+}
+
+static void *slow_request(void *arg) {
+  WebbResponse res = {0};
+  int *ok = arg;
+  *ok = get(CACHE, "/slow", NULL, NULL, &res) == 200 && body_is(&res, "/slow");
+  http_res_free(&res);
+  return NULL;
+}
+
+TEST(test_cache_collapses_misses) {
+  CACHE = webb_cache_new(cached_handler, NULL);
+  ASSERT(CACHE);
+  CALLS = 0;
+  pthread_t threads[8];
+  int ok[8] = {0};
+  for (int i = 0; i < 8; i++)
+    ASSERT(pthread_create(&threads[i], NULL, slow_request, &ok[i]) == 0);
+  for (int i = 0; i < 8; i++) {
+    EXPECT(pthread_join(threads[i], NULL) == 0);
+    EXPECT(ok[i]);
+  }
+  EXPECT(CALLS == 1);
+  webb_cache_free(CACHE);
+}
+
+static void *stuck_request(void *arg) {
+  WebbResponse res = {0};
+  int *ok = arg;
+  *ok = get(CACHE, "/stuck", NULL, NULL, &res) == 200;
+  http_res_free(&res);
+  return NULL;
+}
+
+TEST(test_cache_wait_timeout) {
+  // a miss waits a while for the request computing the same response, then calls the handler itself
+  CACHE = webb_cache_new(cached_handler, NULL);
+  ASSERT(CACHE);
+  CALLS = 0;
+  pthread_t filler;
+  int ok = 0;
+  ASSERT(pthread_create(&filler, NULL, stuck_request, &ok) == 0);
+  while (__atomic_load_n(&CALLS, __ATOMIC_RELAXED) == 0)
+    usleep(1000);
+  WebbResponse res = {0};
+  EXPECT(get(CACHE, "/stuck", NULL, NULL, &res) == 200);
+  EXPECT(__atomic_load_n(&CALLS, __ATOMIC_RELAXED) == 2);
+  http_res_free(&res);
+  EXPECT(pthread_join(filler, NULL) == 0);
+  EXPECT(ok);
+  webb_cache_free(CACHE);
+}
+
+static void yield_request(void *arg) {
+  WebbResponse res = {0};
+  int *ok = arg;
+  *ok = get(CACHE, "/yield", NULL, NULL, &res) == 200 && body_is(&res, "/yield");
+  http_res_free(&res);
+}
+
+TEST(test_cache_same_worker_misses) {
+  // this thread plays the worker, the first request's handler yields back to it while computing the response
+  CACHE = webb_cache_new(cached_handler, NULL);
+  ASSERT(CACHE);
+  CALLS = 0;
+  CoroutinePool pool = {.stack_size = 64 * 1024};
+  int ok[2] = {0};
+  Coroutine *filler = coro_new(&pool, yield_request, &ok[0]);
+  ASSERT(filler);
+  EXPECT(coro_resume(filler) == 0);
+
+  // a request on a coroutine waits for it, yielding too
+  Coroutine *waiter = coro_new(&pool, yield_request, &ok[1]);
+  ASSERT(waiter);
+  EXPECT(coro_resume(waiter) == 0);
+  EXPECT(CALLS == 1);
+
+  // one off a coroutine would block the filler forever, it calls the handler instead
+  WebbResponse res = {0};
+  EXPECT(get(CACHE, "/yield", NULL, NULL, &res) == 200);
+  EXPECT(CALLS == 2);
+  http_res_free(&res);
+
+  EXPECT(coro_resume(filler) == 1);
+  EXPECT(coro_resume(waiter) == 1);
+  EXPECT(ok[0] && ok[1]);
+  EXPECT(CALLS == 2);
+  coro_put(&pool, filler);
+  coro_put(&pool, waiter);
+  coro_pool_free(&pool);
+  webb_cache_free(CACHE);
+}
+
+TEST_MAIN(
+  test_cache_hits,
+  test_cache_uncacheable,
+  test_cache_expiry,
+  test_cache_budget,
+  test_cache_collapses_misses,
+  test_cache_wait_timeout,
+  test_cache_same_worker_misses)
@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+#define LARGE_BODY_LEN 200000
+#define HUGE_BODY_LEN  (2 * 1024 * 1024)
+
+static WebbServer *SERVER;
+static char LARGE[LARGE_BODY_LEN];
+static char HUGE[HUGE_BODY_LEN];
+static char BUF[1024 * 1024];
+static unsigned char PAYLOAD[1 << 24];
+
+typedef struct Headers {
+  char *names[16];
+  char *values[16];
+  size_t len;
+} Headers;
+
+static int collect(void *arg, char *name, char *value) {
+  Headers *headers = arg;
+  if (headers->len == 16) {
+    free(name);
+    free(value);
+    return 1;
+  }
+  headers->names[headers->len] = name;
+  headers->values[headers->len++] = value;
+  return 0;
+}
+
+static const char *find(const Headers *headers, const char *name) {
+  for (size_t i = 0; i < headers->len; i++) {
+    if (strcmp(headers->names[i], name) == 0)
+      return headers->values[i];
+  }
+  return NULL;
+}
+
+static void clear(Headers *headers) {
+  for (size_t i = 0; i < headers->len; i++) {
+    free(headers->names[i]);
+    free(headers->values[i]);
+  }
+  headers->len = 0;
+}
+
+static size_t unhex(const char *hex, unsigned char *out) {
+  size_t len = 0;
+  for (; hex[0] && hex[1]; hex += 2) {
+    if (*hex == ' ')
+      hex--;
+    else
+      out[len++] = (unsigned char) strtol((char[]) {hex[0], hex[1], '\0'}, NULL, 16);
+  }
+  return len;
+}
+
+static int decode_hex(HpackTable *table, const char *hex, Headers *headers) {
+  unsigned char block[256];
+  return hpack_decode(table, block, unhex(hex, block), collect, headers);
+}
+
+static int handler(const WebbRequest *req, WebbResponse *res) {
+  if (strcmp(req->uri, "/large") == 0) {
+    webb_set_body_static(res, LARGE, sizeof(LARGE));
+    return 200;
+  }
+  if (strcmp(req->uri, "/huge") == 0) {
+    webb_set_body_static(res, HUGE, sizeof(HUGE));
+    return 200;
+  }
+  if (strcmp(req->uri, "/echo") == 0) {
+    char *body = malloc(req->body_len + 1);
+    if (!body)
+      return -1;
+    memcpy(body, req->body, req->body_len);
+    webb_set_body(res, body, req->body_len);
+    res->content_type = "text/plain";
+    return 200;
+  }
+  if (strcmp(req->uri, "/hello") != 0)
+    return 404;
+  const char *host = webb_get_header(req, "host");
+  if (webb_set_headerf(res, "x-echo", "%s %s %s", host ? host : "-", req->query ? req->query : "-",
+                       req->method == WEBB_GET ? "GET" : "other") != 0)
+    return -1;
+  res->raw_headers = "x-raw: 1\r\nconnection: close\r\n";
+  webb_set_body_static(res, "hello", 5);
+  return 200;
+}
+
+static int connect_server(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(9531), .sin_addr = {htonl(INADDR_LOOPBACK)}};
+  int nodelay = 1;
+  if (fd != -1)
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  if (fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static size_t receive(int fd, void *buf, size_t len) {
+  // reads exactly len bytes, unless the connection is closed first
+  size_t nread = 0;
+  for (int i = 0; i < 100000 && nread < len; i++) {
+    (void) webb_server_process(SERVER, 16);
+    ssize_t n = recv(fd, (char *) buf + nread, len - nread, MSG_DONTWAIT);
+    if (n == 0)
+      break;
+    if (n > 0)
+      nread += (size_t) n;
+  }
+  return nread;
+}
+
+typedef struct Frame {
+  size_t len;
+  int type;
+  int flags;
+  uint32_t stream;
+} Frame;
+
+static int read_frame(int fd, Frame *frame) {
+  // the payload goes to PAYLOAD
+  unsigned char head[9];
+  if (receive(fd, head, sizeof(head)) != sizeof(head))
+    return 1;
+  frame->len = (size_t) head[0] << 16 | (size_t) head[1] << 8 | head[2];
+  frame->type = head[3];
+  frame->flags = head[4];
+  frame->stream = (uint32_t) head[5] << 24 | (uint32_t) head[6] << 16 | (uint32_t) head[7] << 8 | head[8];
+  return receive(fd, PAYLOAD, frame->len) != frame->len;
+}
+
+static int send_frame(int fd, int type, int flags, uint32_t stream, const void *payload, size_t len) {
+  unsigned char frame[9 + 1024];
+  frame[0] = (unsigned char) (len >> 16);
+  frame[1] = (unsigned char) (len >> 8);
+  frame[2] = (unsigned char) len;
+  frame[3] = (unsigned char) type;
+  frame[4] = (unsigned char) flags;
+  frame[5] = (unsigned char) (stream >> 24);
+  frame[6] = (unsigned char) (stream >> 16);
+  frame[7] = (unsigned char) (stream >> 8);
+  frame[8] = (unsigned char) stream;
+  memcpy(frame + 9, payload, len);
+  return send(fd, frame, 9 + len, 0) != (ssize_t) (9 + len);
+}
+
+static int send_request(int fd, uint32_t stream, const char *method, const char *path, int end_stream) {
+  unsigned char block[512];
+  size_t len = hpack_encode_header(block, ":method", 7, method, strlen(method));
+  len += hpack_encode_header(block + len, ":scheme", 7, "http", 4);
+  len += hpack_encode_header(block + len, ":authority", 10, "example.com", 11);
+  len += hpack_encode_header(block + len, ":path", 5, path, strlen(path));
+  return send_frame(fd, 0x1, 0x4 | (end_stream ? 0x1 : 0), stream, block, len);
+}
+
+static int send_window_update(int fd, uint32_t stream, uint32_t increment) {
+  unsigned char payload[4] = {
+    (unsigned char) (increment >> 24), (unsigned char) (increment >> 16), (unsigned char) (increment >> 8),
+    (unsigned char) increment};
+  return send_frame(fd, 0x8, 0, stream, payload, 4);
+}
+
+static int start_session(int fd, int upgraded) {
+  // the client's preface, then the server's settings, window update and settings ack. after an upgrade, the
+  // response to stream 1 may come before the ack
+  const char *preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  if (send(fd, preface, strlen(preface), 0) != (ssize_t) strlen(preface) || send_frame(fd, 0x4, 0, 0, "", 0) != 0)
+    return 1;
+  Frame frame;
+  if (read_frame(fd, &frame) != 0 || frame.type != 0x4 || frame.flags != 0 || frame.len != 12)
+    return 1;
+  if (read_frame(fd, &frame) != 0 || frame.type != 0x8 || frame.stream != 0)
+    return 1;
+  return !upgraded && (read_frame(fd, &frame) != 0 || frame.type != 0x4 || frame.flags != 0x1);
+}
+
+static int read_response(int fd, HpackTable *table, uint32_t stream, Headers *headers, size_t *body_len) {
+  // the headers and body of one stream, frames of other streams are skipped
+  Frame frame;
+  *body_len = 0;
+  do {
+    if (read_frame(fd, &frame) != 0)
+      return 1;
+    if (frame.stream != stream)
+      continue;
+    if (frame.type == 0x1 && hpack_decode(table, PAYLOAD, frame.len, collect, headers) != 0)
+      return 1;
+    if (frame.type == 0x0) {
+      memcpy(BUF + *body_len, PAYLOAD, frame.len);
+      *body_len += frame.len;
+    }
+  } while (frame.stream != stream || !(frame.flags & 0x1));
+  return 0;
+}
+
+TEST(test_hpack_decode) {
+  // the examples of rfc7541 c.3 and c.4, the same requests without and with huffman coding
+  static const char *const BLOCKS[2][3] = {
+    {"828684410f7777772e6578616d706c652e636f6d", "828684be58086e6f2d6361636865",
+     "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"},
+    {"828684418cf1e3c2e5f23a6ba0ab90f4ff", "828684be5886a8eb10649cbf",
+     "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"},
+  };
+  for (int huffman = 0; huffman < 2; huffman++) {
+    HpackTable table = {.max_size = HPACK_TABLE_SIZE};
+    Headers headers = {0};
+    EXPECT(decode_hex(&table, BLOCKS[huffman][0], &headers) == 0);
+    EXPECT(headers.len == 4);
+    EXPECT(find(&headers, ":method") && strcmp(find(&headers, ":method"), "GET") == 0);
+    EXPECT(find(&headers, ":authority") && strcmp(find(&headers, ":authority"), "www.example.com") == 0);
+    EXPECT(table.size == 57);
+    clear(&headers);
+    EXPECT(decode_hex(&table, BLOCKS[huffman][1], &headers) == 0);
+    EXPECT(headers.len == 5);
+    EXPECT(find(&headers, "cache-control") && strcmp(find(&headers, "cache-control"), "no-cache") == 0);
+    EXPECT(table.size == 110);
+    clear(&headers);
+    EXPECT(decode_hex(&table, BLOCKS[huffman][2], &headers) == 0);
+    EXPECT(headers.len == 5);
+    EXPECT(find(&headers, ":path") && strcmp(find(&headers, ":path"), "/index.html") == 0);
+    EXPECT(find(&headers, "custom-key") && strcmp(find(&headers, "custom-key"), "custom-value") == 0);
+    EXPECT(table.size == 164);
+    clear(&headers);
+    hpack_table_free(&table);
+  }
+
+  // indices past the table, truncated strings and bad padding
+  HpackTable table = {.max_size = HPACK_TABLE_SIZE};
+  Headers headers = {0};
+  EXPECT(decode_hex(&table, "be", &headers) != 0);
+  EXPECT(decode_hex(&table, "410f7777", &headers) != 0);
+  EXPECT(decode_hex(&table, "4181fe", &headers) != 0);
+  clear(&headers);
+  hpack_table_free(&table);
+}
+
+TEST(test_hpack_encode) {
+  unsigned char block[256];
+  size_t len = hpack_encode_status(block, 200);
+  EXPECT(len == 1 && block[0] == 0x88);
+  len += hpack_encode_status(block + len, 418);
+  len += hpack_encode_header(block + len, "Content-Type", 12, "text/html", 9);
+  len += hpack_encode_header(block + len, "X-Custom", 8, "Value", 5);
+  HpackTable table = {.max_size = HPACK_TABLE_SIZE};
+  Headers headers = {0};
+  EXPECT(hpack_decode(&table, block, len, collect, &headers) == 0);
+  EXPECT(headers.len == 4);
+  EXPECT(strcmp(headers.values[0], "200") == 0 && strcmp(headers.values[1], "418") == 0);
+  EXPECT(find(&headers, "content-type") && strcmp(find(&headers, "content-type"), "text/html") == 0);
+  EXPECT(find(&headers, "x-custom") && strcmp(find(&headers, "x-custom"), "Value") == 0);
+  // never indexed, the decoder's table stays empty
+  EXPECT(table.len == 0);
+  clear(&headers);
+  hpack_table_free(&table);
+}
+
+TEST(test_h2_prior_knowledge) {
+  SERVER = webb_server_new("9531", handler, NULL);
+  ASSERT(SERVER);
+  int fd = connect_server();
+  ASSERT(fd != -1);
+  ASSERT(start_session(fd, 0) == 0);
+  HpackTable table = {.max_size = HPACK_TABLE_SIZE};
+  Headers headers = {0};
+  size_t len;
+
+  EXPECT(send_request(fd, 1, "GET", "/hello?a=1", 1) == 0);
+  EXPECT(read_response(fd, &table, 1, &headers, &len) == 0);
+  EXPECT(find(&headers, ":status") && strcmp(find(&headers, ":status"), "200") == 0);
+  EXPECT(find(&headers, "content-length") && strcmp(find(&headers, "content-length"), "5") == 0);
+  EXPECT(find(&headers, "x-echo") && strcmp(find(&headers, "x-echo"), "example.com a=1 GET") == 0);
+  EXPECT(find(&headers, "x-raw") && strcmp(find(&headers, "x-raw"), "1") == 0);
+  EXPECT(!find(&headers, "connection"));
+  EXPECT(len == 5 && memcmp(BUF, "hello", 5) == 0);
+  clear(&headers);
+
+  // a body in two data frames, one of them padded
+  EXPECT(send_request(fd, 3, "POST", "/echo", 0) == 0);
+  EXPECT(send_frame(fd, 0x0, 0, 3, "abc", 3) == 0);
+  EXPECT(send_frame(fd, 0x0, 0x9, 3, "\x02" "def\0\0", 6) == 0);
+  EXPECT(read_response(fd, &table, 3, &headers, &len) == 0);
+  EXPECT(find(&headers, "content-type") && strcmp(find(&headers, "content-type"), "text/plain") == 0);
+  EXPECT(len == 6 && memcmp(BUF, "abcdef", 6) == 0);
+  clear(&headers);
+
+  // pings are answered, head responses have no body
+  EXPECT(send_frame(fd, 0x6, 0, 0, "12345678", 8) == 0);
+  Frame frame;
+  EXPECT(read_frame(fd, &frame) == 0 && frame.type == 0x6 && frame.flags == 0x1);
+  EXPECT(memcmp(PAYLOAD, "12345678", 8) == 0);
+  EXPECT(send_request(fd, 5, "HEAD", "/hello", 1) == 0);
+  EXPECT(read_frame(fd, &frame) == 0 && frame.type == 0x1 && frame.stream == 5 && frame.flags == 0x5);
+
+  // stream ids have to increase, a stream reused is a connection error
+  EXPECT(send_request(fd, 3, "GET", "/hello", 1) == 0);
+  EXPECT(read_frame(fd, &frame) == 0 && frame.type == 0x7);
+  EXPECT(PAYLOAD[3] == 5 && PAYLOAD[7] == 0x5);
+  EXPECT(receive(fd, BUF, 1) == 0);
+  hpack_table_free(&table);
+  EXPECT(close(fd) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST(test_h2c_upgrade) {
+  SERVER = webb_server_new("9531", handler, NULL);
+  ASSERT(SERVER);
+  int fd = connect_server();
+  ASSERT(fd != -1);
+  // the settings of rfc7540 3.2.1's example, 100 streams and the default window
+  const char *req = "GET /hello HTTP/1.1\r\nhost: upgraded\r\nconnection: Upgrade, HTTP2-Settings\r\n"
+                    "upgrade: h2c\r\nhttp2-settings: AAMAAABkAAQAAP__\r\n\r\n";
+  EXPECT(send(fd, req, strlen(req), 0) == (ssize_t) strlen(req));
+  const char *switching = "HTTP/1.1 101 Switching Protocols\r\nconnection: upgrade\r\nupgrade: h2c\r\n\r\n";
+  EXPECT(receive(fd, BUF, strlen(switching)) == strlen(switching));
+  EXPECT(memcmp(BUF, switching, strlen(switching)) == 0);
+  ASSERT(start_session(fd, 1) == 0);
+
+  // the upgrade request is answered on stream 1
+  HpackTable table = {.max_size = HPACK_TABLE_SIZE};
+  Headers headers = {0};
+  size_t len;
+  EXPECT(read_response(fd, &table, 1, &headers, &len) == 0);
+  EXPECT(find(&headers, "x-echo") && strcmp(find(&headers, "x-echo"), "upgraded - GET") == 0);
+  EXPECT(len == 5 && memcmp(BUF, "hello", 5) == 0);
+  clear(&headers);
+  EXPECT(send_request(fd, 3, "GET", "/missing", 1) == 0);
+  EXPECT(read_response(fd, &table, 3, &headers, &len) == 0);
+  EXPECT(find(&headers, ":status") && strcmp(find(&headers, ":status"), "404") == 0);
+  clear(&headers);
+  hpack_table_free(&table);
+  EXPECT(close(fd) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST(test_h2_flow_control) {
+  for (size_t i = 0; i < sizeof(LARGE); i++)
+    LARGE[i] = (char) ('a' + i % 26);
+  SERVER = webb_server_new("9531", handler, NULL);
+  ASSERT(SERVER);
+  int fd = connect_server();
+  ASSERT(fd != -1);
+  ASSERT(start_session(fd, 0) == 0);
+  EXPECT(send_request(fd, 1, "GET", "/large", 1) == 0);
+  EXPECT(send_request(fd, 3, "GET", "/large", 1) == 0);
+
+  // the streams take turns within the default 65535 byte connection window
+  static size_t received[2];
+  size_t total = 0, switches = 0;
+  int last = -1;
+  Frame frame;
+  HpackTable table = {.max_size = HPACK_TABLE_SIZE};
+  Headers headers = {0};
+  while (total < 65535 && read_frame(fd, &frame) == 0) {
+    if (frame.type == 0x1)
+      EXPECT(hpack_decode(&table, PAYLOAD, frame.len, collect, &headers) == 0);
+    if (frame.type != 0x0)
+      continue;
+    int i = frame.stream == 3;
+    EXPECT(memcmp(PAYLOAD, LARGE + received[i], frame.len) == 0);
+    received[i] += frame.len;
+    total += frame.len;
+    switches += last != -1 && last != i;
+    last = i;
+  }
+  EXPECT(total == 65535);
+  EXPECT(switches >= 2);
+  EXPECT(headers.len == 8);
+  clear(&headers);
+  // nothing more until the window is raised
+  EXPECT(receive(fd, BUF, 1) == 0);
+  EXPECT(send_window_update(fd, 0, 1 << 20) == 0);
+  EXPECT(send_window_update(fd, 1, 1 << 20) == 0);
+  EXPECT(send_window_update(fd, 3, 1 << 20) == 0);
+  while ((received[0] < sizeof(LARGE) || received[1] < sizeof(LARGE)) && read_frame(fd, &frame) == 0) {
+    if (frame.type != 0x0)
+      continue;
+    int i = frame.stream == 3;
+    EXPECT(memcmp(PAYLOAD, LARGE + received[i], frame.len) == 0);
+    received[i] += frame.len;
+    if (received[i] == sizeof(LARGE))
+      EXPECT(frame.flags == 0x1);
+  }
+  EXPECT(received[0] == sizeof(LARGE) && received[1] == sizeof(LARGE));
+
+  hpack_table_free(&table);
+  EXPECT(close(fd) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST(test_h2_large_settings) {
+  for (size_t i = 0; i < sizeof(HUGE); i++)
+    HUGE[i] = (char) ('a' + i % 26);
+  SERVER = webb_server_new("9531", handler, NULL);
+  ASSERT(SERVER);
+  int fd = connect_server();
+  ASSERT(fd != -1);
+  ASSERT(start_session(fd, 0) == 0);
+
+  // the largest frames allowed and an 8mb window, like some clients ask for
+  unsigned char settings[] = {0, 0x5, 0, 0xff, 0xff, 0xff, 0, 0x4, 0, 0x80, 0, 0};
+  EXPECT(send_frame(fd, 0x4, 0, 0, settings, sizeof(settings)) == 0);
+  EXPECT(send_window_update(fd, 0, 8 * 1024 * 1024) == 0);
+  Frame frame;
+  EXPECT(read_frame(fd, &frame) == 0 && frame.type == 0x4 && frame.flags == 0x1);
+  EXPECT(send_request(fd, 1, "GET", "/huge", 1) == 0);
+
+  // the body still comes in frames of the default size
+  size_t received = 0, largest = 0;
+  while (received < sizeof(HUGE) && read_frame(fd, &frame) == 0) {
+    if (frame.type != 0x0)
+      continue;
+    EXPECT(memcmp(PAYLOAD, HUGE + received, frame.len) == 0);
+    received += frame.len;
+    largest = frame.len > largest ? frame.len : largest;
+    if (received == sizeof(HUGE))
+      EXPECT(frame.flags == 0x1);
+  }
+  EXPECT(received == sizeof(HUGE));
+  EXPECT(largest == 16384);
+  EXPECT(close(fd) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST_MAIN(
+  test_hpack_decode,
+  test_hpack_encode,
+  test_h2_prior_knowledge,
+  test_h2c_upgrade,
+  test_h2_flow_control,
+  test_h2_large_settings)
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "internal.h"
 #include "libtest.h"
 #include "tmpfile.h"
@@ -11,6 +12,7 @@ static WebbRequest REQ;
 static int open_request(const char *request) {
   if (tmpfile_open(&TMPFILE, request) != 0)
     return 1;
+  http_state_free(&STATE);
   memset(&STATE, 0, sizeof(STATE));
   return 0;
 }
@@ -18,6 +20,7 @@ static int open_request(const char *request) {
 static int reopen_request(const char *request) {
   if (tmpfile_reopen(&TMPFILE, request) != 0)
     return 1;
+  http_state_free(&STATE);
   memset(&STATE, 0, sizeof(STATE));
   return 0;
 }
@@ -34,6 +37,7 @@ TEST(test_parse_curl_example) {
 
   EXPECT(REQ.method == WEBB_GET);
   EXPECT(strcmp(REQ.uri, "/test/a.txt") == 0);
+  EXPECT(strcmp(REQ.target, "/test/a.txt") == 0);
   EXPECT(strcmp(REQ.query, "abc=2") == 0);
   EXPECT(strcmp(webb_get_header(&REQ, "host"), "localhost:8080") == 0);
   EXPECT(strcmp(webb_get_header(&REQ, "user-agent"), "curl/7.77.0") == 0);
@@ -153,6 +157,135 @@ TEST(test_max_header_limit) {
   ASSERT(tmpfile_close(&TMPFILE) == 0);
 }
 
+static char *large_header_request(size_t header_len) {
+  char *request = malloc(header_len + 64), *ptr = request;
+  ptr += sprintf(ptr, "GET / HTTP/1.1\r\nCookie: ");
+  memset(ptr, 'a', header_len);
+  ptr += header_len;
+  (void) sprintf(ptr, "\r\nAccept: */*\r\n\r\n");
+  return request;
+}
+
+TEST(test_large_headers_grow_buffer) {
+  char *request = large_header_request(6000);
+  ASSERT(open_request(request) == 0);
+  EXPECT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_OK);
+  EXPECT(strlen(webb_get_header(&REQ, "cookie")) == 6000);
+  EXPECT(strcmp(webb_get_header(&REQ, "accept"), "*/*") == 0);
+  EXPECT(STATE.cap == 8192);
+  http_req_free(&REQ);
+
+  // buffers are released once a request is done
+  http_state_reset(&STATE);
+  EXPECT(STATE.buf == NULL);
+
+  free(request);
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+}
+
+TEST(test_max_header_size) {
+  char *request = large_header_request(DEFAULT_MAX_HEADER_SIZE);
+  ASSERT(open_request(request) == 0);
+  EXPECT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_HEADERS_TOO_LARGE);
+  http_req_free(&REQ);
+
+  // a larger limit accepts the same request
+  ASSERT(reopen_request(request) == 0);
+  STATE.max_header_size = 4 * DEFAULT_MAX_HEADER_SIZE;
+  EXPECT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_OK);
+  EXPECT(strlen(webb_get_header(&REQ, "cookie")) == DEFAULT_MAX_HEADER_SIZE);
+  http_req_free(&REQ);
+  http_state_free(&STATE);
+
+  free(request);
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+}
+
+TEST(test_pipelined_request_after_body) {
+  const char *request =
+    "POST / HTTP/1.1\r\n"
+    "Content-Length: 5\r\n"
+    "\r\n"
+    "hello"
+    "GET /next HTTP/1.1\r\n\r\n";
+  ASSERT(open_request(request) == 0);
+  ASSERT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_OK);
+  EXPECT(REQ.body_len == 5);
+  EXPECT(memcmp(REQ.body, "hello", 5) == 0);
+  http_req_free(&REQ);
+  http_state_reset(&STATE);
+
+  ASSERT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_OK);
+  EXPECT(REQ.method == WEBB_GET);
+  EXPECT(strcmp(REQ.uri, "/next") == 0);
+  http_req_free(&REQ);
+  http_state_free(&STATE);
+
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+}
+
+TEST(test_parse_response_head) {
+  const char *response =
+    "HTTP/1.1 404 Not Found\r\n"
+    "Content-Length: 3\r\n"
+    "\r\n"
+    "abc";
+  ASSERT(open_request(response) == 0);
+  STATE.response = 1;
+  ASSERT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_OK);
+  EXPECT(STATE.status == 404);
+  EXPECT(REQ.uri == NULL);
+  EXPECT(REQ.body_len == 3);
+  EXPECT(memcmp(REQ.body, "abc", 3) == 0);
+  http_req_free(&REQ);
+
+  // the reason phrase is optional, the status code is not
+  ASSERT(reopen_request("HTTP/1.1 204\r\n\r\n") == 0);
+  STATE.response = 1;
+  EXPECT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_OK);
+  EXPECT(STATE.status == 204);
+  http_req_free(&REQ);
+  const char *invalid[] = {"HTTP/1.1 20 OK\r\n\r\n", "HTTP/2 200 OK\r\n\r\n", "HTTP/1.1 999 No\r\n\r\n"};
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    ASSERT(reopen_request(invalid[i]) == 0);
+    STATE.response = 1;
+    EXPECT(parse_request(TMPFILE.fd, &STATE, &REQ) == RESULT_INVALID_HTTP);
+    http_req_free(&REQ);
+  }
+  http_state_free(&STATE);
+  memset(&STATE, 0, sizeof(STATE));
+
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+}
+
+TEST(test_response_header_arena) {
+  WebbResponse res = {0};
+  webb_set_header_static(&res, "vary", "accept-encoding");
+  EXPECT(webb_set_headerf(&res, "content-range", "bytes %d-%d/%d", 0, 9, 100) == 0);
+  EXPECT(strcmp(res.headers->key, "content-range") == 0);
+  EXPECT(strcmp(res.headers->val, "bytes 0-9/100") == 0);
+  EXPECT(strcmp(res.headers->next->val, "accept-encoding") == 0);
+  size_t used = res.arena_used;
+  EXPECT(used > 0);
+  EXPECT(used <= sizeof(res.arena.buf));
+
+  // once the arena is full headers are allocated instead, and freed with the response
+  char value[WEBB_HEADER_ARENA_SIZE];
+  memset(value, 'v', sizeof(value) - 1);
+  value[sizeof(value) - 1] = '\0';
+  EXPECT(webb_set_headerf(&res, "x-large", "%s", value) == 0);
+  EXPECT(res.arena_used == used);
+  EXPECT(strcmp(res.headers->val, value) == 0);
+  for (int i = 0; i < 64; i++)
+    webb_set_header_static(&res, "x-many", "value");
+  EXPECT(res.arena_used <= sizeof(res.arena.buf));
+  size_t n = 0;
+  for (WebbHeaders *h = res.headers; h; h = h->next)
+    n++;
+  EXPECT(n == 67);
+  http_res_free(&res);
+}
+
 TEST_MAIN(
   test_parse_curl_example,
   test_parse_minimal_request,
@@ -160,4 +293,9 @@ TEST_MAIN(
   test_missing_final_newline,
   test_invalid_http_version,
   test_multiple_requests_per_connection,
-  test_max_header_limit)
+  test_max_header_limit,
+  test_large_headers_grow_buffer,
+  test_max_header_size,
+  test_pipelined_request_after_body,
+  test_parse_response_head,
+  test_response_header_arena)
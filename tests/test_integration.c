@@ -1,31 +1,27 @@
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "libtest.h"
 #include "webb/webb.h"
 
-pid_t start_child_server(WebbHandler *handler, const char *port) {
+pid_t start_child_server(WebbHandler *handler, const WebbServerOptions *opts, const char *port) {
   pid_t pid = fork();
   if (pid == 0)
-    exit(webb_server_run(port, handler));
+    exit(webb_server_run_opts(port, handler, opts));
   if (pid == -1)
     perror("fork");
   return pid;
 }
 
-int open_webb_socket(WebbHandler *handler, pid_t *pid) {
-  // get a new port everytime due to OS race conditions when killing child process
-  static int port_counter = 9000;
-  char port[5];
-  (void) sprintf(port, "%d", port_counter++);
-
-  *pid = start_child_server(handler, port);
-  if (*pid == -1)
-    return -1;
+int connect_webb_socket(const char *port) {
   struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
   struct addrinfo *servinfo;
 
@@ -58,12 +54,70 @@ int open_webb_socket(WebbHandler *handler, pid_t *pid) {
   return -1;
 }
 
+int open_webb_socket_opts(WebbHandler *handler, const WebbServerOptions *opts, pid_t *pid, char *port) {
+  // get a new port everytime due to OS race conditions when killing child process
+  static int port_counter = 9000;
+  (void) sprintf(port, "%d", port_counter++);
+
+  *pid = start_child_server(handler, opts, port);
+  if (*pid == -1)
+    return -1;
+  return connect_webb_socket(port);
+}
+
+int open_webb_socket(WebbHandler *handler, pid_t *pid) {
+  char port[6];
+  return open_webb_socket_opts(handler, NULL, pid, port);
+}
+
 int test_handler(const WebbRequest *req, WebbResponse *res) {
   (void) req;
   webb_set_header(res, "x-libwebb-test", strdup("cool value"));
   return 200;
 }
 
+int fd_range_handler(const WebbRequest *req, WebbResponse *res) {
+  (void) req;
+  FILE *f = tmpfile();
+  if (!f || fputs("hello world", f) == EOF || fflush(f) == EOF)
+    return -1;
+  webb_set_body_fd_range(res, dup(fileno(f)), 6, 5);
+  (void) fclose(f);
+  return 206;
+}
+
+int slow_handler(const WebbRequest *req, WebbResponse *res) {
+  (void) res;
+  if (strcmp(req->uri, "/slow") == 0)
+    (void) usleep(500 * 1000);
+  return 200;
+}
+
+void *counter_init(size_t worker, void *arg) {
+  (void) worker;
+  (void) arg;
+  return calloc(1, sizeof(size_t));
+}
+
+int counter_handler(const WebbRequest *req, WebbResponse *res) {
+  // only the worker's own thread touches its counter
+  size_t *count = req->worker_data;
+  if (!count)
+    return -1;
+  char *value = malloc(64);
+  if (!value)
+    return -1;
+  (void) snprintf(value, 64, "%zu %zu", req->worker, ++*count);
+  webb_set_header(res, "x-worker", value);
+  return 200;
+}
+
+int sleep_handler(const WebbRequest *req, WebbResponse *res) {
+  (void) req;
+  (void) res;
+  return webb_sleep(200) == 0 ? 200 : 500;
+}
+
 TEST(test_sending_minimal_request) {
   pid_t pid;
   int fd = open_webb_socket(test_handler, &pid);
@@ -133,7 +187,308 @@ TEST(test_invalid_request_should_close_connection) {
   ASSERT(kill(pid, SIGKILL) != -1);
 }
 
+TEST(test_fd_range_body) {
+  pid_t pid;
+  int fd = open_webb_socket(fd_range_handler, &pid);
+  ASSERT(fd != -1);
+  ASSERT(pid != -1);
+
+  const char *request = "GET / HTTP/1.1\r\n\r\n";
+  EXPECT(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+
+  char res[4096];
+  ssize_t nread = 0;
+  while (nread < (ssize_t) sizeof(res) - 1) {
+    ssize_t n = read(fd, res + nread, sizeof(res) - 1 - nread);
+    if (n < 1)
+      break;
+    nread += n;
+    res[nread] = '\0';
+    const char *body = strstr(res, "\r\n\r\n");
+    if (body && strlen(body + 4) >= 5)
+      break;
+  }
+  res[nread] = '\0';
+  EXPECT(memcmp(res, "HTTP/1.1 206 Partial Content\r\n", 30) == 0);
+  EXPECT(strstr(res, "content-length: 5\r\n"));
+  const char *body = strstr(res, "\r\n\r\n");
+  ASSERT(body);
+  EXPECT(strcmp(body + 4, "world") == 0);
+
+  EXPECT(close(fd) != -1);
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
+TEST(test_too_large_headers) {
+  pid_t pid;
+  int fd = open_webb_socket(test_handler, &pid);
+  ASSERT(fd != -1);
+  ASSERT(pid != -1);
+
+  char request[16384], *ptr = request;
+  ptr += sprintf(ptr, "GET / HTTP/1.1\r\nCookie: ");
+  memset(ptr, 'a', 12000);
+  ptr += 12000;
+  ptr += sprintf(ptr, "\r\n\r\n");
+  EXPECT(send(fd, request, ptr - request, 0) == ptr - request);
+
+  char res[4096];
+  ssize_t nread = read(fd, res, sizeof(res) - 1);
+  EXPECT(nread > 0);
+  res[nread < 0 ? 0 : nread] = '\0';
+  EXPECT(strstr(res, "HTTP/1.1 431 Request Header Fields Too Large\r\n") == res);
+
+  EXPECT(close(fd) != -1);
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
+TEST(test_connection_limit_sheds_load) {
+  pid_t pid;
+  char port[6];
+  WebbServerOptions opts = {.max_connections = 1, .retry_after = 3, .defer_accept = 1};
+  int fd = open_webb_socket_opts(test_handler, &opts, &pid, port);
+  ASSERT(fd != -1);
+  ASSERT(pid != -1);
+
+  // make sure the first connection has been accepted
+  const char *request = "GET / HTTP/1.1\r\n\r\n";
+  char res[4096];
+  EXPECT(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+  EXPECT(read(fd, res, sizeof(res)) > 0);
+
+  // the request is unread when the connection is shed (accepts are deferred until it arrived), which does not
+  // make the server reset the connection
+  int fd2 = connect_webb_socket(port);
+  ASSERT(fd2 != -1);
+  const char *post = "POST / HTTP/1.1\r\ncontent-length: 5\r\n\r\nhello";
+  EXPECT(send(fd2, post, strlen(post), MSG_NOSIGNAL) == (ssize_t) strlen(post));
+  struct timespec delay = {.tv_nsec = 50 * 1000 * 1000};
+  (void) nanosleep(&delay, NULL);
+  size_t len = 0;
+  ssize_t nread;
+  while ((nread = read(fd2, res + len, sizeof(res) - 1 - len)) > 0)
+    len += (size_t) nread;
+  EXPECT(nread == 0);
+  res[len] = '\0';
+  EXPECT(strstr(res, "HTTP/1.1 503 Service Unavailable\r\n") == res);
+  EXPECT(strstr(res, "retry-after: 3\r\n"));
+  EXPECT(close(fd2) != -1);
+
+  // once the first connection is closed there is room again
+  EXPECT(close(fd) != -1);
+  int accepted = 0;
+  for (int i = 0; i < 100 && !accepted; i++) {
+    fd = connect_webb_socket(port);
+    ASSERT(fd != -1);
+    EXPECT(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+    nread = read(fd, res, sizeof(res) - 1);
+    accepted = nread > 17 && memcmp(res, "HTTP/1.1 200 OK\r\n", 17) == 0;
+    EXPECT(close(fd) != -1);
+  }
+  EXPECT(accepted);
+
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
+static int find_socket(int port, int listening) {
+  // the listener, or a connection accepted by it, among the fds of this process
+  for (int fd = 3; fd < 1024; fd++) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int accepting = 0;
+    socklen_t len = sizeof(accepting);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == -1 || accepting != listening)
+      continue;
+    if (getsockname(fd, (struct sockaddr *) &addr, &addr_len) == -1)
+      continue;
+    if ((addr.ss_family == AF_INET && ntohs(((struct sockaddr_in *) &addr)->sin_port) == port)
+        || (addr.ss_family == AF_INET6 && ntohs(((struct sockaddr_in6 *) &addr)->sin6_port) == port))
+      return fd;
+  }
+  return -1;
+}
+
+static int get_int_option(int fd, int level, int name) {
+  int val = -1;
+  socklen_t len = sizeof(val);
+  return getsockopt(fd, level, name, &val, &len) == -1 ? -1 : val;
+}
+
+TEST(test_socket_options) {
+  // embedded, so the server's sockets are in this process
+  WebbServerOptions opts = {
+    .defer_accept = 1,
+    .fastopen_queue = 16,
+    .send_buffer_size = 65536,
+    .recv_buffer_size = 65536,
+  };
+  WebbServer *server = webb_server_new("9560", test_handler, &opts);
+  ASSERT(server);
+  int listener = find_socket(9560, 1);
+  ASSERT(listener != -1);
+  EXPECT(get_int_option(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT) > 0);
+  EXPECT(get_int_option(listener, IPPROTO_TCP, TCP_FASTOPEN) == 16);
+  // the kernel doubles the sizes asked for, to account for its own bookkeeping
+  EXPECT(get_int_option(listener, SOL_SOCKET, SO_SNDBUF) >= 65536);
+  EXPECT(get_int_option(listener, SOL_SOCKET, SO_RCVBUF) >= 65536);
+
+  // with a deferred accept the connection is only handed to the server once the request arrives
+  int fd = connect_webb_socket("9560");
+  ASSERT(fd != -1);
+  const char *request = "GET / HTTP/1.1\r\n\r\n";
+  EXPECT(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  for (int i = 0; i < 100 && poll(&pfd, 1, 10) == 0; i++)
+    EXPECT(webb_server_process(server, 16) != -1);
+  char res[4096];
+  ssize_t nread = read(fd, res, sizeof(res) - 1);
+  EXPECT(nread > 17);
+  res[nread < 0 ? 0 : nread] = '\0';
+  EXPECT(memcmp(res, "HTTP/1.1 200 OK\r\n", 17) == 0);
+
+  // nodelay is inherited by the accepted connection
+  int accepted = find_socket(9560, 0);
+  EXPECT(accepted != -1);
+  EXPECT(get_int_option(accepted, IPPROTO_TCP, TCP_NODELAY) == 1);
+
+  EXPECT(close(fd) != -1);
+  webb_server_free(server);
+}
+
+TEST(test_pinned_workers) {
+  pid_t pid;
+  char port[6];
+  WebbServerOptions opts = {.pin_workers = 1};
+  int fds[16];
+  fds[0] = open_webb_socket_opts(test_handler, &opts, &pid, port);
+  ASSERT(fds[0] != -1);
+  ASSERT(pid != -1);
+  for (int i = 1; i < 16; i++) {
+    fds[i] = connect_webb_socket(port);
+    ASSERT(fds[i] != -1);
+  }
+
+  // every connection is accepted by one of the workers, whichever cpu it arrived on
+  const char *request = "GET / HTTP/1.1\r\n\r\n";
+  for (int i = 0; i < 16; i++) {
+    EXPECT(send(fds[i], request, strlen(request), 0) == (ssize_t) strlen(request));
+    char res[4096];
+    ssize_t nread = read(fds[i], res, sizeof(res));
+    EXPECT(nread > 17);
+    EXPECT(memcmp(res, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    EXPECT(close(fds[i]) != -1);
+  }
+
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
+TEST(test_busy_worker_avoided) {
+#ifdef WEBB_NO_THREADS
+  // a single event loop cannot move work away from its own slow handler
+  return;
+#endif
+  pid_t pid;
+  char port[6];
+  int slow = open_webb_socket_opts(slow_handler, NULL, &pid, port);
+  ASSERT(slow != -1);
+  ASSERT(pid != -1);
+
+  const char *request = "GET /slow HTTP/1.1\r\n\r\n";
+  EXPECT(send(slow, request, strlen(request), 0) == (ssize_t) strlen(request));
+  (void) usleep(50 * 1000);
+
+  // more connections than workers, round robin would put one of them behind the slow request
+  request = "GET /fast HTTP/1.1\r\n\r\n";
+  struct timespec start, end;
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < 12; i++) {
+    int fd = connect_webb_socket(port);
+    ASSERT(fd != -1);
+    EXPECT(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+    char res[4096];
+    EXPECT(read(fd, res, sizeof(res)) > 17);
+    EXPECT(close(fd) != -1);
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  EXPECT((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 < 300);
+
+  EXPECT(close(slow) != -1);
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
+TEST(test_worker_data) {
+  pid_t pid;
+  char port[6];
+  WebbServerOptions opts = {.worker_init = counter_init};
+  int fd = open_webb_socket_opts(counter_handler, &opts, &pid, port);
+  ASSERT(fd != -1);
+  ASSERT(pid != -1);
+
+  // a connection stays on its worker, so it sees that worker's counter go up
+  const char *request = "GET / HTTP/1.1\r\n\r\n";
+  size_t worker = 0;
+  for (size_t i = 1; i <= 3; i++) {
+    EXPECT(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+    char res[4096];
+    ssize_t nread = read(fd, res, sizeof(res) - 1);
+    ASSERT(nread > 17);
+    res[nread] = '\0';
+    const char *header = strstr(res, "x-worker: ");
+    ASSERT(header);
+    size_t index, count;
+    EXPECT(sscanf(header, "x-worker: %zu %zu", &index, &count) == 2);
+    if (i == 1)
+      worker = index;
+    EXPECT(index == worker);
+    EXPECT(index < 8);
+    EXPECT(count == i);
+  }
+
+  EXPECT(close(fd) != -1);
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
+TEST(test_coroutine_handlers) {
+  pid_t pid;
+  char port[6];
+  WebbServerOptions opts = {.coroutine_stack_size = 64 * 1024};
+  int fds[32];
+  fds[0] = open_webb_socket_opts(sleep_handler, &opts, &pid, port);
+  ASSERT(fds[0] != -1);
+  ASSERT(pid != -1);
+  for (int i = 1; i < 32; i++) {
+    fds[i] = connect_webb_socket(port);
+    ASSERT(fds[i] != -1);
+  }
+
+  // far more sleeping handlers than workers, they all sleep at the same time
+  const char *request = "GET / HTTP/1.1\r\n\r\n";
+  struct timespec start, end;
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < 32; i++)
+    EXPECT(send(fds[i], request, strlen(request), 0) == (ssize_t) strlen(request));
+  for (int i = 0; i < 32; i++) {
+    char res[4096];
+    ssize_t nread = read(fds[i], res, sizeof(res));
+    EXPECT(nread > 17);
+    EXPECT(memcmp(res, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    EXPECT(close(fds[i]) != -1);
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  EXPECT((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 < 600);
+
+  ASSERT(kill(pid, SIGKILL) != -1);
+}
+
 TEST_MAIN(
   test_sending_minimal_request,
   test_multiple_requests_per_connection,
-  test_invalid_request_should_close_connection)
+  test_fd_range_body,
+  test_invalid_request_should_close_connection,
+  test_too_large_headers,
+  test_connection_limit_sheds_load,
+  test_socket_options,
+  test_pinned_workers,
+  test_busy_worker_avoided,
+  test_worker_data,
+  test_coroutine_handlers)
@@ -0,0 +1,116 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+static RateLimiter LIMITER;
+static size_t ALLOWED;
+
+static struct sockaddr_storage address(const char *ip) {
+  struct sockaddr_storage addr = {0};
+  struct sockaddr_in *in = (struct sockaddr_in *) &addr;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &addr;
+  if (inet_pton(AF_INET, ip, &in->sin_addr) == 1)
+    in->sin_family = AF_INET;
+  else if (inet_pton(AF_INET6, ip, &in6->sin6_addr) == 1)
+    in6->sin6_family = AF_INET6;
+  return addr;
+}
+
+static int allow(const char *ip, uint64_t now_us) {
+  struct sockaddr_storage addr = address(ip);
+  return rate_limiter_allow(&LIMITER, (struct sockaddr *) &addr, now_us);
+}
+
+TEST(test_rate_limit_bucket) {
+  WebbServerOptions opts = {.rate_limit = 10, .rate_limit_burst = 3};
+  ASSERT(rate_limiter_init(&LIMITER, &opts) == 0);
+  // a full burst at once, then one request per 100ms
+  uint64_t now = 1000000;
+  EXPECT(allow("10.0.0.1", now));
+  EXPECT(allow("10.0.0.1", now));
+  EXPECT(allow("10.0.0.1", now));
+  EXPECT(!allow("10.0.0.1", now));
+  EXPECT(!allow("10.0.0.1", now + 99999));
+  EXPECT(allow("10.0.0.1", now + 100000));
+  EXPECT(!allow("10.0.0.1", now + 100000));
+  // other clients have their own bucket
+  EXPECT(allow("10.0.0.2", now));
+  // idle long enough, the bucket is full again but not fuller
+  now += 10000000;
+  EXPECT(allow("10.0.0.1", now));
+  EXPECT(allow("10.0.0.1", now));
+  EXPECT(allow("10.0.0.1", now));
+  EXPECT(!allow("10.0.0.1", now));
+  rate_limiter_free(&LIMITER);
+
+  opts = (WebbServerOptions){0};
+  ASSERT(rate_limiter_init(&LIMITER, &opts) == 0);
+  for (int i = 0; i < 100; i++)
+    EXPECT(allow("10.0.0.1", now));
+  rate_limiter_free(&LIMITER);
+}
+
+TEST(test_rate_limit_prefixes) {
+  WebbServerOptions opts = {.rate_limit = 1, .rate_limit_ipv4_prefix = 24};
+  ASSERT(rate_limiter_init(&LIMITER, &opts) == 0);
+  uint64_t now = 1000000;
+  EXPECT(allow("192.168.1.1", now));
+  EXPECT(!allow("192.168.1.200", now));
+  EXPECT(!allow("::ffff:192.168.1.7", now));
+  EXPECT(allow("192.168.2.1", now));
+
+  // the default ipv6 prefix is 64 bits
+  EXPECT(allow("2001:db8:1:2::1", now));
+  EXPECT(!allow("2001:db8:1:2:ffff::1", now));
+  EXPECT(allow("2001:db8:1:3::1", now));
+  EXPECT(allow("::", now));
+
+  // only ip addresses are limited
+  struct sockaddr_un un = {.sun_family = AF_UNIX};
+  EXPECT(rate_limiter_allow(&LIMITER, (struct sockaddr *) &un, now));
+  EXPECT(rate_limiter_allow(&LIMITER, (struct sockaddr *) &un, now));
+  EXPECT(rate_limiter_allow(&LIMITER, NULL, now));
+  rate_limiter_free(&LIMITER);
+}
+
+TEST(test_rate_limit_full_table) {
+  // more clients than slots, the ones idle the longest are forgotten and new clients are never refused
+  WebbServerOptions opts = {.rate_limit = 1, .rate_limit_clients = 16};
+  ASSERT(rate_limiter_init(&LIMITER, &opts) == 0);
+  EXPECT(LIMITER.nsets == 2);
+  char ip[32];
+  for (int i = 0; i < 1000; i++) {
+    (void) snprintf(ip, sizeof(ip), "10.0.%d.%d", i / 256, i % 256);
+    EXPECT(allow(ip, 1000000 + (uint64_t) i));
+  }
+  // the most recent clients are still limited
+  EXPECT(!allow(ip, 2000000));
+  rate_limiter_free(&LIMITER);
+}
+
+static void *hammer(void *arg) {
+  (void) arg;
+  for (int i = 0; i < 10000; i++) {
+    if (allow("10.1.2.3", 5000000))
+      __atomic_add_fetch(&ALLOWED, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+TEST(test_rate_limit_concurrent) {
+  // the burst is handed out exactly once, however many workers race for it
+  WebbServerOptions opts = {.rate_limit = 1, .rate_limit_burst = 1000};
+  ASSERT(rate_limiter_init(&LIMITER, &opts) == 0);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    ASSERT(pthread_create(&threads[i], NULL, hammer, NULL) == 0);
+  for (int i = 0; i < 4; i++)
+    EXPECT(pthread_join(threads[i], NULL) == 0);
+  EXPECT(ALLOWED == 1000);
+  rate_limiter_free(&LIMITER);
+}
+
+TEST_MAIN(test_rate_limit_bucket, test_rate_limit_prefixes, test_rate_limit_full_table, test_rate_limit_concurrent)
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include "internal.h"
+#include "libtest.h"
+#include "tmpfile.h"
+#include "webb/webb.h"
+
+static TmpFile TMPFILE;
+
+static AccessLogRecord record(int status, const char *target) {
+  AccessLogRecord r = {.time = 0, .method = WEBB_GET, .status = status, .body_len = 11, .duration_us = 5};
+  (void) snprintf(r.target, sizeof(r.target), "%s", target);
+  return r;
+}
+
+static void read_log(char *buf, size_t len) {
+  ssize_t nread = pread(TMPFILE.fd, buf, len - 1, 0);
+  buf[nread < 0 ? 0 : nread] = '\0';
+}
+
+TEST(test_access_log_flush) {
+  ASSERT(tmpfile_open(&TMPFILE, "") == 0);
+  AccessLog log;
+  ASSERT(access_log_init(&log, TMPFILE.fd, 2) == 0);
+
+  AccessLogRecord a = record(200, "/a?b=c"), b = record(404, "/missing");
+  EXPECT(access_log_push(&log.rings[0], &a) == 0);
+  EXPECT(access_log_push(&log.rings[1], &b) == 0);
+  EXPECT(access_log_flush(&log) == 2);
+  EXPECT(access_log_flush(&log) == 0);
+
+  char buf[256];
+  read_log(buf, sizeof(buf));
+  EXPECT(strstr(buf, "1970-01-01T00:00:00Z GET /a?b=c 200 11 5us\n"));
+  EXPECT(strstr(buf, "1970-01-01T00:00:00Z GET /missing 404 11 5us\n"));
+
+  access_log_free(&log);
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+}
+
+TEST(test_access_log_full_ring_drops) {
+  ASSERT(tmpfile_open(&TMPFILE, "") == 0);
+  AccessLog log;
+  ASSERT(access_log_init(&log, TMPFILE.fd, 1) == 0);
+
+  AccessLogRecord r = record(200, "/");
+  for (int i = 0; i < ACCESS_LOG_RING_SIZE; i++)
+    EXPECT(access_log_push(&log.rings[0], &r) == 0);
+  EXPECT(access_log_push(&log.rings[0], &r) != 0);
+  EXPECT(log.rings[0].dropped == 1);
+  EXPECT(access_log_flush(&log) == ACCESS_LOG_RING_SIZE);
+  EXPECT(log.rings[0].dropped == 0);
+
+  // space is available again once flushed
+  EXPECT(access_log_push(&log.rings[0], &r) == 0);
+  EXPECT(access_log_flush(&log) == 1);
+
+  access_log_free(&log);
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+}
+
+TEST(test_access_log_writer_thread) {
+#ifndef WEBB_NO_THREADS
+  ASSERT(tmpfile_open(&TMPFILE, "") == 0);
+  AccessLog log;
+  ASSERT(access_log_init(&log, TMPFILE.fd, 1) == 0);
+  ASSERT(access_log_start(&log) == 0);
+
+  AccessLogRecord r = record(201, "/created");
+  EXPECT(access_log_push(&log.rings[0], &r) == 0);
+  access_log_free(&log);  // stops the writer, flushing everything pending
+
+  char buf[256];
+  read_log(buf, sizeof(buf));
+  EXPECT(strstr(buf, "GET /created 201 11 5us\n"));
+  ASSERT(tmpfile_close(&TMPFILE) == 0);
+#else
+  (void) test_failed;  // there is no writer thread to test
+#endif
+}
+
+TEST(test_log_rate_limit) {
+  log_set_rate_limit(3);
+  int allowed = 0;
+  for (int i = 0; i < 100; i++)
+    allowed += log_allowed();
+  // the one second window may roll over during the loop
+  EXPECT(allowed >= 3);
+  EXPECT(allowed <= 6);
+
+  log_set_rate_limit(0);
+  for (int i = 0; i < 100; i++)
+    EXPECT(log_allowed());
+}
+
+TEST_MAIN(test_access_log_flush, test_access_log_full_ring_drops, test_access_log_writer_thread, test_log_rate_limit)
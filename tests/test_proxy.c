@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+#define LARGE_BODY_LEN (4 * 1024 * 1024)
+
+static WebbServer *SERVERS[3];
+static WebbProxy *PROXY;
+static char LARGE[LARGE_BODY_LEN];
+static char BUF[LARGE_BODY_LEN + 4096];
+
+static int backend(const WebbRequest *req, WebbResponse *res, char *name) {
+  // the port of the proxy's connection tells whether it was reused
+  const struct sockaddr_in *peer = (const struct sockaddr_in *) (const void *) req->peer;
+  webb_set_header_static(res, "x-backend", name);
+  if (webb_set_headerf(res, "x-peer-port", "%d", ntohs(peer->sin_port)) != 0)
+    return -1;
+  const char *forwarded = webb_get_header(req, "x-forwarded-for");
+  if (forwarded && webb_set_headerf(res, "x-seen-forwarded-for", "%s", forwarded) != 0)
+    return -1;
+  if (webb_set_headerf(res, "x-target", "%s", req->target) != 0)
+    return -1;
+  if (strcmp(req->uri, "/large") == 0) {
+    webb_set_body_static(res, LARGE, sizeof(LARGE));
+    return 200;
+  }
+  if (strcmp(req->uri, "/chunked") == 0)
+    webb_set_header_static(res, "transfer-encoding", "chunked");
+  char *body = malloc(req->body_len + 256);
+  if (!body)
+    return -1;
+  int len = sprintf(body, "%s %s?%s ", webb_method_str(req->method), req->uri, req->query ? req->query : "");
+  memcpy(body + len, req->body ? req->body : "", req->body_len);
+  webb_set_body(res, body, (size_t) len + req->body_len);
+  res->content_type = "text/plain";
+  return strcmp(req->uri, "/missing") == 0 ? 404 : 200;
+}
+
+static int backend_a(const WebbRequest *req, WebbResponse *res) {
+  return backend(req, res, "a");
+}
+
+static int backend_b(const WebbRequest *req, WebbResponse *res) {
+  return backend(req, res, "b");
+}
+
+static int proxy_handler(const WebbRequest *req, WebbResponse *res) {
+  return webb_proxy_handle(PROXY, req, res);
+}
+
+static int start(WebbProxyBalance balance, const char *second_upstream) {
+  for (size_t i = 0; i < sizeof(LARGE); i++)
+    LARGE[i] = (char) ('a' + i % 26);
+  const char *upstreams[] = {"127.0.0.1:9511", second_upstream, NULL};
+  WebbProxyOptions proxy_opts = {.upstreams = upstreams, .balance = balance};
+  PROXY = webb_proxy_new(&proxy_opts);
+  WebbServerOptions opts = {.coroutine_stack_size = 64 * 1024, .send_buffer_size = 65536};
+  SERVERS[0] = webb_server_new("9511", backend_a, NULL);
+  SERVERS[1] = webb_server_new("9512", backend_b, NULL);
+  SERVERS[2] = webb_server_new("9513", proxy_handler, &opts);
+  return !PROXY || !SERVERS[0] || !SERVERS[1] || !SERVERS[2];
+}
+
+static void stop(void) {
+  // the proxy's server first, its responses return their upstream connections to the proxy
+  webb_server_free(SERVERS[2]);
+  webb_proxy_free(PROXY);
+  webb_server_free(SERVERS[0]);
+  webb_server_free(SERVERS[1]);
+}
+
+static void drive(int rounds) {
+  // single threaded, the proxy and its upstreams are driven in turn
+  for (int i = 0; i < rounds; i++) {
+    for (int j = 0; j < 3; j++)
+      (void) webb_server_process(SERVERS[j], 16);
+  }
+}
+
+static int connect_proxy(int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(9513), .sin_addr = {htonl(INADDR_LOOPBACK)}};
+  if (fd != -1 && rcvbuf)
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static size_t request(int fd, const char *req) {
+  // sends req and reads the whole response into BUF
+  if (send(fd, req, strlen(req), 0) != (ssize_t) strlen(req))
+    return 0;
+  size_t nread = 0;
+  BUF[0] = '\0';
+  for (int i = 0; i < 1000000; i++) {
+    drive(1);
+    ssize_t n = recv(fd, BUF + nread, sizeof(BUF) - 1 - nread, MSG_DONTWAIT);
+    if (n == 0)
+      break;
+    if (n > 0)
+      nread += (size_t) n;
+    BUF[nread] = '\0';
+    const char *end = strstr(BUF, "\r\n\r\n"), *length = strstr(BUF, "content-length: ");
+    if (end && length && nread >= (size_t) (end + 4 - BUF) + strtoul(length + 16, NULL, 10))
+      break;
+  }
+  return nread;
+}
+
+static int header(const char *name, char *val, size_t len) {
+  const char *h = strstr(BUF, name);
+  if (!h || h > strstr(BUF, "\r\n\r\n"))
+    return 1;
+  h += strlen(name) + 2;
+  size_t n = strcspn(h, "\r");
+  if (n >= len)
+    return 1;
+  memcpy(val, h, n);
+  val[n] = '\0';
+  return 0;
+}
+
+TEST(test_proxy_round_robin_keep_alive) {
+  ASSERT(start(WEBB_PROXY_ROUND_ROBIN, "127.0.0.1:9512") == 0);
+  int fd = connect_proxy(0);
+  ASSERT(fd != -1);
+  char backends[4][8], ports[4][8], expected[64], req[64];
+  for (int i = 0; i < 4; i++) {
+    (void) sprintf(req, "GET /echo%%20me?x=%d HTTP/1.1\r\n\r\n", i);
+    EXPECT(request(fd, req) > 0);
+    EXPECT(strstr(BUF, "HTTP/1.1 200 OK\r\n") == BUF);
+    EXPECT(strstr(BUF, "content-type: text/plain\r\n"));
+    EXPECT(header("x-backend", backends[i], sizeof(backends[i])) == 0);
+    EXPECT(header("x-peer-port", ports[i], sizeof(ports[i])) == 0);
+    EXPECT(header("x-seen-forwarded-for", expected, sizeof(expected)) == 0 && strcmp(expected, "127.0.0.1") == 0);
+    (void) sprintf(expected, "\r\n\r\nGET /echo me?x=%d ", i);
+    EXPECT(strstr(BUF, expected));
+  }
+  // the upstreams are taken in turn, each over the connection its previous request used
+  EXPECT(strcmp(backends[0], backends[1]) != 0);
+  EXPECT(strcmp(backends[0], backends[2]) == 0);
+  EXPECT(strcmp(backends[1], backends[3]) == 0);
+  EXPECT(strcmp(ports[0], ports[2]) == 0);
+  EXPECT(strcmp(ports[1], ports[3]) == 0);
+
+  EXPECT(request(fd, "POST /echo HTTP/1.1\r\ncontent-length: 5\r\nx-forwarded-for: 10.0.0.1\r\n\r\nhello") > 0);
+  EXPECT(strstr(BUF, "\r\n\r\nPOST /echo? hello"));
+  EXPECT(header("x-seen-forwarded-for", expected, sizeof(expected)) == 0);
+  EXPECT(strcmp(expected, "10.0.0.1, 127.0.0.1") == 0);
+  EXPECT(request(fd, "GET /missing HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(strstr(BUF, "HTTP/1.1 404 Not Found\r\n") == BUF);
+
+  // the target is forwarded as received, an encoded slash or dot segment is not decoded into the path
+  EXPECT(request(fd, "GET /a%2Fb/%2e%2e/c+d?q=%2F HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(header("x-target", expected, sizeof(expected)) == 0 && strcmp(expected, "/a%2Fb/%2e%2e/c+d") == 0);
+  EXPECT(strstr(BUF, "\r\n\r\nGET /a/b/../c d?q=%2F "));
+
+  EXPECT(close(fd) != -1);
+  stop();
+}
+
+TEST(test_proxy_splices_large_bodies) {
+  ASSERT(start(WEBB_PROXY_ROUND_ROBIN, "127.0.0.1:9512") == 0);
+  int fd = connect_proxy(0);
+  ASSERT(fd != -1);
+  char ports[2][8];
+  size_t nread = request(fd, "GET /large HTTP/1.1\r\n\r\n");
+  const char *body = strstr(BUF, "\r\n\r\n");
+  ASSERT(body);
+  body += 4;
+  EXPECT(nread - (size_t) (body - BUF) == sizeof(LARGE));
+  EXPECT(memcmp(body, LARGE, sizeof(LARGE)) == 0);
+  EXPECT(header("x-peer-port", ports[0], sizeof(ports[0])) == 0);
+
+  // once the body was read from it, the upstream connection is reused
+  EXPECT(request(fd, "GET /b HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(request(fd, "GET /a HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(header("x-peer-port", ports[1], sizeof(ports[1])) == 0);
+  EXPECT(strcmp(ports[0], ports[1]) == 0);
+
+  EXPECT(close(fd) != -1);
+  stop();
+}
+
+TEST(test_proxy_least_connections) {
+  ASSERT(start(WEBB_PROXY_LEAST_CONNECTIONS, "127.0.0.1:9512") == 0);
+  // a large body the client does not read keeps its upstream busy, the other one gets the next requests
+  int slow = connect_proxy(4096), fd = connect_proxy(0);
+  ASSERT(slow != -1);
+  ASSERT(fd != -1);
+  const char *large = "GET /large HTTP/1.1\r\n\r\n";
+  EXPECT(send(slow, large, strlen(large), 0) == (ssize_t) strlen(large));
+  drive(1000);
+  char other[8];
+  for (int i = 0; i < 3; i++) {
+    EXPECT(request(fd, "GET / HTTP/1.1\r\n\r\n") > 0);
+    EXPECT(header("x-backend", other, sizeof(other)) == 0);
+    EXPECT(strcmp(other, "b") == 0);
+  }
+  EXPECT(recv(slow, BUF, 1, 0) == 1);
+  EXPECT(close(slow) != -1);
+  EXPECT(close(fd) != -1);
+  stop();
+}
+
+TEST(test_proxy_bad_gateway) {
+  // nothing listens on the second upstream
+  ASSERT(start(WEBB_PROXY_ROUND_ROBIN, "127.0.0.1:9519") == 0);
+  int fd = connect_proxy(0);
+  ASSERT(fd != -1);
+  EXPECT(request(fd, "GET /chunked HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(strstr(BUF, "HTTP/1.1 502 Bad Gateway\r\n") == BUF);
+  EXPECT(request(fd, "GET / HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(strstr(BUF, "HTTP/1.1 502 Bad Gateway\r\n") == BUF);
+  EXPECT(request(fd, "GET / HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(strstr(BUF, "HTTP/1.1 200 OK\r\n") == BUF);
+  EXPECT(close(fd) != -1);
+  stop();
+
+  const char *invalid[] = {"localhost", "[::1:80", NULL};
+  for (const char **upstream = invalid; *upstream; upstream++) {
+    const char *upstreams[] = {*upstream, NULL};
+    WebbProxyOptions opts = {.upstreams = upstreams};
+    EXPECT(webb_proxy_new(&opts) == NULL);
+  }
+  WebbProxyOptions none = {0};
+  EXPECT(webb_proxy_new(&none) == NULL);
+}
+
+static int listen_raw(const char *port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET, .sin_port = htons((uint16_t) atoi(port)), .sin_addr = {htonl(INADDR_LOOPBACK)}};
+  if (fd == -1)
+    return -1;
+  (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 8) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *broken_backend(void *arg) {
+  // the first connection gets part of a head before being closed, the second nothing until the proxy gives up
+  int listener = *(int *) arg;
+  for (int i = 0; i < 2; i++) {
+    char buf[4096];
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1)
+      return NULL;
+    (void) recv(fd, buf, sizeof(buf), 0);
+    if (i == 0)
+      (void) send(fd, "HTTP/1.1 200 OK\r\nContent-Le", 27, MSG_NOSIGNAL);
+    else
+      (void) recv(fd, buf, sizeof(buf), 0);
+    (void) close(fd);
+  }
+  return NULL;
+}
+
+TEST(test_proxy_broken_upstream) {
+  ASSERT(start(WEBB_PROXY_ROUND_ROBIN, NULL) == 0);
+  webb_proxy_free(PROXY);
+  const char *upstreams[] = {"127.0.0.1:9518", NULL};
+  WebbProxyOptions proxy_opts = {.upstreams = upstreams, .timeout = 200};
+  PROXY = webb_proxy_new(&proxy_opts);
+  ASSERT(PROXY);
+  int listener = listen_raw("9518");
+  ASSERT(listener != -1);
+  pthread_t thread;
+  ASSERT(pthread_create(&thread, NULL, broken_backend, &listener) == 0);
+  int fd = connect_proxy(0);
+  ASSERT(fd != -1);
+
+  // a head cut short by the upstream closing is a bad gateway, an upstream never answering times out
+  EXPECT(request(fd, "GET / HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(strstr(BUF, "HTTP/1.1 502 Bad Gateway\r\n") == BUF);
+  EXPECT(request(fd, "GET / HTTP/1.1\r\n\r\n") > 0);
+  EXPECT(strstr(BUF, "HTTP/1.1 504 Gateway Timeout\r\n") == BUF);
+
+  EXPECT(pthread_join(thread, NULL) == 0);
+  EXPECT(close(fd) != -1);
+  EXPECT(close(listener) != -1);
+  stop();
+}
+
+TEST_MAIN(
+  test_proxy_round_robin_keep_alive,
+  test_proxy_splices_large_bodies,
+  test_proxy_least_connections,
+  test_proxy_bad_gateway,
+  test_proxy_broken_upstream)
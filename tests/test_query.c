@@ -0,0 +1,92 @@
+#include <string.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+static int slice_is(const WebbSlice *slice, const char *s) {
+  return slice->len == strlen(s) && memcmp(slice->ptr, s, slice->len) == 0;
+}
+
+TEST(test_query_next) {
+  char query[] = "a=1&&b=two%20words&flag&=x&";
+  WebbRequest req = {.query = query};
+  WebbQueryParam param;
+  size_t pos = 0;
+  ASSERT(webb_query_next(&req, &pos, &param) == 0);
+  EXPECT(slice_is(&param.key, "a") && slice_is(&param.value, "1"));
+  ASSERT(webb_query_next(&req, &pos, &param) == 0);
+  EXPECT(slice_is(&param.key, "b") && slice_is(&param.value, "two%20words"));
+  ASSERT(webb_query_next(&req, &pos, &param) == 0);
+  EXPECT(slice_is(&param.key, "flag") && param.value.len == 0);
+  ASSERT(webb_query_next(&req, &pos, &param) == 0);
+  EXPECT(param.key.len == 0 && slice_is(&param.value, "x"));
+  EXPECT(webb_query_next(&req, &pos, &param) != 0);
+  EXPECT(webb_query_next(&req, &pos, &param) != 0);
+
+  WebbRequest empty = {.query = NULL};
+  pos = 0;
+  EXPECT(webb_query_next(&empty, &pos, &param) != 0);
+}
+
+TEST(test_query_get) {
+  char query[] = "x=1&a%20b=2&c+d=3&a=4&a=5&bad=%zz";
+  WebbRequest req = {.query = query};
+  WebbSlice value;
+  ASSERT(webb_query_get(&req, "a", &value) == 0);
+  EXPECT(slice_is(&value, "4"));
+  ASSERT(webb_query_get(&req, "a b", &value) == 0);
+  EXPECT(slice_is(&value, "2"));
+  ASSERT(webb_query_get(&req, "c d", &value) == 0);
+  EXPECT(slice_is(&value, "3"));
+  EXPECT(webb_query_get(&req, "a%20b", &value) != 0);
+  EXPECT(webb_query_get(&req, "", &value) != 0);
+  EXPECT(webb_query_get(&req, "missing", &value) != 0);
+
+  char buf[16];
+  ASSERT(webb_query_get(&req, "bad", &value) == 0);
+  EXPECT(webb_query_decode(&value, buf, sizeof(buf)) == -1);
+}
+
+TEST(test_query_decode) {
+  char buf[64];
+  WebbSlice slice = {.ptr = "plain", .len = 5};
+  EXPECT(webb_query_decode(&slice, buf, sizeof(buf)) == 5);
+  EXPECT(strcmp(buf, "plain") == 0);
+  slice = (WebbSlice){.ptr = "a+b%2Fc%2f", .len = 10};
+  EXPECT(webb_query_decode(&slice, buf, sizeof(buf)) == 6);
+  EXPECT(strcmp(buf, "a b/c/") == 0);
+
+  // the result has to fit along with its terminator
+  EXPECT(webb_query_decode(&slice, buf, 7) == 6);
+  EXPECT(webb_query_decode(&slice, buf, 6) == -1);
+  EXPECT(webb_query_decode(&slice, buf, 0) == -1);
+
+  slice = (WebbSlice){.ptr = "ab%4", .len = 4};
+  EXPECT(webb_query_decode(&slice, buf, sizeof(buf)) == -1);
+  slice = (WebbSlice){.ptr = "", .len = 0};
+  EXPECT(webb_query_decode(&slice, buf, 1) == 0);
+  EXPECT(buf[0] == '\0');
+}
+
+TEST(test_query_decode_long_runs) {
+  // escapes at every offset around the 16 byte blocks scanned at a time
+  char src[64], expected[64], buf[64];
+  for (size_t at = 0; at + 3 <= 40; at++) {
+    memset(src, 'x', 40);
+    memcpy(src + at, "%41", 3);
+    WebbSlice slice = {.ptr = src, .len = 40};
+    memset(expected, 'x', 38);
+    expected[at] = 'A';
+    expected[38] = '\0';
+    EXPECT(uri_plain_len(src, 40) == at);
+    EXPECT(webb_query_decode(&slice, buf, sizeof(buf)) == 38);
+    EXPECT(strcmp(buf, expected) == 0);
+  }
+  memset(src, 'y', 40);
+  EXPECT(uri_plain_len(src, 40) == 40);
+  src[33] = '+';
+  EXPECT(uri_plain_len(src, 40) == 33);
+  EXPECT(uri_plain_len(src, 33) == 33);
+}
+
+TEST_MAIN(test_query_next, test_query_get, test_query_decode, test_query_decode_long_runs)
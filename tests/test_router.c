@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+static WebbRouteParams PARAMS;
+
+static int route_a(const WebbRequest *req, const WebbRouteParams *params, WebbResponse *res) {
+  (void) req, (void) res;
+  PARAMS = *params;
+  return 201;
+}
+
+static int route_b(const WebbRequest *req, const WebbRouteParams *params, WebbResponse *res) {
+  (void) req, (void) res;
+  PARAMS = *params;
+  return 202;
+}
+
+static int dispatch(const WebbRouter *router, WebbMethod method, const char *uri) {
+  static char buf[256];
+  (void) snprintf(buf, sizeof(buf), "%s", uri);
+  WebbRequest req = {.method = method, .uri = buf};
+  WebbResponse res = {0};
+  memset(&PARAMS, 0, sizeof(PARAMS));
+  int status = webb_router_dispatch(router, &req, &res);
+  http_res_free(&res);
+  return status;
+}
+
+static int param_is(const char *name, const char *expected) {
+  const WebbSlice *val = webb_route_param(&PARAMS, name);
+  return val && val->len == strlen(expected) && memcmp(val->ptr, expected, val->len) == 0;
+}
+
+TEST(test_static_routes) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_GET, "/user", route_b) == 0);
+  ASSERT(webb_router_add(router, WEBB_GET, "/usage/stats", route_b) == 0);
+
+  EXPECT(dispatch(router, WEBB_GET, "/") == 201);
+  EXPECT(dispatch(router, WEBB_GET, "/users") == 201);
+  EXPECT(dispatch(router, WEBB_GET, "/user") == 202);
+  EXPECT(dispatch(router, WEBB_GET, "/usage/stats") == 202);
+  EXPECT(dispatch(router, WEBB_GET, "/us") == 404);
+  EXPECT(dispatch(router, WEBB_GET, "/users/") == 404);
+  EXPECT(dispatch(router, WEBB_GET, "/usage") == 404);
+  EXPECT(PARAMS.len == 0);
+  webb_router_free(router);
+}
+
+TEST(test_path_params) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users/:id", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users/:id/posts/:post", route_b) == 0);
+
+  EXPECT(dispatch(router, WEBB_GET, "/users/42") == 201);
+  EXPECT(PARAMS.len == 1);
+  EXPECT(param_is("id", "42"));
+  EXPECT(dispatch(router, WEBB_GET, "/users/abc/posts/7") == 202);
+  EXPECT(PARAMS.len == 2);
+  EXPECT(param_is("id", "abc"));
+  EXPECT(param_is("post", "7"));
+  EXPECT(webb_route_param(&PARAMS, "missing") == NULL);
+  EXPECT(dispatch(router, WEBB_GET, "/users/") == 404);
+  EXPECT(dispatch(router, WEBB_GET, "/users/42/posts") == 404);
+  webb_router_free(router);
+}
+
+TEST(test_static_before_params) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users/:id/posts", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users/me", route_b) == 0);
+
+  EXPECT(dispatch(router, WEBB_GET, "/users/me") == 202);
+  EXPECT(dispatch(router, WEBB_GET, "/users/me/posts") == 201);
+  EXPECT(param_is("id", "me"));
+  EXPECT(dispatch(router, WEBB_GET, "/users/mel/posts") == 201);
+  EXPECT(param_is("id", "mel"));
+  webb_router_free(router);
+}
+
+TEST(test_wildcard) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/static/*path", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_GET, "/static/index.html", route_b) == 0);
+
+  EXPECT(dispatch(router, WEBB_GET, "/static/css/main.css") == 201);
+  EXPECT(param_is("path", "css/main.css"));
+  EXPECT(dispatch(router, WEBB_GET, "/static/") == 201);
+  EXPECT(param_is("path", ""));
+  EXPECT(dispatch(router, WEBB_GET, "/static/index.html") == 202);
+  EXPECT(dispatch(router, WEBB_GET, "/static") == 404);
+  webb_router_free(router);
+}
+
+TEST(test_method_dispatch) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/items/:id", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_DELETE, "/items/:item", route_b) == 0);
+
+  EXPECT(dispatch(router, WEBB_GET, "/items/1") == 201);
+  EXPECT(param_is("id", "1"));
+  EXPECT(dispatch(router, WEBB_DELETE, "/items/2") == 202);
+  EXPECT(param_is("item", "2"));
+  EXPECT(dispatch(router, WEBB_POST, "/items/3") == 405);
+  webb_router_free(router);
+}
+
+static int dispatch_allow(const WebbRouter *router, WebbMethod method, const char *uri, const char *expected) {
+  // a 405 with exactly the expected allow header
+  char buf[64];
+  (void) snprintf(buf, sizeof(buf), "%s", uri);
+  WebbRequest req = {.method = method, .uri = buf};
+  WebbResponse res = {0};
+  int status = webb_router_dispatch(router, &req, &res);
+  const char *allow = NULL;
+  for (WebbHeaders *h = res.headers; h; h = h->next)
+    allow = strcmp(h->key, "allow") == 0 ? h->val : allow;
+  int ok = status == 405 && allow && strcmp(allow, expected) == 0;
+  http_res_free(&res);
+  return ok;
+}
+
+TEST(test_method_falls_through) {
+  // a static route for another method does not hide a parameter or wildcard route allowing it
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users/new", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_POST, "/users/:id", route_b) == 0);
+  ASSERT(webb_router_add(router, WEBB_PUT, "/users/*rest", route_a) == 0);
+
+  EXPECT(dispatch(router, WEBB_GET, "/users/new") == 201);
+  EXPECT(dispatch(router, WEBB_POST, "/users/new") == 202);
+  EXPECT(param_is("id", "new"));
+  EXPECT(dispatch(router, WEBB_PUT, "/users/new") == 201);
+  EXPECT(param_is("rest", "new"));
+  EXPECT(dispatch(router, WEBB_POST, "/users/7") == 202);
+  EXPECT(dispatch(router, WEBB_GET, "/users/7") == 405);
+
+  // the allow header lists the methods of every route matching the path
+  EXPECT(dispatch_allow(router, WEBB_DELETE, "/users/new", "GET, POST, PUT"));
+  EXPECT(dispatch_allow(router, WEBB_DELETE, "/users/7", "POST, PUT"));
+  webb_router_free(router);
+
+  router = webb_router_new();
+  ASSERT(router);
+  ASSERT(webb_router_add(router, WEBB_GET, "/users/new", route_a) == 0);
+  ASSERT(webb_router_add(router, WEBB_POST, "/users/:id", route_b) == 0);
+  EXPECT(dispatch_allow(router, WEBB_PUT, "/users/new", "GET, POST"));
+  // routes added after dispatching are matched too
+  ASSERT(webb_router_add(router, WEBB_PUT, "/users/:id", route_a) == 0);
+  EXPECT(dispatch(router, WEBB_PUT, "/users/new") == 201);
+  EXPECT(dispatch_allow(router, WEBB_DELETE, "/users/new", "GET, POST, PUT"));
+  webb_router_free(router);
+}
+
+TEST(test_invalid_routes) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  EXPECT(webb_router_add(router, WEBB_GET, "users", route_a) != 0);
+  EXPECT(webb_router_add(router, WEBB_GET, "/users/:", route_a) != 0);
+  EXPECT(webb_router_add(router, WEBB_GET, "/users/x:id", route_a) != 0);
+  EXPECT(webb_router_add(router, WEBB_GET, "/files/*path/more", route_a) != 0);
+  EXPECT(webb_router_add(router, WEBB_GET, "/users/:id", route_a) == 0);
+  EXPECT(webb_router_add(router, WEBB_GET, "/users/:id", route_b) != 0);
+  webb_router_free(router);
+}
+
+TEST(test_many_routes) {
+  WebbRouter *router = webb_router_new();
+  ASSERT(router);
+  char pattern[64];
+  for (int i = 0; i < 1000; i++) {
+    (void) sprintf(pattern, "/api/v%d/resource%d/:id", i % 10, i);
+    ASSERT(webb_router_add(router, WEBB_GET, pattern, i % 2 ? route_a : route_b) == 0);
+  }
+  for (int i = 0; i < 1000; i++) {
+    (void) sprintf(pattern, "/api/v%d/resource%d/%d", i % 10, i, i);
+    EXPECT(dispatch(router, WEBB_GET, pattern) == (i % 2 ? 201 : 202));
+    (void) sprintf(pattern, "%d", i);
+    EXPECT(param_is("id", pattern));
+  }
+  EXPECT(dispatch(router, WEBB_GET, "/api/v1/resource2/3") == 404);
+  webb_router_free(router);
+}
+
+TEST_MAIN(
+  test_static_routes,
+  test_path_params,
+  test_static_before_params,
+  test_wildcard,
+  test_method_dispatch,
+  test_method_falls_through,
+  test_invalid_routes,
+  test_many_routes)
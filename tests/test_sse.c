@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+static WebbServer *SERVER;
+static WebbSse *SSE;
+static char BUF[65536];
+
+static int handler(const WebbRequest *req, WebbResponse *res) {
+  if (strncmp(req->uri, "/events/", 8) != 0)
+    return 404;
+  return webb_sse_subscribe(SSE, req->uri + 8, res);
+}
+
+static int connect_server(int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(9541), .sin_addr = {htonl(INADDR_LOOPBACK)}};
+  if (fd != -1 && rcvbuf)
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static size_t receive(int fd, size_t len) {
+  // reads exactly len bytes into BUF, unless the connection is closed first
+  size_t nread = 0;
+  for (int i = 0; i < 100000 && nread < len; i++) {
+    (void) webb_server_process(SERVER, 16);
+    ssize_t n = recv(fd, BUF + nread, len - nread, MSG_DONTWAIT);
+    if (n == 0)
+      break;
+    if (n > 0)
+      nread += (size_t) n;
+  }
+  BUF[nread] = '\0';
+  return nread;
+}
+
+static int subscribe(int fd, const char *channel) {
+  // the response's head only, then events
+  char req[256];
+  int len = sprintf(req, "GET /events/%s HTTP/1.1\r\n\r\n", channel);
+  if (send(fd, req, (size_t) len, 0) != len)
+    return 1;
+  size_t nread = 0;
+  BUF[0] = '\0';
+  for (int i = 0; i < 100000 && !strstr(BUF, "\r\n\r\n"); i++) {
+    (void) webb_server_process(SERVER, 16);
+    if (recv(fd, BUF + nread, 1, MSG_DONTWAIT) == 1)
+      BUF[++nread] = '\0';
+  }
+  return strstr(BUF, "HTTP/1.1 200 OK\r\n") != BUF;
+}
+
+static int expect_event(int fd, const char *event) {
+  size_t len = strlen(event);
+  return receive(fd, len) != len || strcmp(BUF, event) != 0;
+}
+
+typedef struct Publish {
+  const char *channel;
+  int subscribers;
+} Publish;
+
+static void *publish(void *arg) {
+  Publish *publish = arg;
+  publish->subscribers = webb_sse_publish(SSE, publish->channel, "update", "line 1\nline 2", 13);
+  return NULL;
+}
+
+TEST(test_sse_publish) {
+  SSE = webb_sse_new(NULL);
+  ASSERT(SSE);
+  SERVER = webb_server_new("9541", handler, NULL);
+  ASSERT(SERVER);
+  int fds[3];
+  const char *channels[3] = {"news", "news", "sports"};
+  for (int i = 0; i < 3; i++) {
+    fds[i] = connect_server(0);
+    ASSERT(fds[i] != -1);
+    ASSERT(subscribe(fds[i], channels[i]) == 0);
+  }
+  EXPECT(strstr(BUF, "content-type: text/event-stream\r\n"));
+  EXPECT(strstr(BUF, "cache-control: no-cache\r\n"));
+  EXPECT(!strstr(BUF, "content-length"));
+
+  // published from another thread while the worker runs
+  Publish news = {.channel = "news"};
+  pthread_t thread;
+  ASSERT(pthread_create(&thread, NULL, publish, &news) == 0);
+  (void) webb_server_process(SERVER, 16);
+  EXPECT(pthread_join(thread, NULL) == 0);
+  EXPECT(news.subscribers == 2);
+  for (int i = 0; i < 2; i++)
+    EXPECT(expect_event(fds[i], "event: update\ndata: line 1\ndata: line 2\n\n") == 0);
+  EXPECT(webb_sse_publish(SSE, "sports", NULL, "goal", 4) == 1);
+  EXPECT(expect_event(fds[2], "data: goal\n\n") == 0);
+  // every kind of line break starts a data field, one in the event's type is refused
+  EXPECT(webb_sse_publish(SSE, "sports", NULL, "a\r\nb\rc\n\r\nd\r", 11) == 1);
+  EXPECT(expect_event(fds[2], "data: a\ndata: b\ndata: c\ndata: \ndata: d\ndata: \n\n") == 0);
+  EXPECT(webb_sse_publish(SSE, "sports", "goal\r\ndata: forged", "", 0) == -1);
+  EXPECT(webb_sse_publish(SSE, "weather", NULL, "", 0) == 0);
+
+  // closed subscribers leave their channel, what clients send is ignored
+  EXPECT(send(fds[1], "ignored", 7, 0) == 7);
+  EXPECT(close(fds[0]) != -1);
+  for (int i = 0; i < 1000; i++)
+    (void) webb_server_process(SERVER, 16);
+  EXPECT(webb_sse_publish(SSE, "news", NULL, "", 0) == 1);
+  EXPECT(expect_event(fds[1], "data: \n\n") == 0);
+  for (int i = 1; i < 3; i++)
+    EXPECT(close(fds[i]) != -1);
+  webb_server_free(SERVER);
+  webb_sse_free(SSE);
+}
+
+TEST(test_sse_slow_consumer) {
+  WebbSseOptions opts = {.max_queued = 64 * 1024};
+  SSE = webb_sse_new(&opts);
+  ASSERT(SSE);
+  SERVER = webb_server_new("9541", handler, NULL);
+  ASSERT(SERVER);
+  int slow = connect_server(4096), fast = connect_server(0);
+  ASSERT(slow != -1 && fast != -1);
+  ASSERT(subscribe(slow, "feed") == 0);
+  ASSERT(subscribe(fast, "feed") == 0);
+
+  // the slow client never reads, it is dropped once its queue is over max_queued
+  static char data[16 * 1024];
+  memset(data, 'x', sizeof(data));
+  size_t event_len = 6 + sizeof(data) + 2;
+  int dropped = 0;
+  for (int i = 0; i < 1000 && !dropped; i++) {
+    int n = webb_sse_publish(SSE, "feed", NULL, data, sizeof(data));
+    EXPECT(n >= 1);
+    dropped = n == 1;
+    EXPECT(receive(fast, event_len) == event_len);
+    EXPECT(memcmp(BUF, "data: xxx", 9) == 0);
+  }
+  EXPECT(dropped);
+  for (int i = 0; i < 1000; i++)
+    (void) webb_server_process(SERVER, 16);
+  EXPECT(webb_sse_publish(SSE, "feed", NULL, "", 0) == 1);
+  EXPECT(expect_event(fast, "data: \n\n") == 0);
+  EXPECT(close(slow) != -1);
+  EXPECT(close(fast) != -1);
+  webb_server_free(SERVER);
+  webb_sse_free(SSE);
+}
+
+TEST_MAIN(test_sse_publish, test_sse_slow_consumer)
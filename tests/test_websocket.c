@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "internal.h"
+#include "libtest.h"
+#include "webb/webb.h"
+
+static WebbServer *SERVER;
+static WebbWebSocket *SOCKETS[4];
+static size_t NSOCKETS;
+static int CLOSE_CODE;
+static char BUF[1024 * 1024];
+
+static void on_open(WebbWebSocket *ws) {
+  SOCKETS[NSOCKETS++] = ws;
+}
+
+static void on_message(WebbWebSocket *ws, const char *data, size_t len, int binary) {
+  // "all " prefixed messages go to every socket, the others are echoed
+  if (len > 4 && memcmp(data, "all ", 4) == 0)
+    (void) webb_websocket_broadcast(SOCKETS, NSOCKETS, data + 4, len - 4, binary);
+  else if (len == 3 && memcmp(data, "bye", 3) == 0)
+    webb_websocket_close(ws, 4000);
+  else
+    (void) webb_websocket_send(ws, data, len, binary);
+}
+
+static void on_close(WebbWebSocket *ws, int code) {
+  for (size_t i = 0; i < NSOCKETS; i++) {
+    if (SOCKETS[i] == ws)
+      SOCKETS[i] = SOCKETS[--NSOCKETS];
+  }
+  CLOSE_CODE = code;
+}
+
+static int handler(const WebbRequest *req, WebbResponse *res) {
+  static const WebbWebSocketHandlers HANDLERS = {
+    .open = on_open, .message = on_message, .close = on_close, .max_message = 65536};
+  return webb_websocket_upgrade(req, res, &HANDLERS, NULL);
+}
+
+static int connect_server(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(9521), .sin_addr = {htonl(INADDR_LOOPBACK)}};
+  // frames are sent one by one, without waiting for the previous ones to be acknowledged
+  int nodelay = 1;
+  if (fd != -1)
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  if (fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static size_t receive(int fd, size_t len) {
+  // reads exactly len bytes into BUF, unless the connection is closed first
+  size_t nread = 0;
+  for (int i = 0; i < 100000 && nread < len; i++) {
+    (void) webb_server_process(SERVER, 16);
+    ssize_t n = recv(fd, BUF + nread, len - nread, MSG_DONTWAIT);
+    if (n == 0)
+      break;
+    if (n > 0)
+      nread += (size_t) n;
+  }
+  return nread;
+}
+
+static void receive_head(int fd) {
+  // a response's head only, frames may follow it
+  size_t nread = 0;
+  BUF[0] = '\0';
+  for (int i = 0; i < 100000 && !strstr(BUF, "\r\n\r\n"); i++) {
+    (void) webb_server_process(SERVER, 16);
+    if (recv(fd, BUF + nread, 1, MSG_DONTWAIT) == 1)
+      BUF[++nread] = '\0';
+  }
+}
+
+static int handshake(int fd, const char *extra) {
+  char req[512];
+  int len = sprintf(
+    req,
+    "GET /chat HTTP/1.1\r\nupgrade: websocket\r\nconnection: keep-alive, Upgrade\r\n"
+    "sec-websocket-key: dGhlIHNhbXBsZSBub25jZQ==\r\nsec-websocket-version: 13\r\n\r\n%s",
+    extra);
+  if (send(fd, req, (size_t) len, 0) != len)
+    return 1;
+  receive_head(fd);
+  return strstr(BUF, "HTTP/1.1 101 Switching protocols\r\n") != BUF;
+}
+
+static size_t client_frame(char *out, int fin, int opcode, const char *data, size_t len) {
+  static const unsigned char MASK[4] = {0x12, 0x34, 0x56, 0x78};
+  size_t head = 2;
+  out[0] = (char) ((fin ? 0x80 : 0) | opcode);
+  if (len < 126) {
+    out[1] = (char) (0x80 | len);
+  } else {
+    out[1] = (char) (0x80 | 126);
+    out[2] = (char) (len >> 8);
+    out[3] = (char) len;
+    head = 4;
+  }
+  memcpy(out + head, MASK, 4);
+  memcpy(out + head + 4, data, len);
+  websocket_unmask(out + head + 4, len, MASK);
+  return head + 4 + len;
+}
+
+static int send_frame(int fd, int fin, int opcode, const char *data) {
+  char frame[1024];
+  size_t len = client_frame(frame, fin, opcode, data, strlen(data));
+  return send(fd, frame, len, 0) != (ssize_t) len;
+}
+
+static int expect_frame(int fd, int opcode, const char *data) {
+  // server frames are never masked
+  size_t len = strlen(data);
+  if (receive(fd, 2 + len) != 2 + len)
+    return 1;
+  return BUF[0] != (char) (0x80 | opcode) || BUF[1] != (char) len || memcmp(BUF + 2, data, len) != 0;
+}
+
+TEST(test_websocket_unmask) {
+  // every alignment and tail length against the plain byte loop
+  static const unsigned char MASK[4] = {0xde, 0xad, 0xbe, 0xef};
+  char data[128], expected[128];
+  for (size_t offset = 0; offset < 8; offset++) {
+    for (size_t len = 0; len + offset <= sizeof(data); len++) {
+      for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = expected[i] = (char) (i * 7);
+      for (size_t i = 0; i < len; i++)
+        expected[offset + i] = (char) (expected[offset + i] ^ MASK[i % 4]);
+      websocket_unmask(data + offset, len, MASK);
+      EXPECT(memcmp(data, expected, sizeof(data)) == 0);
+    }
+  }
+}
+
+TEST(test_websocket_handshake) {
+  SERVER = webb_server_new("9521", handler, NULL);
+  ASSERT(SERVER);
+  int fd = connect_server();
+  ASSERT(fd != -1);
+  // the example of rfc6455 1.3
+  ASSERT(handshake(fd, "") == 0);
+  EXPECT(strstr(BUF, "sec-websocket-accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+  EXPECT(strstr(BUF, "upgrade: websocket\r\n"));
+  EXPECT(strstr(BUF, "connection: upgrade\r\n"));
+  EXPECT(!strstr(BUF, "content-length"));
+  EXPECT(NSOCKETS == 1);
+  EXPECT(close(fd) != -1);
+  for (int i = 0; i < 1000 && NSOCKETS; i++)
+    (void) webb_server_process(SERVER, 16);
+  EXPECT(NSOCKETS == 0);
+  EXPECT(CLOSE_CODE == 1006);
+
+  // anything but a version 13 upgrade is refused, the connection stays http
+  fd = connect_server();
+  ASSERT(fd != -1);
+  const char *old = "GET / HTTP/1.1\r\nupgrade: websocket\r\nconnection: upgrade\r\n"
+                    "sec-websocket-key: dGhlIHNhbXBsZSBub25jZQ==\r\nsec-websocket-version: 8\r\n\r\n";
+  EXPECT(send(fd, old, strlen(old), 0) == (ssize_t) strlen(old));
+  receive_head(fd);
+  EXPECT(strstr(BUF, "HTTP/1.1 426 Upgrade Required\r\n") == BUF);
+  EXPECT(strstr(BUF, "sec-websocket-version: 13\r\n"));
+  const char *plain = "GET / HTTP/1.1\r\n\r\n";
+  EXPECT(send(fd, plain, strlen(plain), 0) == (ssize_t) strlen(plain));
+  receive_head(fd);
+  EXPECT(strstr(BUF, "HTTP/1.1 400 Bad Request\r\n") == BUF);
+  EXPECT(strstr(BUF, "connection: keep-alive\r\n"));
+  EXPECT(close(fd) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST(test_websocket_messages) {
+  SERVER = webb_server_new("9521", handler, NULL);
+  ASSERT(SERVER);
+  int fd = connect_server();
+  ASSERT(fd != -1);
+  // a frame sent along with the handshake is not lost
+  char first[64];
+  first[client_frame(first, 1, 0x1, "early", 5)] = '\0';
+  ASSERT(handshake(fd, first) == 0);
+  EXPECT(expect_frame(fd, 0x1, "early") == 0);
+
+  EXPECT(send_frame(fd, 1, 0x2, "binary") == 0);
+  EXPECT(expect_frame(fd, 0x2, "binary") == 0);
+  // fragments with a ping in between, the pong comes first
+  EXPECT(send_frame(fd, 0, 0x1, "hel") == 0);
+  EXPECT(send_frame(fd, 1, 0x9, "ping") == 0);
+  EXPECT(send_frame(fd, 0, 0x0, "lo ") == 0);
+  EXPECT(send_frame(fd, 1, 0x0, "world") == 0);
+  EXPECT(expect_frame(fd, 0xa, "ping") == 0);
+  EXPECT(expect_frame(fd, 0x1, "hello world") == 0);
+
+  // a 126 byte length and a large echo
+  static char large[60000], frame[60016];
+  for (size_t i = 0; i < sizeof(large); i++)
+    large[i] = (char) ('a' + i % 26);
+  size_t len = client_frame(frame, 1, 0x2, large, sizeof(large));
+  EXPECT(send(fd, frame, len, 0) == (ssize_t) len);
+  EXPECT(receive(fd, 4 + sizeof(large)) == 4 + sizeof(large));
+  EXPECT(BUF[0] == (char) 0x82 && BUF[1] == 126);
+  EXPECT(((unsigned char) BUF[2] << 8 | (unsigned char) BUF[3]) == sizeof(large));
+  EXPECT(memcmp(BUF + 4, large, sizeof(large)) == 0);
+
+  // the client closes, its code is echoed
+  EXPECT(send_frame(fd, 1, 0x8, "\x03\xe8") == 0);
+  EXPECT(expect_frame(fd, 0x8, "\x03\xe8") == 0);
+  EXPECT(receive(fd, 1) == 0);
+  EXPECT(CLOSE_CODE == 1000);
+  EXPECT(close(fd) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST(test_websocket_broadcast_and_close) {
+  SERVER = webb_server_new("9521", handler, NULL);
+  ASSERT(SERVER);
+  int fds[3];
+  for (int i = 0; i < 3; i++) {
+    fds[i] = connect_server();
+    ASSERT(fds[i] != -1);
+    ASSERT(handshake(fds[i], "") == 0);
+  }
+  EXPECT(NSOCKETS == 3);
+  EXPECT(send_frame(fds[1], 1, 0x1, "all news") == 0);
+  for (int i = 0; i < 3; i++)
+    EXPECT(expect_frame(fds[i], 0x1, "news") == 0);
+
+  // closed by the server, then the client answers
+  EXPECT(send_frame(fds[0], 1, 0x1, "bye") == 0);
+  EXPECT(expect_frame(fds[0], 0x8, "\x0f\xa0") == 0);
+  EXPECT(send_frame(fds[0], 1, 0x8, "\x0f\xa0") == 0);
+  EXPECT(receive(fds[0], 1) == 0);
+  EXPECT(CLOSE_CODE == 4000);
+  EXPECT(NSOCKETS == 2);
+
+  // unmasked frames and messages over max_message are protocol errors
+  const char unmasked[] = {(char) 0x81, 0x02, 'h', 'i'};
+  EXPECT(send(fds[1], unmasked, sizeof(unmasked), 0) == sizeof(unmasked));
+  EXPECT(expect_frame(fds[1], 0x8, "\x03\xea") == 0);
+  const char huge[] = {(char) 0x82, (char) 0xff, 0, 0, 0, 1, 0, 0, 0, 0};
+  EXPECT(send(fds[2], huge, sizeof(huge), 0) == sizeof(huge));
+  EXPECT(expect_frame(fds[2], 0x8, "\x03\xf1") == 0);
+  EXPECT(receive(fds[2], 1) == 0);
+  EXPECT(NSOCKETS == 0);
+  for (int i = 0; i < 3; i++)
+    EXPECT(close(fds[i]) != -1);
+  webb_server_free(SERVER);
+}
+
+TEST_MAIN(test_websocket_unmask, test_websocket_handshake, test_websocket_messages, test_websocket_broadcast_and_close)